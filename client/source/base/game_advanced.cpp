@@ -1,6 +1,7 @@
 #include "pch.h"
 #include "game_advanced.h"
 #include "main/settings.h"
+#include "main/settings_storage.h"
 #include "main/memory_stream.h"
 #include "main/zip_packages.h"
 #include "services/service_manager.h"
@@ -118,6 +119,10 @@ DfgGameAdvanced::DfgGameAdvanced(const char * emscriptenDbName, const char * ana
 #endif
 }
 
+DfgGameAdvanced::~DfgGameAdvanced()
+{
+}
+
 void DfgGameAdvanced::initialize()
 {
     DfgGame::initialize();
@@ -227,8 +232,16 @@ void DfgGameAdvanced::loadSettings()
     _needToDeleteWatchDogFile = true;
 
     std::string filename = std::string(getUserDataFolder()) + "/settings.arch";
-    std::unique_ptr<gameplay::Stream> stream2(gameplay::FileSystem::open(filename.c_str(), gameplay::FileSystem::READ));
-    loadSettings(stream2.get());
+    _settingsStorage.reset(new SettingsStorage(filename.c_str()));
+
+    // loaded settings are passed through loadSettings(gameplay::Stream*), so subclasses
+    // that override it keep receiving the settings as a stream
+    std::unique_ptr<Archive> arch(Archive::create());
+    std::unique_ptr<MemoryStream> settingsStream(MemoryStream::create());
+    if (_settingsStorage->load(arch.get()) && arch->serialize(settingsStream.get()) && settingsStream->rewind())
+        loadSettings(settingsStream.get());
+    else if (gameplay::FileSystem::fileExists(filename.c_str()))
+        saveSettings();     // settings file is corrupted, overwrite it
 
 #endif
 }
@@ -248,12 +261,7 @@ void DfgGameAdvanced::loadSettings(gameplay::Stream * stream)
     bool settingsLoaded = arch->deserialize(stream);
     if (settingsLoaded)
     {
-        if (getConfig()->getBool("firstRunTest"))
-            return;
-
-        mergeSettings(*arch);
-
-        _firstTimeUser = false;
+        loadSettings(*arch);
     }
     else
     {
@@ -264,9 +272,24 @@ void DfgGameAdvanced::loadSettings(gameplay::Stream * stream)
     }
 }
 
+void DfgGameAdvanced::loadSettings(Archive& archive)
+{
+    if (getConfig()->getBool("firstRunTest"))
+        return;
+
+    Settings::getInstance()->beginChanges();
+    mergeSettings(archive);
+    Settings::getInstance()->commitChanges();
+
+    _firstTimeUser = false;
+}
+
 void DfgGameAdvanced::mergeSettings(Archive& other)
 {
     // merge the settings, update only keys that are present in the default settings dictionary
+    // notifications are sent once all the keys are merged
+    Settings::getInstance()->beginChanges();
+
     std::vector<std::string> commonKeys;
     Settings::getInstance()->getCommonKeys(other, &commonKeys);
     int sourceVersion = Settings::getInstance()->get<int>("app.version", 0);
@@ -301,32 +324,39 @@ void DfgGameAdvanced::mergeSettings(Archive& other)
 
         sourceValue->set(destValue);
     }
+
+    Settings::getInstance()->commitChanges();
 }
 
 bool DfgGameAdvanced::saveSettings()
 {
 #ifdef __EMSCRIPTEN__
     std::unique_ptr<MemoryStream> stream(MemoryStream::create());
-#else
-    std::string filename = std::string(getUserDataFolder()) + "/settings.arch";
-    std::unique_ptr<gameplay::Stream> stream(gameplay::FileSystem::open(filename.c_str(), gameplay::FileSystem::WRITE));
-#endif
-
     if (!stream)
         return false;
 
     Settings::getInstance()->serialize(stream.get());
 
-#ifdef __EMSCRIPTEN__
     emscripten_idb_async_store(_emscriptenDbName.c_str(), "settings.arch", (void *)stream->getBuffer(), stream->length(), this, NULL, NULL);
     return hasIndexedDB();
 #else
-    return true;
+    if (!_settingsStorage)
+        return false;
+
+    return _settingsStorage->save();
 #endif
 }
 
+void DfgGameAdvanced::flushSettings()
+{
+    if (_settingsStorage)
+        _settingsStorage->flush();
+}
+
 void DfgGameAdvanced::updateSettings()
 {
+    Settings::getInstance()->beginChanges();
+
 #if defined(__EMSCRIPTEN__) || defined(WIN32)
 
     int i = 1;
@@ -359,6 +389,8 @@ void DfgGameAdvanced::updateSettings()
     if (getGameLocale() != appLanguage)
         Settings::getInstance()->set("app.language", std::string(getGameLocale()));
 
+    Settings::getInstance()->commitChanges();
+
     saveSettings();
 
 
@@ -447,6 +479,7 @@ void DfgGameAdvanced::finalize()
     ZipPackagesCache::closePackage("resources.data");
 #endif
     saveSettings();
+    flushSettings();
     DfgGame::finalize();
 }
 
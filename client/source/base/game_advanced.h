@@ -24,6 +24,7 @@ public:
      * \param analyticsApiSecret GA4 API Secret for a data stream.
      */
     DfgGameAdvanced(const char * emscriptenDbName, const char * analyticsAppId, const char * analyticsApiSecret);
+    virtual ~DfgGameAdvanced();
 
     static DfgGameAdvanced * getInstance() { return static_cast<DfgGameAdvanced *>(gameplay::Game::getInstance()); };
 
@@ -58,11 +59,19 @@ public:
 
     /**
      * Save settings either to file or indexed db (for web version).
+     *
+     * Only the settings changed since the last save are written. Writing happens
+     * asynchronously when TaskQueueService is available, use flushSettings to wait for it.
      * 
-     * @return True when settings were saved successfully.
+     * @return True when settings were saved (or scheduled to be saved) successfully.
      */
     virtual bool saveSettings();
 
+    /**
+     * Wait until all scheduled settings writes are completed.
+     */
+    void flushSettings();
+
 protected:
     /**
      * Initialize callback that is called just before the first frame when the game starts.
@@ -104,6 +113,13 @@ protected:
      */
     virtual void loadSettings(gameplay::Stream * stream);
 
+    /**
+     * Applies settings loaded from the storage.
+     *
+     * \param archive Archive with loaded settings.
+     */
+    virtual void loadSettings(class Archive& archive);
+
     /**
      * This method merges the settings, loaded from the file with current ones.
      * Here you can define what to do if other archive has different version and
@@ -151,6 +167,8 @@ private:
     std::string _analyticsAppId;
     std::string _analyticsApiSecret;
     std::string _installerId;
+
+    std::unique_ptr<class SettingsStorage> _settingsStorage;
 };
 
 
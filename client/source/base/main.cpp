@@ -4,6 +4,7 @@
 #include "services/render_service.h"
 #include "services/input_service.h"
 #include "services/tracker_service.h"
+#include "services/taskqueue_service.h"
 #include "main/zip_packages.h"
 #include <curl/curl.h>
 
@@ -48,6 +49,14 @@ JNIEXPORT void Java_com_dreamfarmgames_util_TextViewActivity_textEntered(JNIEnv*
     env->ReleaseStringUTFChars(textObject, text);
 }
 
+// called from Activity.onTrimMemory/onLowMemory on the UI thread
+JNIEXPORT void Java_com_dreamfarmgames_util_DFGActivity_lowMemory(JNIEnv* env, jobject thiz)
+{
+    TaskQueueService * taskQueueService = ServiceManager::getInstance()->findService<TaskQueueService>();
+    if (taskQueueService)
+        taskQueueService->runOnMainThread([]() { static_cast<DfgGame *>(gameplay::Game::getInstance())->lowMemoryEvent(); });
+}
+
 // force declaration of ad callbacks to make sure they are included into shared library
 JNIEXPORT void Java_com_dreamfarmgames_util_BaseAdProvider_onAdShownNative(JNIEnv*, jobject, jstring, jstring, jboolean, jstring);
 JNIEXPORT void Java_com_dreamfarmgames_util_BaseAdProvider_onAdLoadedNative(JNIEnv*, jobject, jstring, jstring, jboolean, jstring);
@@ -150,6 +159,10 @@ void DfgGame::initialize()
      {
          ServiceManager::getInstance()->signals.virtualKeyboardSizeChanged(0.0f, 0.0f);
      }];
+    [NSNotificationCenter.defaultCenter addObserverForName:UIApplicationDidReceiveMemoryWarningNotification object:nil queue:nil usingBlock:^(NSNotification *note)
+     {
+         lowMemoryEvent();
+     }];
 #endif
 #endif
 }
@@ -434,6 +447,14 @@ void DfgGame::safeAreaChangedEvent(float top, float left, float bottom, float ri
     ServiceManager::getInstance()->signals.safeAreaChangedEvent(top, left, bottom, right);
 }
 
+void DfgGame::lowMemoryEvent()
+{
+    size_t evicted = Caches::getInstance()->evictUnused();
+    GP_LOG("Low memory warning, %u bytes of assets evicted", static_cast<unsigned>(evicted));
+
+    ServiceManager::getInstance()->signals.lowMemoryEvent();
+}
+
 void DfgGame::copyToClipboard(const char * textUTF8) const
 {
 #if defined(WIN32)
@@ -79,6 +79,13 @@ public:
      */
     virtual void copyToClipboard(const char * textUTF8) const;
 
+    /**
+     * Handle low memory warning from the OS. Evicts all unreferenced
+     * assets from the caches and fires lowMemoryEvent signal.
+     * Must be called from the main thread.
+     */
+    virtual void lowMemoryEvent();
+
 #ifdef __EMSCRIPTEN__
     /**
      * Whether or not browser supports persistent IndexedDB storage.
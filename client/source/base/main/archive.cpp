@@ -1,6 +1,36 @@
 #include "pch.h"
 #include "archive.h"
 #include "memory_stream.h"
+#include "json.h"
+
+
+
+
+/**
+ * Write-only stream that counts written bytes and discards the data.
+ * Used to compute the size of nested archives before they are written.
+ */
+class SizeStream : public gameplay::Stream
+{
+public:
+    SizeStream() : _size(0) {};
+
+    virtual bool canRead() const override { return false; };
+    virtual bool canWrite() const override { return true; };
+    virtual bool canSeek() const override { return false; };
+    virtual void close() override {};
+    virtual size_t read(void *, size_t, size_t) override { return 0; };
+    virtual char* readLine(char *, int) override { return NULL; };
+    virtual size_t write(const void *, size_t size, size_t count) override { _size += size * count; return count; };
+    virtual bool eof() const override { return true; };
+    virtual size_t length() const override { return _size; };
+    virtual long int position() const override { return static_cast<long int>(_size); };
+    virtual bool seek(long int, int) override { return false; };
+    virtual bool rewind() override { return false; };
+
+private:
+    size_t _size;
+};
 
 
 
@@ -20,13 +50,19 @@ Archive * Archive::create()
 
 Archive * Archive::create(const Archive& other)
 {
+    // nested archives, lists and blobs are shared with the source until modified
     Archive * res = new Archive();
-    for (const auto& kv : other._values)
-        res->set(kv.first.c_str(), VariantType(kv.second));
+    res->_values = other._values;
     return res;
 }
 
 bool Archive::serialize(gameplay::Stream * stream) const
+{
+    NestedSizes nestedSizes = { std::vector<uint32_t>(), 0, false };
+    return serializeValues(stream, &nestedSizes);
+}
+
+bool Archive::serializeValues(gameplay::Stream * stream, NestedSizes * nestedSizes) const
 {
     uint8_t header[2] = { 'K', 'A' };
     uint16_t version = 1;
@@ -41,9 +77,9 @@ bool Archive::serialize(gameplay::Stream * stream) const
 
     for (const auto& item : _values)
     {
-        if (!serializeVariant(stream, VariantType(item.first)))
+        if (!serializeVariant(stream, VariantType(item.first), nestedSizes))
             return false;
-        if (!serializeVariant(stream, item.second))
+        if (!serializeVariant(stream, item.second, nestedSizes))
             return false;
     }
     return true;
@@ -81,7 +117,7 @@ bool Archive::deserialize(gameplay::Stream * stream, const Archive * dictionary)
                 return false;
             }
 
-            _values[key.get<std::string>()] = value;
+            getOrAddValue(key.get<std::string>()) = value;
         }
     }
     else if (version == 0x0002)
@@ -117,7 +153,7 @@ bool Archive::deserialize(gameplay::Stream * stream, const Archive * dictionary)
             if (stream->read(hash, 4, 1) != 1)
                 return false;
 
-            _values[std::string(hash, 4)].set(keys[i]);
+            getOrAddValue(std::string(hash, 4)).set(keys[i]);
         }
     }
     else if (version == 0x0102)
@@ -140,7 +176,7 @@ bool Archive::deserialize(gameplay::Stream * stream, const Archive * dictionary)
 
             const std::string& key = (*dictionary->_values.find(std::string(keyHash, 4))).second.get<std::string>();
 
-            if (!deserializeVariant(stream, &_values[key], dictionary))
+            if (!deserializeVariant(stream, &getOrAddValue(key), dictionary))
             {
                 clear();
                 return false;
@@ -161,7 +197,7 @@ bool Archive::deserialize(gameplay::Stream * stream, const Archive * dictionary)
     return true;
 }
 
-bool Archive::serializeVariant(gameplay::Stream * stream, const VariantType& value) const
+bool Archive::serializeVariant(gameplay::Stream * stream, const VariantType& value, NestedSizes * nestedSizes) const
 {
     VariantType::Type type = value.getType();
     if (stream->write(&type, 1, 1) != 1)
@@ -211,12 +247,36 @@ bool Archive::serializeVariant(gameplay::Stream * stream, const VariantType& val
         }
     case VariantType::TYPE_KEYED_ARCHIVE:
         {
-            std::unique_ptr<MemoryStream> archiveStream(MemoryStream::create());
-            if(!value.getArchive()->serialize(archiveStream.get()))
-                return false;
+            // nested archive's size is computed in a separate pass, so the archive is written
+            // directly to any stream without seeking back or going through a temporary buffer;
+            // the pass collects sizes of all the archives nested in it too, so each one is counted once
+            if (nestedSizes->collect)
+            {
+                size_t index = nestedSizes->sizes.size();
+                nestedSizes->sizes.push_back(0);
 
-            uint32_t len = static_cast<uint32_t>(archiveStream->length());
-            return stream->write(&len, sizeof(len), 1) == 1 && stream->write(archiveStream->getBuffer(), 1, len) == len;
+                uint32_t len = 0;
+                size_t start = stream->length();
+                if (stream->write(&len, sizeof(len), 1) != 1 || !value.getArchive()->serializeValues(stream, nestedSizes))
+                    return false;
+                nestedSizes->sizes[index] = static_cast<uint32_t>(stream->length() - start - sizeof(len));
+                return true;
+            }
+
+            if (nestedSizes->next == nestedSizes->sizes.size())
+            {
+                SizeStream sizeStream;
+                nestedSizes->sizes.clear();
+                nestedSizes->next = 0;
+                nestedSizes->collect = true;
+                bool res = serializeVariant(&sizeStream, value, nestedSizes);
+                nestedSizes->collect = false;
+                if (!res)
+                    return false;
+            }
+
+            uint32_t len = nestedSizes->sizes[nestedSizes->next++];
+            return stream->write(&len, sizeof(len), 1) == 1 && value.getArchive()->serializeValues(stream, nestedSizes);
         }
     case VariantType::TYPE_VECTOR2:
         return stream->write(&value.get<gameplay::Vector2>(), sizeof(gameplay::Vector2), 1) == 1;
@@ -249,7 +309,7 @@ bool Archive::serializeVariant(gameplay::Stream * stream, const VariantType& val
                 return false;
 
             for (const VariantType& v : value)
-                if (!serializeVariant(stream, v))
+                if (!serializeVariant(stream, v, nestedSizes))
                     return false;
         }
         return true;
@@ -415,7 +475,7 @@ bool Archive::deserializeVariant(gameplay::Stream * stream, VariantType * out, c
 
             std::unique_ptr<MemoryStream> archiveStream(MemoryStream::create(buf, size));
             out->setArchive(NULL);
-            return out->getArchive()->deserialize(archiveStream.get(), dictionary);
+            return out->getMutableArchive()->deserialize(archiveStream.get(), dictionary);
         }
     case VariantType::TYPE_VECTOR2:
         {
@@ -482,9 +542,10 @@ bool Archive::deserializeVariant(gameplay::Stream * stream, VariantType * out, c
 
             std::vector<VariantType> list{};
             out->set(list.begin(), list.end()); // initialize variant as an empty list
-            out->getList()->resize(size);
-            
-            for (VariantType& v : *out->getList())
+            std::vector<VariantType> * values = out->getMutableList();
+            values->resize(size);
+
+            for (VariantType& v : *values)
                 if (!deserializeVariant(stream, &v, dictionary))
                     return false;
         }
@@ -654,27 +715,11 @@ bool Archive::serializeToJSON(std::string * outStr) const
     if (!outStr)
         return false;
 
-    *outStr += '{';
-
-    for (const auto& it : _values)
-    {
-        *outStr += '"';
-        *outStr += it.first;
-        *outStr += "\": ";
-
-        if (!it.second.serializeToJSON(outStr))
-            return false;
-
-        *outStr += ", ";
-    }
-
-    if (!_values.empty())
-    {
-        outStr->pop_back();
-        outStr->pop_back();
-    }
-
-    *outStr += '}';
+    JSONWriter writer(outStr, 64 * _values.size() + 2);
+    return writer.writeArchive(*this);
+}
 
-    return true;
+bool Archive::deserializeFromJSON(const char * json, size_t length)
+{
+    return JSONReader::parse(json, length, this);
 }
\ No newline at end of file
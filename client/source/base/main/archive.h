@@ -31,6 +31,7 @@ public:
 
     /**
      * Create Archive class as a copy of other archive.
+     * Nested archives, lists and blobs are shared with the other archive until modified.
      */
     static Archive * create(const Archive& other);
 
@@ -153,6 +154,15 @@ public:
      */
     bool deserialize(gameplay::Stream * stream, const Archive * dictionary = NULL);
 
+    /**
+     * Deserialize Archive from JSON object. Parsed keys are added to the archive.
+     *
+     * \param json JSON text (UTF8), doesn't need to be null-terminated.
+     * \param length Length of JSON text in bytes.
+     * \return True if JSON has been successfully parsed.
+     */
+    bool deserializeFromJSON(const char * json, size_t length);
+
     /**
      * Get list of keys that are present in both archives.
      * Useful for merging or updating one archive with contents of the other.
@@ -176,10 +186,34 @@ public:
 protected:
     Archive();
 
-    bool serializeVariant(gameplay::Stream * stream, const VariantType& value) const;
+    /**
+     * Called after a new key is added to the archive.
+     */
+    virtual void onKeyAdded(const std::string& key) {};
+
+    /**
+     * Called before a key is removed from the archive, the value is still accessible.
+     */
+    virtual void onKeyRemoved(const std::string& key) {};
+
+    // get the value for a key, adding an empty value when the key is not present
+    inline VariantType& getOrAddValue(const std::string& key);
+
+    // sizes of nested archives in the order they are written, collected in a separate pass
+    struct NestedSizes
+    {
+        std::vector<uint32_t> sizes;
+        size_t next;
+        bool collect;
+    };
+
+    bool serializeValues(gameplay::Stream * stream, NestedSizes * nestedSizes) const;
+    bool serializeVariant(gameplay::Stream * stream, const VariantType& value, NestedSizes * nestedSizes) const;
     bool deserializeVariant(gameplay::Stream * stream, VariantType * out, const Archive * dictionary = NULL);
 
     std::unordered_map<std::string, VariantType> _values;
+
+    friend class JSONWriter;
 };
 
 
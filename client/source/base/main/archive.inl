@@ -33,21 +33,36 @@ inline const VariantType * Archive::get(const char * key) const
 
 template<typename _Type> inline VariantType& Archive::set(const char * key, const _Type& value)
 {
-    VariantType& archMember = _values[key];
+    VariantType& archMember = getOrAddValue(key);
     archMember.set(value);
     return archMember;
 }
 
 inline void Archive::removeKey(const char * key)
 {
-    _values.erase(key);
+    auto it = _values.find(key);
+    if (it == _values.end())
+        return;
+
+    onKeyRemoved((*it).first);
+    _values.erase(it);
 }
 
 inline void Archive::clear()
 {
+    for (const auto& it : _values)
+        onKeyRemoved(it.first);
     _values.clear();
 }
 
+inline VariantType& Archive::getOrAddValue(const std::string& key)
+{
+    auto res = _values.try_emplace(key);
+    if (res.second)
+        onKeyAdded(key);
+    return (*res.first).second;
+}
+
 template<typename _Type> inline const _Type * Archive::getBlob(const char * key) const
 {
     uint32_t size;
@@ -59,7 +74,7 @@ template<typename _Type> inline const _Type * Archive::getBlob(const char * key)
 
 inline VariantType& Archive::setBlob(const char * key, const void * data, uint32_t size)
 {
-    VariantType& archMember = _values[key];
+    VariantType& archMember = getOrAddValue(key);
     archMember.setBlob(data, size);
 
     return archMember;
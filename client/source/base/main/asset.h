@@ -36,6 +36,14 @@ public:
      */
     virtual bool reload() = 0;
 
+    /**
+     * Get approximate amount of memory used by the asset, including GPU memory.
+     * Used by caches to apply memory budgets.
+     *
+     * @return Size in bytes.
+     */
+    virtual size_t getMemorySize() const { return 0; };
+
     /**
      * Returns string representation.
      */
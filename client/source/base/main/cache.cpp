@@ -0,0 +1,203 @@
+#include "pch.h"
+#include "cache.h"
+#include "services/service_manager.h"
+#include "services/taskqueue_service.h"
+
+
+
+
+#define ASSET_LOADER_QUEUE "AssetLoaderQueue"
+
+uint64_t CacheBase::_useCounter = 0;
+
+
+
+
+void CacheBase::setMemoryBudget(size_t budget)
+{
+    _memoryBudget = budget;
+    if (_memoryBudget > 0)
+        trim(_memoryBudget);
+}
+
+size_t CacheBase::trim(size_t size)
+{
+    if (_memorySize <= size)
+        return 0;
+
+    std::vector<EvictionCandidate> candidates;
+    getEvictionCandidates(&candidates);
+    return evictCandidates(candidates, _memorySize, size);
+}
+
+size_t CacheBase::evictUnused()
+{
+    std::vector<EvictionCandidate> candidates;
+    getEvictionCandidates(&candidates);
+
+    size_t res = 0;
+    for (const EvictionCandidate& candidate : candidates)
+    {
+        res += candidate.memorySize;
+        evict(candidate.key);
+    }
+
+    return res;
+}
+
+void CacheBase::onAssetAdded(size_t memorySize)
+{
+    _memorySize += memorySize;
+
+    if (_memoryBudget > 0 && _memorySize > _memoryBudget)
+        trim(_memoryBudget);
+
+    Caches::getInstance()->checkMemoryBudget();
+}
+
+size_t CacheBase::evictCandidates(std::vector<EvictionCandidate>& candidates, size_t currentSize, size_t targetSize)
+{
+    std::sort(candidates.begin(), candidates.end(), [](const EvictionCandidate& a, const EvictionCandidate& b) { return a.lastUse < b.lastUse; });
+
+    size_t res = 0;
+    for (const EvictionCandidate& candidate : candidates)
+    {
+        if (currentSize - res <= targetSize)
+            break;
+
+        res += candidate.memorySize;
+        candidate.cache->evict(candidate.key);
+    }
+
+    return res;
+}
+
+bool CacheBase::canLoadAsync()
+{
+    TaskQueueService * taskQueueService = ServiceManager::getInstance()->findService<TaskQueueService>();
+    return taskQueueService && taskQueueService->getState() == Service::RUNNING;
+}
+
+void CacheBase::runOnLoaderQueue(const std::function<void()>& func)
+{
+    TaskQueueService * taskQueueService = ServiceManager::getInstance()->findService<TaskQueueService>();
+    GP_ASSERT(taskQueueService);
+
+    taskQueueService->createQueue(ASSET_LOADER_QUEUE);
+    taskQueueService->addWorkItem(ASSET_LOADER_QUEUE, func);
+}
+
+void CacheBase::runOnMainThread(const std::function<void()>& func)
+{
+    TaskQueueService * taskQueueService = ServiceManager::getInstance()->findService<TaskQueueService>();
+    GP_ASSERT(taskQueueService);
+
+    taskQueueService->runOnMainThread(func);
+}
+
+
+
+
+size_t Caches::getMemorySize() const
+{
+    size_t res = 0;
+    for (CacheBase * cache : _registeredCaches)
+        res += cache->getMemorySize();
+    return res;
+}
+
+void Caches::setMemoryBudget(size_t budget)
+{
+    _memoryBudget = budget;
+    checkMemoryBudget();
+}
+
+void Caches::checkMemoryBudget()
+{
+    if (_memoryBudget > 0 && getMemorySize() > _memoryBudget)
+        trim(_memoryBudget);
+}
+
+size_t Caches::trim(size_t size)
+{
+    size_t memorySize = getMemorySize();
+    if (memorySize <= size)
+        return 0;
+
+    std::vector<CacheBase::EvictionCandidate> candidates;
+    for (CacheBase * cache : _registeredCaches)
+        cache->getEvictionCandidates(&candidates);
+
+    return CacheBase::evictCandidates(candidates, memorySize, size);
+}
+
+size_t Caches::evictUnused()
+{
+    size_t res = 0;
+    for (CacheBase * cache : _registeredCaches)
+        res += cache->evictUnused();
+    return res;
+}
+
+void Caches::addDependency(const char * url, const char * dependencyURL)
+{
+    if (!url || !dependencyURL || *url == '\0' || *dependencyURL == '\0')
+        return;
+
+    DependencyNode& node = _dependencies[AssetId::makeKey(dependencyURL)];
+    if (node.url.empty())
+        node.url = dependencyURL;
+    node.dependents.insert(AssetId::makeKey(url));
+}
+
+size_t Caches::reload(const std::vector<std::string>& urls)
+{
+    // reversed depth-first post-order makes sure every asset is reloaded
+    // after all the assets it depends on
+    std::vector<std::string> order;
+    std::unordered_set<std::string> visited;
+    std::vector<std::pair<std::string, bool>> stack;
+    for (const std::string& url : urls)
+        stack.emplace_back(AssetId::makeKey(url), false);
+
+    while (!stack.empty())
+    {
+        std::pair<std::string, bool> item = std::move(stack.back());
+        stack.pop_back();
+
+        if (item.second)
+        {
+            order.push_back(std::move(item.first));
+            continue;
+        }
+
+        if (!visited.insert(item.first).second)
+            continue;
+
+        auto it = _dependencies.find(item.first);
+        stack.emplace_back(std::move(item.first), true);
+        if (it != _dependencies.end())
+            for (const std::string& dependent : (*it).second.dependents)
+                if (visited.find(dependent) == visited.end())
+                    stack.emplace_back(dependent, false);
+    }
+
+    std::reverse(order.begin(), order.end());
+
+    size_t res = 0;
+    for (const std::string& key : order)
+        for (CacheBase * cache : _registeredCaches)
+            if (cache->reload(key))
+                res++;
+
+    return res;
+}
+
+void Caches::getWatchedURLs(std::vector<std::string> * out) const
+{
+    for (CacheBase * cache : _registeredCaches)
+        cache->getURLs(out);
+
+    for (auto& it : _dependencies)
+        out->push_back(it.second.url);
+}
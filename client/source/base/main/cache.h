@@ -1,13 +1,15 @@
 #ifndef __DFG_CACHE__
 #define __DFG_CACHE__
 
-#include <locale>
+#include <string_view>
 
 
 
 
 class CacheBase : Noncopyable
 {
+    friend class Caches;
+
 public:
     virtual ~CacheBase() { _cachesConnection.disconnect(); };
 
@@ -17,8 +19,253 @@ public:
     //! Reload all asset.
     virtual void reloadAll() = 0;
 
+    /**
+     * Get memory used by assets in this cache, as reported by Asset::getMemorySize.
+     */
+    size_t getMemorySize() const { return _memorySize; };
+
+    /**
+     * Set memory budget of this cache. When the cache grows over the budget,
+     * assets that are not referenced outside of the cache are evicted,
+     * least recently used first.
+     *
+     * @param budget Budget in bytes, zero means no budget (default).
+     */
+    void setMemoryBudget(size_t budget);
+
+    /**
+     * Evict unreferenced assets, least recently used first, until
+     * memory used by the cache is not greater than the given size.
+     *
+     * @param size Target size in bytes.
+     * @return Memory size of evicted assets.
+     */
+    size_t trim(size_t size);
+
+    /**
+     * Evict all assets that are not referenced outside of the cache.
+     *
+     * @return Memory size of evicted assets.
+     */
+    size_t evictUnused();
+
+protected:
+    struct EvictionCandidate
+    {
+        CacheBase * cache;
+        std::string key;
+        uint64_t lastUse;
+        size_t memorySize;
+    };
+
+    CacheBase() : _memorySize(0), _memoryBudget(0) {};
+
+    /**
+     * Get unreferenced assets that can be evicted.
+     */
+    virtual void getEvictionCandidates(std::vector< EvictionCandidate > * out) const = 0;
+
+    /**
+     * Remove asset by its key.
+     */
+    virtual void evict(const std::string& key) = 0;
+
+    /**
+     * Reload asset by its key.
+     *
+     * @return False if there is no such asset in the cache.
+     */
+    virtual bool reload(const std::string& key) = 0;
+
+    /**
+     * Get URLs of all assets in the cache.
+     */
+    virtual void getURLs(std::vector< std::string > * out) const = 0;
+
+    /**
+     * Must be called when new asset is added. Applies memory budgets.
+     */
+    void onAssetAdded(size_t memorySize);
+
+    /**
+     * Returns increasing value used to order assets by their last use.
+     */
+    static uint64_t nextUseStamp() { return ++_useCounter; };
+
+    /**
+     * Evict candidates with the least last use value first until
+     * current size is not greater than target size.
+     */
+    static size_t evictCandidates(std::vector< EvictionCandidate >& candidates, size_t currentSize, size_t targetSize);
+
+    size_t _memorySize;
+    size_t _memoryBudget;
+
+    /**
+     * Returns true if TaskQueueService is running and assets can be loaded asynchronously.
+     */
+    static bool canLoadAsync();
+
+    /**
+     * Add work item to the asset loading queue.
+     */
+    static void runOnLoaderQueue(const std::function<void()>& func);
+
+    /**
+     * Schedule work item to run on main thread.
+     */
+    static void runOnMainThread(const std::function<void()>& func);
+
 private:
     sigc::connection _cachesConnection;
+    static uint64_t _useCounter;
+};
+
+
+
+/** @brief Precomputed asset key.
+ *
+ *	Holds asset's URL together with its case-insensitive hash. Can be kept
+ *	for frequently loaded assets to skip hashing on every Cache lookup.
+ */
+
+class AssetId
+{
+public:
+    AssetId(const char * url)
+        : _url(url)
+        , _hash(hash(_url))
+    {
+    };
+
+    /**
+     * Get asset's URL.
+     */
+    const char * getURL() const { return _url.c_str(); };
+
+    /**
+     * Get case-insensitive hash of the URL.
+     */
+    uint64_t getHash() const { return _hash; };
+
+    /**
+     * Compute case-insensitive hash (FNV-1a) of the URL. Doesn't allocate.
+     */
+    static uint64_t hash(std::string_view url)
+    {
+        uint64_t res = 14695981039346656037ULL;
+        for (char c : url)
+            res = (res ^ static_cast<uint8_t>(foldCase(c))) * 1099511628211ULL;
+        return res;
+    };
+
+    /**
+     * Compare lowercase key with the URL ignoring case.
+     */
+    static bool equals(std::string_view lowerKey, std::string_view url)
+    {
+        if (lowerKey.size() != url.size())
+            return false;
+
+        for (size_t i = 0; i < url.size(); i++)
+            if (lowerKey[i] != foldCase(url[i]))
+                return false;
+
+        return true;
+    };
+
+    /**
+     * Make lowercase key from the URL.
+     */
+    static std::string makeKey(std::string_view url)
+    {
+        std::string res(url);
+        std::for_each(res.begin(), res.end(), [](char & c) { c = foldCase(c); });
+        return res;
+    };
+
+private:
+    static char foldCase(char c) { return c >= 'A' && c <= 'Z' ? c + ('a' - 'A') : c; };
+
+    std::string _url;
+    uint64_t _hash;
+};
+
+
+
+template< class T > class Cache;
+
+/** @brief Asynchronous asset loading request.
+ *
+ *	Handle returned by Cache::loadAsync. The asset is NULL until the request
+ *	is completed. Request is cancelled if all handles are dropped before
+ *	it's completed. Should be used only from the main thread.
+ */
+
+template< class T >
+class AssetRequest : Noncopyable
+{
+    friend class Cache< T >;
+
+public:
+    enum State
+    {
+        PENDING,
+        LOADED,
+        FAILED,
+    };
+
+    typedef std::function< void(const RefPtr< const T >&) > Callback;
+
+    /**
+     * Get request state.
+     */
+    State getState() const { return _state; };
+
+    /**
+     * Returns true when the asset is either loaded or failed to load.
+     */
+    bool isCompleted() const { return _state != PENDING; };
+
+    /**
+     * Get loaded asset. NULL while request is pending or when loading failed.
+     */
+    const RefPtr< const T >& get() const { return _asset; };
+
+    /**
+     * Get asset's URL.
+     */
+    const char * getURL() const { return _url.c_str(); };
+
+    /**
+     * Get request priority.
+     */
+    int getPriority() const { return _priority; };
+
+private:
+    AssetRequest(const char * url, int priority)
+        : _url(url)
+        , _priority(priority)
+        , _state(PENDING)
+    {
+    };
+
+    void complete(const RefPtr< const T >& asset)
+    {
+        _asset = asset;
+        _state = asset ? LOADED : FAILED;
+
+        std::vector< Callback > callbacks;
+        callbacks.swap(_callbacks);
+        for (const Callback& callback : callbacks)
+            callback(_asset);
+    };
+
+    std::string _url;
+    int _priority;
+    State _state;
+    RefPtr< const T > _asset;
+    std::vector< Callback > _callbacks;
 };
 
 
@@ -43,6 +290,65 @@ public:
         std::for_each(_registeredCaches.begin(), _registeredCaches.end(), [](CacheBase * c) { c->clear(); });
     }
 
+    /**
+     * Get memory used by assets in all caches.
+     */
+    size_t getMemorySize() const;
+
+    /**
+     * Set global memory budget for all caches. When total size of the caches
+     * grows over the budget, unreferenced assets are evicted from all
+     * caches, least recently used first.
+     *
+     * @param budget Budget in bytes, zero means no budget (default).
+     */
+    void setMemoryBudget(size_t budget);
+
+    /**
+     * Apply global memory budget.
+     */
+    void checkMemoryBudget();
+
+    /**
+     * Evict unreferenced assets from all caches, least recently used first,
+     * until total memory size is not greater than the given size.
+     *
+     * @param size Target size in bytes.
+     * @return Memory size of evicted assets.
+     */
+    size_t trim(size_t size);
+
+    /**
+     * Evict all unreferenced assets from all caches. Should be called
+     * when the OS reports low memory.
+     *
+     * @return Memory size of evicted assets.
+     */
+    size_t evictUnused();
+
+    /**
+     * Register dependency of the asset on another asset or file. When the
+     * dependency is reloaded, the asset is reloaded after it.
+     *
+     * @param url Asset's URL.
+     * @param dependencyURL URL of asset or file the asset depends on.
+     */
+    void addDependency(const char * url, const char * dependencyURL);
+
+    /**
+     * Reload assets loaded from given URLs in all caches, followed by
+     * all assets depending on them. Each asset is reloaded once.
+     *
+     * @param urls URLs of changed assets or files.
+     * @return Number of reloaded assets.
+     */
+    size_t reload(const std::vector< std::string >& urls);
+
+    /**
+     * Get URLs of all cached assets and their dependencies.
+     */
+    void getWatchedURLs(std::vector< std::string > * out) const;
+
     /**
      * Register new cache object.
      */
@@ -66,10 +372,18 @@ public:
     }
 
 private:
-    Caches() {};
+    Caches() : _memoryBudget(0) {};
     ~Caches() {};
 
+    struct DependencyNode
+    {
+        std::string url;
+        std::unordered_set< std::string > dependents;   // lowercase URLs
+    };
+
     std::vector< CacheBase * > _registeredCaches;
+    size_t _memoryBudget;
+    std::unordered_map< std::string, DependencyNode > _dependencies;   // by lowercase URL
 };
 
 
@@ -84,7 +398,42 @@ private:
 template< class T >
 class Cache : public CacheBase
 {
+    /**
+     * Detects optional T::decode(url), which runs on a worker thread.
+     *
+     * Assets that don't need the main thread return the asset itself. Assets that do
+     * declare T::Decoded and return it from decode(), the asset is then created from it
+     * by T::finalize(url, decoded) on the main thread. finalize() takes ownership of
+     * the decoded data and receives NULL if decode() failed.
+     */
+    template< class U, class = void >
+    struct HasDecode : std::false_type {};
+
+    template< class U >
+    struct HasDecode< U, std::void_t< decltype(U::decode(static_cast< const char * >(NULL))) > > : std::true_type {};
+
+    template< class U, class = void >
+    struct HasFinalize : std::false_type {};
+
+    template< class U >
+    struct HasFinalize< U, std::void_t< decltype(U::finalize(static_cast< const char * >(NULL), static_cast< typename U::Decoded * >(NULL))) > > : std::true_type {};
+
+    template< class U, class = void >
+    struct DecodedType { typedef U type; };
+
+    template< class U >
+    struct DecodedType< U, typename std::enable_if< HasFinalize< U >::value >::type > { typedef typename U::Decoded type; };
+
+    typedef typename DecodedType< T >::type Decoded;
+
 public:
+    typedef std::shared_ptr< AssetRequest< T > > RequestPtr;
+
+    virtual ~Cache()
+    {
+        _loader->cache = NULL;
+    };
+
     static Cache<T> * create()
     {
         Cache<T> * res = new Cache<T>();
@@ -103,27 +452,86 @@ public:
      */
     RefPtr< const T > load(const char * url)
     {
-        std::string lowerName(url);
-        std::for_each(lowerName.begin(), lowerName.end(), [](char & c) {c = ::tolower(c);});
-        typename ResourcesType::iterator it = _resources.find(lowerName);
+        return load(url, AssetId::hash(url));
+    };
 
-        RefPtr< const T > res;
-        if (it == _resources.end())
+    /**	@brief Register new asset.
+     *
+     *	Same as load(url), but uses precomputed URL hash.
+     *
+     *	@param	id Asset's id.
+     *	@return	Returns shared pointer to resource.
+     */
+    RefPtr< const T > load(const AssetId& id)
+    {
+        return load(id.getURL(), id.getHash());
+    };
+
+    /**	@brief Load asset asynchronously.
+     *
+     *	Returns immediately with a pending request. Asset is decoded on the
+     *	loader queue if T implements decode(url), otherwise the request only
+     *	waits in the queue and asset is created on the main thread. Requests
+     *	with higher priority are processed first. Concurrent requests for
+     *	the same URL share the same request object, which takes the highest
+     *	of their priorities.
+     *
+     *	The callback is called on the main thread when the request completes,
+     *	with NULL asset in case of failure. It's called immediately if the
+     *	asset is already loaded. Dropping all handles to a pending request
+     *	cancels it and its callbacks are never called.
+     *
+     *	@param	url Asset's URL.
+     *	@param	priority Request priority.
+     *	@param	callback Completion callback, can be empty.
+     *	@return	Returns request handle.
+     */
+    RequestPtr loadAsync(const char * url, int priority = 0, const typename AssetRequest< T >::Callback& callback = nullptr)
+    {
+        std::string lowerName(AssetId::makeKey(url));
+
+        typename PendingType::iterator pending = _pending.find(lowerName);
+        RequestPtr request = pending != _pending.end() ? (*pending).second.lock() : nullptr;
+        if (request)
         {
-            T * r = T::create(url);
-            res.reset(r);
+            if (callback)
+                request->_callbacks.push_back(callback);
+            if (priority > request->_priority)
+                raisePriority(request, priority);
+            return request;
+        }
 
-            if (!r)
-            {
-                GP_WARN("Can't load asset: %s", lowerName.c_str());
-                return RefPtr< const T >();
-            }
+        request.reset(new AssetRequest< T >(url, priority));
+        if (callback)
+            request->_callbacks.push_back(callback);
 
-            _resources.insert(std::make_pair(lowerName, res));
-            return res;
+        typename ResourcesType::iterator it = find(AssetId::hash(lowerName), lowerName);
+        if (it != _resources.end())
+        {
+            (*it).second.lastUse = nextUseStamp();
+            request->complete((*it).second.asset);
+            return request;
         }
 
-        return (*it).second;
+        if (!canLoadAsync())
+        {
+            request->complete(load(url));
+            return request;
+        }
+
+        _pending[lowerName] = request;
+
+        {
+            std::unique_lock< std::mutex > lock(_loader->mutex);
+            _loader->jobs.push_back({ url, lowerName, priority, _loader->counter++, request });
+            std::push_heap(_loader->jobs.begin(), _loader->jobs.end());
+        }
+
+        // each work item processes the most important pending job, not necessary the one it was added for
+        std::shared_ptr< AsyncLoader > loader = _loader;
+        runOnLoaderQueue([loader]() { processJob(loader); });
+
+        return request;
     };
 
     /**	@brief Unregister asset.
@@ -134,17 +542,18 @@ public:
      */
     void remove(RefPtr< T >& object)
     {
-        // Linear search used due to rarely function using.
-        typename ResourcesType::iterator it = _resources.begin();
-        while (it != _resources.end())
+        typename AssetHashesType::iterator hash = _assetHashes.find(object.get());
+        if (hash == _assetHashes.end())
+            return;
+
+        auto range = _resources.equal_range((*hash).second);
+        for (typename ResourcesType::iterator it = range.first; it != range.second; ++it)
         {
-            if ((*it).second == object)
+            if ((*it).second.asset.get() == object.get())
             {
-                _resources.erase(it);
+                erase(it);
                 break;
             }
-
-            ++it;
         }
     };
 
@@ -154,6 +563,8 @@ public:
     virtual void clear()
     {
         _resources.clear();
+        _assetHashes.clear();
+        _memorySize = 0;
     };
 
     /**
@@ -162,14 +573,309 @@ public:
     virtual void reloadAll()
     {
         for (typename ResourcesType::iterator it = _resources.begin(), end_it = _resources.end(); it != end_it; it++)
-            const_cast<T *>((*it).second.get())->reload();
+        {
+            CacheEntry& entry = (*it).second;
+            const_cast<T *>(entry.asset.get())->reload();
+
+            _memorySize -= entry.memorySize;
+            entry.memorySize = entry.asset->getMemorySize();
+            _memorySize += entry.memorySize;
+        }
     }
 
+protected:
+    virtual void getEvictionCandidates(std::vector< EvictionCandidate > * out) const
+    {
+        for (typename ResourcesType::const_iterator it = _resources.begin(), end_it = _resources.end(); it != end_it; it++)
+            if ((*it).second.asset->getRefCount() == 1)
+                out->push_back({ const_cast<Cache< T > *>(this), (*it).second.key, (*it).second.lastUse, (*it).second.memorySize });
+    };
+
+    virtual void evict(const std::string& key)
+    {
+        typename ResourcesType::iterator it = find(AssetId::hash(key), key);
+        if (it != _resources.end())
+            erase(it);
+    };
+
+    virtual bool reload(const std::string& key)
+    {
+        typename ResourcesType::iterator it = find(AssetId::hash(key), key);
+        if (it == _resources.end())
+            return false;
+
+        CacheEntry& entry = (*it).second;
+        if (!const_cast<T *>(entry.asset.get())->reload())
+            GP_WARN("Can't reload asset: %s", key.c_str());
+
+        _memorySize -= entry.memorySize;
+        entry.memorySize = entry.asset->getMemorySize();
+        _memorySize += entry.memorySize;
+        return true;
+    };
+
+    virtual void getURLs(std::vector< std::string > * out) const
+    {
+        for (typename ResourcesType::const_iterator it = _resources.begin(), end_it = _resources.end(); it != end_it; it++)
+            out->push_back((*it).second.asset->getURL());
+    };
+
 private:
-    Cache() { };
+    struct CacheEntry
+    {
+        std::string key;            // lowercase URL
+        RefPtr< const T > asset;
+        size_t memorySize;
+        uint64_t lastUse;
+    };
+
+    // keyed by case-insensitive hash of the URL, so lookups don't need to allocate
+    typedef std::unordered_multimap< uint64_t, CacheEntry > ResourcesType;
+    typedef std::unordered_map< const T *, uint64_t > AssetHashesType;
+
+    struct LoadJob
+    {
+        std::string url;
+        std::string key;
+        int priority;
+        uint64_t order;
+        std::weak_ptr< AssetRequest< T > > request;
+
+        bool operator < (const LoadJob& other) const
+        {
+            return priority < other.priority || (priority == other.priority && order > other.order);
+        };
+    };
+
+    struct FinishedJob
+    {
+        LoadJob job;
+        Decoded * decoded;
+    };
+
+    /**
+     * Pending jobs, shared with the work items so it outlives the cache.
+     */
+    struct AsyncLoader
+    {
+        AsyncLoader() : cache(NULL), counter(0) {};
+        ~AsyncLoader()
+        {
+            for (FinishedJob& finished : finishedJobs)
+                discard(finished.decoded);
+        };
+
+        std::mutex mutex;
+        std::vector< LoadJob > jobs;
+        std::vector< FinishedJob > finishedJobs;    // decoded jobs waiting for the main thread
+        Cache< T > * cache;             // accessed only from main thread
+        uint64_t counter;
+    };
+
+    Cache()
+        : _loader(new AsyncLoader())
+    {
+        _loader->cache = this;
+    };
+
+    RefPtr< const T > load(const char * url, uint64_t hash)
+    {
+        typename ResourcesType::iterator it = find(hash, url);
+
+        RefPtr< const T > res;
+        if (it == _resources.end())
+        {
+            T * r = T::create(url);
+            res.reset(r);
+
+            if (!r)
+            {
+                GP_WARN("Can't load asset: %s", url);
+                return RefPtr< const T >();
+            }
+
+            insert(AssetId::makeKey(url), hash, res);
+            return res;
+        }
+
+        (*it).second.lastUse = nextUseStamp();
+        return (*it).second.asset;
+    };
+
+    typename ResourcesType::iterator find(uint64_t hash, std::string_view url)
+    {
+        auto range = _resources.equal_range(hash);
+        for (typename ResourcesType::iterator it = range.first; it != range.second; ++it)
+            if (AssetId::equals((*it).second.key, url))
+                return it;
+
+        return _resources.end();
+    };
+
+    void raisePriority(const RequestPtr& request, int priority)
+    {
+        request->_priority = priority;
+
+        // the job is not in the heap anymore if it's being decoded
+        std::unique_lock< std::mutex > lock(_loader->mutex);
+        for (LoadJob& job : _loader->jobs)
+        {
+            if (job.request.lock() == request)
+            {
+                job.priority = priority;
+                std::make_heap(_loader->jobs.begin(), _loader->jobs.end());
+                break;
+            }
+        }
+    };
+
+    template< class U = T >
+    static typename std::enable_if< HasDecode< U >::value, Decoded * >::type decode(const char * url)
+    {
+        return U::decode(url);
+    };
+
+    template< class U = T >
+    static typename std::enable_if< !HasDecode< U >::value, Decoded * >::type decode(const char *)
+    {
+        return NULL;
+    };
+
+    template< class U = T >
+    static typename std::enable_if< HasFinalize< U >::value, T * >::type finalize(const char * url, typename DecodedType< U >::type * decoded)
+    {
+        return U::finalize(url, decoded);
+    };
+
+    template< class U = T >
+    static typename std::enable_if< !HasFinalize< U >::value, T * >::type finalize(const char *, typename DecodedType< U >::type * decoded)
+    {
+        return decoded;
+    };
+
+    template< class U = T >
+    static typename std::enable_if< HasFinalize< U >::value >::type discard(typename DecodedType< U >::type * decoded)
+    {
+        delete decoded;
+    };
+
+    template< class U = T >
+    static typename std::enable_if< !HasFinalize< U >::value >::type discard(typename DecodedType< U >::type * decoded)
+    {
+        if (decoded)
+            decoded->release();
+    };
+
+    static void processJob(const std::shared_ptr< AsyncLoader >& loader)
+    {
+        LoadJob job;
+        {
+            std::unique_lock< std::mutex > lock(loader->mutex);
+            if (loader->jobs.empty())
+                return;
+
+            std::pop_heap(loader->jobs.begin(), loader->jobs.end());
+            job = std::move(loader->jobs.back());
+            loader->jobs.pop_back();
+        }
+
+        // cancelled requests are not decoded
+        Decoded * decoded = job.request.expired() ? NULL : decode(job.url.c_str());
+
+        // jobs finished before the main thread gets to them are completed together,
+        // so only the first one schedules the work item
+        bool schedule;
+        {
+            std::unique_lock< std::mutex > lock(loader->mutex);
+            schedule = loader->finishedJobs.empty();
+            loader->finishedJobs.push_back({ std::move(job), decoded });
+        }
+
+        if (schedule)
+            runOnMainThread([loader]() { finishJobs(loader); });
+    };
+
+    static void finishJobs(const std::shared_ptr< AsyncLoader >& loader)
+    {
+        std::vector< FinishedJob > finishedJobs;
+        {
+            std::unique_lock< std::mutex > lock(loader->mutex);
+            finishedJobs.swap(loader->finishedJobs);
+        }
+
+        for (FinishedJob& finished : finishedJobs)
+        {
+            if (loader->cache)
+                loader->cache->finishJob(finished.job, finished.decoded);
+            else
+                discard(finished.decoded);
+        }
+    };
+
+    void finishJob(const LoadJob& job, Decoded * decoded)
+    {
+        RequestPtr request = job.request.lock();
+        typename PendingType::iterator pending = _pending.find(job.key);
+        if (pending != _pending.end() && (*pending).second.lock() == request)
+            _pending.erase(pending);
+
+        uint64_t hash = AssetId::hash(job.key);
+        typename ResourcesType::iterator it = request ? find(hash, job.key) : _resources.end();
+        if (!request || it != _resources.end() || !HasDecode< T >::value)
+            discard(decoded);
+
+        if (!request)
+            return;
+
+        RefPtr< const T > asset;
+        if (it != _resources.end())
+        {
+            (*it).second.lastUse = nextUseStamp();
+            asset = (*it).second.asset;
+        }
+        else if (HasDecode< T >::value)
+        {
+            asset.reset(finalize(job.url.c_str(), decoded));
+            if (asset)
+                insert(job.key, hash, asset);
+            else
+                GP_WARN("Can't load asset: %s", job.key.c_str());
+        }
+        else
+        {
+            asset = load(job.url.c_str());
+        }
+
+        request->complete(asset);
+    };
+
+    void insert(const std::string& key, uint64_t hash, const RefPtr< const T >& asset)
+    {
+        CacheEntry& entry = (*_resources.emplace(hash, CacheEntry())).second;
+        entry.key = key;
+        entry.asset = asset;
+        entry.memorySize = asset->getMemorySize();
+        entry.lastUse = nextUseStamp();
+        _assetHashes[asset.get()] = hash;
+
+        // the new asset is referenced by the caller, so it's never evicted here
+        onAssetAdded(entry.memorySize);
+    };
+
+    void erase(typename ResourcesType::iterator it)
+    {
+        _memorySize -= (*it).second.memorySize;
+        _assetHashes.erase((*it).second.asset.get());
+        _resources.erase(it);
+    };
 
-    typedef std::unordered_map< std::string, RefPtr< const T > > ResourcesType;
     ResourcesType _resources;
+    AssetHashesType _assetHashes;
+
+    typedef std::unordered_map< std::string, std::weak_ptr< AssetRequest< T > > > PendingType;
+    PendingType _pending;
+
+    std::shared_ptr< AsyncLoader > _loader;
 };
 
 
@@ -55,6 +55,13 @@ bool PropertiesAsset::reload()
 
 Cache< SpriteBatchAsset > * SpriteBatchAsset::_cache = nullptr;
 
+// reload the batch when its texture changes
+static void addTextureDependency(const char * url, gameplay::SpriteBatch * spriteBatch)
+{
+    if (spriteBatch && spriteBatch->getSampler() && spriteBatch->getSampler()->getTexture())
+        Caches::getInstance()->addDependency(url, spriteBatch->getSampler()->getTexture()->getPath());
+}
+
 SpriteBatchAsset::SpriteBatchAsset()
     : _spriteBatch(NULL)
 {
@@ -67,7 +74,11 @@ SpriteBatchAsset::~SpriteBatchAsset()
 
 SpriteBatchAsset * SpriteBatchAsset::create(const char * url)
 {
-    gameplay::Properties * properties = gameplay::Properties::create(url);
+    return finalize(url, gameplay::Properties::create(url));
+}
+
+SpriteBatchAsset * SpriteBatchAsset::finalize(const char * url, gameplay::Properties * properties)
+{
     if (!properties)
         return NULL;
 
@@ -79,6 +90,7 @@ SpriteBatchAsset * SpriteBatchAsset::create(const char * url)
     SpriteBatchAsset * res = new SpriteBatchAsset();
     res->_spriteBatch = gameplay::SpriteBatch::create(material);
     res->setURL(url);
+    addTextureDependency(url, res->_spriteBatch);
 
     SAFE_RELEASE(material);
 
@@ -100,5 +112,59 @@ bool SpriteBatchAsset::reload()
     _spriteBatch = gameplay::SpriteBatch::create(material);
     SAFE_RELEASE(material);
 
+    addTextureDependency(getURL(), _spriteBatch);
+
     return true;
 }
+
+size_t SpriteBatchAsset::getMemorySize() const
+{
+    if (!_spriteBatch || !_spriteBatch->getSampler())
+        return 0;
+
+    return getGameplayObjectMemorySize(_spriteBatch->getSampler()->getTexture());
+}
+
+
+
+//
+// GameplayRefAsset
+//
+
+size_t getGameplayObjectMemorySize(const gameplay::Texture * texture)
+{
+    if (!texture)
+        return 0;
+
+    // compressed formats take 4 to 8 bits per pixel
+    size_t bytesPerPixel = 4;
+    if (texture->isCompressed())
+        bytesPerPixel = 1;
+    else if (texture->getFormat() == gameplay::Texture::RGB)
+        bytesPerPixel = 3;
+    else if (texture->getFormat() == gameplay::Texture::ALPHA)
+        bytesPerPixel = 1;
+
+    size_t res = static_cast<size_t>(texture->getWidth()) * texture->getHeight() * bytesPerPixel;
+    if (texture->getType() == gameplay::Texture::TEXTURE_CUBE)
+        res *= 6;
+
+    // full mipmap chain adds a third of the base level
+    return texture->isMipmapped() ? res + res / 3 : res;
+}
+
+size_t getGameplayObjectMemorySize(const gameplay::Font * font)
+{
+    if (!font)
+        return 0;
+
+    size_t res = 0;
+    for (unsigned i = 0; i < font->getSizeCount(); i++)
+    {
+        gameplay::SpriteBatch * batch = font->getSpriteBatch(font->getSize(i));
+        if (batch && batch->getSampler())
+            res += getGameplayObjectMemorySize(batch->getSampler()->getTexture());
+    }
+
+    return res;
+}
@@ -28,6 +28,11 @@ public:
      */
     static PropertiesAsset * create(const char * url);
 
+    /**
+     * Load Properties on a worker thread, used by Cache::loadAsync.
+     */
+    static PropertiesAsset * decode(const char * url) { return create(url); };
+
     /**
      * Get resource name.
      */
@@ -76,11 +81,26 @@ public:
         return *_cache;
     }
 
+    typedef gameplay::Properties Decoded;
+
     /** 
      * Load SpriteBatch from url.
      */
     static SpriteBatchAsset * create(const char * materialURL);
 
+    /**
+     * Parse material file on a worker thread, used by Cache::loadAsync.
+     */
+    static gameplay::Properties * decode(const char * materialURL) { return gameplay::Properties::create(materialURL); };
+
+    /**
+     * Create SpriteBatch from the parsed material file on the main thread.
+     *
+     * @param materialURL URL to material file.
+     * @param properties Parsed material file or NULL. Deleted by this function.
+     */
+    static SpriteBatchAsset * finalize(const char * materialURL, gameplay::Properties * properties);
+
     /**
      * Get resource name.
      */
@@ -93,6 +113,11 @@ public:
      */
     virtual bool reload();
 
+    /**
+     * Get approximate size of the batch's texture, including mipmaps.
+     */
+    virtual size_t getMemorySize() const;
+
     /**
      * Return underlying asset.
      */
@@ -110,6 +135,25 @@ private:
 
 
 
+/**
+ * Get approximate memory used by a texture, including its mipmaps.
+ */
+size_t getGameplayObjectMemorySize(const gameplay::Texture * texture);
+
+/**
+ * Get approximate memory used by font's textures, one for every font size.
+ */
+size_t getGameplayObjectMemorySize(const gameplay::Font * font);
+
+/**
+ * Memory of other gameplay objects is not estimated.
+ */
+template<class _Type> size_t getGameplayObjectMemorySize(const _Type * object) { return 0; };
+
+
+
+
+
 /** 
  * Asset wrapper for Ref-based gameplay assets (Font, AudioSource, etc).
  *
@@ -121,6 +165,15 @@ private:
 template<class _Type>
 class GameplayRefAsset : public Asset
 {
+    /**
+     * Detects _Type::create(Properties *).
+     */
+    template< class U, class = void >
+    struct HasPropertiesCreate : std::false_type {};
+
+    template< class U >
+    struct HasPropertiesCreate< U, std::void_t< decltype(U::create(static_cast< gameplay::Properties * >(NULL))) > > : std::true_type {};
+
 public:
     virtual ~GameplayRefAsset() {};
 
@@ -131,19 +184,43 @@ public:
         return *_cache;
     }
 
+    typedef gameplay::Properties Decoded;
+
     /** 
      * Load FontAsset from url.
      */
     static GameplayRefAsset< _Type > * create(const char * url)
     {
-        _Type * asset = _Type::create(url);
-        if (!asset)
-            return NULL;
+        return wrap(url, _Type::create(url));
+    }
 
-        GameplayRefAsset< _Type > * res = new GameplayRefAsset< _Type >();
-        res->_asset.reset(asset);
-        res->setURL(url);
+    /**
+     * Parse properties file on a worker thread, used by Cache::loadAsync.
+     *
+     * Available for types created from Properties (AudioSource, Material, etc).
+     * Only URLs with a namespace id ("file#id") are parsed here, as they always refer
+     * to a properties file. Other assets are created on the main thread by finalize().
+     */
+    template< class U = _Type >
+    static typename std::enable_if< HasPropertiesCreate< U >::value, gameplay::Properties * >::type decode(const char * url)
+    {
+        return strchr(url, '#') ? gameplay::Properties::create(url) : NULL;
+    }
 
+    /**
+     * Create asset on the main thread.
+     *
+     * @param url Asset's URL.
+     * @param properties Properties parsed by decode() or NULL. Deleted by this function.
+     */
+    template< class U = _Type >
+    static typename std::enable_if< HasPropertiesCreate< U >::value, GameplayRefAsset< _Type > * >::type finalize(const char * url, gameplay::Properties * properties)
+    {
+        if (!properties)
+            return create(url);
+
+        GameplayRefAsset< _Type > * res = wrap(url, U::create((strlen(properties->getNamespace()) > 0) ? properties : properties->getNextNamespace()));
+        SAFE_DELETE(properties);
         return res;
     }
 
@@ -163,6 +240,14 @@ public:
         return _asset.get() != NULL;
     }
 
+    /**
+     * Get approximate size of the underlying object, textures and fonts are estimated.
+     */
+    virtual size_t getMemorySize() const
+    {
+        return _asset.get() ? getGameplayObjectMemorySize(_asset.get()) : 0;
+    }
+
     /**
      * Return underlying asset and increment ref counter.
      */
@@ -177,6 +262,18 @@ protected:
     GameplayRefAsset() {};
 
 private:
+    static GameplayRefAsset< _Type > * wrap(const char * url, _Type * asset)
+    {
+        if (!asset)
+            return NULL;
+
+        GameplayRefAsset< _Type > * res = new GameplayRefAsset< _Type >();
+        res->_asset.reset(asset);
+        res->setURL(url);
+
+        return res;
+    }
+
     RefPtr< _Type > _asset;
     static Cache< GameplayRefAsset< _Type > > * _cache;
 };
@@ -0,0 +1,899 @@
+#include "pch.h"
+#include "json.h"
+#include "archive.h"
+#include <charconv>
+
+
+
+
+//
+// JSONWriter
+//
+
+JSONWriter::JSONWriter(std::string * out, size_t reserveSize)
+    : _out(out)
+    , _afterKey(false)
+{
+    GP_ASSERT(_out);
+    _out->reserve(_out->size() + reserveSize);
+    _scopeIsEmpty.reserve(16);
+}
+
+void JSONWriter::separator()
+{
+    if (_afterKey)
+    {
+        _afterKey = false;
+        return;
+    }
+
+    if (_scopeIsEmpty.empty())
+        return;
+
+    if (_scopeIsEmpty.back())
+        _scopeIsEmpty.back() = false;
+    else
+        _out->push_back(',');
+}
+
+void JSONWriter::beginObject()
+{
+    separator();
+    _out->push_back('{');
+    _scopeIsEmpty.push_back(true);
+}
+
+void JSONWriter::endObject()
+{
+    GP_ASSERT(!_scopeIsEmpty.empty() && !_afterKey);
+    _scopeIsEmpty.pop_back();
+    _out->push_back('}');
+}
+
+void JSONWriter::beginArray()
+{
+    separator();
+    _out->push_back('[');
+    _scopeIsEmpty.push_back(true);
+}
+
+void JSONWriter::endArray()
+{
+    GP_ASSERT(!_scopeIsEmpty.empty() && !_afterKey);
+    _scopeIsEmpty.pop_back();
+    _out->push_back(']');
+}
+
+void JSONWriter::key(const char * name)
+{
+    key(name, strlen(name));
+}
+
+void JSONWriter::key(const char * name, size_t length)
+{
+    GP_ASSERT(!_afterKey);
+    separator();
+    escapeString(name, length, _out);
+    _out->push_back(':');
+    _afterKey = true;
+}
+
+void JSONWriter::writeNull()
+{
+    separator();
+    _out->append("null", 4);
+}
+
+void JSONWriter::writeBool(bool value)
+{
+    separator();
+    if (value)
+        _out->append("true", 4);
+    else
+        _out->append("false", 5);
+}
+
+void JSONWriter::writeInt(int64_t value)
+{
+    separator();
+    char buf[24];
+    auto res = std::to_chars(buf, buf + sizeof(buf), value);
+    _out->append(buf, res.ptr - buf);
+}
+
+void JSONWriter::writeUInt(uint64_t value)
+{
+    separator();
+    char buf[24];
+    auto res = std::to_chars(buf, buf + sizeof(buf), value);
+    _out->append(buf, res.ptr - buf);
+}
+
+void JSONWriter::writeFloat(float value)
+{
+    // JSON has no representation for NaN and infinity
+    if (!std::isfinite(value))
+        return writeNull();
+
+    // floating point std::to_chars is not available on all of our platforms (iOS, older NDKs),
+    // fmt produces the same shortest round-trip representation without temporary strings
+    separator();
+    fmt::format_to(std::back_inserter(*_out), "{}", value);
+}
+
+void JSONWriter::writeDouble(double value)
+{
+    if (!std::isfinite(value))
+        return writeNull();
+
+    separator();
+    fmt::format_to(std::back_inserter(*_out), "{}", value);
+}
+
+void JSONWriter::writeString(const char * str)
+{
+    writeString(str, strlen(str));
+}
+
+void JSONWriter::writeString(const char * str, size_t length)
+{
+    separator();
+    escapeString(str, length, _out);
+}
+
+void JSONWriter::writeRaw(const char * json, size_t length)
+{
+    separator();
+    _out->append(json, length);
+}
+
+void JSONWriter::escapeString(const char * str, size_t length, std::string * out)
+{
+    static const char hexmap[16] = { '0', '1', '2', '3', '4', '5', '6', '7', '8', '9', 'a', 'b', 'c', 'd', 'e', 'f' };
+
+    out->reserve(out->size() + length + 2);
+    out->push_back('"');
+
+    // copy the runs of characters that don't need escaping at once
+    const char * runStart = str;
+    const char * end = str + length;
+    for (const char * p = str; p < end; p++)
+    {
+        unsigned char c = static_cast<unsigned char>(*p);
+        if (c >= 0x20 && c != '"' && c != '\\' && c != 0x7F)
+            continue;
+
+        out->append(runStart, p - runStart);
+        runStart = p + 1;
+
+        switch (c)
+        {
+        case '"':  out->append("\\\"", 2); break;
+        case '\\': out->append("\\\\", 2); break;
+        case '\b': out->append("\\b", 2); break;
+        case '\f': out->append("\\f", 2); break;
+        case '\n': out->append("\\n", 2); break;
+        case '\r': out->append("\\r", 2); break;
+        case '\t': out->append("\\t", 2); break;
+        default:
+            {
+                char buf[6] = { '\\', 'u', '0', '0', hexmap[c >> 4], hexmap[c & 0xF] };
+                out->append(buf, 6);
+            }
+            break;
+        }
+    }
+
+    out->append(runStart, end - runStart);
+    out->push_back('"');
+}
+
+bool JSONWriter::writeVariant(const VariantType& value)
+{
+    switch (value.getType())
+    {
+    case VariantType::TYPE_NONE:
+        writeNull();
+        return true;
+    case VariantType::TYPE_BOOLEAN:
+        writeBool(value.get<bool>());
+        return true;
+    case VariantType::TYPE_INT8:
+        writeInt(value.get<int8_t>());
+        return true;
+    case VariantType::TYPE_UINT8:
+        writeUInt(value.get<uint8_t>());
+        return true;
+    case VariantType::TYPE_INT16:
+        writeInt(value.get<int16_t>());
+        return true;
+    case VariantType::TYPE_UINT16:
+        writeUInt(value.get<uint16_t>());
+        return true;
+    case VariantType::TYPE_INT32:
+        writeInt(value.get<int32_t>());
+        return true;
+    case VariantType::TYPE_UINT32:
+        writeUInt(value.get<uint32_t>());
+        return true;
+    case VariantType::TYPE_INT64:
+        writeInt(value.get<int64_t>());
+        return true;
+    case VariantType::TYPE_UINT64:
+        writeUInt(value.get<uint64_t>());
+        return true;
+    case VariantType::TYPE_FLOAT:
+        writeFloat(value.get<float>());
+        return true;
+    case VariantType::TYPE_FLOAT64:
+        writeDouble(value.get<double>());
+        return true;
+    case VariantType::TYPE_STRING:
+        writeString(value.get<std::string>());
+        return true;
+    case VariantType::TYPE_WIDE_STRING:
+        writeString(Utils::WCSToUTF8(value.get<std::wstring>()));
+        return true;
+    case VariantType::TYPE_BYTE_ARRAY:
+        {
+            uint32_t size;
+            const uint8_t * buf = value.getBlob(&size);
+            std::string encoded;
+            Utils::base64Encode(buf, size, &encoded);
+            writeString(encoded);
+        }
+        return true;
+    case VariantType::TYPE_KEYED_ARCHIVE:
+        return writeArchive(*value.getArchive());
+    case VariantType::TYPE_VECTOR2:
+        {
+            const gameplay::Vector2& v = value.get<gameplay::Vector2>();
+            beginArray();
+            writeFloat(v.x);
+            writeFloat(v.y);
+            endArray();
+        }
+        return true;
+    case VariantType::TYPE_VECTOR3:
+        {
+            const gameplay::Vector3& v = value.get<gameplay::Vector3>();
+            beginArray();
+            writeFloat(v.x);
+            writeFloat(v.y);
+            writeFloat(v.z);
+            endArray();
+        }
+        return true;
+    case VariantType::TYPE_VECTOR4:
+        {
+            const gameplay::Vector4& v = value.get<gameplay::Vector4>();
+            beginArray();
+            writeFloat(v.x);
+            writeFloat(v.y);
+            writeFloat(v.z);
+            writeFloat(v.w);
+            endArray();
+        }
+        return true;
+    case VariantType::TYPE_LIST:
+        beginArray();
+        for (const VariantType& v : value)
+            if (!writeVariant(v))
+                return false;
+        endArray();
+        return true;
+    default:
+        GP_ASSERT(!"Not implemented yet");
+    }
+
+    return false;
+}
+
+bool JSONWriter::writeArchive(const Archive& archive)
+{
+    beginObject();
+    for (const auto& it : archive._values)
+    {
+        key(it.first.c_str(), it.first.size());
+        if (!writeVariant(it.second))
+            return false;
+    }
+    endObject();
+
+    return true;
+}
+
+
+
+
+//
+// JSONReader
+//
+
+class JSONParser
+{
+public:
+    JSONParser(const char * json, size_t length, JSONReader::Handler * handler)
+        : _begin(json), _cur(json), _end(json + length), _handler(handler)
+    {
+    }
+
+    bool parse()
+    {
+        skipWhitespace();
+        if (!parseValue(0))
+            return false;
+
+        skipWhitespace();
+        if (_cur != _end)
+            return error("unexpected data after the root value");
+
+        return true;
+    }
+
+private:
+    static const unsigned MAX_DEPTH = 512;
+
+    bool error(const char * message)
+    {
+        GP_WARN("Malformed JSON at offset %u: %s", static_cast<unsigned>(_cur - _begin), message);
+        return false;
+    }
+
+    void skipWhitespace()
+    {
+        while (_cur < _end && (*_cur == ' ' || *_cur == '\n' || *_cur == '\r' || *_cur == '\t'))
+            _cur++;
+    }
+
+    bool consumeLiteral(const char * literal, size_t length)
+    {
+        if (static_cast<size_t>(_end - _cur) < length || memcmp(_cur, literal, length) != 0)
+            return error("invalid literal");
+        _cur += length;
+        return true;
+    }
+
+    bool parseValue(unsigned depth)
+    {
+        if (_cur >= _end)
+            return error("unexpected end of data");
+
+        switch (*_cur)
+        {
+        case '{':
+            return parseObject(depth);
+        case '[':
+            return parseArray(depth);
+        case '"':
+            {
+                const char * str;
+                size_t length;
+                return parseString(&str, &length) && _handler->onString(str, length);
+            }
+        case 't':
+            return consumeLiteral("true", 4) && _handler->onBool(true);
+        case 'f':
+            return consumeLiteral("false", 5) && _handler->onBool(false);
+        case 'n':
+            return consumeLiteral("null", 4) && _handler->onNull();
+        default:
+            return parseNumber();
+        }
+    }
+
+    bool parseObject(unsigned depth)
+    {
+        if (depth >= MAX_DEPTH)
+            return error("too deep nesting");
+
+        _cur++;
+        if (!_handler->onStartObject())
+            return false;
+
+        skipWhitespace();
+        if (_cur < _end && *_cur == '}')
+        {
+            _cur++;
+            return _handler->onEndObject();
+        }
+
+        while (true)
+        {
+            skipWhitespace();
+            if (_cur >= _end || *_cur != '"')
+                return error("expected object key");
+
+            const char * key;
+            size_t keyLength;
+            if (!parseString(&key, &keyLength) || !_handler->onKey(key, keyLength))
+                return false;
+
+            skipWhitespace();
+            if (_cur >= _end || *_cur != ':')
+                return error("expected ':'");
+            _cur++;
+
+            skipWhitespace();
+            if (!parseValue(depth + 1))
+                return false;
+
+            skipWhitespace();
+            if (_cur >= _end)
+                return error("unexpected end of data");
+
+            if (*_cur == ',')
+            {
+                _cur++;
+                continue;
+            }
+
+            if (*_cur == '}')
+            {
+                _cur++;
+                return _handler->onEndObject();
+            }
+
+            return error("expected ',' or '}'");
+        }
+    }
+
+    bool parseArray(unsigned depth)
+    {
+        if (depth >= MAX_DEPTH)
+            return error("too deep nesting");
+
+        _cur++;
+        if (!_handler->onStartArray())
+            return false;
+
+        skipWhitespace();
+        if (_cur < _end && *_cur == ']')
+        {
+            _cur++;
+            return _handler->onEndArray();
+        }
+
+        while (true)
+        {
+            skipWhitespace();
+            if (!parseValue(depth + 1))
+                return false;
+
+            skipWhitespace();
+            if (_cur >= _end)
+                return error("unexpected end of data");
+
+            if (*_cur == ',')
+            {
+                _cur++;
+                continue;
+            }
+
+            if (*_cur == ']')
+            {
+                _cur++;
+                return _handler->onEndArray();
+            }
+
+            return error("expected ',' or ']'");
+        }
+    }
+
+    static int hexValue(char c)
+    {
+        if (c >= '0' && c <= '9')
+            return c - '0';
+        if (c >= 'a' && c <= 'f')
+            return c - 'a' + 10;
+        if (c >= 'A' && c <= 'F')
+            return c - 'A' + 10;
+        return -1;
+    }
+
+    bool parseHex4(uint32_t * out)
+    {
+        if (_end - _cur < 4)
+            return error("invalid unicode escape");
+
+        uint32_t res = 0;
+        for (int i = 0; i < 4; i++)
+        {
+            int v = hexValue(_cur[i]);
+            if (v < 0)
+                return error("invalid unicode escape");
+            res = (res << 4) | v;
+        }
+
+        _cur += 4;
+        *out = res;
+        return true;
+    }
+
+    void appendUTF8(uint32_t cp)
+    {
+        if (cp < 0x80)
+        {
+            _scratch.push_back(static_cast<char>(cp));
+        }
+        else if (cp < 0x800)
+        {
+            _scratch.push_back(static_cast<char>(0xC0 | (cp >> 6)));
+            _scratch.push_back(static_cast<char>(0x80 | (cp & 0x3F)));
+        }
+        else if (cp < 0x10000)
+        {
+            _scratch.push_back(static_cast<char>(0xE0 | (cp >> 12)));
+            _scratch.push_back(static_cast<char>(0x80 | ((cp >> 6) & 0x3F)));
+            _scratch.push_back(static_cast<char>(0x80 | (cp & 0x3F)));
+        }
+        else
+        {
+            _scratch.push_back(static_cast<char>(0xF0 | (cp >> 18)));
+            _scratch.push_back(static_cast<char>(0x80 | ((cp >> 12) & 0x3F)));
+            _scratch.push_back(static_cast<char>(0x80 | ((cp >> 6) & 0x3F)));
+            _scratch.push_back(static_cast<char>(0x80 | (cp & 0x3F)));
+        }
+    }
+
+    bool parseString(const char ** outStr, size_t * outLength)
+    {
+        GP_ASSERT(*_cur == '"');
+        _cur++;
+
+        // fast path: string without escape sequences is returned as a pointer to the source buffer
+        const char * start = _cur;
+        while (_cur < _end && *_cur != '"' && *_cur != '\\')
+        {
+            if (static_cast<unsigned char>(*_cur) < 0x20)
+                return error("control character in string");
+            _cur++;
+        }
+
+        if (_cur >= _end)
+            return error("unterminated string");
+
+        if (*_cur == '"')
+        {
+            *outStr = start;
+            *outLength = _cur - start;
+            _cur++;
+            return true;
+        }
+
+        // slow path: unescape to scratch buffer
+        _scratch.assign(start, _cur - start);
+        while (_cur < _end && *_cur != '"')
+        {
+            char c = *_cur++;
+            if (static_cast<unsigned char>(c) < 0x20)
+                return error("control character in string");
+
+            if (c != '\\')
+            {
+                _scratch.push_back(c);
+                continue;
+            }
+
+            if (_cur >= _end)
+                break;
+
+            c = *_cur++;
+            switch (c)
+            {
+            case '"':  _scratch.push_back('"'); break;
+            case '\\': _scratch.push_back('\\'); break;
+            case '/':  _scratch.push_back('/'); break;
+            case 'b':  _scratch.push_back('\b'); break;
+            case 'f':  _scratch.push_back('\f'); break;
+            case 'n':  _scratch.push_back('\n'); break;
+            case 'r':  _scratch.push_back('\r'); break;
+            case 't':  _scratch.push_back('\t'); break;
+            case 'u':
+                {
+                    uint32_t cp;
+                    if (!parseHex4(&cp))
+                        return false;
+
+                    if (cp >= 0xD800 && cp <= 0xDBFF)
+                    {
+                        // surrogate pair
+                        uint32_t low;
+                        if (_end - _cur < 6 || _cur[0] != '\\' || _cur[1] != 'u')
+                            return error("invalid surrogate pair");
+                        _cur += 2;
+                        if (!parseHex4(&low))
+                            return false;
+                        if (low < 0xDC00 || low > 0xDFFF)
+                            return error("invalid surrogate pair");
+                        cp = 0x10000 + ((cp - 0xD800) << 10) + (low - 0xDC00);
+                    }
+                    else if (cp >= 0xDC00 && cp <= 0xDFFF)
+                    {
+                        return error("invalid surrogate pair");
+                    }
+
+                    appendUTF8(cp);
+                }
+                break;
+            default:
+                return error("invalid escape sequence");
+            }
+        }
+
+        if (_cur >= _end)
+            return error("unterminated string");
+
+        _cur++;
+        *outStr = _scratch.data();
+        *outLength = _scratch.size();
+        return true;
+    }
+
+    bool parseNumber()
+    {
+        const char * start = _cur;
+        bool negative = false;
+        if (*_cur == '-')
+        {
+            negative = true;
+            _cur++;
+        }
+
+        if (_cur >= _end || *_cur < '0' || *_cur > '9')
+            return error("invalid value");
+
+        uint64_t mantissa = 0;
+        bool overflow = false;
+        if (*_cur == '0')
+        {
+            _cur++;
+        }
+        else
+        {
+            while (_cur < _end && *_cur >= '0' && *_cur <= '9')
+            {
+                unsigned digit = *_cur - '0';
+                if (mantissa > (UINT64_MAX - digit) / 10)
+                    overflow = true;
+                else
+                    mantissa = mantissa * 10 + digit;
+                _cur++;
+            }
+        }
+
+        bool isInteger = true;
+        if (_cur < _end && *_cur == '.')
+        {
+            isInteger = false;
+            _cur++;
+            if (_cur >= _end || *_cur < '0' || *_cur > '9')
+                return error("invalid number");
+            while (_cur < _end && *_cur >= '0' && *_cur <= '9')
+                _cur++;
+        }
+
+        if (_cur < _end && (*_cur == 'e' || *_cur == 'E'))
+        {
+            isInteger = false;
+            _cur++;
+            if (_cur < _end && (*_cur == '+' || *_cur == '-'))
+                _cur++;
+            if (_cur >= _end || *_cur < '0' || *_cur > '9')
+                return error("invalid number");
+            while (_cur < _end && *_cur >= '0' && *_cur <= '9')
+                _cur++;
+        }
+
+        if (isInteger && !overflow)
+        {
+            if (!negative)
+                return mantissa <= static_cast<uint64_t>(INT64_MAX) ? _handler->onInt(static_cast<int64_t>(mantissa)) : _handler->onUInt(mantissa);
+
+            if (mantissa <= static_cast<uint64_t>(INT64_MAX) + 1)
+                return _handler->onInt(static_cast<int64_t>(0 - mantissa));
+        }
+
+        double value;
+        auto res = fast_float::from_chars(start, _cur, value);
+        if (res.ec != std::errc())
+            return error("invalid number");
+
+        return _handler->onDouble(value);
+    }
+
+    const char * _begin;
+    const char * _cur;
+    const char * _end;
+    JSONReader::Handler * _handler;
+    std::string _scratch;
+};
+
+
+
+/**
+ * Handler that builds VariantType/Archive tree in place.
+ */
+class JSONVariantBuilder : public JSONReader::Handler
+{
+public:
+    JSONVariantBuilder(VariantType * root)
+        : _root(root), _rootArchive(nullptr), _rootIsSet(false)
+    {
+    }
+
+    JSONVariantBuilder(Archive * root)
+        : _root(nullptr), _rootArchive(root), _rootIsSet(false)
+    {
+    }
+
+    virtual bool onNull() override
+    {
+        VariantType * v = nextValue();
+        if (!v)
+            return false;
+        v->clear();
+        return true;
+    }
+
+    virtual bool onBool(bool value) override
+    {
+        VariantType * v = nextValue();
+        if (!v)
+            return false;
+        v->set(value);
+        return true;
+    }
+
+    virtual bool onInt(int64_t value) override
+    {
+        VariantType * v = nextValue();
+        if (!v)
+            return false;
+        if (value >= INT32_MIN && value <= INT32_MAX)
+            v->set(static_cast<int32_t>(value));
+        else
+            v->set(value);
+        return true;
+    }
+
+    virtual bool onUInt(uint64_t value) override
+    {
+        VariantType * v = nextValue();
+        if (!v)
+            return false;
+        v->set(value);
+        return true;
+    }
+
+    virtual bool onDouble(double value) override
+    {
+        VariantType * v = nextValue();
+        if (!v)
+            return false;
+        v->set(value);
+        return true;
+    }
+
+    virtual bool onString(const char * str, size_t length) override
+    {
+        VariantType * v = nextValue();
+        if (!v)
+            return false;
+        v->set(std::string(str, length));
+        return true;
+    }
+
+    virtual bool onStartObject() override
+    {
+        if (_scopes.empty() && _rootArchive)
+        {
+            if (_rootIsSet)
+                return false;
+            _rootIsSet = true;
+            _scopes.push_back({ _rootArchive, nullptr });
+            return true;
+        }
+
+        VariantType * v = nextValue();
+        if (!v)
+            return false;
+        v->setArchive();
+        _scopes.push_back({ v->getMutableArchive(), nullptr });
+        return true;
+    }
+
+    virtual bool onKey(const char * str, size_t length) override
+    {
+        _key.assign(str, length);
+        return true;
+    }
+
+    virtual bool onEndObject() override
+    {
+        _scopes.pop_back();
+        return true;
+    }
+
+    virtual bool onStartArray() override
+    {
+        VariantType * v = nextValue();
+        if (!v)
+            return false;
+
+        std::vector<VariantType> empty;
+        v->set(empty.begin(), empty.end());
+        _scopes.push_back({ nullptr, v->getMutableList() });
+        return true;
+    }
+
+    virtual bool onEndArray() override
+    {
+        _scopes.pop_back();
+        return true;
+    }
+
+private:
+    struct Scope
+    {
+        Archive * archive;
+        std::vector<VariantType> * list;
+    };
+
+    VariantType * nextValue()
+    {
+        if (_scopes.empty())
+        {
+            // archive root accepts only object
+            if (_rootIsSet || !_root)
+                return nullptr;
+            _rootIsSet = true;
+            return _root;
+        }
+
+        Scope& scope = _scopes.back();
+        if (scope.archive)
+            return &scope.archive->set(_key.c_str(), VariantType());
+
+        scope.list->emplace_back();
+        return &scope.list->back();
+    }
+
+    VariantType * _root;
+    Archive * _rootArchive;
+    bool _rootIsSet;
+    std::vector<Scope> _scopes;
+    std::string _key;
+};
+
+
+
+bool JSONReader::parse(const char * json, size_t length, Handler * handler)
+{
+    GP_ASSERT(handler);
+    if (!json || !handler)
+        return false;
+
+    JSONParser parser(json, length, handler);
+    return parser.parse();
+}
+
+bool JSONReader::parse(const char * json, size_t length, VariantType * out)
+{
+    GP_ASSERT(out);
+    if (!out)
+        return false;
+
+    JSONVariantBuilder builder(out);
+    return parse(json, length, &builder);
+}
+
+bool JSONReader::parse(const char * json, size_t length, Archive * out)
+{
+    GP_ASSERT(out);
+    if (!out)
+        return false;
+
+    JSONVariantBuilder builder(out);
+    return parse(json, length, &builder);
+}
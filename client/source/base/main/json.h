@@ -0,0 +1,179 @@
+#pragma once
+
+#ifndef __DFG_JSON_H__
+#define __DFG_JSON_H__
+
+
+
+
+/**
+ * JSONWriter appends JSON text to a string.
+ *
+ * Commas and colons are inserted automatically based on the current
+ * nesting, so the caller only describes the structure. Numbers are
+ * formatted without temporary strings and all string values and keys
+ * are properly escaped. The output buffer is reserved ahead to avoid
+ * reallocations on every append.
+ *
+ * \code
+ * std::string out;
+ * JSONWriter writer(&out);
+ * writer.beginObject();
+ * writer.key("name");
+ * writer.writeString("value");
+ * writer.endObject();
+ * \endcode
+ */
+class JSONWriter : Noncopyable
+{
+public:
+    /**
+     * Construct writer which appends to a given string.
+     *
+     * @param out String to append JSON to. Existing contents are preserved.
+     * @param reserveSize Number of bytes to reserve in the string ahead.
+     */
+    JSONWriter(std::string * out, size_t reserveSize = 256);
+
+    void beginObject();
+    void endObject();
+    void beginArray();
+    void endArray();
+
+    /**
+     * Write object's key. Must be followed by a value.
+     */
+    void key(const char * name);
+    void key(const char * name, size_t length);
+
+    void writeNull();
+    void writeBool(bool value);
+    void writeInt(int64_t value);
+    void writeUInt(uint64_t value);
+    void writeFloat(float value);
+    void writeDouble(double value);
+    void writeString(const char * str);
+    void writeString(const char * str, size_t length);
+    void writeString(const std::string& str) { writeString(str.c_str(), str.size()); };
+
+    /**
+     * Write already formatted JSON value as is.
+     */
+    void writeRaw(const char * json, size_t length);
+
+    /**
+     * Write VariantType value. Archives are written as objects, lists and
+     * vectors as arrays and blobs as base64 encoded strings.
+     *
+     * @return False if variant holds a type that can't be represented in JSON.
+     */
+    bool writeVariant(const VariantType& value);
+
+    /**
+     * Write Archive as JSON object.
+     *
+     * @return False if any of archive's values can't be represented in JSON.
+     */
+    bool writeArchive(const class Archive& archive);
+
+    /**
+     * Append quoted and escaped string to the output.
+     *
+     * @param str Source string (UTF8).
+     * @param length Length of the string in bytes.
+     * @param out String to append to.
+     */
+    static void escapeString(const char * str, size_t length, std::string * out);
+
+private:
+    void separator();
+
+    std::string * _out;
+    std::vector<bool> _scopeIsEmpty;
+    bool _afterKey;
+};
+
+
+
+
+/**
+ * JSONReader is an in-place JSON parser.
+ *
+ * It can either be used in SAX mode by providing a Handler, or
+ * it can build VariantType/Archive structure directly. Strings without
+ * escape sequences are passed to the Handler as pointers into the source
+ * buffer, so no memory is allocated for them.
+ *
+ * Objects are mapped to Archives, arrays to lists, integer numbers to INT32
+ * (or INT64/UINT64 when they don't fit), other numbers to FLOAT64 and
+ * strings to UTF8 std::string.
+ */
+class JSONReader : Noncopyable
+{
+public:
+    /**
+     * SAX handler. Return false from any method to stop parsing.
+     */
+    class Handler
+    {
+    public:
+        virtual ~Handler() {};
+
+        virtual bool onNull() = 0;
+        virtual bool onBool(bool value) = 0;
+        virtual bool onInt(int64_t value) = 0;
+        virtual bool onUInt(uint64_t value) = 0;
+        virtual bool onDouble(double value) = 0;
+
+        /**
+         * String value. The string is not null-terminated and is only valid during the call.
+         */
+        virtual bool onString(const char * str, size_t length) = 0;
+
+        virtual bool onStartObject() = 0;
+
+        /**
+         * Object's key. The string is not null-terminated and is only valid during the call.
+         */
+        virtual bool onKey(const char * str, size_t length) = 0;
+        virtual bool onEndObject() = 0;
+        virtual bool onStartArray() = 0;
+        virtual bool onEndArray() = 0;
+    };
+
+    /**
+     * Parse JSON text and pass the events to the handler.
+     *
+     * @param json JSON text (UTF8), doesn't need to be null-terminated.
+     * @param length Length of text in bytes.
+     * @param handler SAX handler.
+     * @return False in case of malformed data or when handler stopped parsing.
+     */
+    static bool parse(const char * json, size_t length, Handler * handler);
+
+    /**
+     * Parse JSON text into VariantType.
+     *
+     * @param json JSON text (UTF8), doesn't need to be null-terminated.
+     * @param length Length of text in bytes.
+     * @param[out] out Variant that receives parsed value.
+     * @return False in case of malformed data.
+     */
+    static bool parse(const char * json, size_t length, VariantType * out);
+
+    /**
+     * Parse JSON object into Archive. Parsed keys are added to the archive,
+     * existing keys are overwritten.
+     *
+     * @param json JSON text (UTF8), doesn't need to be null-terminated.
+     * @param length Length of text in bytes.
+     * @param[out] out Archive that receives parsed values.
+     * @return False in case of malformed data or when root value is not an object.
+     */
+    static bool parse(const char * json, size_t length, class Archive * out);
+};
+
+
+
+
+#endif // __DFG_JSON_H__
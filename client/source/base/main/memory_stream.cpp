@@ -4,6 +4,12 @@
 
 
 
+// auto-allocated buffer stops growing past this size, the rest of data goes to segments of this size
+static const size_t SEGMENT_SIZE = 1024 * 1024;
+
+
+
+
 MemoryStream::MemoryStream()
 {
 }
@@ -16,10 +22,12 @@ MemoryStream::~MemoryStream()
 void MemoryStream::close()
 {
     _ownedBuffer.reset();
+    _bufferOwner.reset();
     _readBuffer = nullptr;
     _writeBuffer = nullptr;
     _cursor = _bufferSize = 0;
     _autoBuffer.clear();
+    _segments.clear();
 }
 
 MemoryStream * MemoryStream::create(const void * buffer, size_t bufferSize)
@@ -37,6 +45,15 @@ MemoryStream * MemoryStream::create(const void * buffer, size_t bufferSize)
     return res;
 }
 
+MemoryStream * MemoryStream::create(const void * buffer, size_t bufferSize, const std::shared_ptr<const void>& owner)
+{
+    MemoryStream * res = create(buffer, bufferSize);
+    if (res)
+        res->_bufferOwner = owner;
+
+    return res;
+}
+
 MemoryStream * MemoryStream::create(void * buffer, size_t bufferSize)
 {
     if (!buffer)
@@ -92,8 +109,25 @@ size_t MemoryStream::read(void* ptr, size_t size, size_t count)
         return 0;
 
     maxReadBytes = maxReadElements * size;
-    memcpy(ptr, _readBuffer + _cursor, maxReadBytes);
-    _cursor += maxReadBytes;
+    if (_segments.empty())
+    {
+        memcpy(ptr, _readBuffer + _cursor, maxReadBytes);
+        _cursor += maxReadBytes;
+        return maxReadElements;
+    }
+
+    uint8_t * dst = reinterpret_cast<uint8_t *>(ptr);
+    while (maxReadBytes > 0)
+    {
+        size_t available;
+        const uint8_t * src = getSegmentData(_cursor, &available);
+        available = std::min(available, maxReadBytes);
+        memcpy(dst, src, available);
+        dst += available;
+        _cursor += available;
+        maxReadBytes -= available;
+    }
+
     return maxReadElements;
 }
 
@@ -106,19 +140,25 @@ char* MemoryStream::readLine(char* str, int num)
     char * strSave = str;
     while (maxReadBytes > 0)
     {
-        const char& ch = *(_readBuffer + _cursor);
-        if (ch == '\r' || ch == '\n')
+        size_t available = _bufferSize - _cursor;
+        const char * data = reinterpret_cast<const char *>(_segments.empty() ? _readBuffer + _cursor : getSegmentData(_cursor, &available));
+        const char * end = data + std::min(available, maxReadBytes);
+        for (; data < end; data++)
         {
+            const char& ch = *data;
+            if (ch == '\r' || ch == '\n')
+            {
+                *str++ = ch;
+                _cursor++;
+                if (str - strSave < num)
+                    *str++ = '\0';
+                return strSave;
+            }
+
             *str++ = ch;
             _cursor++;
-            if (str - strSave < num)
-                *str++ = '\0';
-            return strSave;
+            maxReadBytes--;
         }
-
-        *str++ = ch;
-        _cursor++;
-        maxReadBytes--;
     }
 
     if (str - strSave < num)
@@ -128,28 +168,133 @@ char* MemoryStream::readLine(char* str, int num)
 
 size_t MemoryStream::write(const void* ptr, size_t size, size_t count)
 {
-    if (!canWrite())
+    if (!canWrite() || size == 0)
         return 0;
 
     size_t maxWriteBytes = _canAllocate ? size * count : std::min(_bufferSize - _cursor, size * count);
     size_t maxWriteElements = maxWriteBytes / size;
 
-    if (maxWriteBytes == 0)
+    if (maxWriteElements == 0)
         return 0;
 
+    maxWriteBytes = maxWriteElements * size;
     if (_canAllocate && _cursor + maxWriteBytes > _bufferSize)
+        grow(_cursor + maxWriteBytes);
+
+    if (_segments.empty())
     {
-        _bufferSize = _cursor + maxWriteBytes;
-        _autoBuffer.resize(_bufferSize);
-        _readBuffer = _writeBuffer = &_autoBuffer.front();
+        memcpy(_writeBuffer + _cursor, ptr, maxWriteBytes);
+        _cursor += maxWriteBytes;
+        return maxWriteElements;
+    }
+
+    const uint8_t * src = reinterpret_cast<const uint8_t *>(ptr);
+    while (maxWriteBytes > 0)
+    {
+        size_t available;
+        uint8_t * dst = getSegmentData(_cursor, &available);
+        available = std::min(available, maxWriteBytes);
+        memcpy(dst, src, available);
+        src += available;
+        _cursor += available;
+        maxWriteBytes -= available;
     }
 
-    maxWriteBytes = maxWriteElements * size;
-    memcpy(_writeBuffer + _cursor, ptr, maxWriteBytes);
-    _cursor += maxWriteBytes;
     return maxWriteElements;
 }
 
+void MemoryStream::grow(size_t size)
+{
+    GP_ASSERT(_canAllocate);
+
+    if (_segments.empty() && (size <= _autoBuffer.capacity() || _autoBuffer.capacity() < SEGMENT_SIZE))
+    {
+        _autoBuffer.resize(size);
+        _readBuffer = _writeBuffer = _autoBuffer.data();
+    }
+    else
+    {
+        // the buffer becomes the first segment, its spare capacity is used as is
+        if (_segments.empty())
+            _autoBuffer.resize(_autoBuffer.capacity());
+
+        while (_autoBuffer.size() + _segments.size() * SEGMENT_SIZE < size)
+            _segments.emplace_back(new uint8_t[SEGMENT_SIZE]);
+    }
+
+    _bufferSize = size;
+}
+
+uint8_t * MemoryStream::getSegmentData(size_t offset, size_t * available)
+{
+    if (offset < _autoBuffer.size())
+    {
+        *available = _autoBuffer.size() - offset;
+        return _autoBuffer.data() + offset;
+    }
+
+    offset -= _autoBuffer.size();
+    *available = SEGMENT_SIZE - offset % SEGMENT_SIZE;
+    return _segments[offset / SEGMENT_SIZE].get() + offset % SEGMENT_SIZE;
+}
+
+void MemoryStream::coalesce()
+{
+    if (_segments.empty())
+        return;
+
+    std::vector<uint8_t> buffer;
+    buffer.reserve(_bufferSize);
+    for (size_t offset = 0; offset < _bufferSize; )
+    {
+        size_t available;
+        const uint8_t * data = getSegmentData(offset, &available);
+        available = std::min(available, _bufferSize - offset);
+        buffer.insert(buffer.end(), data, data + available);
+        offset += available;
+    }
+
+    _autoBuffer.swap(buffer);
+    _segments.clear();
+    _readBuffer = _writeBuffer = _autoBuffer.data();
+}
+
+const uint8_t * MemoryStream::getBuffer() const
+{
+    // merging segments doesn't change the stream's contents
+    const_cast<MemoryStream *>(this)->coalesce();
+    return _readBuffer;
+}
+
+bool MemoryStream::reserve(size_t size)
+{
+    if (!_canAllocate || !_segments.empty())
+        return false;
+
+    if (size > _autoBuffer.capacity())
+    {
+        _autoBuffer.reserve(size);
+        _readBuffer = _writeBuffer = _autoBuffer.data();
+    }
+
+    return true;
+}
+
+std::vector<uint8_t> MemoryStream::releaseBuffer()
+{
+    std::vector<uint8_t> res;
+    if (!_canAllocate)
+        return res;
+
+    coalesce();
+    _autoBuffer.resize(_bufferSize);
+    res.swap(_autoBuffer);
+
+    _readBuffer = _writeBuffer = nullptr;
+    _cursor = _bufferSize = 0;
+    return res;
+}
+
 bool MemoryStream::seek(long int offset, int origin)
 {
     switch (origin)
@@ -23,6 +23,17 @@ public:
      */
     static MemoryStream * create(const void * buffer, size_t bufferSize);
 
+    /**
+     * Create read-only MemoryStream stream over the memory owned by some other object.
+     * Stream keeps the owner alive until it's closed.
+     *
+     * @param buffer Buffer used to read data from.
+     * @param bufferSize Size of the buffer.
+     * @param owner Object that owns the buffer.
+     * @return Newly created MemoryStream.
+     */
+    static MemoryStream * create(const void * buffer, size_t bufferSize, const std::shared_ptr<const void>& owner);
+
     /**
      * Create read-write MemoryStream stream, passing pointer to buffer of data.
      *
@@ -188,21 +199,50 @@ public:
 
     /**
      * Get underlying memory buffer.
+     *
+     * Large auto-allocated streams keep data in segments, which are merged
+     * into one contiguous buffer the first time this method is called.
+     */
+    const uint8_t * getBuffer() const;
+
+    /**
+     * Reserve memory for auto-allocated stream, so writing up to <code>size</code> bytes
+     * doesn't reallocate the buffer. Has no effect on other streams.
+     *
+     * @param size Total number of bytes the stream is expected to hold.
+     * @return True if the memory is reserved, false otherwise.
      */
-    const uint8_t * getBuffer() const { return _readBuffer; };
+    bool reserve(size_t size);
+
+    /**
+     * Take ownership of auto-allocated stream's data without copying it.
+     * Stream becomes empty and can be written again.
+     *
+     * @return Stream data or empty vector if stream is not auto-allocated.
+     */
+    std::vector<uint8_t> releaseBuffer();
 
 protected:
     MemoryStream();
 
 private:
+    void coalesce();
+    void grow(size_t size);
+    uint8_t * getSegmentData(size_t offset, size_t * available);
+
     const uint8_t * _readBuffer;
     uint8_t * _writeBuffer;
     size_t _cursor;
     size_t _bufferSize;
     std::unique_ptr<uint8_t[]> _ownedBuffer;
+    std::shared_ptr<const void> _bufferOwner;
 
     bool _canAllocate;
+
+    // auto-allocated data, once it grows beyond the segment size
+    // the buffer is no longer reallocated and new data goes to fixed-size segments
     std::vector<uint8_t> _autoBuffer;
+    std::vector<std::unique_ptr<uint8_t[]>> _segments;
 };
 
 
@@ -0,0 +1,398 @@
+#include "pch.h"
+#include "message_channel.h"
+
+#include <zlib.h>
+
+
+
+
+// frame header: payload size (uint32), request id (uint32), flags (uint8)
+static const size_t HEADER_SIZE = 9;
+static const size_t INPUT_BUFFER_SIZE = 64 * 1024;
+static const size_t DEFAULT_MAX_MESSAGE_SIZE = 16 * 1024 * 1024;
+
+static const uint8_t FLAG_COMPRESSED = 1;       // payload is uncompressed size (uint32) followed by zlib stream
+static const uint8_t FLAG_REQUEST = 2;
+static const uint8_t FLAG_RESPONSE = 4;
+
+static bool serializeFrame(const Archive& archive, std::vector<uint8_t> * out)
+{
+    // header is reserved in front of the payload, so the frame is sent without copying
+    std::unique_ptr<MemoryStream> stream(MemoryStream::create());
+    uint8_t header[HEADER_SIZE] = { 0 };
+    if (stream->write(header, 1, HEADER_SIZE) != HEADER_SIZE || !archive.serialize(stream.get()))
+        return false;
+
+    *out = stream->releaseBuffer();
+    return true;
+}
+
+
+
+
+MessageChannel::MessageChannel(SocketStream * stream)
+    : _stream(stream)
+    , _maxMessageSize(DEFAULT_MAX_MESSAGE_SIZE)
+    , _closed(false)
+    , _input(std::make_shared<std::vector<uint8_t>>())
+    , _inputOffset(0)
+    , _outputOffset(0)
+    , _nextRequestId(1)
+{
+}
+
+MessageChannel::~MessageChannel()
+{
+    _requests.clear();
+    close();
+}
+
+MessageChannel * MessageChannel::create(SocketStream * stream)
+{
+    GP_ASSERT(stream);
+
+    MessageChannel * res = new MessageChannel(stream);
+
+    // callbacks are invoked for non-blocking streams only and never after the stream is closed,
+    // frames that didn't fit into the stream are sent once it has room for them
+    stream->setReadCallback([res]() { res->update(); });
+    stream->setWriteCallback([res]() { res->flushOutput(); });
+
+    return res;
+}
+
+bool MessageChannel::send(const void * data, size_t size, bool compress)
+{
+    std::vector<uint8_t> frame(HEADER_SIZE + size);
+    if (size > 0)
+        memcpy(frame.data() + HEADER_SIZE, data, size);
+
+    return sendFrame(frame, 0, 0, compress);
+}
+
+bool MessageChannel::send(const Archive& archive, bool compress)
+{
+    std::vector<uint8_t> frame;
+    return serializeFrame(archive, &frame) && sendFrame(frame, 0, 0, compress);
+}
+
+int MessageChannel::request(const Archive& request, const ResponseCallback& callback, bool compress)
+{
+    std::vector<uint8_t> frame;
+    if (_closed || !serializeFrame(request, &frame))
+        return 0;
+
+    uint32_t requestId = _nextRequestId++;
+    if (_nextRequestId > INT_MAX)
+        _nextRequestId = 1;
+
+    if (!sendFrame(frame, requestId, FLAG_REQUEST, compress))
+        return 0;
+
+    _requests[requestId] = callback;
+    return static_cast<int>(requestId);
+}
+
+void MessageChannel::cancelRequest(int requestId)
+{
+    _requests.erase(static_cast<uint32_t>(requestId));
+}
+
+MemoryStream * MessageChannel::receive()
+{
+    update();
+
+    // read() of blocking stream waits for data, non-blocking stream returns immediately
+    while (_messages.empty() && readInput(true))
+        processFrames();
+
+    if (_messages.empty())
+        return NULL;
+
+    MemoryStream * res = _messages.front().release();
+    _messages.pop_front();
+    return res;
+}
+
+bool MessageChannel::update()
+{
+    flushOutput();
+
+    while (readInput(false))
+        processFrames();
+
+    return !_closed;
+}
+
+void MessageChannel::close()
+{
+    if (_closed)
+        return;
+
+    _closed = true;
+    _stream->close();
+    _output.clear();
+    _outputOffset = 0;
+
+    failRequests();
+}
+
+bool MessageChannel::isClosed() const
+{
+    return _closed && _messages.empty();
+}
+
+bool MessageChannel::sendFrame(std::vector<uint8_t>& frame, uint32_t requestId, uint8_t flags, bool compress)
+{
+    if (_closed)
+        return false;
+
+    size_t payloadSize = frame.size() - HEADER_SIZE;
+    if (payloadSize > _maxMessageSize)
+    {
+        GP_WARN("Message of %d bytes exceeds maximum message size", static_cast<int>(payloadSize));
+        return false;
+    }
+
+    if (compress && payloadSize > 0)
+    {
+        uLongf compressedSize = compressBound(static_cast<uLong>(payloadSize));
+        std::vector<uint8_t> compressed(HEADER_SIZE + sizeof(uint32_t) + compressedSize);
+        if (compress2(compressed.data() + HEADER_SIZE + sizeof(uint32_t), &compressedSize, frame.data() + HEADER_SIZE, static_cast<uLong>(payloadSize), Z_DEFAULT_COMPRESSION) == Z_OK &&
+            compressedSize + sizeof(uint32_t) < payloadSize)
+        {
+            uint32_t uncompressedSize = static_cast<uint32_t>(payloadSize);
+            memcpy(compressed.data() + HEADER_SIZE, &uncompressedSize, sizeof(uncompressedSize));
+            compressed.resize(HEADER_SIZE + sizeof(uint32_t) + compressedSize);
+            frame.swap(compressed);
+            flags |= FLAG_COMPRESSED;
+        }
+    }
+
+    uint32_t size = static_cast<uint32_t>(frame.size() - HEADER_SIZE);
+    memcpy(frame.data(), &size, sizeof(size));
+    memcpy(frame.data() + 4, &requestId, sizeof(requestId));
+    frame[8] = flags;
+
+    // frames are queued behind the data that didn't fit into the stream, so they're never interleaved
+    size_t written = 0;
+    if (_outputOffset == _output.size() && _stream->canWrite())
+        written = _stream->write(frame.data(), 1, frame.size());
+
+    // frame is never sent once the connection is lost
+    if (written < frame.size() && _stream->isClosed())
+    {
+        close();
+        return false;
+    }
+
+    if (written < frame.size())
+    {
+        if (_outputOffset > 0)
+        {
+            _output.erase(_output.begin(), _output.begin() + _outputOffset);
+            _outputOffset = 0;
+        }
+        _output.insert(_output.end(), frame.begin() + written, frame.end());
+    }
+
+    return true;
+}
+
+bool MessageChannel::flushOutput()
+{
+    while (_outputOffset < _output.size() && _stream->canWrite())
+    {
+        size_t written = _stream->write(_output.data() + _outputOffset, 1, _output.size() - _outputOffset);
+        if (written == 0)
+            break;
+        _outputOffset += written;
+    }
+
+    if (_outputOffset < _output.size())
+        return false;
+
+    _output.clear();
+    _outputOffset = 0;
+    return true;
+}
+
+bool MessageChannel::readInput(bool wait)
+{
+    if (_closed)
+        return false;
+
+    if (_stream->eof())
+    {
+        close();
+        return false;
+    }
+
+    if (!wait && !_stream->canRead())
+        return false;
+
+    // make room for the whole frame at the head of the buffer if its header is already received
+    size_t remaining = _input->size() - _inputOffset;
+    size_t required = remaining + INPUT_BUFFER_SIZE;
+    if (remaining >= HEADER_SIZE)
+    {
+        uint32_t size;
+        memcpy(&size, _input->data() + _inputOffset, sizeof(size));
+        if (size <= _maxMessageSize)
+            required = std::max(required, HEADER_SIZE + size);
+    }
+
+    if (_input->capacity() - _inputOffset < required)
+    {
+        // buffer is never reallocated while delivered messages point into it
+        if (_input.use_count() == 1 && _input->capacity() >= required)
+        {
+            _input->erase(_input->begin(), _input->begin() + _inputOffset);
+        }
+        else
+        {
+            std::shared_ptr<std::vector<uint8_t>> input = std::make_shared<std::vector<uint8_t>>();
+            input->reserve(std::max(required, INPUT_BUFFER_SIZE));
+            input->assign(_input->begin() + _inputOffset, _input->end());
+            _input = input;
+        }
+        _inputOffset = 0;
+    }
+
+    size_t size = _input->size();
+    size_t toRead = std::min(_input->capacity() - size, required - remaining);
+    _input->resize(size + toRead);
+    size_t bytesRead = _stream->read(_input->data() + size, 1, toRead);
+    _input->resize(size + bytesRead);
+
+    if (bytesRead == 0 && _stream->eof())
+        close();
+
+    return bytesRead > 0;
+}
+
+bool MessageChannel::processFrames()
+{
+    while (!_closed)
+    {
+        size_t remaining = _input->size() - _inputOffset;
+        if (remaining < HEADER_SIZE)
+            break;
+
+        const uint8_t * header = _input->data() + _inputOffset;
+        uint32_t size, requestId;
+        memcpy(&size, header, sizeof(size));
+        memcpy(&requestId, header + 4, sizeof(requestId));
+        uint8_t flags = header[8];
+
+        if (size > _maxMessageSize)
+        {
+            GP_WARN("Received message of %d bytes exceeds maximum message size, closing connection", static_cast<int>(size));
+            close();
+            return false;
+        }
+
+        if (remaining < HEADER_SIZE + size)
+            break;
+
+        const uint8_t * payload = header + HEADER_SIZE;
+        _inputOffset += HEADER_SIZE + size;
+
+        MemoryStream * message = NULL;
+        if (flags & FLAG_COMPRESSED)
+        {
+            uint32_t uncompressedSize = 0;
+            if (size >= sizeof(uncompressedSize))
+                memcpy(&uncompressedSize, payload, sizeof(uncompressedSize));
+
+            std::shared_ptr<std::vector<uint8_t>> data;
+            uLongf dataSize = uncompressedSize;
+            if (uncompressedSize > 0 && uncompressedSize <= _maxMessageSize)
+            {
+                data = std::make_shared<std::vector<uint8_t>>(uncompressedSize);
+                if (uncompress(data->data(), &dataSize, payload + sizeof(uncompressedSize), size - sizeof(uncompressedSize)) != Z_OK)
+                    dataSize = 0;
+            }
+
+            if (!data || dataSize != uncompressedSize)
+            {
+                GP_WARN("Received corrupted compressed message, closing connection");
+                close();
+                return false;
+            }
+
+            message = MemoryStream::create(data->data(), data->size(), data);
+        }
+        else
+        {
+            message = MemoryStream::create(payload, size, _input);
+        }
+
+        dispatch(message, requestId, flags);
+    }
+
+    // reuse the buffer once all received data is processed
+    if (_inputOffset == _input->size() && _input.use_count() == 1)
+    {
+        _input->clear();
+        _inputOffset = 0;
+    }
+
+    return !_closed;
+}
+
+void MessageChannel::dispatch(MemoryStream * message, uint32_t requestId, uint8_t flags)
+{
+    std::unique_ptr<MemoryStream> stream(message);
+
+    if (flags & FLAG_RESPONSE)
+    {
+        auto it = _requests.find(requestId);
+        if (it == _requests.end())
+            return;
+
+        ResponseCallback callback = (*it).second;
+        _requests.erase(it);
+
+        std::unique_ptr<Archive> response(Archive::create());
+        if (!response->deserialize(stream.get()))
+        {
+            GP_WARN("Failed to deserialize response to request %d", static_cast<int>(requestId));
+            response.reset();
+        }
+
+        if (callback)
+            callback(response.get());
+        return;
+    }
+
+    if (flags & FLAG_REQUEST)
+    {
+        std::unique_ptr<Archive> request(Archive::create());
+        std::unique_ptr<Archive> response(Archive::create());
+        if (!request->deserialize(stream.get()))
+            GP_WARN("Failed to deserialize request %d", static_cast<int>(requestId));
+        else if (_requestHandler)
+            _requestHandler(*request, response.get());
+
+        std::vector<uint8_t> frame;
+        if (serializeFrame(*response, &frame))
+            sendFrame(frame, requestId, FLAG_RESPONSE, (flags & FLAG_COMPRESSED) != 0);
+        return;
+    }
+
+    if (_messageCallback)
+        _messageCallback(stream.get());
+    else
+        _messages.push_back(std::move(stream));
+}
+
+void MessageChannel::failRequests()
+{
+    std::unordered_map<uint32_t, ResponseCallback> requests;
+    requests.swap(_requests);
+
+    for (auto& it : requests)
+        if (it.second)
+            it.second(NULL);
+}
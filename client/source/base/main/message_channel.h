@@ -0,0 +1,174 @@
+#pragma once
+
+#ifndef __DFG_MESSAGE_CHANNEL_H__
+#define __DFG_MESSAGE_CHANNEL_H__
+
+#include "socket_stream.h"
+#include "memory_stream.h"
+#include "archive.h"
+
+
+
+
+/**
+ * MessageChannel exchanges length-prefixed binary messages over SocketStream.
+ *
+ * Every message is sent as a frame consisting of a small header (payload size,
+ * request id and flags) followed by the payload, optionally compressed with zlib.
+ * Received frames are delivered as read-only MemoryStreams pointing directly
+ * into the receive buffer, so uncompressed messages are never copied.
+ *
+ * Besides plain messages, channel supports Archive requests: a request is
+ * sent with a unique id and the peer's response is delivered to the callback
+ * given to request().
+ *
+ * With non-blocking stream incoming frames are processed automatically on the
+ * main thread as soon as they are received, and frames that didn't fit into the
+ * stream's output are sent as soon as it has room. For blocking stream call update()
+ * or receive() to process them. MessageChannel is not thread-safe and should
+ * be used on the main thread only.
+ */
+class MessageChannel : Noncopyable
+{
+public:
+    typedef std::function<void(MemoryStream * message)> MessageCallback;
+    typedef std::function<void(const Archive * response)> ResponseCallback;
+    typedef std::function<void(const Archive& request, Archive * response)> RequestHandler;
+
+    virtual ~MessageChannel();
+
+    /**
+     * Create MessageChannel over connected stream.
+     *
+     * @param stream Socket stream. Channel takes ownership of the stream.
+     * @return Newly created MessageChannel.
+     */
+    static MessageChannel * create(SocketStream * stream);
+
+    /**
+     * Get underlying stream.
+     */
+    SocketStream * getStream() const { return _stream.get(); };
+
+    /**
+     * Set maximum size of a single message. Connection is closed when
+     * peer sends a larger frame. Default is 16Mb.
+     */
+    void setMaxMessageSize(size_t size) { _maxMessageSize = size; };
+
+    /**
+     * Set callback invoked for each received message.
+     *
+     * The message stream is valid only during the call. When the callback is not set,
+     * messages are queued until they are taken by receive().
+     *
+     * @param callback Callback function, or empty function to queue messages.
+     */
+    void setMessageCallback(const MessageCallback& callback) { _messageCallback = callback; };
+
+    /**
+     * Set function that handles requests received from the peer.
+     * Response archive filled by the handler is sent back immediately.
+     * Peer receives empty response when no handler is set.
+     *
+     * @param handler Request handler.
+     */
+    void setRequestHandler(const RequestHandler& handler) { _requestHandler = handler; };
+
+    /**
+     * Send message.
+     *
+     * @param data Message data.
+     * @param size Size of data in bytes.
+     * @param compress Compress message if it makes it smaller.
+     * @return True if the message is sent or queued for sending, false if connection is closed.
+     */
+    bool send(const void * data, size_t size, bool compress = false);
+
+    /**
+     * Send serialized archive as a message.
+     *
+     * @param archive Archive to send.
+     * @param compress Compress message if it makes it smaller.
+     * @return True if the message is sent or queued for sending, false if connection is closed.
+     */
+    bool send(const Archive& archive, bool compress = false);
+
+    /**
+     * Send request to the peer.
+     *
+     * Callback receives NULL response when the connection is closed before
+     * the response arrives or the response can't be deserialized.
+     *
+     * @param request Request archive.
+     * @param callback Function called with the response.
+     * @param compress Compress request if it makes it smaller.
+     * @return Request id or 0 if the request can't be sent.
+     */
+    int request(const Archive& request, const ResponseCallback& callback, bool compress = false);
+
+    /**
+     * Cancel request. Its callback won't be invoked.
+     *
+     * @param requestId Id of the request returned by request().
+     */
+    void cancelRequest(int requestId);
+
+    /**
+     * Get next queued message.
+     *
+     * Blocking stream waits until a message is received or connection is closed.
+     *
+     * @return Message stream, which must be deleted by caller, or NULL if there is no message.
+     */
+    MemoryStream * receive();
+
+    /**
+     * Process received frames and send data that didn't fit into the stream's output.
+     *
+     * @return False if connection is closed, true otherwise.
+     */
+    bool update();
+
+    /**
+     * Close connection. Pending requests receive NULL response.
+     */
+    void close();
+
+    /**
+     * Returns true if connection is closed and all received messages are processed.
+     */
+    bool isClosed() const;
+
+protected:
+    MessageChannel(SocketStream * stream);
+
+private:
+    bool sendFrame(std::vector<uint8_t>& frame, uint32_t requestId, uint8_t flags, bool compress);
+    bool flushOutput();
+    bool readInput(bool wait);
+    bool processFrames();
+    void dispatch(MemoryStream * message, uint32_t requestId, uint8_t flags);
+    void failRequests();
+
+    std::unique_ptr<SocketStream> _stream;
+    size_t _maxMessageSize;
+    bool _closed;
+
+    std::shared_ptr<std::vector<uint8_t>> _input;      // shared with delivered messages
+    size_t _inputOffset;
+    std::vector<uint8_t> _output;                       // frames that didn't fit into the stream
+    size_t _outputOffset;
+
+    MessageCallback _messageCallback;
+    RequestHandler _requestHandler;
+    std::deque<std::unique_ptr<MemoryStream>> _messages;
+
+    uint32_t _nextRequestId;
+    std::unordered_map<uint32_t, ResponseCallback> _requests;
+};
+
+
+
+
+#endif // __DFG_MESSAGE_CHANNEL_H__
@@ -6,5 +6,41 @@
 
 
 Settings::Settings()
+    : _changesDepth(0)
 {
 }
+
+void Settings::beginChanges()
+{
+    _changesDepth++;
+    VariantType::beginDeferredNotifications();
+}
+
+void Settings::commitChanges()
+{
+    GP_ASSERT(_changesDepth > 0);
+
+    std::vector<std::string> changedKeys;
+    if (_changesDepth == 1 && !changesCommittedSignal.empty())
+    {
+        for (const auto& it : _values)
+            if (it.second.isChangePending())
+                changedKeys.push_back(it.first);
+    }
+
+    _changesDepth--;
+    VariantType::endDeferredNotifications();
+
+    if (!changedKeys.empty())
+        changesCommittedSignal(changedKeys);
+}
+
+void Settings::onKeyAdded(const std::string& key)
+{
+    keyAddedSignal(key);
+}
+
+void Settings::onKeyRemoved(const std::string& key)
+{
+    keyRemovedSignal(key);
+}
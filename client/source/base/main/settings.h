@@ -21,6 +21,41 @@ class Settings : public Archive, public Singleton<Settings>
     friend class Singleton<Settings>;
 
 public:
+    /**
+     * Signals when a batch of changes is committed.
+     * Receives the list of keys that have been changed in the batch.
+     */
+    sigc::signal<void, const std::vector<std::string>&> changesCommittedSignal;
+
+    /**
+     * Signals after a new key is added. The value is already accessible.
+     */
+    sigc::signal<void, const std::string&> keyAddedSignal;
+
+    /**
+     * Signals before a key is removed. The value is destroyed after the call,
+     * along with the slots connected to it.
+     */
+    sigc::signal<void, const std::string&> keyRemovedSignal;
+
+    /**
+     * Start a batch of changes. Change notifications of all settings are deferred
+     * until the matching commitChanges call, so that slots and RunOnChange handlers
+     * run once per batch instead of once per changed value. Calls can be nested.
+     */
+    void beginChanges();
+
+    /**
+     * Commit a batch of changes started with beginChanges.
+     * The outermost call sends deferred notifications and emits changesCommittedSignal.
+     */
+    void commitChanges();
+
+    /**
+     * Whether there is an uncommitted batch of changes.
+     */
+    bool isChanging() const { return _changesDepth > 0; };
+
     /**
      * Helper function to allow connect specialized slots to general VariantType's signals.
      */
@@ -35,7 +70,12 @@ public:
 protected:
     Settings();
 
+    virtual void onKeyAdded(const std::string& key) override;
+    virtual void onKeyRemoved(const std::string& key) override;
+
 private:
+    unsigned _changesDepth;
+
     template<typename _Type, typename _Fn> inline void slotFunctor(const VariantType& value, const _Fn& fn) const;
     template<typename _Type, typename _Fn> inline bool validatorFunctor(const VariantType& oldValue, VariantType& newValue, const _Fn& fn) const;
 };
@@ -0,0 +1,463 @@
+#include "pch.h"
+#include "settings_storage.h"
+#include "settings.h"
+#include "memory_stream.h"
+#include "services/service_manager.h"
+#include "services/taskqueue_service.h"
+#include "zlib.h"
+
+#ifdef WIN32
+#include <io.h>
+#else
+#include <unistd.h>
+#endif
+
+
+
+#define SETTINGS_STORAGE_QUEUE "SettingsStorageQueue"
+
+// key in the snapshot archive that binds the snapshot to its journal
+#define JOURNAL_GENERATION_KEY "settings.journalGeneration"
+
+// key in the journal record that holds an archive of the keys removed from settings
+#define JOURNAL_REMOVED_KEYS_KEY "settings.removedKeys"
+
+static const uint8_t JOURNAL_MAGIC[2] = { 'S', 'J' };
+static const uint16_t JOURNAL_VERSION = 1;
+static const size_t JOURNAL_HEADER_SIZE = 8;
+static const size_t JOURNAL_RECORD_HEADER_SIZE = 8;
+static const size_t DEFAULT_JOURNAL_LIMIT = 64 * 1024;
+
+
+
+static bool readFile(const std::string& path, std::vector<uint8_t> * out)
+{
+    FILE * file = fopen(path.c_str(), "rb");
+    if (!file)
+        return false;
+
+    fseek(file, 0, SEEK_END);
+    long size = ftell(file);
+    fseek(file, 0, SEEK_SET);
+
+    out->resize(size > 0 ? size : 0);
+    bool res = out->empty() || fread(out->data(), 1, out->size(), file) == out->size();
+    fclose(file);
+
+    return res;
+}
+
+static bool syncAndClose(FILE * file)
+{
+    bool res = fflush(file) == 0;
+#ifdef WIN32
+    res = res && _commit(_fileno(file)) == 0;
+#else
+    res = res && fsync(fileno(file)) == 0;
+#endif
+    return fclose(file) == 0 && res;
+}
+
+static bool writeFileAtomically(const std::string& path, const void * data, size_t size)
+{
+    std::string tmpPath = path + ".tmp";
+    FILE * file = fopen(tmpPath.c_str(), "wb");
+    if (!file)
+        return false;
+
+    bool res = fwrite(data, 1, size, file) == size;
+    res = syncAndClose(file) && res;
+
+#ifdef WIN32
+    res = res && MoveFileExA(tmpPath.c_str(), path.c_str(), MOVEFILE_REPLACE_EXISTING | MOVEFILE_WRITE_THROUGH) != 0;
+#else
+    res = res && rename(tmpPath.c_str(), path.c_str()) == 0;
+#endif
+
+    if (!res)
+        remove(tmpPath.c_str());
+
+    return res;
+}
+
+
+
+
+/**
+ * Performs the actual file writes. Shared with the work items
+ * so that it outlives SettingsStorage while they are queued.
+ */
+class SettingsWriter
+{
+public:
+    struct Job
+    {
+        std::shared_ptr<Archive> values;
+        bool snapshot;
+    };
+
+    SettingsWriter(const char * path)
+        : _path(path)
+        , _journalPath(std::string(path) + ".journal")
+        , _generation(0)
+        , _snapshotCount(0)
+        , _journalSize(0)
+        , _journalIsValid(false)
+    {
+    }
+
+    bool load(Archive * out);
+    void addJob(const Job& job);
+    void processJobs();
+
+    size_t getJournalSize() const { std::unique_lock<std::mutex> lock(_jobsMutex); return _journalSize; };
+    bool isJournalValid() const { std::unique_lock<std::mutex> lock(_jobsMutex); return _journalIsValid; };
+
+private:
+    bool writeSnapshot(Archive * values);
+    bool appendJournal(const Archive * values, size_t * outRecordSize);
+
+    std::string _path;
+    std::string _journalPath;
+
+    // guards the jobs and the journal state, which is changed both by the scheduled
+    // snapshots and by the finished writes
+    mutable std::mutex _jobsMutex;
+    std::deque<Job> _jobs;
+    uint32_t _snapshotCount;
+    size_t _journalSize;
+    bool _journalIsValid;
+
+    // held while writing, files are only touched under this mutex
+    std::mutex _writeMutex;
+    uint32_t _generation;
+};
+
+bool SettingsWriter::load(Archive * out)
+{
+    std::unique_lock<std::mutex> lock(_writeMutex);
+
+    bool loaded = false;
+    std::vector<uint8_t> data;
+    if (readFile(_path, &data))
+    {
+        std::unique_ptr<MemoryStream> stream(MemoryStream::create(static_cast<const void *>(data.data()), data.size()));
+        if (!out->deserialize(stream.get()))
+            return false;
+
+        _generation = out->get<uint32_t>(JOURNAL_GENERATION_KEY, 0);
+        out->removeKey(JOURNAL_GENERATION_KEY);
+        loaded = true;
+    }
+
+    {
+        std::unique_lock<std::mutex> jobsLock(_jobsMutex);
+        _journalSize = 0;
+        _journalIsValid = false;
+    }
+
+    if (!readFile(_journalPath, &data))
+        return loaded;
+
+    uint16_t version;
+    uint32_t generation;
+    if (data.size() < JOURNAL_HEADER_SIZE || memcmp(data.data(), JOURNAL_MAGIC, 2) != 0)
+        return loaded;
+    memcpy(&version, data.data() + 2, sizeof(version));
+    memcpy(&generation, data.data() + 4, sizeof(generation));
+
+    // journal from other generation was left by interrupted snapshot write, its data is already in the snapshot
+    if (version != JOURNAL_VERSION || generation != _generation)
+        return loaded;
+
+    size_t offset = JOURNAL_HEADER_SIZE;
+    while (offset + JOURNAL_RECORD_HEADER_SIZE <= data.size())
+    {
+        uint32_t size, crc;
+        memcpy(&size, data.data() + offset, sizeof(size));
+        memcpy(&crc, data.data() + offset + 4, sizeof(crc));
+
+        const uint8_t * payload = data.data() + offset + JOURNAL_RECORD_HEADER_SIZE;
+        if (size > data.size() - offset - JOURNAL_RECORD_HEADER_SIZE || crc32(0L, payload, size) != crc)
+            break;
+
+        std::unique_ptr<Archive> record(Archive::create());
+        std::unique_ptr<MemoryStream> stream(MemoryStream::create(static_cast<const void *>(payload), size));
+        if (!record->deserialize(stream.get()))
+            break;
+
+        std::vector<std::string> keys;
+        record->getKeyList(&keys);
+        for (const std::string& key : keys)
+        {
+            if (key != JOURNAL_REMOVED_KEYS_KEY)
+                out->set(key.c_str(), *record->get(key.c_str()));
+        }
+
+        const VariantType * removedKeys = record->get(JOURNAL_REMOVED_KEYS_KEY);
+        if (removedKeys && removedKeys->getType() == VariantType::TYPE_KEYED_ARCHIVE)
+        {
+            removedKeys->getArchive()->getKeyList(&keys);
+            for (const std::string& key : keys)
+                out->removeKey(key.c_str());
+        }
+
+        offset += JOURNAL_RECORD_HEADER_SIZE + size;
+        loaded = true;
+    }
+
+    // the tail of the journal is torn, keep appending only if it is intact
+    std::unique_lock<std::mutex> jobsLock(_jobsMutex);
+    _journalIsValid = offset == data.size();
+    _journalSize = offset;
+
+    return loaded;
+}
+
+void SettingsWriter::addJob(const Job& job)
+{
+    std::unique_lock<std::mutex> lock(_jobsMutex);
+    if (job.snapshot)
+    {
+        // snapshot contains all the changes of the jobs that have not been written yet,
+        // the following journal records are appended to the new journal
+        _jobs.clear();
+        _journalSize = 0;
+        _journalIsValid = true;
+        _snapshotCount++;
+    }
+    _jobs.push_back(job);
+}
+
+void SettingsWriter::processJobs()
+{
+    std::unique_lock<std::mutex> lock(_writeMutex);
+
+    while (true)
+    {
+        Job job;
+        uint32_t snapshotCount;
+        {
+            std::unique_lock<std::mutex> jobsLock(_jobsMutex);
+            if (_jobs.empty())
+                return;
+            job = _jobs.front();
+            _jobs.pop_front();
+            snapshotCount = _snapshotCount;
+        }
+
+        size_t recordSize = 0;
+        bool res = job.snapshot ? writeSnapshot(job.values.get()) : appendJournal(job.values.get(), &recordSize);
+        if (!res)
+            GP_WARN("Failed to write settings to %s", job.snapshot ? _path.c_str() : _journalPath.c_str());
+
+        // snapshot scheduled while writing has already reset the journal state
+        std::unique_lock<std::mutex> jobsLock(_jobsMutex);
+        if (snapshotCount == _snapshotCount)
+        {
+            _journalSize += recordSize;
+
+            // force the next save to write the full snapshot
+            if (!res)
+                _journalIsValid = false;
+        }
+    }
+}
+
+bool SettingsWriter::writeSnapshot(Archive * values)
+{
+    uint32_t generation = _generation + 1;
+    values->set(JOURNAL_GENERATION_KEY, generation);
+
+    std::unique_ptr<MemoryStream> stream(MemoryStream::create());
+    if (!values->serialize(stream.get()) || !writeFileAtomically(_path, stream->getBuffer(), stream->length()))
+        return false;
+
+    // the old journal is ignored anyway since its generation doesn't match the snapshot
+    _generation = generation;
+    remove(_journalPath.c_str());
+
+    return true;
+}
+
+bool SettingsWriter::appendJournal(const Archive * values, size_t * outRecordSize)
+{
+    std::unique_ptr<MemoryStream> stream(MemoryStream::create());
+    if (!values->serialize(stream.get()))
+        return false;
+
+    FILE * file = fopen(_journalPath.c_str(), "ab");
+    if (!file)
+        return false;
+
+    bool res = true;
+    fseek(file, 0, SEEK_END);
+    if (ftell(file) == 0)
+    {
+        uint8_t header[JOURNAL_HEADER_SIZE];
+        memcpy(header, JOURNAL_MAGIC, 2);
+        memcpy(header + 2, &JOURNAL_VERSION, sizeof(JOURNAL_VERSION));
+        memcpy(header + 4, &_generation, sizeof(_generation));
+        res = fwrite(header, 1, sizeof(header), file) == sizeof(header);
+    }
+
+    uint32_t size = static_cast<uint32_t>(stream->length());
+    uint32_t record[2] = { size, static_cast<uint32_t>(crc32(0L, stream->getBuffer(), size)) };
+    res = res && fwrite(record, 1, sizeof(record), file) == sizeof(record);
+    res = res && fwrite(stream->getBuffer(), 1, size, file) == size;
+    res = syncAndClose(file) && res;
+
+    *outRecordSize = JOURNAL_RECORD_HEADER_SIZE + size;
+    return res;
+}
+
+
+
+
+SettingsStorage::SettingsStorage(const char * path)
+    : _writer(new SettingsWriter(path))
+    , _tracking(false)
+    , _journalLimit(DEFAULT_JOURNAL_LIMIT)
+{
+}
+
+SettingsStorage::~SettingsStorage()
+{
+    _keyAddedConnection.disconnect();
+    _keyRemovedConnection.disconnect();
+    for (auto& it : _trackedKeys)
+        it.second.disconnect();
+
+    flush();
+}
+
+bool SettingsStorage::load(Archive * out)
+{
+    GP_ASSERT(out);
+    return _writer->load(out);
+}
+
+void SettingsStorage::trackKeys(std::vector<std::string> * outDirtyKeys, std::vector<std::string> * outRemovedKeys)
+{
+    Settings * settings = Settings::getInstance();
+
+    if (!_tracking)
+    {
+        // keys added or removed later are reported by the settings
+        _tracking = true;
+        _keyAddedConnection = settings->keyAddedSignal.connect(sigc::mem_fun(this, &SettingsStorage::onKeyAdded));
+        _keyRemovedConnection = settings->keyRemovedSignal.connect(sigc::mem_fun(this, &SettingsStorage::onKeyRemoved));
+
+        std::vector<std::string> keys;
+        settings->getKeyList(&keys);
+        for (const std::string& key : keys)
+            onKeyAdded(key);
+    }
+
+    for (const auto& it : _trackedKeys)
+    {
+        const VariantType * value = settings->get(it.first.c_str());
+        GP_ASSERT(value);
+        if (value->getType() == VariantType::TYPE_KEYED_ARCHIVE || value->getType() == VariantType::TYPE_LIST)
+            _dirtyKeys.insert(it.first);
+    }
+
+    if (outDirtyKeys)
+        outDirtyKeys->assign(_dirtyKeys.begin(), _dirtyKeys.end());
+    if (outRemovedKeys)
+        outRemovedKeys->assign(_removedKeys.begin(), _removedKeys.end());
+    _dirtyKeys.clear();
+    _removedKeys.clear();
+}
+
+void SettingsStorage::onKeyAdded(const std::string& key)
+{
+    const VariantType * value = Settings::getInstance()->get(key.c_str());
+    GP_ASSERT(value);
+
+    sigc::connection& connection = _trackedKeys[key];
+    connection.disconnect();
+    connection = value->valueChangedSignal.connect(sigc::bind(sigc::mem_fun(this, &SettingsStorage::onValueChanged), key));
+
+    // key removed and added again between saves is written with its new value
+    _dirtyKeys.insert(key);
+    _removedKeys.erase(key);
+}
+
+void SettingsStorage::onKeyRemoved(const std::string& key)
+{
+    auto it = _trackedKeys.find(key);
+    if (it != _trackedKeys.end())
+    {
+        (*it).second.disconnect();
+        _trackedKeys.erase(it);
+    }
+
+    _dirtyKeys.erase(key);
+    _removedKeys.insert(key);
+}
+
+void SettingsStorage::onValueChanged(const VariantType&, const std::string& key)
+{
+    _dirtyKeys.insert(key);
+}
+
+bool SettingsStorage::save()
+{
+    bool firstSave = !_tracking;
+
+    std::vector<std::string> dirtyKeys, removedKeys;
+    trackKeys(&dirtyKeys, &removedKeys);
+
+    if (firstSave || !_writer->isJournalValid() || _writer->getJournalSize() > _journalLimit)
+        return schedule(Archive::create(*Settings::getInstance()), true);
+
+    if (dirtyKeys.empty() && removedKeys.empty())
+        return true;
+
+    const Settings * settings = Settings::getInstance();
+    Archive * values = Archive::create();
+    for (const std::string& key : dirtyKeys)
+        values->set(key.c_str(), *settings->get(key.c_str()));
+
+    if (!removedKeys.empty())
+    {
+        std::unique_ptr<Archive> removed(Archive::create());
+        for (const std::string& key : removedKeys)
+            removed->set(key.c_str(), true);
+        values->set(JOURNAL_REMOVED_KEYS_KEY, VariantType()).setArchive(removed.get());
+    }
+
+    return schedule(values, false);
+}
+
+bool SettingsStorage::compact()
+{
+    trackKeys(nullptr, nullptr);
+    return schedule(Archive::create(*Settings::getInstance()), true);
+}
+
+bool SettingsStorage::schedule(Archive * values, bool snapshot)
+{
+    _writer->addJob({ std::shared_ptr<Archive>(values), snapshot });
+
+    TaskQueueService * taskQueueService = ServiceManager::getInstance()->findService<TaskQueueService>();
+    if (taskQueueService && taskQueueService->getState() == Service::RUNNING)
+    {
+        taskQueueService->createQueue(SETTINGS_STORAGE_QUEUE);
+
+        std::shared_ptr<SettingsWriter> writer = _writer;
+        taskQueueService->addWorkItem(SETTINGS_STORAGE_QUEUE, [writer]() { writer->processJobs(); });
+    }
+    else
+    {
+        _writer->processJobs();
+    }
+
+    return true;
+}
+
+void SettingsStorage::flush()
+{
+    _writer->processJobs();
+}
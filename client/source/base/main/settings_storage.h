@@ -0,0 +1,95 @@
+#pragma once
+
+#ifndef __DFG_SETTINGS_STORAGE_H__
+#define __DFG_SETTINGS_STORAGE_H__
+
+
+
+
+/**
+ * SettingsStorage persists Settings to a file.
+ *
+ * The storage consists of a snapshot file and an append-only journal (same path with
+ * ".journal" suffix). Every save appends only the keys changed or removed since the
+ * previous save to the journal. When journal grows over the limit, the full snapshot is
+ * written instead and the journal is discarded.
+ *
+ * Settings values are copied on the calling thread, while serialization and file writes
+ * happen on a background task queue when TaskQueueService is available. Snapshot is
+ * written to a temporary file that is renamed over the old one, so the settings are never
+ * left half-written. Journal records are checksummed and a torn record at the end of
+ * the journal is ignored on load.
+ */
+class SettingsStorage : Noncopyable
+{
+public:
+    /**
+     * Create storage for a given snapshot file path.
+     *
+     * @param path Full path of the snapshot file.
+     */
+    SettingsStorage(const char * path);
+
+    /**
+     * Destructor. Waits for all pending writes.
+     */
+    ~SettingsStorage();
+
+    /**
+     * Load the snapshot and replay the journal.
+     *
+     * @param[out] out Archive that receives loaded values.
+     * @return True if any settings were loaded, false when there is no data or snapshot is corrupted.
+     */
+    bool load(class Archive * out);
+
+    /**
+     * Save changed settings. Writing is done asynchronously if possible.
+     *
+     * Values holding archives or lists are always written, since changes made
+     * inside them are not signaled.
+     *
+     * @return True if the save has been scheduled or no changes needed to be written.
+     */
+    bool save();
+
+    /**
+     * Write the full snapshot of settings and discard the journal.
+     * Writing is done asynchronously if possible.
+     */
+    bool compact();
+
+    /**
+     * Wait until all scheduled writes are completed.
+     * Pending writes are performed on the calling thread.
+     */
+    void flush();
+
+    /**
+     * Set journal size after which the next save writes the full snapshot.
+     *
+     * @param size Size in bytes.
+     */
+    void setJournalLimit(size_t size) { _journalLimit = size; };
+
+private:
+    void trackKeys(std::vector<std::string> * outDirtyKeys, std::vector<std::string> * outRemovedKeys);
+    void onValueChanged(const VariantType& value, const std::string& key);
+    void onKeyAdded(const std::string& key);
+    void onKeyRemoved(const std::string& key);
+    bool schedule(class Archive * values, bool snapshot);
+
+    std::shared_ptr<class SettingsWriter> _writer;
+    bool _tracking;
+    std::unordered_map<std::string, sigc::connection> _trackedKeys;
+    std::unordered_set<std::string> _dirtyKeys;
+    std::unordered_set<std::string> _removedKeys;
+    sigc::connection _keyAddedConnection;
+    sigc::connection _keyRemovedConnection;
+    size_t _journalLimit;
+};
+
+
+
+
+#endif // __DFG_SETTINGS_STORAGE_H__
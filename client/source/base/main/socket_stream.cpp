@@ -1,5 +1,6 @@
 #include "pch.h"
 #include "socket_stream.h"
+#include "services/service_manager.h"
 
 
 
@@ -27,17 +28,21 @@
 
 #endif
 
+#ifdef WIN32
+#define MSG_NOSIGNAL 0
+#endif
+
+static const size_t READ_CHUNK_SIZE = 16 * 1024;
+static const size_t OUTPUT_CHUNK_SIZE = 16 * 1024;
+static const size_t MAX_OUTPUT_SIZE = SocketReactorService::Channel::MAX_OUTPUT_SIZE;
+
 
 
 
 
 SocketStream::SocketStream()
-#ifdef WIN32
-    : _socket((SOCKET)-1)
-#else
-    : _socket(-1)
-#endif
-    , _connectionIsClosed(false)
+    : _channel(std::make_shared<SocketReactorService::Channel>())
+    , _reactor(NULL)
     , _totalBytes(0)
 {
 }
@@ -49,7 +54,16 @@ SocketStream::~SocketStream()
 
 SocketStream * SocketStream::create(const char * ipAddress, uint16_t port, bool blocking)
 {
-    GP_ASSERT(blocking && "Non-blocking SocketStrems are not implemented");
+    SocketReactorService * reactor = NULL;
+    if (!blocking)
+    {
+        reactor = ServiceManager::getInstance()->findService<SocketReactorService>();
+        if (!reactor)
+        {
+            GP_WARN("Can't create non-blocking SocketStream %s:%d, SocketReactorService is not registered", ipAddress, port);
+            return NULL;
+        }
+    }
 
 #ifdef WIN32
 
@@ -133,45 +147,123 @@ SocketStream * SocketStream::create(const char * ipAddress, uint16_t port, bool
 #endif
 
     SocketStream * res = new SocketStream();
-    res->_socket = socket;
+    res->_channel->socket = socket;
+
+    if (reactor)
+    {
+#ifdef WIN32
+        u_long mode = 1;
+        ioctlsocket(socket, FIONBIO, &mode);
+#else
+        fcntl(socket, F_SETFL, fcntl(socket, F_GETFL, 0) | O_NONBLOCK);
+#endif
+
+        if (!reactor->addChannel(res->_channel))
+        {
+            delete res;
+            return NULL;
+        }
+
+        res->_reactor = reactor;
+    }
 
     return res;
 }
 
+void SocketStream::setReadCallback(const std::function<void()>& callback)
+{
+    std::unique_lock<std::mutex> lock(_channel->mutex);
+    _channel->readCallback = callback;
+}
+
+void SocketStream::setWriteCallback(const std::function<void()>& callback)
+{
+    std::unique_lock<std::mutex> lock(_channel->mutex);
+    _channel->writeCallback = callback;
+}
+
 void SocketStream::close()
 {
-    _connectionIsClosed = true;
-    if (_socket == -1)
+    // reactor doesn't touch the socket once the channel is removed
+    if (_reactor)
+    {
+        _reactor->removeChannel(_channel);
+        _reactor = NULL;
+    }
+
+    std::unique_lock<std::mutex> lock(_channel->mutex);
+    _channel->closed = true;
+    _channel->readCallback = nullptr;
+    _channel->writeCallback = nullptr;
+    _channel->input.clear();
+    _channel->inputOffset = 0;
+    _channel->output.clear();
+    _channel->outputOffset = _channel->outputSize = 0;
+
+    if (_channel->socket == -1)
         return;
 
 #ifdef WIN32
-    closesocket(_socket);
+    closesocket(_channel->socket);
     WSACleanup();
-    _socket = (SOCKET)-1;
+    _channel->socket = (SOCKET)-1;
 #else
-    ::close(_socket);
-    _socket = -1;
+    ::close(_channel->socket);
+    _channel->socket = -1;
 #endif
 }
 
+void SocketStream::receive(size_t minSize)
+{
+    // blocking stream is read on the caller's thread only, so buffer doesn't need to be locked
+    SocketReactorService::Channel * channel = _channel.get();
+    while (channel->getInputSize() < minSize && !channel->closed)
+    {
+        if (channel->inputOffset > 0)
+        {
+            channel->input.erase(channel->input.begin(), channel->input.begin() + channel->inputOffset);
+            channel->inputOffset = 0;
+        }
+
+        size_t size = channel->input.size();
+        channel->input.resize(size + READ_CHUNK_SIZE);
+        auto result = recv(channel->socket, reinterpret_cast<char *>(channel->input.data() + size), READ_CHUNK_SIZE, 0);
+        channel->input.resize(size + (result > 0 ? result : 0));
+        channel->closed |= result <= 0;
+    }
+}
+
 size_t SocketStream::read(void* ptr, size_t size, size_t count)
 {
-    GP_ASSERT(!_connectionIsClosed);
+    GP_ASSERT(!eof());
     if (size == 0 || count == 0)
         return 0;
 
-    size_t sizeInBytes = size * count;
-    size_t bytesRemaining = sizeInBytes;
-    char * buffer = (char*)ptr;
+    if (!_reactor)
+        receive(size);
+
+    std::unique_lock<std::mutex> lock(_channel->mutex);
+    SocketReactorService::Channel * channel = _channel.get();
 
-    auto result = recv(_socket, buffer, bytesRemaining, 0);
-    if (result > 0)
-        bytesRemaining -= result;
+    size_t bytes = std::min(channel->getInputSize() / size, count) * size;
+    memcpy(ptr, channel->input.data() + channel->inputOffset, bytes);
+    channel->inputOffset += bytes;
+    if (channel->inputOffset == channel->input.size())
+    {
+        channel->input.clear();
+        channel->inputOffset = 0;
+    }
 
-    _connectionIsClosed |= result <= 0;
-    _totalBytes += sizeInBytes - bytesRemaining;
+    // reactor stops reading when too much data is buffered
+    bool resume = channel->inputPaused && bytes > 0;
+    channel->inputPaused &= !resume;
+    lock.unlock();
 
-    return (sizeInBytes - bytesRemaining) / size;
+    if (resume)
+        _reactor->updateChannel(_channel);
+
+    _totalBytes += bytes;
+    return bytes / size;
 }
 
 char* SocketStream::readLine(char* str, int num)
@@ -179,57 +271,161 @@ char* SocketStream::readLine(char* str, int num)
     if (num <= 0)
         return NULL;
 
-    char ch;
-    char * strSave = str;
-
-   size_t maxReadBytes = num;
-    while (maxReadBytes > 0)
+    size_t maxLength = static_cast<size_t>(num - 1);
+    size_t scanned = 0;
+    while (true)
     {
-        if (read(&ch, 1, 1) != 1)
-            return NULL;
+        std::unique_lock<std::mutex> lock(_channel->mutex);
+        SocketReactorService::Channel * channel = _channel.get();
 
-        if (ch == '\r' || ch == '\n')
+        const char * begin = reinterpret_cast<const char *>(channel->input.data() + channel->inputOffset);
+        size_t available = channel->getInputSize();
+        size_t limit = std::min(available, maxLength);
+
+        // line break is searched in the buffered data only once
+        size_t length = 0;
+        for (size_t i = scanned; i < limit; i++)
         {
-            *str++ = ch;
-            if (str - strSave < num)
-                *str++ = '\0';
-            return strSave;
+            if (begin[i] == '\r' || begin[i] == '\n')
+            {
+                length = i + 1;
+                if (begin[i] == '\r' && length < limit && begin[length] == '\n')
+                    length++;
+                break;
+            }
         }
 
-        *str++ = ch;
-        maxReadBytes--;
-    }
+        // "\r" may be followed by "\n" that isn't received yet
+        size_t rescan = limit;
+        if (length > 0 && length == available && length < maxLength && begin[length - 1] == '\r' && !channel->closed)
+        {
+            rescan = length - 1;
+            length = 0;
+        }
+
+        // line doesn't fit into str or connection is closed before line break is received
+        if (length == 0 && (available >= maxLength || (channel->closed && available > 0)))
+            length = limit;
+
+        if (length > 0 || maxLength == 0)
+        {
+            memcpy(str, begin, length);
+            str[length] = '\0';
+            channel->inputOffset += length;
+            _totalBytes += length;
+
+            bool resume = channel->inputPaused;
+            channel->inputPaused = false;
+            lock.unlock();
+
+            if (resume)
+                _reactor->updateChannel(_channel);
+            return str;
+        }
 
-    if (str - strSave < num)
-        *str++ = '\0';
-    return strSave;
+        if (channel->closed || _reactor)
+            return NULL;
+
+        scanned = rescan;
+        lock.unlock();
+        receive(available + 1);
+    }
 }
 
 size_t SocketStream::write(const void* ptr, size_t size, size_t count)
 {
-    GP_ASSERT(!_connectionIsClosed);
+    GP_ASSERT(!_channel->closed);
+    if (size == 0 || count == 0)
+        return 0;
 
-#ifdef WIN32
-    size_t result = send(_socket, reinterpret_cast<const char *>(ptr), size * count, 0);
-#else
-    size_t result = send(_socket, ptr, size * count, 0);
-#endif
+    size_t sizeInBytes = size * count;
+    const uint8_t * data = reinterpret_cast<const uint8_t *>(ptr);
+
+    if (!_reactor)
+    {
+        size_t sent = 0;
+        while (sent < sizeInBytes)
+        {
+            auto result = send(_channel->socket, reinterpret_cast<const char *>(data + sent), sizeInBytes - sent, MSG_NOSIGNAL);
+            if (result <= 0)
+            {
+                _channel->closed = true;
+                break;
+            }
+
+            sent += result;
+        }
+
+        _totalBytes += sent;
+        return sent / size;
+    }
 
-    if (result < 0)
+    std::unique_lock<std::mutex> lock(_channel->mutex);
+    SocketReactorService::Channel * channel = _channel.get();
+    if (channel->closed || channel->outputSize >= MAX_OUTPUT_SIZE)
+    {
+        channel->writeBlocked = !channel->closed;
         return 0;
+    }
 
-    _totalBytes += result;
-    return result / size;
+    size_t bytes = std::min((MAX_OUTPUT_SIZE - channel->outputSize) / size, count) * size;
+    channel->writeBlocked = bytes < size * count;
+    bool wasEmpty = channel->outputSize == 0;
+
+    // small writes are merged into chunks, so fewer buffers are passed to a single vectored write
+    if (!channel->output.empty() && channel->output.back().size() + bytes <= OUTPUT_CHUNK_SIZE)
+        channel->output.back().insert(channel->output.back().end(), data, data + bytes);
+    else
+        channel->output.emplace_back(data, data + bytes);
+    channel->outputSize += bytes;
+    lock.unlock();
+
+    if (wasEmpty)
+        _reactor->updateChannel(_channel);
+
+    _totalBytes += bytes;
+    return bytes / size;
 }
 
 bool SocketStream::canRead() const
 {
+    {
+        std::unique_lock<std::mutex> lock(_channel->mutex);
+        if (_channel->getInputSize() > 0)
+            return true;
+        if (_reactor || _channel->closed)
+            return false;
+    }
+
     unsigned long bytes = 0;
 #ifdef WIN32
-    ioctlsocket(_socket, FIONREAD, &bytes);
+    ioctlsocket(_channel->socket, FIONREAD, &bytes);
 #else
-    ioctl(_socket, FIONREAD, &bytes);
+    ioctl(_channel->socket, FIONREAD, &bytes);
 #endif
 
     return bytes != 0;
 }
+
+bool SocketStream::canWrite() const
+{
+    std::unique_lock<std::mutex> lock(_channel->mutex);
+    if (_channel->closed)
+        return false;
+
+    // writer is going to wait for write callback
+    _channel->writeBlocked = _channel->outputSize >= MAX_OUTPUT_SIZE;
+    return !_channel->writeBlocked;
+}
+
+bool SocketStream::eof() const
+{
+    std::unique_lock<std::mutex> lock(_channel->mutex);
+    return _channel->closed && _channel->getInputSize() == 0;
+}
+
+bool SocketStream::isClosed() const
+{
+    std::unique_lock<std::mutex> lock(_channel->mutex);
+    return _channel->closed;
+}
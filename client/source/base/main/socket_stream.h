@@ -10,6 +10,8 @@
 #include <sys/socket.h>
 #endif
 
+#include "services/socket_reactor_service.h"
+
 
 
 
@@ -19,6 +21,11 @@
  *
  * You can use SocketStream only with TCP sockets, either
  * blocking or non-blocking.
+ *
+ * Both kinds of streams buffer received data, so small reads and
+ * readLine don't result in a system call each. I/O of non-blocking
+ * streams is performed by SocketReactorService on its own thread,
+ * writes are queued and sent together.
  */
 class SocketStream : public gameplay::Stream, Noncopyable
 {
@@ -33,7 +40,7 @@ public:
      * no data is ready in the pipe. You need to check EOF to make sure
      * socket is closed and retry reading or writing again if it's not.
      *
-     * Non-blocking sockets are not supported at the moment.
+     * Non-blocking sockets require SocketReactorService to be registered.
      *
      * @param ipAddress IPv4 address.
      * @param port Port number.
@@ -42,6 +49,24 @@ public:
      */
     static SocketStream * create(const char * ipAddress, uint16_t port, bool blocking = true);
 
+    /**
+     * Set callback invoked on the main thread when new data is received by
+     * non-blocking stream or its connection is closed. Callback is never
+     * invoked after the stream is closed.
+     *
+     * @param callback Callback function, or empty function to remove it.
+     */
+    void setReadCallback(const std::function<void()>& callback);
+
+    /**
+     * Set callback invoked on the main thread when non-blocking stream refused
+     * to queue data and has room for it again. Callback is never invoked after
+     * the stream is closed.
+     *
+     * @param callback Callback function, or empty function to remove it.
+     */
+    void setWriteCallback(const std::function<void()>& callback);
+
     /**
      * Returns true if this stream can perform read operations.
      * Actually checks whether any bytes are available to make socket read operation
@@ -52,10 +77,12 @@ public:
 
     /**
      * Returns true if this stream can perform write operations.
+     * Non-blocking stream can't be written to while too much data is waiting to be sent,
+     * write callback is invoked once it can.
      *
      * @return True if the stream can write, false otherwise.
      */
-    virtual bool canWrite() const override { return true; };
+    virtual bool canWrite() const override;
 
     /**
      * Returns true if this stream can seek.
@@ -72,10 +99,10 @@ public:
     /**
      * Reads an array of <code>count</code> elements, each of size <code>size</code>.
      *
-     * Please note, that for SocketStream read is a blocking operation, it wait until
+     * Please note, that for blocking SocketStream read is a blocking operation, it wait until
      * something is ready to read from queue and it may read less bytes than your asked.
      * In this case, you need to always check how many bytes were read and call the read
-     * again to receive the rest.
+     * again to receive the rest. Non-blocking stream only reads already received data.
      *
      * \code
      * int numbers[3];
@@ -101,8 +128,12 @@ public:
      * The line break character is included in the string.
      * The terminating null character is added to the end of the string.
      *
+     * Non-blocking stream returns NULL until the whole line is received.
+     * Line ending with "\r" is returned only once the next character is
+     * received or the connection is closed, so "\r\n" is never split.
+     *
      * @param str The array of chars to copy the string to.
-     * @param num The maximum number of characters to be copied.
+     * @param num The maximum number of characters to be copied, including the terminating null character.
      *
      * @return On success, str is returned. On error, NULL is returned.
      *
@@ -123,6 +154,8 @@ public:
      * @param size  The size of each element to be written, in bytes.
      * @param count The number of elements to write.
      *
+     * Non-blocking stream queues the data and returns immediately.
+     *
      * @return The number of elements written.
      *
      * @see canWrite()
@@ -130,11 +163,19 @@ public:
     virtual size_t write(const void* ptr, size_t size, size_t count) override;
 
     /**
-     * Returns true if the end of the stream has been reached.
+     * Returns true if the end of the stream has been reached,
+     * i.e. connection is closed and all received data is read.
      *
      * @return True if end of stream reached, false otherwise.
      */
-    virtual bool eof() const override { return _connectionIsClosed; };
+    virtual bool eof() const override;
+
+    /**
+     * Returns true if the connection is closed, received data may still be read.
+     *
+     * @return True if connection is closed, false otherwise.
+     */
+    bool isClosed() const;
 
     /**
      * Returns the length of the stream in bytes.
@@ -188,13 +229,10 @@ protected:
     SocketStream();
 
 private:
-#ifdef WIN32
-    SOCKET _socket;
-#else
-    int _socket;
-#endif
+    void receive(size_t minSize);
 
-    bool _connectionIsClosed;
+    std::shared_ptr<SocketReactorService::Channel> _channel;
+    SocketReactorService * _reactor;                // NULL for blocking stream
     long int _totalBytes;
 };
 
@@ -1,6 +1,20 @@
 #include "pch.h"
 #include "variant.h"
 #include "archive.h"
+#include "json.h"
+#include <charconv>
+
+
+
+thread_local unsigned VariantType::deferredNotificationsDepth = 0;
+
+// variants changed while notifications are deferred, entries before __pendingNotificationsBegin
+// belong to batches that are being emitted at the moment (slots can start and end new batches)
+static thread_local std::vector<VariantType *> __pendingNotifications;
+static thread_local size_t __pendingNotificationsBegin = 0;
+
+static thread_local unsigned __notificationBatchCounter = 0;
+static thread_local unsigned __notificationBatchId = 0;
 
 
 
@@ -12,6 +26,9 @@ VariantType::VariantType()
 
 VariantType::~VariantType()
 {
+    if (notificationIndex != 0)
+        cancelPendingNotification();
+
     release();
 }
 
@@ -22,41 +39,225 @@ VariantType::VariantType(const VariantType& other)
     set(other);
 }
 
+VariantType::VariantType(VariantType&& other) noexcept
+    : type(other.type)
+    , uint64Value(other.uint64Value)
+{
+    // signals are not moved, same as they are not copied
+    other.type = TYPE_NONE;
+    other.uint64Value = 0;
+}
+
 VariantType& VariantType::operator= (const VariantType& other)
 {
     set(other);
     return *this;
 }
 
-void VariantType::setBlob(const void * data, uint32_t size)
+void VariantType::takeValue(VariantType& other)
 {
-    if (type == TYPE_BYTE_ARRAY && (pointerValue == NULL && size == 0 || pointerValue != NULL && size == reinterpret_cast<std::vector<uint8_t> *>(pointerValue)->size() && memcmp(&(*reinterpret_cast<std::vector<uint8_t> *>(pointerValue)->begin()), data, size) == 0))
+    if (!valueValidatorSignal.empty() || type == other.type)
+    {
+        // validators have to see the new value and equal values must not be notified, set() handles both
+        set(other);
         return;
+    }
 
-    const uint8_t * buf = reinterpret_cast<const uint8_t *>(data);
+    adoptValue(other);
+    notifyChanged();
+}
+
+void VariantType::adoptValue(VariantType& other)
+{
+    release();
+    type = other.type;
+    uint64Value = other.uint64Value;
+    other.type = TYPE_NONE;
+    other.uint64Value = 0;
+}
+
+void VariantType::shareValue(const VariantType& value)
+{
+    GP_ASSERT(value.type == TYPE_BYTE_ARRAY || value.type == TYPE_KEYED_ARCHIVE || value.type == TYPE_LIST);
+
+    // archives are compared by identity only, see operator==
+    if (type == value.type && (sharedValue == value.sharedValue || type != TYPE_KEYED_ARCHIVE && *this == value))
+        return;
+
+    if (!valueValidatorSignal.empty())
+    {
+        VariantType newValue(value);
+        if (!valueValidatorSignal(*this, newValue))
+            return;
+
+        adoptValue(newValue);
+        notifyChanged();
+        return;
+    }
+
+    // value may be owned by this variant, so reference it before releasing
+    SharedData * data = value.sharedValue;
+    Type dataType = value.type;
+    if (data && data->leaked)
+        data = cloneSharedData(dataType, data);
+    else if (data)
+        data->refCount.fetch_add(1, std::memory_order_relaxed);
+
+    release();
+    type = dataType;
+    sharedValue = data;
+
+    notifyChanged();
+}
+
+void VariantType::cloneSharedValue()
+{
+    SharedData * clone = cloneSharedData(type, sharedValue);
+    if (!clone)
+        return;
+
+    releaseSharedValue();
+    sharedValue = clone;
+}
+
+VariantType::SharedData * VariantType::cloneSharedData(Type dataType, const SharedData * data)
+{
+    switch (dataType)
+    {
+    case TYPE_BYTE_ARRAY:
+        return new SharedBlob(std::vector<uint8_t>(static_cast<const SharedBlob *>(data)->value));
+    case TYPE_KEYED_ARCHIVE:
+        return new SharedArchive(std::unique_ptr<Archive>(Archive::create(*static_cast<const SharedArchive *>(data)->value)));
+    case TYPE_LIST:
+        return new SharedList(std::vector<VariantType>(static_cast<const SharedList *>(data)->value));
+    default:
+        GP_ASSERT(!"Value can't be shared");
+        return NULL;
+    }
+}
+
+void VariantType::releaseSharedValue()
+{
+    if (sharedValue->refCount.fetch_sub(1, std::memory_order_acq_rel) == 1)
+    {
+        switch (type)
+        {
+        case TYPE_BYTE_ARRAY:
+            delete static_cast<SharedBlob *>(sharedValue);
+            break;
+        case TYPE_KEYED_ARCHIVE:
+            delete static_cast<SharedArchive *>(sharedValue);
+            break;
+        case TYPE_LIST:
+            delete static_cast<SharedList *>(sharedValue);
+            break;
+        default:
+            GP_ASSERT(!"Value can't be shared");
+            break;
+        }
+    }
+    sharedValue = NULL;
+}
+
+void VariantType::beginDeferredNotifications()
+{
+    deferredNotificationsDepth++;
+}
+
+void VariantType::endDeferredNotifications()
+{
+    GP_ASSERT(deferredNotificationsDepth > 0);
+    size_t begin = __pendingNotificationsBegin;
+    size_t end = __pendingNotifications.size();
+    if (--deferredNotificationsDepth > 0 || begin == end)
+        return;
+
+    __pendingNotificationsBegin = end;
+
+    unsigned prevBatchId = __notificationBatchId;
+    if (++__notificationBatchCounter == 0)
+        ++__notificationBatchCounter;
+    __notificationBatchId = __notificationBatchCounter;
+
+    for (size_t i = begin; i < end; i++)
+    {
+        // the variant can be destroyed by one of the previous slots, in this case it's removed from the batch
+        VariantType * v = __pendingNotifications[i];
+        if (!v)
+            continue;
+
+        __pendingNotifications[i] = nullptr;
+        v->notificationIndex = 0;
+        v->valueChangedSignal(*v);
+    }
+
+    // nested batches started by slots are already emitted
+    __pendingNotifications.resize(begin);
+    __pendingNotificationsBegin = begin;
+    __notificationBatchId = prevBatchId;
+}
+
+unsigned VariantType::getNotificationBatchId()
+{
+    return __notificationBatchId;
+}
+
+void VariantType::emitChanged()
+{
+    if (deferredNotificationsDepth == 0)
+    {
+        valueChangedSignal(*this);
+        return;
+    }
+
+    if (notificationIndex == 0)
+    {
+        __pendingNotifications.push_back(this);
+        notificationIndex = static_cast<uint32_t>(__pendingNotifications.size());
+    }
+}
+
+void VariantType::cancelPendingNotification()
+{
+    GP_ASSERT(notificationIndex <= __pendingNotifications.size() && __pendingNotifications[notificationIndex - 1] == this);
+    __pendingNotifications[notificationIndex - 1] = nullptr;
+    notificationIndex = 0;
+}
+
+void VariantType::setBlob(const void * data, uint32_t size)
+{
     if (type == TYPE_BYTE_ARRAY)
     {
-        std::vector<uint8_t> * src = reinterpret_cast<std::vector<uint8_t> *>(pointerValue);
-        if (src && src->size() == size)
+        uint32_t currentSize;
+        const uint8_t * current = getBlob(&currentSize);
+        if (currentSize == size && (size == 0 || memcmp(current, data, size) == 0))
+            return;
+    }
+
+    const uint8_t * buf = reinterpret_cast<const uint8_t *>(data);
+    if (type == TYPE_BYTE_ARRAY && sharedValue && sharedValue->refCount.load(std::memory_order_acquire) == 1)
+    {
+        std::vector<uint8_t>& src = static_cast<SharedBlob *>(sharedValue)->value;
+        if (src.size() == size)
         {
             // copy the data inplace without reallocating the vector
-            src->assign(buf, buf + size);
-            valueChangedSignal(*this);
+            src.assign(buf, buf + size);
+            notifyChanged();
             return;
         }
     }
 
     release();
     type = TYPE_BYTE_ARRAY;
-    pointerValue = size > 0 ? reinterpret_cast<void *>(new std::vector<uint8_t>(buf, buf + size)) : NULL;
+    sharedValue = size > 0 ? new SharedBlob(std::vector<uint8_t>(buf, buf + size)) : NULL;
 
-    valueChangedSignal(*this);
+    notifyChanged();
 }
 
 const uint8_t * VariantType::getBlob(uint32_t * size) const
 {
     GP_ASSERT(type == TYPE_BYTE_ARRAY);
-    std::vector<uint8_t> * buf = reinterpret_cast<std::vector<uint8_t> *>(pointerValue);
+    const std::vector<uint8_t> * buf = sharedValue ? &static_cast<const SharedBlob *>(sharedValue)->value : NULL;
 
     if (!buf)
     {
@@ -85,22 +286,22 @@ void VariantType::setArchive(const Archive * archive)
             return;
         }
 
-        release();
-        type = TYPE_KEYED_ARCHIVE;
-        pointerValue = newValue.pointerValue;   // take ownership
-        newValue.pointerValue = nullptr;
-        valueChangedSignal(*this);
+        adoptValue(newValue);
+        notifyChanged();
         return;
     }
 
     // TODO: make a proper Archive comparison
-    if (type == TYPE_KEYED_ARCHIVE && pointerValue == archive)
+    if (type == TYPE_KEYED_ARCHIVE && static_cast<SharedArchive *>(sharedValue)->value.get() == archive)
         return;
 
+    // nested values of the archive are shared with the source
+    SharedArchive * data = new SharedArchive(std::unique_ptr<Archive>(archive ? Archive::create(*archive) : Archive::create()));
+
     release();
     type = TYPE_KEYED_ARCHIVE;
-    pointerValue = archive ? Archive::create(*archive) : Archive::create();
-    valueChangedSignal(*this);
+    sharedValue = data;
+    notifyChanged();
 }
 
 void VariantType::release()
@@ -132,16 +333,9 @@ void VariantType::release()
         SAFE_DELETE(wideStringValue);
         return;
     case TYPE_BYTE_ARRAY:
-        delete reinterpret_cast<std::vector<uint8_t> *>(pointerValue);
-        pointerValue = NULL;
-        return;
     case TYPE_KEYED_ARCHIVE:
-        delete reinterpret_cast<class Archive *>(pointerValue);
-        pointerValue = NULL;
-        return;
     case TYPE_LIST:
-        delete reinterpret_cast<std::vector<VariantType>*>(pointerValue);
-        pointerValue = NULL;
+        releaseSharedValue();
         return;
     case TYPE_AABBOX3:
         delete reinterpret_cast<gameplay::BoundingBox *>(pointerValue);
@@ -220,36 +414,426 @@ void VariantType::release()
 #define LONG1    '\x8a' /* push long from < 256 bytes */
 #define LONG4    '\x8b' /* push really big long */
 
-// workaround for android gnustl_static which doesn't support std::to_string methods
-#if defined(__ANDROID__) && defined(_GLIBCXX_CSTDLIB)
-#include <string>
-#include <sstream>
+/* Protocol 3 (Python 3.x) */
+#define BINBYTES       'B' /* push bytes; counted binary string argument */
+#define SHORT_BINBYTES 'C' /*  "     "   ;    "      "       "      " < 256 bytes */
+
+/* Protocol 4 */
+#define SHORT_BINUNICODE '\x8c' /* push short string; UTF-8 length < 256 bytes */
+#define BINUNICODE8      '\x8d' /* push very long string */
+#define BINBYTES8        '\x8e' /* push very long bytes string */
+#define EMPTY_SET        '\x8f' /* push empty set on the stack */
+#define ADDITEMS         '\x90' /* modify set by adding topmost stack items */
+#define FROZENSET        '\x91' /* build frozenset from topmost stack items */
+#define NEWOBJ_EX        '\x92' /* like NEWOBJ but work with keyword only arguments */
+#define STACK_GLOBAL     '\x93' /* same as GLOBAL but using names on the stacks */
+#define MEMOIZE          '\x94' /* store top of the stack in memo */
+#define FRAME            '\x95' /* indicate the beginning of a new frame */
+
+/* Protocol 5 */
+#define BYTEARRAY8       '\x96' /* push bytearray */
+#define NEXT_BUFFER      '\x97' /* push next out-of-band buffer */
+#define READONLY_BUFFER  '\x98' /* make top of stack readonly */
+
+#define HIGHEST_PICKLE_PROTOCOL 5
 
-namespace std{
-template <typename T>
-std::string to_string(T value)
+
+
+/**
+ * Bounds-checked reader of the pickle data held in memory.
+ */
+class PickleReader
 {
-    std::ostringstream os;
-    os << value;
-    return os.str();
+public:
+    PickleReader(const char * data, size_t size)
+        : _begin(data)
+        , _cur(data)
+        , _end(data + size)
+    {
+    }
+
+    size_t consumed() const { return _cur - _begin; };
+    size_t remaining() const { return _end - _cur; };
+
+    template<typename _Type> bool read(_Type * out)
+    {
+        if (remaining() < sizeof(_Type))
+            return false;
+        memcpy(out, _cur, sizeof(_Type));
+        _cur += sizeof(_Type);
+        return true;
+    }
+
+    bool readBytes(uint64_t length, const char ** out)
+    {
+        if (remaining() < length)
+            return false;
+        *out = _cur;
+        _cur += length;
+        return true;
+    }
+
+    /**
+     * Reads line without the trailing '\n'.
+     */
+    bool readLine(const char ** out, size_t * outLength)
+    {
+        const char * eol = reinterpret_cast<const char *>(memchr(_cur, '\n', remaining()));
+        if (!eol)
+            return false;
+        *out = _cur;
+        *outLength = eol - _cur;
+        _cur = eol + 1;
+        return true;
+    }
+
+private:
+    const char * _begin;
+    const char * _cur;
+    const char * _end;
+};
+
+template<typename _Type> static bool parsePickleNumber(const char * str, size_t length, _Type * out)
+{
+    // python 2 longs in text format have 'L' suffix, it just stops the parsing
+    auto res = std::from_chars(str, str + length, *out);
+    return res.ec == std::errc();
+}
+
+static bool parsePickleFloat(const char * str, size_t length, double * out)
+{
+    auto res = fast_float::from_chars(str, str + length, *out);
+    return res.ec == std::errc();
+}
+
+/**
+ * Item of the unpickler's stack.
+ *
+ * Binary unicode strings are kept as views into the source data until the item is stored
+ * into a list, a dictionary or the result, so the strings used as dictionary keys
+ * are never decoded to wide strings.
+ */
+struct PickleItem : public VariantType
+{
+    const char * utf8;
+    size_t utf8Length;
+    uint32_t memoRefs;      // number of memo entries made from this stack item, copies are not counted
+
+    PickleItem() : utf8(NULL), utf8Length(0), memoRefs(0) {};
+    template<class _Type> explicit PickleItem(const _Type& value) : VariantType(value), utf8(NULL), utf8Length(0), memoRefs(0) {};
+    template<typename _InputIterator> PickleItem(_InputIterator begin, _InputIterator end) : VariantType(begin, end), utf8(NULL), utf8Length(0), memoRefs(0) {};
+    PickleItem(const PickleItem& other) : VariantType(static_cast<const VariantType&>(other)), utf8(other.utf8), utf8Length(other.utf8Length), memoRefs(0) {};
+    PickleItem(PickleItem&& other) noexcept : VariantType(static_cast<VariantType&&>(other)), utf8(other.utf8), utf8Length(other.utf8Length), memoRefs(other.memoRefs) {};
+
+    PickleItem& operator=(const PickleItem& other)
+    {
+        VariantType::operator=(other);
+        utf8 = other.utf8;
+        utf8Length = other.utf8Length;
+        memoRefs = 0;
+        return *this;
+    }
+};
+
+// whether the list or archive held by container is reachable from the value
+static bool pickleValueReferences(const VariantType& value, const VariantType& container)
+{
+    const void * target = container.getType() == VariantType::TYPE_LIST
+        ? static_cast<const void *>(container.getList()) : static_cast<const void *>(container.getArchive());
+
+    std::vector<const VariantType *> pending(1, &value);
+    std::unordered_set<const void *> visited;
+    std::vector<std::string> keys;
+    while (!pending.empty())
+    {
+        const VariantType * v = pending.back();
+        pending.pop_back();
+
+        if (v->getType() == VariantType::TYPE_LIST)
+        {
+            const std::vector<VariantType> * list = v->getList();
+            if (list == target)
+                return true;
+            if (visited.insert(list).second)
+                for (const VariantType& item : *list)
+                    pending.push_back(&item);
+        }
+        else if (v->getType() == VariantType::TYPE_KEYED_ARCHIVE)
+        {
+            const Archive * archive = v->getArchive();
+            if (archive == target)
+                return true;
+            if (visited.insert(archive).second)
+            {
+                archive->getKeyList(&keys);
+                for (const std::string& key : keys)
+                    pending.push_back(archive->get(key.c_str()));
+            }
+        }
+    }
+
+    return false;
+}
+
+static void decodePickleUnicode(const char * str, size_t length, std::wstring * out)
+{
+    // the data is validated by the parser, unchecked decoder can read past the end of truncated sequences
+    out->reserve(length);
+    utf8::unchecked::utf8to16(str, str + length, std::back_inserter(*out));
 }
+
+static void decodePickleRawUnicode(const char * str, size_t length, std::wstring * out)
+{
+    // raw-unicode-escape: latin1 characters and \uXXXX, \UXXXXXXXX escapes
+    out->reserve(length);
+    for (size_t i = 0; i < length; i++)
+    {
+        size_t digits = 0;
+        if (str[i] == '\\' && i + 1 < length)
+            digits = str[i + 1] == 'u' ? 4 : str[i + 1] == 'U' ? 8 : 0;
+
+        uint32_t code;
+        if (digits > 0 && i + 2 + digits <= length && std::from_chars(str + i + 2, str + i + 2 + digits, code, 16).ptr == str + i + 2 + digits)
+        {
+            if (code >= 0x10000)
+            {
+                // same utf16 representation as Utils::UTF8ToWCS
+                code -= 0x10000;
+                out->push_back(static_cast<wchar_t>(0xD800 + (code >> 10)));
+                code = 0xDC00 + (code & 0x3FF);
+            }
+            out->push_back(static_cast<wchar_t>(code));
+            i += 1 + digits;
+        }
+        else
+        {
+            out->push_back(static_cast<wchar_t>(static_cast<uint8_t>(str[i])));
+        }
+    }
+}
+
+static bool pickleKeyToString(const PickleItem& key, std::string * out)
+{
+    char buf[32];
+    std::to_chars_result res;
+
+    // keys are stored in utf8 encoding, same as binary unicode strings in pickle data
+    if (key.utf8)
+    {
+        out->assign(key.utf8, key.utf8Length);
+        return true;
+    }
+
+    switch (key.getType())
+    {
+    case VariantType::TYPE_STRING:
+        *out = key.get<std::string>();
+        return true;
+    case VariantType::TYPE_WIDE_STRING:
+        // store keys in utf8 encoding
+        *out = Utils::WCSToUTF8(key.get<std::wstring>());
+        return true;
+    case VariantType::TYPE_BOOLEAN:
+        *out = key.get<bool>() ? "1" : "0";
+        return true;
+    case VariantType::TYPE_INT32:
+        res = std::to_chars(buf, buf + sizeof(buf), key.get<int32_t>());
+        break;
+    case VariantType::TYPE_INT64:
+        res = std::to_chars(buf, buf + sizeof(buf), key.get<int64_t>());
+        break;
+    default:
+        GP_WARN("Unsupported pickle dictionary key type %s", key.getTypeName());
+        return false;
+    }
+
+    out->assign(buf, res.ptr);
+    return true;
 }
-#endif
 
 bool VariantType::unpickle(gameplay::Stream * stream)
 {
-    bool stopped = false;
-    std::vector<VariantType> stack;
-    char str[1024];
-    std::unordered_map<std::string, VariantType> memo;
+    GP_ASSERT(stream);
+    if (!stream)
+        return false;
+
+    // read the rest of the stream at once and parse it from memory
+    long start = stream->position();
+    size_t length = stream->length();
+    std::vector<char> data(start >= 0 && length > static_cast<size_t>(start) ? length - start : 4096);
+    size_t size = 0;
+    while (true)
+    {
+        size += stream->read(data.data() + size, 1, data.size() - size);
+        if (size < data.size())
+            break;
+        data.resize(data.size() * 2);
+    }
+
+    size_t consumed = 0;
+    bool res = unpickle(data.data(), size, &consumed);
+
+    // leave the stream right after the STOP opcode
+    if (stream->canSeek() && start >= 0)
+        stream->seek(start + static_cast<long>(consumed), SEEK_SET);
+
+    return res;
+}
+
+bool VariantType::unpickle(const void * data, size_t size, size_t * outConsumed)
+{
+    GP_ASSERT(data || size == 0);
+
+    PickleReader reader(reinterpret_cast<const char *>(data), size);
+    std::vector<PickleItem> stack;
+    std::vector<PickleItem> memo;
     std::vector<size_t> marks;
 
     stack.reserve(128);
 
-    while (!stream->eof() && !stopped)
+    // decode the string view once the item is stored into a container
+    auto materialize = [](PickleItem& item)
+    {
+        if (!item.utf8)
+            return;
+
+        VariantType value;
+        value.type = TYPE_WIDE_STRING;
+        value.wideStringValue = new std::wstring();
+        decodePickleUnicode(item.utf8, item.utf8Length, value.wideStringValue);
+        item.adoptValue(value);
+        item.utf8 = NULL;
+    };
+
+    // objects are moved from the stack, list grows geometrically since APPENDS add items in batches
+    auto moveToList = [&stack, &materialize](size_t first, std::vector<VariantType> * list)
+    {
+        size_t required = list->size() + stack.size() - first;
+        if (required > list->capacity())
+            list->reserve(std::max(required, list->capacity() * 2));
+        for (size_t i = first; i < stack.size(); i++)
+        {
+            materialize(stack[i]);
+            list->emplace_back(static_cast<VariantType&&>(stack[i]));
+        }
+        stack.erase(stack.begin() + first, stack.end());
+    };
+
+    // replace stack items starting from first with a list made of them
+    auto collapseToList = [&stack, &moveToList](size_t first)
+    {
+        SharedList * list = new SharedList();
+        moveToList(first, &list->value);
+        stack.emplace_back();
+        stack.back().type = TYPE_LIST;
+        stack.back().sharedValue = list;
+    };
+
+    // MARK pushes a placeholder which is replaced by the object built from the items above it
+    auto popMark = [&stack, &marks](size_t * outMark) -> bool
+    {
+        if (marks.empty() || marks.back() >= stack.size())
+            return false;
+        *outMark = marks.back();
+        marks.pop_back();
+        return true;
+    };
+
+    auto collapseMarkToList = [&stack, &popMark, &collapseToList]() -> bool
+    {
+        size_t mark;
+        if (!popMark(&mark))
+            return false;
+        collapseToList(mark + 1);
+        stack[mark].takeValue(stack.back());
+        stack.pop_back();
+        return true;
+    };
+
+    // Lists and dicts can be referenced from the memo and from other containers. Like in Python,
+    // they are modified in place, so every reference sees the items added after it's been taken.
+    auto listOf = [](VariantType& item) -> std::vector<VariantType> *
+    {
+        return &static_cast<SharedList *>(item.sharedValue)->value;
+    };
+
+    // VariantType can't hold recursive structures, so adding items that reference the container
+    // itself is rejected. Items can reach the container only when it's referenced by something
+    // besides its stack item and memo entries, that's checked first to skip the search.
+    bool memoOverwritten = false;
+    auto makesCycle = [&stack, &memoOverwritten](const PickleItem& container, size_t first) -> bool
+    {
+        unsigned refs = container.sharedValue->refCount.load(std::memory_order_relaxed);
+        if (!memoOverwritten && refs <= 1 + container.memoRefs)
+            return false;
+
+        for (size_t i = first; i < stack.size(); i++)
+        {
+            if (pickleValueReferences(stack[i], container))
+            {
+                GP_WARN("Recursive pickle structures are not supported");
+                return true;
+            }
+        }
+        return false;
+    };
+
+    auto setItems = [&stack, &materialize, &makesCycle](PickleItem& dict, size_t first) -> bool
+    {
+        if (dict.getType() != TYPE_KEYED_ARCHIVE || (stack.size() - first) % 2 != 0 || makesCycle(dict, first))
+            return false;
+
+        std::string key;
+        Archive * archive = static_cast<SharedArchive *>(dict.sharedValue)->value.get();
+        for (size_t i = first; i < stack.size(); i += 2)
+        {
+            if (!pickleKeyToString(stack[i], &key))
+                return false;
+            materialize(stack[i + 1]);
+            archive->set(key.c_str(), VariantType()).takeValue(stack[i + 1]);
+        }
+
+        stack.erase(stack.begin() + first, stack.end());
+        return true;
+    };
+
+    auto readMemoIndex = [size](const char * line, size_t length, uint32_t * outIndex) -> bool
+    {
+        // every memo entry takes at least one opcode, larger indices are malformed
+        return parsePickleNumber(line, length, outIndex) && *outIndex <= size;
+    };
+
+    auto put = [&stack, &memo, &memoOverwritten, size](uint32_t index) -> bool
+    {
+        if (stack.empty() || index > size)
+            return false;
+        if (index >= memo.size())
+            memo.resize(index + 1);
+
+        // memo references of the replaced container are not tracked anymore
+        PickleItem& entry = memo[index];
+        if (entry.type == TYPE_LIST || entry.type == TYPE_KEYED_ARCHIVE)
+            memoOverwritten = true;
+
+        // entry references the same data as the stack item, assignment of an equal value would keep the old one
+        entry.clear();
+        entry = stack.back();
+        stack.back().memoRefs++;
+        return true;
+    };
+
+    auto get = [&stack, &memo](uint32_t index) -> bool
+    {
+        if (index >= memo.size())
+            return false;
+        stack.push_back(memo[index]);
+        return true;
+    };
+
+    while (true)
     {
         char key;
-        if (stream->read(&key, sizeof(key), 1) != 1)
+        if (!reader.read(&key))
             return false;
 
         switch (key)
@@ -257,134 +841,147 @@ bool VariantType::unpickle(gameplay::Stream * stream)
         case PROTO:
             {
                 uint8_t version;
-                if (stream->read(&version, sizeof(version), 1) != 1)
+                if (!reader.read(&version))
                     return false;
 
-                if (version > 2)
+                if (version > HIGHEST_PICKLE_PROTOCOL)
                 {
                     GP_WARN("Unsupported pickle protocol %d", version);
                     return false;
                 }
             }
             break;
+        case FRAME:
+            {
+                // the whole data is already in memory, just validate the frame size
+                uint64_t frameSize;
+                if (!reader.read(&frameSize) || frameSize > reader.remaining())
+                    return false;
+            }
+            break;
         case PERSID:
-            if (stream->readLine(str, 1024) == NULL)
-                return false;
+            {
+                const char * line;
+                size_t length;
+                if (!reader.readLine(&line, &length))
+                    return false;
 
-            // do nothing with persistent objects, just push None on stack
-            stack.push_back(VariantType());
+                // do nothing with persistent objects, just push None on stack
+                stack.emplace_back();
+            }
             break;
         case BINPERSID:
-            GP_ASSERT(!stack.empty() && stack.back().getType() == TYPE_INT32);
-            if (stack.empty() || stack.back().getType() != TYPE_INT32)
+            if (stack.empty())
                 return false;
 
             // do nothing with persistent objects, just push None on stack
-            stack.back().clear();
+            stack.back() = PickleItem();
             break;
         case NONE:
-            stack.push_back(VariantType());
+            stack.emplace_back();
             break;
         case NEWFALSE:
-            stack.push_back(VariantType(false));
+            stack.emplace_back(false);
             break;
         case NEWTRUE:
-            stack.push_back(VariantType(true));
+            stack.emplace_back(true);
             break;
         case INT:
-            if (stream->readLine(str, 1024) == NULL)
-                return false;
-            if (strlen(str) == 3)
             {
-                if (str[1] == '0' && str[2] == '0')
-                {
-                    stack.push_back(VariantType(false));
-                    break;
-                }
-                else if (str[1] == '0' && str[2] == '1')
+                const char * line;
+                size_t length;
+                if (!reader.readLine(&line, &length))
+                    return false;
+
+                if (length == 2 && line[0] == '0' && (line[1] == '0' || line[1] == '1'))
                 {
-                    stack.push_back(VariantType(true));
+                    stack.emplace_back(line[1] == '1');
                     break;
                 }
+
+                int64_t val;
+                if (!parsePickleNumber(line, length, &val))
+                    return false;
+                stack.emplace_back(val);
             }
-            stack.push_back(VariantType((int64_t)atoll(str)));
             break;
-        case BININT:
+        case LONG:
             {
-                int32_t val;
-                if (stream->read(&val, sizeof(val), 1) != 1)
+                const char * line;
+                size_t length;
+                int64_t val;
+                if (!reader.readLine(&line, &length) || !parsePickleNumber(line, length, &val))
                     return false;
-                stack.push_back(VariantType(val));
+                stack.emplace_back(val);
             }
             break;
-        case BININT1:
+        case BININT:
             {
-                int8_t val;
-                if (stream->read(&val, sizeof(val), 1) != 1)
+                int32_t val;
+                if (!reader.read(&val))
                     return false;
-                stack.push_back(VariantType(val));
+                stack.emplace_back(val);
             }
             break;
-        case BININT2:
+        case BININT1:
             {
-                int16_t val;
-                if (stream->read(&val, sizeof(val), 1) != 1)
+                // unsigned 1-byte integer
+                uint8_t val;
+                if (!reader.read(&val))
                     return false;
-                stack.push_back(VariantType(val));
+                stack.emplace_back(static_cast<int32_t>(val));
             }
             break;
-        case LONG:
+        case BININT2:
             {
-                if (stream->readLine(str, 1024) == NULL)
+                // unsigned 2-byte integer
+                uint16_t val;
+                if (!reader.read(&val))
                     return false;
-                stack.push_back(VariantType((int64_t)atoll(str)));
+                stack.emplace_back(static_cast<int32_t>(val));
             }
             break;
         case LONG1:
+        case LONG4:
             {
-                int8_t n;
-                if (stream->read(&n, sizeof(n), 1) != 1)
-                    return false;
-                // we don't actually support python's long type if it's larger than 64bits
-                if (n > 8)
+                uint32_t n;
+                if (key == LONG1)
                 {
-                    stream->seek(n, SEEK_CUR);
-                    stack.push_back(VariantType((int64_t)0));
-                    break;
+                    uint8_t n1;
+                    if (!reader.read(&n1))
+                        return false;
+                    n = n1;
                 }
-
-                int64_t val = 0;
-                if (stream->read(&val, 1, n) != n)
+                else if (!reader.read(&n))
                     return false;
-                stack.push_back(VariantType(val));
-            }
-            break;
-        case LONG4:
-            {
-                int16_t n;
-                if (stream->read(&n, sizeof(n), 1) != 1)
+
+                const char * bytes;
+                if (!reader.readBytes(n, &bytes))
                     return false;
+
                 // we don't actually support python's long type if it's larger than 64bits
                 if (n > 8)
                 {
-                    stream->seek(n, SEEK_CUR);
-                    stack.push_back(VariantType((int64_t)0));
+                    stack.emplace_back(static_cast<int64_t>(0));
                     break;
                 }
 
-                int64_t val = 0;
-                if (stream->read(&val, 1, n) != n)
-                    return false;
-                stack.push_back(VariantType(val));
+                // little-endian two's complement
+                uint64_t val = 0;
+                memcpy(&val, bytes, n);
+                if (n > 0 && n < 8 && (bytes[n - 1] & 0x80))
+                    val |= ~0ULL << (n * 8);
+                stack.emplace_back(static_cast<int64_t>(val));
             }
             break;
         case FLOAT:
             {
-                if (stream->readLine(str, 1024) == NULL)
+                const char * line;
+                size_t length;
+                double val;
+                if (!reader.readLine(&line, &length) || !parsePickleFloat(line, length, &val))
                     return false;
-                double value;
-                fast_float::from_chars(str, str + strlen(str), value);
-                stack.push_back(VariantType(value));
+                stack.emplace_back(val);
             }
             break;
         case BINFLOAT:
@@ -396,468 +993,352 @@ bool VariantType::unpickle(gameplay::Stream * stream)
                     int8_t b[8];
                 } val;
 
-                if (stream->read(&val.val, sizeof(val), 1) != 1)
+                if (!reader.read(&val.val))
                     return false;
                 std::swap(val.b[0], val.b[7]);
                 std::swap(val.b[1], val.b[6]);
                 std::swap(val.b[2], val.b[5]);
                 std::swap(val.b[3], val.b[4]);
-                stack.push_back(VariantType(val.val));
+                stack.emplace_back(val.val);
             }
             break;
         case STRING:
-            // we don't support quoted strings
-            if (stream->readLine(str, 1024) == NULL)
-                return false;
-            stack.push_back(VariantType(std::string(str)));
+            {
+                const char * line;
+                size_t length;
+                if (!reader.readLine(&line, &length))
+                    return false;
+
+                // escape sequences are not supported, only the quotes are removed
+                if (length >= 2 && (line[0] == '\'' || line[0] == '"') && line[length - 1] == line[0])
+                {
+                    line++;
+                    length -= 2;
+                }
+                stack.emplace_back(std::string(line, length));
+            }
             break;
         case BINSTRING:
+        case SHORT_BINSTRING:
             {
                 uint32_t len;
-                if (stream->read(&len, sizeof(len), 1) != 1)
+                if (key == SHORT_BINSTRING)
+                {
+                    uint8_t len1;
+                    if (!reader.read(&len1))
+                        return false;
+                    len = len1;
+                }
+                else if (!reader.read(&len))
                     return false;
-                std::unique_ptr<char[]> buf(new char[len]);
-                if (stream->read(buf.get(), 1, len) != len)
+
+                const char * str;
+                if (!reader.readBytes(len, &str))
                     return false;
-                stack.push_back(VariantType(std::string(buf.get(), len)));
+                stack.emplace_back(std::string(str, len));
             }
             break;
         case UNICODE:
-            // we don't support unicode strings in text format
-            stack.push_back(VariantType(std::wstring(L"<unsupported>")));
+            {
+                const char * line;
+                size_t length;
+                std::wstring str;
+                if (!reader.readLine(&line, &length))
+                    return false;
+                decodePickleRawUnicode(line, length, &str);
+                stack.emplace_back(std::move(str));
+            }
             break;
         case BINUNICODE:
+        case SHORT_BINUNICODE:
+        case BINUNICODE8:
             {
-                // BINUNICODE uses utf8
-
-                uint32_t len;
-                if (stream->read(&len, sizeof(len), 1) != 1)
+                // all binary unicode strings use utf8
+                uint64_t len;
+                if (key == SHORT_BINUNICODE)
+                {
+                    uint8_t len1;
+                    if (!reader.read(&len1))
+                        return false;
+                    len = len1;
+                }
+                else if (key == BINUNICODE)
+                {
+                    uint32_t len4;
+                    if (!reader.read(&len4))
+                        return false;
+                    len = len4;
+                }
+                else if (!reader.read(&len))
                     return false;
-                std::unique_ptr<char[]> buf(new char[len]);
-                if (stream->read(buf.get(), 1, len) != len)
+
+                // unchecked decoder can read past the end of truncated sequences
+                const char * bytes;
+                if (!reader.readBytes(len, &bytes) || utf8::find_invalid(bytes, bytes + len) != bytes + len)
                     return false;
-                stack.push_back(VariantType(Utils::UTF8ToWCS(std::string(buf.get(), len))));
+                stack.emplace_back();
+                stack.back().utf8 = bytes;
+                stack.back().utf8Length = static_cast<size_t>(len);
             }
             break;
-        case SHORT_BINSTRING:
+        case BINBYTES:
+        case SHORT_BINBYTES:
+        case BINBYTES8:
+        case BYTEARRAY8:
             {
-                uint8_t len;
-                if (stream->read(&len, sizeof(len), 1) != 1)
-                    return false;
-                std::unique_ptr<char[]> buf(new char[len + 1]);
-                if (stream->read(buf.get(), 1, len) != len)
+                // bytes and bytearray are stored as blobs
+                uint64_t len;
+                if (key == SHORT_BINBYTES)
+                {
+                    uint8_t len1;
+                    if (!reader.read(&len1))
+                        return false;
+                    len = len1;
+                }
+                else if (key == BINBYTES)
+                {
+                    uint32_t len4;
+                    if (!reader.read(&len4))
+                        return false;
+                    len = len4;
+                }
+                else if (!reader.read(&len))
                     return false;
-                buf[len] = '\0';
 
-                stack.push_back(VariantType(std::string(buf.get(), len)));
+                const char * bytes;
+                if (len > std::numeric_limits<uint32_t>::max() || !reader.readBytes(len, &bytes))
+                    return false;
+                stack.emplace_back();
+                stack.back().setBlob(bytes, static_cast<uint32_t>(len));
             }
             break;
+        case NEXT_BUFFER:
+            GP_WARN("Out-of-band pickle buffers are not supported");
+            return false;
+        case READONLY_BUFFER:
+            // all values are mutable anyway
+            if (stack.empty())
+                return false;
+            break;
         case TUPLE:
-            GP_ASSERT(!marks.empty() && marks.back() < stack.size());
-            if (marks.empty() || marks.back() >= stack.size())
+        case LIST:
+        case FROZENSET:
+            // we don't distinguish tuples, lists and sets
+            if (!collapseMarkToList())
+                return false;
+            break;
+        case OBJ:
+            // we don't support OBJ opcode, instead we store all objects creation arguments as a list
+            if (!collapseMarkToList())
                 return false;
-            stack[marks.back()].set(stack.begin() + marks.back() + 1, stack.end());
-            stack.resize(marks.back()+1);
-            marks.pop_back();
             break;
         case EMPTY_TUPLE:
         case EMPTY_LIST:
-            stack.push_back(VariantType((int *)0, (int *)0));
+        case EMPTY_SET:
+            stack.emplace_back((int *)0, (int *)0);
             break;
         case TUPLE1:
-            stack[stack.size() - 1].set(stack.begin() + stack.size() - 1, stack.end());
-            break;
         case TUPLE2:
-            stack[stack.size() - 2].set(stack.begin() + stack.size() - 2, stack.end());
-            stack.pop_back();
-            break;
         case TUPLE3:
-            stack[stack.size() - 3].set(stack.begin() + stack.size() - 3, stack.end());
-            stack.pop_back();
-            stack.pop_back();
-            break;
-        case EMPTY_DICT:
             {
-                stack.push_back(VariantType());
-                stack.back().setArchive();
+                size_t count = key - TUPLE1 + 1;
+                if (stack.size() < count)
+                    return false;
+                collapseToList(stack.size() - count);
             }
             break;
-        case LIST:
-            GP_ASSERT(!marks.empty() && marks.back() < stack.size());
-            if (marks.empty() || marks.back() >= stack.size())
-                return false;
-            stack[marks.back()].set(stack.begin() + marks.back() + 1, stack.end());
-            stack.resize(marks.back() +1);
-            marks.pop_back();
+        case EMPTY_DICT:
+            stack.emplace_back();
+            stack.back().setArchive();
             break;
         case DICT:
             {
-                GP_ASSERT(!marks.empty() && marks.back() < stack.size());
-                if (marks.empty() || marks.back() >= stack.size())
+                size_t mark;
+                if (!popMark(&mark))
                     return false;
 
-                stack[marks.back()].setArchive();
-                for (size_t i = marks.back() + 1; i < stack.size(); i += 2)
-                    stack[marks.back()].getArchive()->set(stack[i].get<std::string>().c_str(), stack[i + 1]);
-                stack.resize(marks.back() +1);
-                marks.pop_back();
+                stack[mark].setArchive();
+                if (!setItems(stack[mark], mark + 1))
+                    return false;
             }
             break;
         case INST:
-            // we don't support INST opcode, instead we store all objects creation arguments as a list
+        case GLOBAL:
             {
-                std::string module, name;
-
-                if (stream->readLine(str, 1024) == NULL)
+                // we don't support INST opcode, instead we store all objects creation arguments as a list
+                const char * module, * name;
+                size_t moduleLength, nameLength;
+                if (!reader.readLine(&module, &moduleLength) || !reader.readLine(&name, &nameLength))
                     return false;
-                module.assign(str, strlen(str) - 1);
-        
-                if (stream->readLine(str, 1024) == NULL)
-                    return false;
-                name.assign(str, strlen(str) - 1);
 
-                GP_ASSERT(!marks.empty() && marks.back() < stack.size());
-                if (marks.empty() || marks.back() >= stack.size())
-                    return false;
+                size_t first = stack.size();
+                if (key == INST)
+                {
+                    size_t mark;
+                    if (!popMark(&mark))
+                        return false;
+
+                    // drop the placeholder, module and name go before the arguments
+                    stack.erase(stack.begin() + mark);
+                    first = mark;
+                }
 
-                std::vector<VariantType> args;
-                args.push_back(VariantType(module));
-                args.push_back(VariantType(name));
-                std::copy(stack.begin() + marks.back() + 1, stack.end(), std::back_inserter(args));
-                stack[marks.back()].set(args.begin(), args.end());
-                stack.resize(marks.back() +1);
-                marks.pop_back();
+                stack.emplace(stack.begin() + first, std::string(name, nameLength));
+                stack.emplace(stack.begin() + first, std::string(module, moduleLength));
+                collapseToList(first);
             }
             break;
-        case OBJ:
-            // we don't support OBJ opcode, instead we store all objects creation arguments as a list
-            GP_ASSERT(!marks.empty() && marks.back() < stack.size());
-            if (marks.empty() || marks.back() >= stack.size())
+        case STACK_GLOBAL:
+            // module and name are already on the stack
+            if (stack.size() < 2)
                 return false;
-
-            stack[marks.back()].set(stack.begin() + marks.back() + 1, stack.end());
-            stack.resize(marks.back() +1);
-            marks.pop_back();
+            collapseToList(stack.size() - 2);
             break;
         case NEWOBJ:
-            stack[stack.size() - 2].set(stack.begin() + stack.size() - 2, stack.end());
+        case REDUCE:
+            // store class or callable with its arguments as a list
+            if (stack.size() < 2)
+                return false;
+            collapseToList(stack.size() - 2);
             break;
-        case GLOBAL:
-            {
-                std::string module, name;
-
-                if (stream->readLine(str, 1024) == NULL)
-                    return false;
-                module.assign(str, strlen(str) - 1);
-        
-                if (stream->readLine(str, 1024) == NULL)
-                    return false;
-                name.assign(str, strlen(str) - 1);
-
-                std::vector<VariantType> args;
-                args.push_back(VariantType(module));
-                args.push_back(VariantType(name));
-                stack.push_back(VariantType(args.begin(), args.end()));
-            }
+        case NEWOBJ_EX:
+            // class, arguments and keyword arguments
+            if (stack.size() < 3)
+                return false;
+            collapseToList(stack.size() - 3);
             break;
         case EXT1:
             {
-                int8_t val;
-                if (stream->read(&val, sizeof(val), 1) != 1)
+                uint8_t val;
+                if (!reader.read(&val))
                     return false;
-                stack.push_back(VariantType());
+                stack.emplace_back();
             }
             break;
         case EXT2:
             {
-                int16_t val;
-                if (stream->read(&val, sizeof(val), 1) != 1)
+                uint16_t val;
+                if (!reader.read(&val))
                     return false;
-                stack.push_back(VariantType());
+                stack.emplace_back();
             }
             break;
         case EXT4:
             {
-                int32_t val;
-                if (stream->read(&val, sizeof(val), 1) != 1)
+                uint32_t val;
+                if (!reader.read(&val))
                     return false;
-                stack.push_back(VariantType());
+                stack.emplace_back();
             }
             break;
-        case REDUCE:
-            stack[stack.size() - 2].set(stack.begin() + stack.size() - 2, stack.end());
-            stack.pop_back();
-            break;
         case POP:
+            if (stack.empty())
+                return false;
+            if (!marks.empty() && marks.back() == stack.size() - 1)
+                marks.pop_back();   // popping the mark itself
             stack.pop_back();
             break;
         case POP_MARK:
-            GP_ASSERT(!marks.empty() && marks.back() < stack.size());
-            if (marks.empty() || marks.back() >= stack.size())
-                return false;
-            stack.resize(marks.back());
-            marks.pop_back();
+            {
+                size_t mark;
+                if (!popMark(&mark))
+                    return false;
+                stack.resize(mark);
+            }
             break;
         case DUP:
+            if (stack.empty())
+                return false;
             stack.push_back(stack.back());
             break;
         case GET:
-            if (stream->readLine(str, 1024) == NULL)
-                return false;
-            if (memo.find(str) == memo.end())
-                return false;
-            stack.push_back(memo[str]);
-            break;
-        case BINGET:
-            {
-                int8_t val;
-                if (stream->read(&val, sizeof(val), 1) != 1)
-                    return false;
-
-                std::string s = std::to_string(val);
-                if (memo.find(s) == memo.end())
-                    return false;
-                stack.push_back(memo[s]);
-            }
-            break;
-        case LONG_BINGET:
+        case PUT:
             {
-                int32_t val;
-                if (stream->read(&val, sizeof(val), 1) != 1)
+                const char * line;
+                size_t length;
+                uint32_t index;
+                if (!reader.readLine(&line, &length) || !readMemoIndex(line, length, &index))
                     return false;
-
-                std::string s = std::to_string(val);
-                if (memo.find(s) == memo.end())
+                if (!(key == GET ? get(index) : put(index)))
                     return false;
-                stack.push_back(memo[s]);
             }
             break;
-        case PUT:
-            if (stream->readLine(str, 1024) == NULL)
-                return false;
-            memo[str] = stack.back();
-            break;
+        case BINGET:
         case BINPUT:
             {
-                int8_t val;
-                if (stream->read(&val, sizeof(val), 1) != 1)
-                    return false;
-
-                std::string s = std::to_string(val);
-                if (stack.empty())
+                uint8_t index;
+                if (!reader.read(&index) || !(key == BINGET ? get(index) : put(index)))
                     return false;
-                memo[s] = stack.back();
             }
             break;
+        case LONG_BINGET:
         case LONG_BINPUT:
             {
-                int32_t val;
-                if (stream->read(&val, sizeof(val), 1) != 1)
-                    return false;
-
-                std::string s = std::to_string(val);
-                if (stack.empty())
+                uint32_t index;
+                if (!reader.read(&index) || !(key == LONG_BINGET ? get(index) : put(index)))
                     return false;
-                memo[s] = stack.back();
             }
             break;
+        case MEMOIZE:
+            if (!put(static_cast<uint32_t>(memo.size())))
+                return false;
+            break;
         case APPEND:
-            {
-                std::vector<VariantType> list;
-                std::copy(stack[stack.size() - 2].begin(), stack[stack.size() - 2].end(), std::back_inserter(list));
-                list.push_back(stack.back());
-                stack.pop_back();
-                stack.back().set(list.begin(), list.end());
-            }
+            if (stack.size() < 2 || stack[stack.size() - 2].getType() != TYPE_LIST || makesCycle(stack[stack.size() - 2], stack.size() - 1))
+                return false;
+            moveToList(stack.size() - 1, listOf(stack[stack.size() - 2]));
             break;
         case APPENDS:
+        case ADDITEMS:
             {
-            GP_ASSERT(!marks.empty() && marks.back() < stack.size());
-            if (marks.empty() || marks.back() >= stack.size())
-                return false;
-
-                std::vector<VariantType> list;
-                std::copy(stack[marks.back() - 1].begin(), stack[marks.back() - 1].end(), std::back_inserter(list));
-                std::copy(stack.begin() + marks.back() + 1, stack.end(), std::back_inserter(list));
-                stack[marks.back() - 1].set(list.begin(), list.end());
-
-                stack.resize(marks.back());
-                marks.pop_back();
+                size_t mark;
+                if (!popMark(&mark) || mark == 0 || stack[mark - 1].getType() != TYPE_LIST || makesCycle(stack[mark - 1], mark + 1))
+                    return false;
+                moveToList(mark + 1, listOf(stack[mark - 1]));
+                stack.pop_back();
             }
             break;
         case SETITEM:
-            if (stack[stack.size() - 2].getType() == VariantType::TYPE_STRING)
-                stack[stack.size() - 3].getArchive()->set(stack[stack.size() - 2].get<std::string>().c_str(), stack[stack.size() - 1]);
-            else
-                stack[stack.size() - 3].getArchive()->set(std::to_string(stack[stack.size() - 2].get<int32_t>()).c_str(), stack[stack.size() - 1]);
-            stack.pop_back();
-            stack.pop_back();
+            if (stack.size() < 3 || !setItems(stack[stack.size() - 3], stack.size() - 2))
+                return false;
             break;
         case SETITEMS:
             {
-                GP_ASSERT(!marks.empty() && marks.back() < stack.size());
-                if (marks.empty() || marks.back() >= stack.size())
+                size_t mark;
+                if (!popMark(&mark) || mark == 0 || !setItems(stack[mark - 1], mark + 1))
                     return false;
-
-                for (size_t i = marks.back() + 1; i < stack.size(); i += 2)
-                {
-                    if (stack[i].getType() == VariantType::TYPE_STRING)
-                        stack[marks.back() - 1].getArchive()->set(stack[i].get<std::string>().c_str(), stack[i + 1]);
-                    else if (stack[i].getType() == VariantType::TYPE_WIDE_STRING)
-                        // store keys in utf8 encoding
-                        stack[marks.back() - 1].getArchive()->set(Utils::WCSToUTF8(stack[i].get<std::wstring>()).c_str(), stack[i + 1]);
-                    else
-                        stack[marks.back() - 1].getArchive()->set(std::to_string(stack[i].get<int64_t>()).c_str(), stack[i + 1]);
-                }
-
-                stack.resize(marks.back());
-                marks.pop_back();
+                stack.pop_back();
             }
             break;
         case BUILD:
+            if (stack.empty())
+                return false;
             stack.pop_back();
             break;
         case MARK:
             marks.push_back(stack.size());
-            stack.push_back(VariantType());
+            stack.emplace_back();
             break;
         case STOP:
-            stopped = true;
-            set(stack.back());
-            stack.pop_back();
-            GP_ASSERT(stack.empty());
-            break;
+            if (stack.empty())
+                return false;
+            materialize(stack.back());
+            takeValue(stack.back());
+            if (outConsumed)
+                *outConsumed = reader.consumed();
+            return true;
         default:
-            GP_WARN("Unsupported pickle opcode 0x%X", key);
+            GP_WARN("Unsupported pickle opcode 0x%X", static_cast<uint8_t>(key));
             return false;
         }
     }
-
-    return true;
 }
 
 bool VariantType::serializeToJSON(std::string * outStr) const
 {
-    const VariantType& value = *this;
-    VariantType::Type type = value.getType();
-
-    switch (type)
-    {
-    case VariantType::TYPE_NONE:
-        *outStr += "null";
-        break;
-    case VariantType::TYPE_BOOLEAN:
-        if (value.get<bool>())
-            *outStr += "true";
-        else
-            *outStr += "false";
-        break;
-    case VariantType::TYPE_INT8:
-        *outStr += fmt::format("{}", value.get<int8_t>());
-        break;
-    case VariantType::TYPE_UINT8:
-        *outStr += fmt::format("{}", value.get<uint8_t>());
-        break;
-    case VariantType::TYPE_INT16:
-        *outStr += fmt::format("{}", value.get<int16_t>());
-        break;
-    case VariantType::TYPE_UINT16:
-        *outStr += fmt::format("{}", value.get<uint16_t>());
-        break;
-    case VariantType::TYPE_INT32:
-        *outStr += fmt::format("{}", value.get<int32_t>());
-        break;
-    case VariantType::TYPE_UINT32:
-        *outStr += fmt::format("{}", value.get<uint32_t>());
-        break;
-    case VariantType::TYPE_INT64:
-        *outStr += fmt::format("{}", value.get<int64_t>());
-        break;
-    case VariantType::TYPE_UINT64:
-        *outStr += fmt::format("{}", value.get<uint64_t>());
-        break;
-    case VariantType::TYPE_FLOAT:
-        *outStr += fmt::format("{}", value.get<float>());
-        break;
-    case VariantType::TYPE_FLOAT64:
-        *outStr += fmt::format("{}", value.get<double>());
-        break;
-    case VariantType::TYPE_STRING:
-        *outStr += '\"';
-        *outStr += value.get<std::string>();    // TODO: support escaping of quotes
-        *outStr += '\"';
-        break;
-    case VariantType::TYPE_WIDE_STRING:
-        *outStr += '\"';
-        *outStr += Utils::WCSToUTF8(value.get<std::wstring>());    // TODO: support escaping of quotes
-        *outStr += '\"';
-        break;
-    case VariantType::TYPE_BYTE_ARRAY:
-    {
-        uint32_t size;
-        const uint8_t * buf = value.getBlob(&size);
-        Utils::base64Encode(buf, size, outStr);
-    }
-    break;
-    case VariantType::TYPE_KEYED_ARCHIVE:
-        value.getArchive()->serializeToJSON(outStr);
-        break;
-    case VariantType::TYPE_VECTOR2:
-        *outStr += fmt::format("[{}, {}]", value.get<gameplay::Vector2>().x, value.get<gameplay::Vector2>().y);
-        break;
-    case VariantType::TYPE_VECTOR3:
-        *outStr += fmt::format("[{}, {}, {}]", value.get<gameplay::Vector3>().x, value.get<gameplay::Vector3>().y, value.get<gameplay::Vector3>().z);
-        break;
-    case VariantType::TYPE_VECTOR4:
-        *outStr += fmt::format("[{}, {}, {}, {}]", value.get<gameplay::Vector4>().x, value.get<gameplay::Vector4>().y, value.get<gameplay::Vector4>().z, value.get<gameplay::Vector4>().w);
-        break;
-    case VariantType::TYPE_MATRIX2:
-        GP_ASSERT(!"Not implemented yet");
-        return false;
-    case VariantType::TYPE_MATRIX3:
-        GP_ASSERT(!"Not implemented yet");
+    if (!outStr)
         return false;
-    case VariantType::TYPE_MATRIX4:
-        GP_ASSERT(!"Not implemented yet");
-        return false;
-    case VariantType::TYPE_COLOR:
-        GP_ASSERT(!"Not implemented yet");
-        return false;
-    case VariantType::TYPE_FASTNAME:
-        GP_ASSERT(!"Not implemented yet");
-        return false;
-    case VariantType::TYPE_AABBOX3:
-        GP_ASSERT(!"Not implemented yet");
-        return false;
-    case VariantType::TYPE_FILEPATH:
-        GP_ASSERT(!"Not implemented yet");
-        return false;
-    case VariantType::TYPE_LIST:
-    {
-        uint32_t size = static_cast<uint32_t>(std::distance(value.begin(), value.end()));
 
-        *outStr += '[';
-        for (const VariantType& v : value)
-        {
-            if (!v.serializeToJSON(outStr))
-                return false;
-
-            *outStr += ", ";
-        }
-
-        if (size)
-        {
-            outStr->pop_back();
-            outStr->pop_back();
-        }
-
-        *outStr += ']';
-    }
-    break;
-    default:
-        GP_ASSERT(!"Not implemented yet");
-        return false;
-    }
-
-    return true;
+    JSONWriter writer(outStr);
+    return writer.writeVariant(*this);
 }
\ No newline at end of file
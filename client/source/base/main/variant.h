@@ -6,6 +6,14 @@
  * Defines Variant data type that can hold arbitrary other types.
  * Compatible with DAVA Framework's VariantType.
  * https://github.com/dava/dava.engine/blob/development/Sources/Internal/FileSystem/VariantType.h
+ *
+ * Archives, lists and blobs are shared between copies of a variant and are cloned
+ * only when one of the copies is modified, so copying large structures is cheap.
+ * Non-const accessors (getArchive, getList, begin, end, operator[]) clone the shared
+ * data first. Since the caller may keep the returned pointer, the data is never shared
+ * after that and the next copies of the variant clone it immediately, so modifications
+ * made through the pointer don't affect the copies. Values read from archives, JSON
+ * and pickle data are filled without such accessors, so their copies share the data.
  */
 
 class VariantType
@@ -94,6 +102,12 @@ public:
      */
     VariantType(const VariantType& other);
 
+    /**
+     * Move constructor. Takes the value from other variant leaving it empty.
+     * Signals are not moved.
+     */
+    VariantType(VariantType&& other) noexcept;
+
     /**
      * Assignment operator.
      */
@@ -244,14 +258,61 @@ public:
      * List and tuples are treated same. Objects instantinations (OBJ, INST, NEWOBJ) are not
      * handled properly. Instead the creation arguments are stored as a list in VariantType.
      *
+     * Protocols up to 5 are supported. Python 3 bytes and bytearray are stored as blobs.
+     *
+     * The rest of the stream is read into memory and parsed with unpickle(const void *, size_t, size_t *),
+     * stream is positioned right after the pickled data.
+     *
      * @return False in case of malformed data.
      */
     bool unpickle(gameplay::Stream * stream);
 
+    /**
+     * Set contents of a variant to a pickled data stored in memory.
+     * All reads are bounds-checked, truncated or malformed data is rejected.
+     *
+     * Dictionary keys are taken directly from the data and unicode strings are decoded
+     * once they are stored into the result. Byte strings and blobs are copied, since
+     * VariantType owns its values and can't reference the source data.
+     *
+     * @param data Pickled data.
+     * @param size Size of data in bytes.
+     * @param[out] outConsumed Number of bytes parsed up to and including STOP opcode, optional.
+     * @return False in case of malformed data.
+     */
+    bool unpickle(const void * data, size_t size, size_t * outConsumed = NULL);
+
     inline bool operator== (const VariantType& other) const;
     inline bool operator!= (const VariantType& other) const;
 
 
+    /**
+     * Defer valueChangedSignal of the variants changed on the current thread until
+     * the matching endDeferredNotifications call. Calls can be nested.
+     *
+     * The values are still changed immediately, only notifications are postponed.
+     * Every changed variant is notified once with its final value. Variants without
+     * connected slots are recorded as well, so isChangePending reports all changes.
+     */
+    static void beginDeferredNotifications();
+
+    /**
+     * End deferring notifications. The outermost call emits valueChangedSignal
+     * for every variant that has been changed since beginDeferredNotifications.
+     */
+    static void endDeferredNotifications();
+
+    /**
+     * Get the id of notification batch being currently emitted or 0 otherwise.
+     * Lets slots connected to several variants to run once per batch.
+     */
+    static unsigned getNotificationBatchId();
+
+    /**
+     * Whether the variant has been changed and its notification is deferred.
+     */
+    bool isChangePending() const { return notificationIndex != 0; };
+
     /**
      * Serialize Variant to JSON.
      * 
@@ -268,6 +329,48 @@ private:
 
     void release();
 
+    // take the value without copying, other is left empty
+    void takeValue(VariantType& other);
+    void adoptValue(VariantType& other);
+
+    // reference counter of the data shared by copies of a variant
+    struct SharedData
+    {
+        SharedData() : refCount(1), leaked(false) {};
+
+        std::atomic<unsigned> refCount;
+        bool leaked;                    // non-const pointer to the data has been returned, it can't be shared anymore
+    };
+
+    template<typename _Type> struct SharedValue : public SharedData
+    {
+        SharedValue() {};
+        explicit SharedValue(_Type&& v) : value(std::move(v)) {};
+
+        _Type value;
+    };
+
+    typedef SharedValue<std::vector<VariantType>> SharedList;
+    typedef SharedValue<std::vector<uint8_t>> SharedBlob;
+    typedef SharedValue<std::unique_ptr<class Archive>> SharedArchive;
+
+    void shareValue(const VariantType& value);
+    inline void detach(bool leak = true);
+
+    // Non-const access for the readers (Archive, JSON) filling a value they own. Shared data
+    // is cloned, but it's not marked as leaked, since the pointer doesn't escape to the caller.
+    inline std::vector<VariantType> * getMutableList();
+    inline class Archive * getMutableArchive();
+    void cloneSharedValue();
+    static SharedData * cloneSharedData(Type dataType, const SharedData * data);
+    void releaseSharedValue();
+
+    inline void notifyChanged();
+    void emitChanged();
+    void cancelPendingNotification();
+
+    static thread_local unsigned deferredNotificationsDepth;
+
     template<class _Type> inline void setInternal(const _Type& value, _Type& field, Type fieldType);
     template<class _Type> inline void setInternalObject(const _Type& value, _Type* field, Type fieldType);
 
@@ -301,9 +404,15 @@ private:
 
         std::string * stringValue;
         std::wstring * wideStringValue;
+
+        SharedData * sharedValue;
     };
 
     Type type;
+    uint32_t notificationIndex = 0;         // 1-based index in the list of deferred notifications, 0 if not pending
+
+    friend class Archive;
+    friend class JSONVariantBuilder;
 };
 
 
@@ -89,7 +89,7 @@ template<class _Type> inline void VariantType::setInternal(const _Type& value, _
         release();
         type = fieldType;
         field = newValue.get<_Type>();
-        valueChangedSignal(*this);
+        notifyChanged();
         return;
     }
     if (type == fieldType && field == value)
@@ -98,7 +98,7 @@ template<class _Type> inline void VariantType::setInternal(const _Type& value, _
     release();
     type = fieldType;
     field = value;
-    valueChangedSignal(*this);
+    notifyChanged();
 }
 
 template<class _Type> inline void VariantType::setInternalObject(const _Type& value, _Type* field, Type fieldType)
@@ -122,7 +122,7 @@ template<class _Type> inline void VariantType::setInternalObject(const _Type& va
         type = fieldType;
         pointerValue = newValue.pointerValue;   // take ownership
         newValue.pointerValue = nullptr;
-        valueChangedSignal(*this);
+        notifyChanged();
         return;
     }
     if (type == fieldType && field && *field == value)
@@ -138,7 +138,7 @@ template<class _Type> inline void VariantType::setInternalObject(const _Type& va
         type = fieldType;
         pointerValue = new _Type(value);
     }
-    valueChangedSignal(*this);
+    notifyChanged();
 }
 
 template<> inline void VariantType::set(const bool& value)
@@ -271,18 +271,13 @@ template<> inline void VariantType::set(const VariantType& value)
         set(*value.wideStringValue);
         return;
     case TYPE_BYTE_ARRAY:
-        {
-            uint32_t dataSize;
-            const uint8_t * dataBuf = value.getBlob(&dataSize);
-            setBlob(dataBuf, dataSize);
-        }
+    case TYPE_KEYED_ARCHIVE:
+    case TYPE_LIST:
+        shareValue(value);
         return;
     case TYPE_UINT32:
         set(value.uint32Value);
         return;
-    case TYPE_KEYED_ARCHIVE:
-        setArchive(reinterpret_cast<const Archive *>(value.pointerValue));
-        return;
     case TYPE_INT64:
         set(value.int64Value);
         return;
@@ -331,13 +326,6 @@ template<> inline void VariantType::set(const VariantType& value)
     case TYPE_UINT16:
         set(value.uint16Value);
         return;
-    case TYPE_LIST:
-        {
-            std::vector<VariantType> * list = reinterpret_cast<std::vector<VariantType> *>(value.pointerValue);
-            GP_ASSERT(list);
-            set(list->begin(), list->end());
-        }
-        return;
     default:
         GP_ASSERT(!"Not implemented yet");
     }
@@ -460,13 +448,21 @@ template<> inline const gameplay::BoundingBox& VariantType::get() const
 inline class Archive * VariantType::getArchive()
 {
     GP_ASSERT(type == TYPE_KEYED_ARCHIVE);
-    return reinterpret_cast<class Archive *>(pointerValue);
+    detach();
+    return static_cast<SharedArchive *>(sharedValue)->value.get();
+}
+
+inline class Archive * VariantType::getMutableArchive()
+{
+    GP_ASSERT(type == TYPE_KEYED_ARCHIVE);
+    detach(false);
+    return static_cast<SharedArchive *>(sharedValue)->value.get();
 }
 
 inline const class Archive * VariantType::getArchive() const
 {
     GP_ASSERT(type == TYPE_KEYED_ARCHIVE);
-    return reinterpret_cast<const class Archive *>(pointerValue);
+    return static_cast<const SharedArchive *>(sharedValue)->value.get();
 }
 
 inline bool VariantType::operator==(const VariantType& value) const
@@ -488,6 +484,9 @@ inline bool VariantType::operator==(const VariantType& value) const
         return *value.wideStringValue == *wideStringValue;
     case TYPE_BYTE_ARRAY:
         {
+            if (sharedValue == value.sharedValue)
+                return true;
+
             uint32_t dataSize, otherDataSize;
             const uint8_t * dataBuf = getBlob(&dataSize);
             const uint8_t * otherDataBuf = value.getBlob(&otherDataSize);
@@ -534,9 +533,12 @@ inline bool VariantType::operator==(const VariantType& value) const
         return value.uint16Value == uint16Value;
     case TYPE_LIST:
         {
-            std::vector<VariantType> * list = reinterpret_cast<std::vector<VariantType> *>(pointerValue);
-            std::vector<VariantType> * otherList = reinterpret_cast<std::vector<VariantType> *>(value.pointerValue);
-            return list->size() == otherList->size() && std::mismatch(list->begin(), list->end(), otherList->begin()).first == list->end();
+            if (sharedValue == value.sharedValue)
+                return true;
+
+            const std::vector<VariantType>& list = static_cast<const SharedList *>(sharedValue)->value;
+            const std::vector<VariantType>& otherList = static_cast<const SharedList *>(value.sharedValue)->value;
+            return list.size() == otherList.size() && std::mismatch(list.begin(), list.end(), otherList.begin()).first == list.end();
         }
     default:
         GP_ASSERT(!"Not implemented yet");
@@ -554,6 +556,13 @@ inline bool VariantType::isEmpty() const
     return type == TYPE_NONE;
 }
 
+inline void VariantType::notifyChanged()
+{
+    // while notifications are deferred every change is recorded, so Settings can report the changed keys
+    if (deferredNotificationsDepth > 0 || !valueChangedSignal.empty())
+        emitChanged();
+}
+
 inline void VariantType::clear()
 {
     release();
@@ -587,83 +596,87 @@ template<typename _InputIterator> inline void VariantType::set(_InputIterator be
             return;
         }
 
-        release();
-        type = TYPE_LIST;
-        pointerValue = newValue.pointerValue;   // take ownership
-        newValue.pointerValue = nullptr;
-        valueChangedSignal(*this);
+        adoptValue(newValue);
+        notifyChanged();
         return;
     }
 
-    std::vector<VariantType> * list = reinterpret_cast<std::vector<VariantType> *>(pointerValue);
-
-    if (type == TYPE_LIST && list->size() == (size_t)std::distance(begin, end)
-        && std::mismatch(list->begin(), list->end(), begin, [&](const VariantType& a, const typename std::iterator_traits<_InputIterator>::value_type& b) { return a == VariantType(b); }).first == list->end())
-        return;
+    if (type == TYPE_LIST)
+    {
+        const std::vector<VariantType>& list = static_cast<SharedList *>(sharedValue)->value;
+        if (list.size() == (size_t)std::distance(begin, end)
+            && std::mismatch(list.begin(), list.end(), begin, [&](const VariantType& a, const typename std::iterator_traits<_InputIterator>::value_type& b) { return a == VariantType(b); }).first == list.end())
+            return;
+    }
 
-    list = new std::vector<VariantType>();
+    SharedList * list = new SharedList();
     for (_InputIterator it = begin; it != end; ++it)
-        list->push_back(VariantType(*it));
+        list->value.push_back(VariantType(*it));
 
     release();
     type = TYPE_LIST;
-    pointerValue = list;
+    sharedValue = list;
+
+    notifyChanged();
+}
+
+inline void VariantType::detach(bool leak)
+{
+    // shared data is cloned before it's modified
+    if (sharedValue && sharedValue->refCount.load(std::memory_order_acquire) > 1)
+        cloneSharedValue();
 
-    valueChangedSignal(*this);
+    // caller may keep the pointer to the data, so it's cloned by the following copies
+    if (sharedValue && leak)
+        sharedValue->leaked = true;
 }
 
 inline std::vector<VariantType>::iterator VariantType::begin()
 {
-    GP_ASSERT(type == TYPE_LIST);
-    std::vector<VariantType> * list = reinterpret_cast<std::vector<VariantType> *>(pointerValue);
-    return list->begin();
+    return getList()->begin();
 }
 
 inline std::vector<VariantType>::iterator VariantType::end()
 {
-    GP_ASSERT(type == TYPE_LIST);
-    std::vector<VariantType> * list = reinterpret_cast<std::vector<VariantType> *>(pointerValue);
-    return list->end();
+    return getList()->end();
 }
 
 inline std::vector<VariantType>::const_iterator VariantType::begin() const
 {
-    GP_ASSERT(type == TYPE_LIST);
-    std::vector<VariantType> * list = reinterpret_cast<std::vector<VariantType> *>(pointerValue);
-    return list->begin();
+    return getList()->begin();
 }
 
 inline std::vector<VariantType>::const_iterator VariantType::end() const
 {
-    GP_ASSERT(type == TYPE_LIST);
-    std::vector<VariantType> * list = reinterpret_cast<std::vector<VariantType> *>(pointerValue);
-    return list->end();
+    return getList()->end();
 }
 
 inline VariantType& VariantType::operator[](unsigned pos)
 {
-    GP_ASSERT(type == TYPE_LIST);
-    std::vector<VariantType> * list = reinterpret_cast<std::vector<VariantType> *>(pointerValue);
-    return (*list)[pos];
+    return (*getList())[pos];
 }
 
 inline const VariantType& VariantType::operator[](unsigned pos) const
 {
-    GP_ASSERT(type == TYPE_LIST);
-    std::vector<VariantType> * list = reinterpret_cast<std::vector<VariantType> *>(pointerValue);
-    return (*list)[pos];
+    return (*getList())[pos];
 }
 
 inline const std::vector<VariantType> * VariantType::getList() const
 {
     GP_ASSERT(type == TYPE_LIST);
-    const std::vector<VariantType> * list = reinterpret_cast<std::vector<VariantType> *>(pointerValue);
-    return list;
+    return &static_cast<const SharedList *>(sharedValue)->value;
 }
 
 inline std::vector<VariantType> * VariantType::getList()
 {
     GP_ASSERT(type == TYPE_LIST);
-    std::vector<VariantType> * list = reinterpret_cast<std::vector<VariantType> *>(pointerValue);
-    return list;
+    detach();
+    return &static_cast<SharedList *>(sharedValue)->value;
+}
+
+inline std::vector<VariantType> * VariantType::getMutableList()
+{
+    GP_ASSERT(type == TYPE_LIST);
+    detach(false);
+    return &static_cast<SharedList *>(sharedValue)->value;
 }
\ No newline at end of file
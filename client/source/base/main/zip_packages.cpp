@@ -1,13 +1,23 @@
 #include "pch.h"
 #include "zip_packages.h"
 #include "zip_stream.h"
+#include "services/service_manager.h"
+#include "services/taskqueue_service.h"
 #include <zip.h>
+#include <zlib.h>
 
 #ifdef __ANDROID__
 #include <android/asset_manager.h>
 extern AAssetManager* __assetManager;
 #endif
 
+#ifndef WIN32
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#endif
+
 
 
 
@@ -213,15 +223,524 @@ static zip* openZipFromAsset(const char* zipFile)
 
 
 
+//
+// PackageFile
+//
+
+/**
+ * Read-only package file supporting positional reads from multiple threads.
+ * The file can optionally be mapped into memory as a whole.
+ */
+class PackageFile : Noncopyable
+{
+public:
+    static PackageFile * open(const char * path);
+    ~PackageFile();
+
+    uint64_t size() const { return _size; };
+
+    /**
+     * Read exactly size bytes at a given offset. Doesn't change any shared file position.
+     */
+    bool read(void * data, size_t size, uint64_t offset) const;
+
+    /**
+     * Map the whole file into memory. Fails when there is not enough address space.
+     */
+    bool map();
+
+    /**
+     * Get mapped file contents or NULL if the file is not mapped.
+     */
+    const uint8_t * getData() const { return _data; };
+
+private:
+    PackageFile() : _data(NULL) {};
+
+#ifdef WIN32
+    HANDLE _handle;
+    HANDLE _mapping;
+#else
+    int _fd;
+#endif
+    uint64_t _size;
+    const uint8_t * _data;
+};
+
+PackageFile * PackageFile::open(const char * path)
+{
+#ifdef WIN32
+    HANDLE handle = CreateFileA(path, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL | FILE_FLAG_RANDOM_ACCESS, NULL);
+    if (handle == INVALID_HANDLE_VALUE)
+        return NULL;
+
+    LARGE_INTEGER size;
+    if (!GetFileSizeEx(handle, &size))
+    {
+        CloseHandle(handle);
+        return NULL;
+    }
+
+    PackageFile * res = new PackageFile();
+    res->_handle = handle;
+    res->_size = static_cast<uint64_t>(size.QuadPart);
+#else
+    int fd = ::open(path, O_RDONLY);
+    if (fd < 0)
+        return NULL;
+
+    struct stat st;
+    if (fstat(fd, &st) != 0)
+    {
+        ::close(fd);
+        return NULL;
+    }
+
+    PackageFile * res = new PackageFile();
+    res->_fd = fd;
+    res->_size = static_cast<uint64_t>(st.st_size);
+#endif
+    return res;
+}
+
+PackageFile::~PackageFile()
+{
+#ifdef WIN32
+    if (_data)
+    {
+        UnmapViewOfFile(_data);
+        CloseHandle(_mapping);
+    }
+    CloseHandle(_handle);
+#else
+    if (_data)
+        munmap(const_cast<uint8_t *>(_data), static_cast<size_t>(_size));
+    ::close(_fd);
+#endif
+}
+
+bool PackageFile::map()
+{
+    if (_data)
+        return true;
+
+    if (_size == 0 || _size > std::numeric_limits<size_t>::max())
+        return false;
+
+#ifdef WIN32
+    _mapping = CreateFileMappingA(_handle, NULL, PAGE_READONLY, 0, 0, NULL);
+    if (!_mapping)
+        return false;
+
+    _data = reinterpret_cast<const uint8_t *>(MapViewOfFile(_mapping, FILE_MAP_READ, 0, 0, 0));
+    if (!_data)
+        CloseHandle(_mapping);
+#else
+    void * data = mmap(NULL, static_cast<size_t>(_size), PROT_READ, MAP_SHARED, _fd, 0);
+    if (data != MAP_FAILED)
+        _data = reinterpret_cast<const uint8_t *>(data);
+#endif
+
+    return _data != NULL;
+}
+
+bool PackageFile::read(void * data, size_t size, uint64_t offset) const
+{
+    if (offset > _size || size > _size - offset)
+        return false;
+
+    if (_data)
+    {
+        memcpy(data, _data + offset, size);
+        return true;
+    }
+
+    uint8_t * out = reinterpret_cast<uint8_t *>(data);
+    while (size > 0)
+    {
+#ifdef WIN32
+        OVERLAPPED overlapped = {};
+        overlapped.Offset = static_cast<DWORD>(offset);
+        overlapped.OffsetHigh = static_cast<DWORD>(offset >> 32);
+
+        DWORD read = 0;
+        if (!ReadFile(_handle, out, static_cast<DWORD>(std::min<size_t>(size, 1 << 30)), &read, &overlapped) || read == 0)
+            return false;
+#else
+        ssize_t read = pread(_fd, out, size, static_cast<off_t>(offset));
+        if (read < 0 && errno == EINTR)
+            continue;
+        if (read <= 0)
+            return false;
+#endif
+        out += read;
+        size -= read;
+        offset += read;
+    }
+
+    return true;
+}
+
+
+
+static uint16_t readLE16(const uint8_t * p)
+{
+    return static_cast<uint16_t>(p[0] | (p[1] << 8));
+}
+
+static uint32_t readLE32(const uint8_t * p)
+{
+    return static_cast<uint32_t>(p[0]) | (static_cast<uint32_t>(p[1]) << 8) | (static_cast<uint32_t>(p[2]) << 16) | (static_cast<uint32_t>(p[3]) << 24);
+}
+
+static uint64_t readLE64(const uint8_t * p)
+{
+    return static_cast<uint64_t>(readLE32(p)) | (static_cast<uint64_t>(readLE32(p + 4)) << 32);
+}
+
+static const uint32_t LOCAL_HEADER_SIGNATURE = 0x04034b50;
+static const uint32_t CENTRAL_HEADER_SIGNATURE = 0x02014b50;
+static const uint32_t END_OF_CENTRAL_DIR_SIGNATURE = 0x06054b50;
+static const uint32_t ZIP64_END_OF_CENTRAL_DIR_SIGNATURE = 0x06064b50;
+static const uint32_t ZIP64_END_OF_CENTRAL_DIR_LOCATOR_SIGNATURE = 0x07064b50;
+
+static const size_t LOCAL_HEADER_SIZE = 30;
+static const size_t CENTRAL_HEADER_SIZE = 46;
+static const size_t END_OF_CENTRAL_DIR_SIZE = 22;
+static const size_t ZIP64_END_OF_CENTRAL_DIR_SIZE = 56;
+static const size_t ZIP64_END_OF_CENTRAL_DIR_LOCATOR_SIZE = 20;
+
+static const size_t INFLATE_CHUNK_SIZE = 64 * 1024;
+
+#define ZIP_PREFETCH_QUEUE "ZipPrefetchQueue"
+static const unsigned MAX_PREFETCH_QUEUES = 4;
+static const size_t DEFAULT_CACHE_SIZE = 32 * 1024 * 1024;
+
+static inline char foldCase(char c)
+{
+    return c >= 'A' && c <= 'Z' ? c + ('a' - 'A') : c;
+}
+
+// FNV-1a over the case-folded name
+static uint64_t hashName(std::string_view name)
+{
+    uint64_t hash = 14695981039346656037ULL;
+    for (char c : name)
+        hash = (hash ^ static_cast<uint8_t>(foldCase(c))) * 1099511628211ULL;
+    return hash;
+}
+
+
+
+
+//
+// EntryCache
+//
+
+/**
+ * LRU cache of decompressed package entries. Shared with the prefetch
+ * work items so that it outlives ZipPackage while they are queued.
+ */
+class EntryCache : Noncopyable
+{
+public:
+    EntryCache(size_t limit)
+        : cancelled(false)
+        , _size(0)
+        , _limit(limit)
+    {
+    }
+
+    /**
+     * Find cached entry. Waits for the entry if it's being loaded.
+     */
+    std::shared_ptr<uint8_t[]> find(uint64_t key);
+
+    /**
+     * Mark entry as being loaded. Returns false if entry is already
+     * cached or loaded or it doesn't fit into the cache.
+     */
+    bool beginLoad(uint64_t key, size_t size);
+
+    /**
+     * Store loaded entry. Pass NULL data if loading failed.
+     */
+    void endLoad(uint64_t key, const std::shared_ptr<uint8_t[]>& data, size_t size);
+
+    void setLimit(size_t limit);
+    void clear();
+
+    // set when the package is closed, queued work items are skipped
+    std::atomic<bool> cancelled;
+
+private:
+    void evict();
+
+    struct Entry
+    {
+        std::shared_ptr<uint8_t[]> data;
+        size_t size;
+        bool ready;
+        std::list<uint64_t>::iterator lru;
+    };
+
+    std::mutex _mutex;
+    std::condition_variable _loaded;
+    std::unordered_map<uint64_t, Entry> _entries;
+    std::list<uint64_t> _lru;
+    size_t _size;
+    size_t _limit;
+};
+
+std::shared_ptr<uint8_t[]> EntryCache::find(uint64_t key)
+{
+    std::unique_lock<std::mutex> lock(_mutex);
+
+    auto it = _entries.find(key);
+    while (it != _entries.end() && !(*it).second.ready)
+    {
+        _loaded.wait(lock);
+        it = _entries.find(key);
+    }
+
+    if (it == _entries.end())
+        return NULL;
+
+    _lru.splice(_lru.begin(), _lru, (*it).second.lru);
+    return (*it).second.data;
+}
+
+bool EntryCache::beginLoad(uint64_t key, size_t size)
+{
+    std::unique_lock<std::mutex> lock(_mutex);
+    if (size > _limit || _entries.find(key) != _entries.end())
+        return false;
+
+    Entry& entry = _entries[key];
+    entry.size = size;
+    entry.ready = false;
+    entry.lru = _lru.end();
+    return true;
+}
+
+void EntryCache::endLoad(uint64_t key, const std::shared_ptr<uint8_t[]>& data, size_t size)
+{
+    {
+        std::unique_lock<std::mutex> lock(_mutex);
+
+        auto it = _entries.find(key);
+        if (it != _entries.end())
+        {
+            if (data)
+            {
+                Entry& entry = (*it).second;
+                entry.data = data;
+                entry.size = size;
+                entry.ready = true;
+                entry.lru = _lru.insert(_lru.begin(), key);
+                _size += size;
+                evict();
+            }
+            else
+            {
+                _entries.erase(it);
+            }
+        }
+    }
+
+    _loaded.notify_all();
+}
+
+void EntryCache::setLimit(size_t limit)
+{
+    std::unique_lock<std::mutex> lock(_mutex);
+    _limit = limit;
+    evict();
+}
+
+void EntryCache::clear()
+{
+    std::unique_lock<std::mutex> lock(_mutex);
+    for (uint64_t key : _lru)
+        _entries.erase(key);
+    _lru.clear();
+    _size = 0;
+}
+
+void EntryCache::evict()
+{
+    while (_size > _limit && !_lru.empty())
+    {
+        auto it = _entries.find(_lru.back());
+        _size -= (*it).second.size;
+        _entries.erase(it);
+        _lru.pop_back();
+    }
+}
+
+
+
+
+/**
+ * Held by the prefetch work item. Ends loading of the entry as failed if the work item
+ * is destroyed without being run, e.g. dropped by the stopped task queue,
+ * so that EntryCache::find doesn't wait for it forever.
+ */
+struct PendingEntry : Noncopyable
+{
+    std::shared_ptr<EntryCache> cache;
+    uint64_t key;
+    bool loaded;
+
+    PendingEntry(const std::shared_ptr<EntryCache>& _cache, uint64_t _key)
+        : cache(_cache)
+        , key(_key)
+        , loaded(false)
+    {
+    }
+
+    ~PendingEntry()
+    {
+        if (!loaded)
+            cache->endLoad(key, NULL, 0);
+    }
+};
+
+
+
+
 //
 // ZipPackage
 //
 
-ZipPackage::ZipPackage(const char* packageName, zip* zipObject)
+ZipPackage::ZipPackage(const char* packageName)
     : _packageName(packageName)
+    , _cache(new EntryCache(DEFAULT_CACHE_SIZE))
+{
+}
+
+ZipPackage::~ZipPackage()
+{
+    _cache->cancelled = true;
+}
+
+bool ZipPackage::readCentralDirectory()
 {
-    _zip.reset(zipObject, zip_close);
+    uint64_t fileSize = _file->size();
+    if (fileSize < END_OF_CENTRAL_DIR_SIZE)
+        return false;
+
+    // end of central directory record is followed by a comment up to 64K long
+    size_t tailSize = static_cast<size_t>(std::min<uint64_t>(fileSize, END_OF_CENTRAL_DIR_SIZE + 0xFFFF + ZIP64_END_OF_CENTRAL_DIR_LOCATOR_SIZE));
+    std::unique_ptr<uint8_t[]> tail(new uint8_t[tailSize]);
+    if (!_file->read(tail.get(), tailSize, fileSize - tailSize))
+        return false;
+
+    size_t eocd = tailSize - END_OF_CENTRAL_DIR_SIZE + 1;
+    while (eocd-- > 0)
+        if (readLE32(tail.get() + eocd) == END_OF_CENTRAL_DIR_SIGNATURE)
+            break;
+    if (eocd == static_cast<size_t>(-1))
+        return false;
+
+    const uint8_t * record = tail.get() + eocd;
+    uint64_t entries = readLE16(record + 10);
+    uint64_t directorySize = readLE32(record + 12);
+    uint64_t directoryOffset = readLE32(record + 16);
+
+    // multi-disk archives are not supported
+    if (readLE16(record + 4) != 0 || readLE16(record + 6) != 0)
+        return false;
+
+    if (entries == 0xFFFF || directorySize == 0xFFFFFFFF || directoryOffset == 0xFFFFFFFF)
+    {
+        if (eocd < ZIP64_END_OF_CENTRAL_DIR_LOCATOR_SIZE)
+            return false;
+
+        const uint8_t * locator = record - ZIP64_END_OF_CENTRAL_DIR_LOCATOR_SIZE;
+        if (readLE32(locator) != ZIP64_END_OF_CENTRAL_DIR_LOCATOR_SIGNATURE)
+            return false;
+
+        uint8_t zip64Record[ZIP64_END_OF_CENTRAL_DIR_SIZE];
+        if (!_file->read(zip64Record, sizeof(zip64Record), readLE64(locator + 8)) || readLE32(zip64Record) != ZIP64_END_OF_CENTRAL_DIR_SIGNATURE)
+            return false;
+
+        entries = readLE64(zip64Record + 32);
+        directorySize = readLE64(zip64Record + 40);
+        directoryOffset = readLE64(zip64Record + 48);
+    }
+
+    if (directoryOffset > fileSize || directorySize > fileSize - directoryOffset || entries > directorySize / CENTRAL_HEADER_SIZE)
+        return false;
+
+    std::unique_ptr<uint8_t[]> directory(new uint8_t[static_cast<size_t>(directorySize)]);
+    if (!_file->read(directory.get(), static_cast<size_t>(directorySize), directoryOffset))
+        return false;
+
+    _index.reserve(static_cast<size_t>(entries));
+    _names.reserve(static_cast<size_t>(directorySize));
+
+    size_t offset = 0;
+    for (uint64_t i = 0; i < entries; i++)
+    {
+        const uint8_t * header = directory.get() + offset;
+        if (offset + CENTRAL_HEADER_SIZE > directorySize || readLE32(header) != CENTRAL_HEADER_SIGNATURE)
+            return false;
+
+        uint16_t nameLength = readLE16(header + 28);
+        uint16_t extraLength = readLE16(header + 30);
+        uint16_t commentLength = readLE16(header + 32);
+        if (offset + CENTRAL_HEADER_SIZE + nameLength + extraLength + commentLength > directorySize)
+            return false;
+
+        FileInfo info;
+        info.index = i;
+        info.encrypted = (readLE16(header + 8) & 1) != 0;
+        info.method = readLE16(header + 10);
+        info.crc = readLE32(header + 16);
+        info.compressedSize = readLE32(header + 20);
+        info.size = readLE32(header + 24);
+        info.localHeaderOffset = readLE32(header + 42);
+
+        // zip64 extended information holds the values that don't fit into 32 bits
+        const char * name = reinterpret_cast<const char *>(header + CENTRAL_HEADER_SIZE);
+        const uint8_t * extra = header + CENTRAL_HEADER_SIZE + nameLength;
+        for (size_t pos = 0; pos + 4 <= extraLength; )
+        {
+            uint16_t id = readLE16(extra + pos);
+            uint16_t size = readLE16(extra + pos + 2);
+            if (pos + 4 + size > extraLength)
+                break;
+
+            if (id == 0x0001)
+            {
+                const uint8_t * field = extra + pos + 4;
+                const uint8_t * end = field + size;
+                if (info.size == 0xFFFFFFFF && field + 8 <= end)
+                    info.size = readLE64(field), field += 8;
+                if (info.compressedSize == 0xFFFFFFFF && field + 8 <= end)
+                    info.compressedSize = readLE64(field), field += 8;
+                if (info.localHeaderOffset == 0xFFFFFFFF && field + 8 <= end)
+                    info.localHeaderOffset = readLE64(field);
+            }
+            pos += 4 + size;
+        }
+
+        offset += CENTRAL_HEADER_SIZE + nameLength + extraLength + commentLength;
+
+        // Skip directory entries (they typically end with '/')
+        if (nameLength == 0 || name[nameLength - 1] == '/')
+            continue;
+
+        addFile(std::string_view(name, nameLength), info);
+    }
 
+    buildIndex();
+    return true;
+}
+
+void ZipPackage::readZipEntries(zip* zipObject)
+{
     zip_int64_t num_entries = zip_get_num_entries(zipObject, 0);
     if (num_entries < 0)
         return;
@@ -241,74 +760,271 @@ ZipPackage::ZipPackage(const char* packageName, zip* zipObject)
         zip_stat_init(&st);
         if (zip_stat_index(zipObject, i, 0, &st) == 0)
         {
-            // Convert filename to lowercase
-            std::string lowerName = name;
-            std::transform(lowerName.begin(), lowerName.end(), lowerName.begin(),
-                [](unsigned char c) { return std::tolower(c); });
+            FileInfo info = {};
+            info.index = st.index;
+            info.size = st.size;
 
             // Store in mapping
-            _files[lowerName] = { st.index, st.size };
+            addFile(name, info);
         }
     }
+
+    buildIndex();
 }
 
-ZipPackage * ZipPackage::create(const char * zipFile)
+ZipPackage * ZipPackage::create(const char * zipFile, bool memoryMapped)
 {
     if (!gameplay::FileSystem::fileExists(zipFile))
         return NULL;
 
-    std::string fullPath;
-    getFullPath(zipFile, fullPath);
+    std::unique_ptr<ZipPackage> res(new ZipPackage(zipFile));
+    getFullPath(zipFile, res->_fullPath);
+
+    res->_file.reset(PackageFile::open(res->_fullPath.c_str()));
+    if (res->_file && memoryMapped && !res->_file->map())
+        GP_WARN("Can't map package %s into memory", res->_fullPath.c_str());
+
+    if (res->_file && res->readCentralDirectory())
+        return res.release();
+
+    // fallback to libzip for the packages we can't read directly
+    res->_file.reset();
+    res->_index.clear();
+    res->_names.clear();
 
     int err = 0;
-    zip * res = zip_open(fullPath.c_str(), 0, &err);
+    zip * zipObject = zip_open(res->_fullPath.c_str(), 0, &err);
 
 #ifdef __ANDROID__
-    if (!res)
-        res = openZipFromAsset(zipFile);
+    if (!zipObject)
+        zipObject = openZipFromAsset(zipFile);
 #endif
 
-    if (!res)
+    if (!zipObject)
     {
-        GP_WARN("Can't open package %s %d", fullPath.c_str(), err);
+        GP_WARN("Can't open package %s %d", res->_fullPath.c_str(), err);
         return NULL;
     }
 
-    return new ZipPackage(zipFile, res);
+    res->_zip.reset(zipObject, zip_close);
+    res->readZipEntries(zipObject);
+    return res.release();
 }
 
-gameplay::Stream * ZipPackage::open(const char * path, size_t streamMode)
+void ZipPackage::addFile(std::string_view name, const FileInfo& info)
 {
-    if (streamMode != gameplay::FileSystem::READ)
-        return NULL;
+    if (_names.size() + name.size() > std::numeric_limits<uint32_t>::max())
+        return;
 
+    IndexEntry entry;
+    entry.nameHash = hashName(name);
+    entry.nameOffset = static_cast<uint32_t>(_names.size());
+    entry.nameLength = static_cast<uint32_t>(name.size());
+    entry.info = info;
+    _index.push_back(entry);
+
+    for (char c : name)
+        _names.push_back(foldCase(c));
+}
+
+void ZipPackage::buildIndex()
+{
+    auto entryName = [this](const IndexEntry& entry) { return std::string_view(_names.data() + entry.nameOffset, entry.nameLength); };
+
+    // stable sort keeps duplicates in the archive order, the last one wins
+    std::stable_sort(_index.begin(), _index.end(), [&entryName](const IndexEntry& a, const IndexEntry& b)
+    {
+        return a.nameHash < b.nameHash || (a.nameHash == b.nameHash && entryName(a) < entryName(b));
+    });
+
+    auto last = std::unique(_index.rbegin(), _index.rend(), [&entryName](const IndexEntry& a, const IndexEntry& b)
+    {
+        return a.nameHash == b.nameHash && entryName(a) == entryName(b);
+    });
+    _index.erase(_index.begin(), last.base());
+    _index.shrink_to_fit();
+}
+
+const ZipPackage::FileInfo * ZipPackage::findFile(std::string_view path) const
+{
+    uint64_t hash = hashName(path);
+    auto it = std::lower_bound(_index.begin(), _index.end(), hash, [](const IndexEntry& entry, uint64_t hash) { return entry.nameHash < hash; });
+
+    for (; it != _index.end() && (*it).nameHash == hash; ++it)
+    {
+        const IndexEntry& entry = *it;
+        if (entry.nameLength != path.size())
+            continue;
+
+        const char * name = _names.data() + entry.nameOffset;
+        size_t i = 0;
+        while (i < path.size() && name[i] == foldCase(path[i]))
+            i++;
+
+        if (i == path.size())
+            return &entry.info;
+    }
+
+    return NULL;
+}
+
+bool ZipPackage::canReadDirectly(const FileInfo& info) const
+{
+    // stored and deflated entries only, huge entries are left to libzip
+    return _file && !info.encrypted && (info.method == ZIP_CM_STORE || info.method == ZIP_CM_DEFLATE)
+        && info.size < (1u << 31) && info.compressedSize < (1u << 31);
+}
+
+bool ZipPackage::getEntryDataOffset(const PackageFile& file, const FileInfo& info, uint64_t* offset)
+{
+    // local header may have different extra field than the central directory
+    uint8_t header[LOCAL_HEADER_SIZE];
+    if (!file.read(header, sizeof(header), info.localHeaderOffset) || readLE32(header) != LOCAL_HEADER_SIGNATURE)
+        return false;
+
+    *offset = info.localHeaderOffset + LOCAL_HEADER_SIZE + readLE16(header + 26) + readLE16(header + 28);
+    return *offset <= file.size() && info.compressedSize <= file.size() - *offset;
+}
+
+bool ZipPackage::readEntry(const PackageFile& file, const FileInfo& info, uint8_t* out)
+{
+    uint64_t offset;
+    if (!getEntryDataOffset(file, info, &offset))
+        return false;
+
+    size_t size = static_cast<size_t>(info.size);
+
+    if (info.method == ZIP_CM_STORE)
+    {
+        if (info.compressedSize != info.size || !file.read(out, size, offset))
+            return false;
+    }
+    else
+    {
+        z_stream strm = {};
+        if (inflateInit2(&strm, -MAX_WBITS) != Z_OK)
+            return false;
+
+        // mapped package is inflated straight from the mapping, otherwise compressed data is read in chunks
+        const uint8_t * mappedData = file.getData();
+        size_t chunkSize = static_cast<size_t>(std::min<uint64_t>(info.compressedSize, mappedData ? info.compressedSize : INFLATE_CHUNK_SIZE));
+        std::unique_ptr<uint8_t[]> chunk(mappedData ? NULL : new uint8_t[std::max<size_t>(chunkSize, 1)]);
+        uint64_t remaining = info.compressedSize;
+
+        strm.next_out = out;
+        strm.avail_out = static_cast<uInt>(size);
+
+        int ret = Z_OK;
+        while (ret == Z_OK)
+        {
+            if (strm.avail_in == 0)
+            {
+                if (remaining == 0)
+                    break;
+
+                size_t read = static_cast<size_t>(std::min<uint64_t>(remaining, chunkSize));
+                if (mappedData)
+                    strm.next_in = const_cast<Bytef *>(mappedData + offset);
+                else if (file.read(chunk.get(), read, offset))
+                    strm.next_in = chunk.get();
+                else
+                    break;
+
+                strm.avail_in = static_cast<uInt>(read);
+                remaining -= read;
+                offset += read;
+            }
+
+            ret = inflate(&strm, Z_NO_FLUSH);
+        }
+
+        (void)inflateEnd(&strm);
+        if (ret != Z_STREAM_END || strm.total_out != info.size)
+            return false;
+    }
+
+    return crc32(0L, out, static_cast<uInt>(size)) == info.crc;
+}
+
+gameplay::Stream * ZipPackage::openWithZip(const FileInfo& info)
+{
     // make sure we access any zip file only from one thread
     std::unique_lock<std::mutex> guard(_zipReadMutex);
 
-    std::string lowerName = gameplay::FileSystem::resolvePath(path);
-    std::transform(lowerName.begin(), lowerName.end(), lowerName.begin(),
-        [](unsigned char c) { return std::tolower(c); });
+    if (!_zip)
+    {
+        int err = 0;
+        zip * zipObject = zip_open(_fullPath.c_str(), ZIP_RDONLY, &err);
+        if (!zipObject)
+        {
+            GP_WARN("Can't open package %s %d", _fullPath.c_str(), err);
+            return NULL;
+        }
 
-    auto it = _files.find(lowerName);
-    if (it == _files.end())
-        return NULL;
+        _zip.reset(zipObject, zip_close);
+        if (!_password.empty())
+            zip_set_default_password(zipObject, _password.c_str());
+    }
 
     //Read the compressed file
-    zip_file* f = zip_fopen_index(_zip.get(), (*it).second.index, ZIP_FL_ENC_RAW);
+    zip_file* f = zip_fopen_index(_zip.get(), info.index, ZIP_FL_ENC_RAW);
     if (!f)
         return NULL;
 
     //Alloc memory for its uncompressed contents
-    std::unique_ptr<uint8_t[]> fileContent(new uint8_t[(*it).second.size]);
+    std::unique_ptr<uint8_t[]> fileContent(new uint8_t[info.size]);
 
-    if (zip_fread(f, fileContent.get(), (*it).second.size) != (*it).second.size)
+    if (zip_fread(f, fileContent.get(), info.size) != info.size)
     {
         zip_fclose(f);
         return NULL;
     }
 
     zip_fclose(f);
-    return MemoryStream::create(fileContent, static_cast<size_t>((*it).second.size));
+    return MemoryStream::create(fileContent, static_cast<size_t>(info.size));
+}
+
+gameplay::Stream * ZipPackage::open(const char * path, size_t streamMode)
+{
+    if (streamMode != gameplay::FileSystem::READ)
+        return NULL;
+
+    const FileInfo * found = findFile(gameplay::FileSystem::resolvePath(path));
+    if (!found)
+        return NULL;
+
+    const FileInfo& info = *found;
+    if (!canReadDirectly(info))
+        return openWithZip(info);
+
+    // prefetched entry, it's shared with the cache
+    std::shared_ptr<uint8_t[]> cached = _cache->find(info.index);
+    if (cached)
+        return MemoryStream::create(cached.get(), static_cast<size_t>(info.size), cached);
+
+    // stored entries of the mapped package are returned without copying,
+    // the stream keeps the mapping alive even if the package gets closed
+    if (info.method == ZIP_CM_STORE && _file->getData())
+    {
+        uint64_t offset;
+        if (info.compressedSize != info.size || !getEntryDataOffset(*_file, info, &offset))
+        {
+            GP_WARN("Can't read %s from package %s", path, _packageName.c_str());
+            return NULL;
+        }
+
+        return MemoryStream::create(_file->getData() + offset, static_cast<size_t>(info.size), _file);
+    }
+
+    // the file index is never changed after the package is created, so no locking is needed
+    std::unique_ptr<uint8_t[]> fileContent(new uint8_t[std::max<size_t>(static_cast<size_t>(info.size), 1)]);
+    if (!readEntry(*_file, info, fileContent.get()))
+    {
+        GP_WARN("Can't read %s from package %s", path, _packageName.c_str());
+        return NULL;
+    }
+
+    return MemoryStream::create(fileContent, static_cast<size_t>(info.size));
 }
 
 bool ZipPackage::fileExists(const char* path)
@@ -317,16 +1033,75 @@ bool ZipPackage::fileExists(const char* path)
     if (!filename || *filename == 0 || filename[strlen(filename) - 1] == '/')   // ignore empty string, for a directory lookup method always returns false
         return false;
 
-    std::string lowerName = path;
-    std::transform(lowerName.begin(), lowerName.end(), lowerName.begin(),
-        [](unsigned char c) { return std::tolower(c); });
+    return findFile(filename) != NULL;
+}
+
+void ZipPackage::prefetch(const std::vector<std::string>& paths)
+{
+    TaskQueueService * taskQueueService = ServiceManager::getInstance()->findService<TaskQueueService>();
+    bool async = taskQueueService && taskQueueService->getState() == Service::RUNNING;
+
+    unsigned queues = std::max(1u, std::min(MAX_PREFETCH_QUEUES, std::thread::hardware_concurrency() - 1));
+    unsigned queueIndex = 0;
+
+    for (const std::string& path : paths)
+    {
+        const FileInfo * found = findFile(gameplay::FileSystem::resolvePath(path.c_str()));
+
+        // stored entries of the mapped package are never copied
+        if (!found || !canReadDirectly(*found) || (found->method == ZIP_CM_STORE && _file->getData()))
+            continue;
+
+        const FileInfo info = *found;
+        if (!_cache->beginLoad(info.index, static_cast<size_t>(info.size)))
+            continue;
+
+        std::shared_ptr<PackageFile> file = _file;
+        std::shared_ptr<PendingEntry> pending = std::make_shared<PendingEntry>(_cache, info.index);
+        auto workItem = [file, pending, info]()
+        {
+            std::shared_ptr<uint8_t[]> data;
+            if (!pending->cache->cancelled)
+            {
+                data.reset(new uint8_t[std::max<size_t>(static_cast<size_t>(info.size), 1)]);
+                if (!readEntry(*file, info, data.get()))
+                    data.reset();
+            }
+
+            pending->cache->endLoad(info.index, data, static_cast<size_t>(info.size));
+            pending->loaded = true;
+        };
+
+        if (!async)
+        {
+            workItem();
+            continue;
+        }
+
+        std::string queue = fmt::format("{}{}", ZIP_PREFETCH_QUEUE, queueIndex);
+        queueIndex = (queueIndex + 1) % queues;
 
-    return _files.find(lowerName) != _files.end();
+        taskQueueService->createQueue(queue.c_str());
+        taskQueueService->addWorkItem(queue.c_str(), workItem);
+    }
+}
+
+void ZipPackage::setCacheSize(size_t size)
+{
+    _cache->setLimit(size);
+}
+
+void ZipPackage::clearCache()
+{
+    _cache->clear();
 }
 
 void ZipPackage::setPassword(const char * password)
 {
-    zip_set_default_password(_zip.get(), password);
+    std::unique_lock<std::mutex> guard(_zipReadMutex);
+    _password = password ? password : "";
+    if (_zip)
+        zip_set_default_password(_zip.get(), password);
 }
 
 
@@ -350,7 +1125,7 @@ void ZipPackagesCache::finalize()
     __finilized = true;
 }
 
-ZipPackage * ZipPackagesCache::findOrOpenPackage(const char * packageName)
+ZipPackage * ZipPackagesCache::findOrOpenPackage(const char * packageName, bool memoryMapped)
 {
     if (__finilized || packageName == NULL || *packageName == '\0')
         return NULL;
@@ -359,7 +1134,7 @@ ZipPackage * ZipPackagesCache::findOrOpenPackage(const char * packageName)
     if (package != __packages.end())
         return (*package).second.get();
 
-    ZipPackage * res = ZipPackage::create(packageName);
+    ZipPackage * res = ZipPackage::create(packageName, memoryMapped);
     if (!res)
         return NULL;
 
@@ -1,17 +1,44 @@
 #pragma once
 
 #include <zip.h>
+#include <string_view>
 
 
 
 
 /** An extension to gameplay::FileSystem helping
  *  to stream resources from zip packages
+ *
+ *  The central directory is parsed once when the package is opened. Stored
+ *  and deflated entries are then read with positional reads and inflated on
+ *  the calling thread, so several threads can read the package in parallel.
+ *  Encrypted entries and packages that can't be read this way (e.g. Android
+ *  assets) go through libzip, one thread at a time.
+ *
+ *  File names are looked up case-insensitively in a sorted array of name
+ *  hashes built from the central directory, without any allocations.
+ *
+ *  Entries can be prefetched on worker threads into the LRU cache of
+ *  decompressed entries, open() then returns them without reading the package.
+ *
+ *  Memory-mapped package returns stored (uncompressed) entries as read-only
+ *  MemoryStream views over the mapping and inflates compressed entries
+ *  directly from it. Such views share the OS page cache and stay valid even
+ *  after the package is closed. Stored entries are not checksummed in this mode.
  */
 class ZipPackage : public gameplay::Package, Noncopyable
 {
 public:
-    static ZipPackage* create(const char* zipFile);
+    virtual ~ZipPackage();
+
+    /**
+     * Open zip package.
+     *
+     * @param zipFile Path to the package.
+     * @param memoryMapped Map the whole package into memory. Falls back to regular reads if mapping fails.
+     * @return Newly created package or NULL if package can't be opened.
+     */
+    static ZipPackage* create(const char* zipFile, bool memoryMapped = false);
 
     virtual gameplay::Stream* open(const char* path, size_t streamMode = gameplay::FileSystem::READ) override;
 
@@ -31,19 +58,76 @@ public:
      */
     void setPassword(const char* password);
 
+    /**
+     * Decompress files on worker threads and keep them in the cache.
+     * Opening a file that is still being prefetched waits for it.
+     *
+     * Missing files, encrypted files and stored files of memory-mapped
+     * package are ignored.
+     *
+     * @param paths Paths to the files in the package.
+     */
+    void prefetch(const std::vector<std::string>& paths);
+
+    /**
+     * Set the maximum size of decompressed entries kept in the cache.
+     * Least recently used entries are evicted first. Default is 32MB.
+     *
+     * @param size Size in bytes.
+     */
+    void setCacheSize(size_t size);
+
+    /**
+     * Remove all prefetched entries from the cache.
+     */
+    void clearCache();
+
 protected:
-    ZipPackage(const char* packageName, zip* zipObject);
+    ZipPackage(const char* packageName);
 
 private:
-    std::string _packageName;
-    std::shared_ptr<struct zip> _zip;
-
     struct FileInfo 
     {
         zip_uint64_t index;
         zip_uint64_t size;
+        zip_uint64_t compressedSize;
+        zip_uint64_t localHeaderOffset;
+        uint32_t crc;
+        uint16_t method;
+        bool encrypted;
+    };
+
+    struct IndexEntry
+    {
+        uint64_t nameHash;
+        uint32_t nameOffset;
+        uint32_t nameLength;
+        FileInfo info;
     };
-    std::unordered_map<std::string, FileInfo> _files;
+
+    bool readCentralDirectory();
+    void readZipEntries(zip* zipObject);
+    void addFile(std::string_view name, const FileInfo& info);
+    void buildIndex();
+    const FileInfo* findFile(std::string_view path) const;
+    bool canReadDirectly(const FileInfo& info) const;
+    static bool getEntryDataOffset(const class PackageFile& file, const FileInfo& info, uint64_t* offset);
+    static bool readEntry(const class PackageFile& file, const FileInfo& info, uint8_t* out);
+    gameplay::Stream* openWithZip(const FileInfo& info);
+
+    std::string _packageName;
+    std::string _fullPath;
+    std::shared_ptr<class PackageFile> _file;
+
+    // libzip is only used for the entries that can't be read directly, opened on demand
+    std::shared_ptr<struct zip> _zip;
+    std::string _password;
+
+    std::shared_ptr<class EntryCache> _cache;
+
+    // sorted by name hash, names are stored case-folded in a single string
+    std::vector<IndexEntry> _index;
+    std::string _names;
     std::mutex _zipReadMutex;
 };
 
@@ -55,7 +139,13 @@ private:
 class ZipPackagesCache : Noncopyable
 {
 public:
-    static ZipPackage* findOrOpenPackage(const char * packageName);
+    /**
+     * Find already opened package or open a new one.
+     *
+     * @param packageName Path to the package.
+     * @param memoryMapped Map the package into memory, used only when the package is opened.
+     */
+    static ZipPackage* findOrOpenPackage(const char * packageName, bool memoryMapped = false);
     static void closePackage(const char * packageName);
 
     /**
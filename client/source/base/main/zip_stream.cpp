@@ -6,8 +6,36 @@
 
 
 
+// size of the ring buffer with decompressed data
+static const size_t BUFFER_SIZE = 64 * 1024;
+
+// size of the chunk of compressed data read from the source stream
+static const size_t INPUT_CHUNK_SIZE = 16 * 1024;
+
+// every checkpoint holds inflate state with 32K window, interval is doubled when the limit is reached
+static const size_t MAX_CHECKPOINTS = 8;
+static const size_t INITIAL_CHECKPOINT_INTERVAL = 1024 * 1024;
+
+
+
+
 ZipStream::ZipStream()
+    : _initialized(false)
+    , _sourceData(NULL)
+    , _sourceSize(0)
+    , _sourceStream(NULL)
+    , _ownsSourceStream(false)
+    , _sourceStart(0)
+    , _sourceOffset(0)
+    , _finished(false)
+    , _bufferStart(0)
+    , _decompressed(0)
+    , _position(0)
+    , _length(0)
+    , _lengthKnown(false)
+    , _checkpointInterval(INITIAL_CHECKPOINT_INTERVAL)
 {
+    memset(&_zstream, 0, sizeof(_zstream));
 }
 
 ZipStream::~ZipStream()
@@ -31,118 +59,415 @@ gameplay::Stream * ZipStream::create(const char * packageName, const char * file
     return res;
 }
 
-ZipStream * ZipStream::create(gameplay::Stream * compressedStream)
+ZipStream * ZipStream::create(gameplay::Stream * compressedStream, size_t uncompressedSize)
 {
-    // TODO: it not very efficient at the moment since stream is fully read and decompressed in memory
-    // it would be more efficient to decompress by chunks on demand
-
     if (!compressedStream)
         return NULL;
 
-    size_t compressedLength = compressedStream->length() - compressedStream->position();
-    std::unique_ptr<uint8_t[]> compressedData(new uint8_t[compressedLength]);
+    long int position = compressedStream->position();
+    size_t length = compressedStream->length();
+    if (position < 0 || length < static_cast<size_t>(position))
+        return NULL;
 
+    size_t compressedLength = length - position;
+    std::unique_ptr<uint8_t[]> compressedData(new uint8_t[compressedLength]);
     if (compressedStream->read(compressedData.get(), 1, compressedLength) != compressedLength)
         return NULL;
 
-    return ZipStream::create(compressedData.get(), compressedLength);
+    return create(std::move(compressedData), compressedLength, uncompressedSize);
 }
 
-ZipStream * ZipStream::create(const void * buffer, size_t bufferSize)
+ZipStream * ZipStream::createStreaming(gameplay::Stream * compressedStream, bool takeOwnership, size_t uncompressedSize)
 {
-    z_stream strm =
-    {
-        (unsigned char*)(buffer),
-        static_cast<uInt>(bufferSize)
-    };
+    if (!compressedStream)
+        return NULL;
 
-    int ret = inflateInit(&strm);
+    ZipStream * res = new ZipStream();
+    res->_sourceStream = compressedStream;
+    res->_ownsSourceStream = takeOwnership;
+    res->_sourceStart = compressedStream->position();
+    res->_inputBuffer.reset(new uint8_t[INPUT_CHUNK_SIZE]);
 
-    if (ret != Z_OK)
+    if (!res->init(uncompressedSize))
     {
-        GP_WARN("Can't decompress the stream.");
+        delete res;
         return NULL;
     }
 
-    const int chunk = 1 * 1024 * 1024;
-    std::unique_ptr<uint8_t[]> out(new uint8_t[chunk]);
+    return res;
+}
 
+ZipStream * ZipStream::create(const void * buffer, size_t bufferSize, size_t uncompressedSize)
+{
+    if (!buffer && bufferSize > 0)
+        return NULL;
+
+    std::unique_ptr<uint8_t[]> compressedData(new uint8_t[bufferSize]);
+    memcpy(compressedData.get(), buffer, bufferSize);
+    return create(std::move(compressedData), bufferSize, uncompressedSize);
+}
+
+ZipStream * ZipStream::create(std::unique_ptr<uint8_t[]>&& compressedData, size_t compressedSize, size_t uncompressedSize)
+{
     ZipStream * res = new ZipStream();
-    res->_underlyingStream.reset(MemoryStream::create());
+    res->_ownedSourceData = std::move(compressedData);
+    res->_sourceData = res->_ownedSourceData.get();
+    res->_sourceSize = compressedSize;
 
-    do
+    if (!res->init(uncompressedSize))
     {
-        strm.avail_out = chunk;
-        strm.next_out = out.get();
-        ret = inflate(&strm, Z_NO_FLUSH);
+        delete res;
+        return NULL;
+    }
 
-        assert(ret != Z_STREAM_ERROR);
-        switch (ret)
+    return res;
+}
+
+bool ZipStream::init(size_t uncompressedSize)
+{
+    if (inflateInit(&_zstream) != Z_OK)
+    {
+        GP_WARN("Can't decompress the stream.");
+        return false;
+    }
+
+    if (uncompressedSize != UNKNOWN_LENGTH)
+    {
+        _length = uncompressedSize;
+        _lengthKnown = true;
+    }
+
+    _buffer.reset(new uint8_t[BUFFER_SIZE]);
+    _initialized = true;
+    return true;
+}
+
+void ZipStream::close()
+{
+    if (_initialized)
+        (void)inflateEnd(&_zstream);
+    _initialized = false;
+
+    for (auto& checkpoint : _checkpoints)
+        (void)inflateEnd(&checkpoint->state);
+    _checkpoints.clear();
+
+    _buffer.reset();
+    _inputBuffer.reset();
+    _ownedSourceData.reset();
+    _sourceData = NULL;
+
+    if (_ownsSourceStream)
+        SAFE_DELETE(_sourceStream);
+    _sourceStream = NULL;
+}
+
+bool ZipStream::refillInput()
+{
+    if (_sourceStream)
+    {
+        size_t read = _sourceStream->read(_inputBuffer.get(), 1, INPUT_CHUNK_SIZE);
+        if (read == 0)
+            return false;
+
+        _zstream.next_in = _inputBuffer.get();
+        _zstream.avail_in = static_cast<uInt>(read);
+        _sourceOffset += read;
+        return true;
+    }
+
+    if (_sourceOffset >= _sourceSize)
+        return false;
+
+    // avail_in is 32bit, feed large buffers by parts
+    size_t size = std::min<size_t>(_sourceSize - _sourceOffset, 1 << 30);
+    _zstream.next_in = const_cast<Bytef *>(_sourceData + _sourceOffset);
+    _zstream.avail_in = static_cast<uInt>(size);
+    _sourceOffset += size;
+    return true;
+}
+
+size_t ZipStream::inflateTo(uint8_t * out, size_t size)
+{
+    if (_finished)
+        return 0;
+
+    _zstream.next_out = out;
+    _zstream.avail_out = static_cast<uInt>(std::min<size_t>(size, 1 << 30));
+    uInt requested = _zstream.avail_out;
+
+    while (_zstream.avail_out > 0)
+    {
+        if (_zstream.avail_in == 0 && !refillInput())
         {
-        case Z_NEED_DICT:
-            ret = Z_DATA_ERROR;
-        case Z_DATA_ERROR:
-        case Z_MEM_ERROR:
-            (void)inflateEnd(&strm);
+            GP_WARN("Compressed stream is truncated.");
+            break;
         }
 
-        int have = chunk - strm.avail_out;
+        int ret = inflate(&_zstream, Z_NO_FLUSH);
+        if (ret == Z_STREAM_END)
+        {
+            _finished = true;
+            break;
+        }
 
-        if (res->_underlyingStream->write(out.get(), 1, have) != have)
-            GP_WARN("Can't write decompressed data.");
+        if (ret != Z_OK && ret != Z_BUF_ERROR)
+        {
+            GP_WARN("Error while decompressing the stream: %d.", ret);
+            break;
+        }
+    }
 
-    } while (strm.avail_out == 0);
+    size_t produced = requested - _zstream.avail_out;
+    _decompressed += produced;
 
-    (void)inflateEnd(&strm);
+    if (_finished)
+    {
+        _length = _decompressed;
+        _lengthKnown = true;
+    }
 
-    if (ret != Z_STREAM_END && ret != Z_OK)
-        ;// GP_WARN("Error while decompressing the stream.");
+    addCheckpoint();
+    return produced;
+}
 
-    res->_underlyingStream->seek(0, SEEK_SET);
-    return res;
+void ZipStream::addCheckpoint()
+{
+    size_t lastOffset = _checkpoints.empty() ? 0 : _checkpoints.back()->outputOffset;
+    if (_finished || _decompressed < lastOffset + _checkpointInterval)
+        return;
+
+    // a stream without seeking can't restart from the checkpoint's input offset
+    if (_sourceStream && !_sourceStream->canSeek())
+        return;
+
+    if (_checkpoints.size() >= MAX_CHECKPOINTS)
+    {
+        // keep every second checkpoint
+        for (size_t i = 0; i < _checkpoints.size(); i++)
+        {
+            if (i % 2 == 0)
+                (void)inflateEnd(&_checkpoints[i]->state);
+            else
+                _checkpoints[i / 2] = std::move(_checkpoints[i]);
+        }
+        _checkpoints.resize(_checkpoints.size() / 2);
+        _checkpointInterval *= 2;
+        return;
+    }
+
+    std::unique_ptr<Checkpoint> checkpoint(new Checkpoint());
+    if (inflateCopy(&checkpoint->state, &_zstream) != Z_OK)
+        return;
+
+    checkpoint->inputOffset = _sourceOffset - _zstream.avail_in;
+    checkpoint->outputOffset = _decompressed;
+    _checkpoints.push_back(std::move(checkpoint));
 }
 
-void ZipStream::close()
+bool ZipStream::restart(const Checkpoint * checkpoint)
+{
+    if (checkpoint)
+    {
+        (void)inflateEnd(&_zstream);
+        if (inflateCopy(&_zstream, const_cast<z_streamp>(&checkpoint->state)) != Z_OK)
+        {
+            _initialized = false;
+            return false;
+        }
+    }
+    else if (inflateReset(&_zstream) != Z_OK)
+    {
+        return false;
+    }
+
+    _sourceOffset = checkpoint ? checkpoint->inputOffset : 0;
+    _zstream.next_in = NULL;
+    _zstream.avail_in = 0;
+    if (_sourceStream && !_sourceStream->seek(_sourceStart + static_cast<long int>(_sourceOffset), SEEK_SET))
+        return false;
+
+    _decompressed = checkpoint ? checkpoint->outputOffset : 0;
+    _bufferStart = _decompressed;
+    _finished = false;
+    return true;
+}
+
+bool ZipStream::fill()
+{
+    // decompress the next chunk over the oldest data in the ring buffer
+    size_t index = _decompressed % BUFFER_SIZE;
+    size_t produced = inflateTo(_buffer.get() + index, BUFFER_SIZE - index);
+    if (_decompressed > BUFFER_SIZE)
+        _bufferStart = std::max(_bufferStart, _decompressed - BUFFER_SIZE);
+    return produced > 0;
+}
+
+bool ZipStream::moveTo(size_t position)
 {
-    _underlyingStream.reset();
+    if (position < _bufferStart)
+    {
+        // decompress again starting from the closest checkpoint before the position
+        const Checkpoint * checkpoint = NULL;
+        for (auto& it : _checkpoints)
+            if (it->outputOffset <= position)
+                checkpoint = it.get();
+
+        if (!restart(checkpoint))
+            return false;
+    }
+
+    while (_decompressed < position)
+        if (!fill())
+            return false;
+
+    return true;
+}
+
+const uint8_t * ZipStream::peek(size_t * outSize)
+{
+    if (!_initialized || !moveTo(_position))
+        return NULL;
+
+    if (_position == _decompressed && !fill())
+        return NULL;
+
+    size_t index = _position % BUFFER_SIZE;
+    *outSize = std::min(_decompressed - _position, BUFFER_SIZE - index);
+    return _buffer.get() + index;
 }
 
 size_t ZipStream::read(void* ptr, size_t size, size_t count)
 {
-    if (!_underlyingStream)
+    if (!_initialized || size == 0)
         return 0;
 
-    return _underlyingStream->read(ptr, size, count);
+    uint8_t * out = reinterpret_cast<uint8_t *>(ptr);
+    size_t total = size * count;
+    size_t read = 0;
+    while (read < total)
+    {
+        if (_position == _decompressed && total - read >= BUFFER_SIZE)
+        {
+            // large reads are decompressed directly to the destination, the ring buffer is left empty
+            size_t produced = inflateTo(out + read, total - read);
+            _position = _bufferStart = _decompressed;
+            read += produced;
+            if (produced == 0)
+                break;
+            continue;
+        }
+
+        size_t available;
+        const uint8_t * data = peek(&available);
+        if (!data)
+            break;
+
+        size_t bytes = std::min(available, total - read);
+        memcpy(out + read, data, bytes);
+        _position += bytes;
+        read += bytes;
+    }
+
+    return read / size;
 }
 
 char* ZipStream::readLine(char* str, int num)
 {
-    if (!_underlyingStream)
-        return nullptr;
+    if (num <= 0)
+        return NULL;
+
+    size_t length = 0;
+    size_t maxLength = static_cast<size_t>(num - 1);
+    while (length < maxLength)
+    {
+        size_t available;
+        const uint8_t * data = peek(&available);
+        if (!data)
+            break;
+
+        available = std::min(available, maxLength - length);
+
+        // line break character is included in the string
+        size_t bytes = 0;
+        bool lineEnd = false;
+        while (bytes < available && !lineEnd)
+        {
+            lineEnd = data[bytes] == '\n' || data[bytes] == '\r';
+            bytes++;
+        }
+
+        memcpy(str + length, data, bytes);
+        _position += bytes;
+        length += bytes;
+        if (lineEnd)
+            break;
+    }
+
+    if (length == 0)
+        return NULL;
 
-    return _underlyingStream->readLine(str, num);
+    str[length] = '\0';
+    return str;
 }
 
 size_t ZipStream::write(const void* ptr, size_t size, size_t count)
 {
-    if (!_underlyingStream)
-        return 0;
+    return 0;
+}
 
-    return _underlyingStream->write(ptr, size, count);
+size_t ZipStream::length() const
+{
+    if (!_lengthKnown && _initialized && canSeek())
+    {
+        // decompress up to the end, the read position is restored lazily on the next read
+        ZipStream * self = const_cast<ZipStream *>(this);
+        while (self->fill())
+            ;
+
+        // the stream is corrupted or truncated, it ends where decompression has failed
+        self->_length = _decompressed;
+        self->_lengthKnown = true;
+    }
+
+    return _length;
 }
 
 bool ZipStream::seek(long int offset, int origin)
 {
-    if (!_underlyingStream)
+    if (!_initialized)
         return false;
 
-    return _underlyingStream->seek(offset, origin);
+    long int position;
+    switch (origin)
+    {
+    case SEEK_SET:
+        position = offset;
+        break;
+    case SEEK_CUR:
+        position = static_cast<long int>(_position) + offset;
+        break;
+    case SEEK_END:
+        if (!_lengthKnown && !canSeek())
+            return false;
+        position = static_cast<long int>(length()) + offset;
+        break;
+    default:
+        return false;
+    }
+
+    if (position < 0 || static_cast<size_t>(position) < _bufferStart && !canSeek())
+        return false;
+
+    // forward seek within the known length is lazy, the data is decompressed on the next read
+    if (_lengthKnown ? static_cast<size_t>(position) > _length : !moveTo(static_cast<size_t>(position)))
+        return false;
+
+    _position = static_cast<size_t>(position);
+    return true;
 }
 
 bool ZipStream::rewind()
 {
-    if (!_underlyingStream)
-        return false;
-
-    return _underlyingStream->rewind();
-}
\ No newline at end of file
+    return seek(0, SEEK_SET);
+}
@@ -4,6 +4,7 @@
 #define __ZIP_STREAM_H__
 
 #include "memory_stream.h"
+#include <zlib.h>
 
 
 
@@ -12,10 +13,21 @@
  * ZipStream is an extension to gameplay::Stream to stream
  * data from zip packages. Uses ZipPackagesCache.
  * It can be also used to read from other zlib compressed streams.
+ *
+ * Data is inflated on demand as it's read, only a small ring buffer of the
+ * recently decompressed data is kept in memory. Seeking forward decompresses
+ * and skips the data. Seeking backward within the ring buffer is free, otherwise
+ * decompression is restarted from the nearest checkpoint (a saved inflate state
+ * taken periodically while decompressing) or from the beginning of the stream.
  */
 class ZipStream : public gameplay::Stream
 {
 public:
+    /**
+     * Passed to create() when the size of decompressed data is not known.
+     */
+    static const size_t UNKNOWN_LENGTH = static_cast<size_t>(-1);
+
     virtual ~ZipStream();
 
     /**
@@ -31,40 +43,60 @@ public:
     /**
      * Creates ZipStream from another zlib compressed stream.
      *
+     * The rest of the compressed stream is read into memory right away, so it can be
+     * closed after the call. Data is still decompressed on demand as it's read.
+     *
+     * @param stream Stream compressed with zlib.
+     * @param uncompressedSize Size of decompressed data, usually taken from the container's metadata.
+     * @return Newly created ZipStream.
+     */
+    static ZipStream * create(gameplay::Stream * compressedStream, size_t uncompressedSize = UNKNOWN_LENGTH);
+
+    /**
+     * Creates ZipStream reading another zlib compressed stream on demand.
+     *
+     * Compressed data is read from the current position of the stream as it's needed,
+     * so unless the ownership is taken, the stream must stay alive until ZipStream is closed.
+     * Backward seeking requires the compressed stream to be seekable.
+     *
      * @param stream Stream compressed with zlib.
+     * @param takeOwnership Whether ZipStream deletes compressed stream when closed.
+     * @param uncompressedSize Size of decompressed data, usually taken from the container's metadata.
      * @return Newly created ZipStream.
      */
-    static ZipStream * create(gameplay::Stream * compressedStream);
+    static ZipStream * createStreaming(gameplay::Stream * compressedStream, bool takeOwnership, size_t uncompressedSize = UNKNOWN_LENGTH);
 
     /**
      * Creates ZipStream from another compressed buffer in memory.
+     * Compressed data is copied, so the buffer can be freed right after the call.
      *
      * @param buffer Buffer used to read compressed data from.
      * @param bufferSize Size of the buffer.
+     * @param uncompressedSize Size of decompressed data, usually taken from the container's metadata.
      * @return Newly created ZipStream.
      */
-    static ZipStream * create(const void * buffer, size_t bufferSize);
+    static ZipStream * create(const void * buffer, size_t bufferSize, size_t uncompressedSize = UNKNOWN_LENGTH);
 
     /**
      * Returns true if this stream can perform read operations.
      *
      * @return True if the stream can read, false otherwise.
      */
-    virtual bool canRead() const { return _underlyingStream && _underlyingStream->canRead(); };
+    virtual bool canRead() const { return _initialized; };
 
     /**
      * Returns true if this stream can perform write operations.
      *
      * @return True if the stream can write, false otherwise.
      */
-    virtual bool canWrite() const { return _underlyingStream && _underlyingStream->canWrite(); };
+    virtual bool canWrite() const { return false; };
 
     /**
      * Returns true if this stream can seek.
      *
      * @return True if the stream can seek, false otherwise.
      */
-    virtual bool canSeek() const { return _underlyingStream && _underlyingStream->canSeek(); };
+    virtual bool canSeek() const { return _initialized && (!_sourceStream || _sourceStream->canSeek()); };
 
     /**
      * Closes this stream.
@@ -131,25 +163,26 @@ public:
      *
      * @return True if end of stream reached, false otherwise.
      */
-    virtual bool eof() const { return !_underlyingStream || _underlyingStream->eof(); };
+    virtual bool eof() const { return !_initialized || _lengthKnown && _position >= _length; };
 
     /**
      * Returns the length of the stream in bytes.
      *
-     * Zero is returned if the length of the stream is unknown and/or it cannot be seeked.
-     *
-     * Example: The length of a network stream is unknown and cannot be seeked.
+     * Uncompressed length is not stored in zlib stream. When it's not given to create(),
+     * the first call decompresses the whole stream to find it out. Zero is returned
+     * if the length is unknown and the compressed stream can't seek, since the data
+     * can't be decompressed again after the scan.
      *
      * @return The length of the stream in bytes.
      */
-    virtual size_t length() const { return _underlyingStream ? _underlyingStream->length() : 0; };
+    virtual size_t length() const;
 
     /**
      * Returns the position of the file pointer. Zero is the start of the stream.
      *
      * @return The file indicator offset in bytes.
      */
-    virtual long int position() const { return _underlyingStream ? _underlyingStream->position() : 0; };
+    virtual long int position() const { return static_cast<long int>(_position); };
 
     /**
      * Sets the position of the file pointer.
@@ -180,17 +213,53 @@ public:
      */
     virtual bool rewind();
 
-    /**
-     * Get underlying memory buffer.
-     */
-    const uint8_t * getBuffer() const { return _underlyingStream ? _underlyingStream->getBuffer() : nullptr; };
-
 protected:
     ZipStream();
 
 private:
-    std::unique_ptr<MemoryStream> _underlyingStream;
-    static std::mutex _zipReadMutex;
+    struct Checkpoint
+    {
+        z_stream state;
+        size_t inputOffset;
+        size_t outputOffset;
+    };
+
+    static ZipStream * create(std::unique_ptr<uint8_t[]>&& compressedData, size_t compressedSize, size_t uncompressedSize);
+
+    bool init(size_t uncompressedSize);
+    const uint8_t * peek(size_t * outSize);
+    bool fill();
+    size_t inflateTo(uint8_t * out, size_t size);
+    bool refillInput();
+    bool moveTo(size_t position);
+    bool restart(const Checkpoint * checkpoint);
+    void addCheckpoint();
+
+    bool _initialized;
+
+    // compressed data comes either from memory or from another stream
+    const uint8_t * _sourceData;
+    size_t _sourceSize;
+    std::unique_ptr<uint8_t[]> _ownedSourceData;
+    gameplay::Stream * _sourceStream;
+    bool _ownsSourceStream;
+    long int _sourceStart;
+    size_t _sourceOffset;
+    std::unique_ptr<uint8_t[]> _inputBuffer;
+
+    z_stream _zstream;
+    bool _finished;
+
+    // ring buffer holds the decompressed data at [_bufferStart, _decompressed)
+    std::unique_ptr<uint8_t[]> _buffer;
+    size_t _bufferStart;
+    size_t _decompressed;
+    size_t _position;
+    size_t _length;
+    bool _lengthKnown;
+
+    std::vector<std::unique_ptr<Checkpoint>> _checkpoints;
+    size_t _checkpointInterval;
 };
 
 
@@ -479,11 +479,16 @@ void ParticleSystem::rawUpdate(float dt)
 ParticleSystem * ParticleSystem::create(const char * url)
 {
     // Load the particle system properties from file.
-    gameplay::Properties* properties = gameplay::Properties::create(url);
+    return finalize(url, gameplay::Properties::create(url));
+}
+
+ParticleSystem * ParticleSystem::finalize(const char * url, gameplay::Properties * properties)
+{
     if (properties == NULL)
         return NULL;
 
     ParticleSystem * res = new ParticleSystem();
+    res->setURL(url);
     if(!res->loadFromProperties((strlen(properties->getNamespace()) > 0) ? properties : properties->getNextNamespace()))
     {
         SAFE_DELETE(properties);
@@ -493,7 +498,6 @@ ParticleSystem * ParticleSystem::create(const char * url)
 
     SAFE_DELETE(properties);
 
-    res->setURL(url);
     return res;
 }
 
@@ -509,6 +513,11 @@ bool ParticleSystem::reload()
     return res;
 }
 
+size_t ParticleSystem::getMemorySize() const
+{
+    return sizeof(ParticleSystem) + _particles.capacity() * sizeof(Particle) + _systems.size() * sizeof(ParticleSubSystem);
+}
+
 ParticleSystem * ParticleSystem::clone(bool deepClone) const
 {
     ParticleSystem * res = new ParticleSystem();
@@ -565,6 +574,9 @@ bool ParticleSystem::loadFromProperties(gameplay::Properties * properties)
                 return false;
             }
 
+            // subsystem refers to the material's sprite batch, which is recreated when the material is reloaded
+            Caches::getInstance()->addDependency(getURL(), subsystemProperties->getString("material"));
+
             addSubSystem(subsystem);
         }
     }
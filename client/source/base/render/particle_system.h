@@ -288,8 +288,23 @@ public:
         return *_cache;
     }
 
+    typedef gameplay::Properties Decoded;
+
     static ParticleSystem * create(const char * url);
 
+    /**
+     * Parse particle system file on a worker thread, used by Cache::loadAsync.
+     */
+    static gameplay::Properties * decode(const char * url) { return gameplay::Properties::create(url); };
+
+    /**
+     * Create particle system from the parsed file on the main thread.
+     *
+     * @param url Particle system's URL.
+     * @param properties Parsed file or NULL. Deleted by this function.
+     */
+    static ParticleSystem * finalize(const char * url, gameplay::Properties * properties);
+
     //
     // Inherited from Asset
     //
@@ -307,6 +322,14 @@ public:
      */
     virtual bool reload();
 
+    /**
+     * Get approximate size of particles and subsystems. Subsystem textures are
+     * accounted by SpriteBatchAsset cache they are loaded from.
+     *
+     * @see Asset::getMemorySize
+     */
+    virtual size_t getMemorySize() const;
+
     /** 
      * Clone asset.
      *
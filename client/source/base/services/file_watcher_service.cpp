@@ -0,0 +1,179 @@
+#include "pch.h"
+#include "file_watcher_service.h"
+
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#ifdef __linux__
+#include <sys/inotify.h>
+#include <unistd.h>
+#endif
+
+
+
+
+static bool getModificationTime(const std::string& path, time_t * out)
+{
+    struct stat st;
+    if (stat(path.c_str(), &st) != 0)
+        return false;
+
+    *out = st.st_mtime;
+    return true;
+}
+
+static void getFullPath(const char * url, std::string * out)
+{
+    if (gameplay::FileSystem::isAbsolutePath(url))
+    {
+        out->assign(url);
+    }
+    else
+    {
+        out->assign(gameplay::FileSystem::getResourcePath());
+        out->append(gameplay::FileSystem::resolvePath(url));
+    }
+}
+
+
+
+
+FileWatcherService::FileWatcherService(const ServiceManager * manager)
+    : Service(manager)
+    , _pollInterval(1.0f)
+    , _nextPollTime(0.0)
+#ifdef __linux__
+    , _inotify(-1)
+#endif
+{
+}
+
+FileWatcherService::~FileWatcherService()
+{
+#ifdef __linux__
+    if (_inotify >= 0)
+        close(_inotify);
+#endif
+}
+
+bool FileWatcherService::onInit()
+{
+#ifdef __linux__
+    _inotify = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if (_inotify < 0)
+        GP_WARN("inotify is not available, falling back to polling");
+#endif
+
+    return true;
+}
+
+bool FileWatcherService::onShutdown()
+{
+    _files.clear();
+    _changedURLs.clear();
+    return true;
+}
+
+bool FileWatcherService::onTick()
+{
+    double time = gameplay::Game::getAbsoluteTime() * 0.001;
+    bool poll = time >= _nextPollTime;
+    if (poll)
+    {
+        _nextPollTime = time + _pollInterval;
+        updateWatchedFiles();
+    }
+
+#ifdef __linux__
+    if (_inotify >= 0)
+        readNotifications();
+    else
+#endif
+    if (poll)
+        pollFiles();
+
+    if (!_changedURLs.empty())
+    {
+        std::vector<std::string> urls(_changedURLs.begin(), _changedURLs.end());
+        _changedURLs.clear();
+
+        size_t reloaded = Caches::getInstance()->reload(urls);
+        GP_LOG("%u files changed, %u assets reloaded", static_cast<unsigned>(urls.size()), static_cast<unsigned>(reloaded));
+    }
+
+    return false;
+}
+
+void FileWatcherService::updateWatchedFiles()
+{
+    std::vector<std::string> urls;
+    Caches::getInstance()->getWatchedURLs(&urls);
+
+    std::string path;
+    for (const std::string& url : urls)
+    {
+        getFullPath(url.c_str(), &path);
+        if (_files.find(path) != _files.end())
+            continue;
+
+        // files that don't exist on disk are most likely loaded from packages
+        time_t modificationTime;
+        if (!getModificationTime(path, &modificationTime))
+            continue;
+
+        _files[path] = { url, modificationTime };
+
+#ifdef __linux__
+        std::string dir = path.substr(0, path.find_last_of('/'));
+        if (_inotify >= 0 && _watchedDirPaths.find(dir) == _watchedDirPaths.end())
+        {
+            int wd = inotify_add_watch(_inotify, dir.c_str(), IN_CLOSE_WRITE | IN_MOVED_TO | IN_CREATE);
+            if (wd >= 0)
+            {
+                _watchedDirs[wd] = dir;
+                _watchedDirPaths.insert(dir);
+            }
+        }
+#endif
+    }
+}
+
+void FileWatcherService::pollFiles()
+{
+    for (auto& it : _files)
+    {
+        time_t modificationTime;
+        if (getModificationTime(it.first, &modificationTime) && modificationTime != it.second.modificationTime)
+        {
+            it.second.modificationTime = modificationTime;
+            _changedURLs.insert(it.second.url);
+        }
+    }
+}
+
+void FileWatcherService::readNotifications()
+{
+#ifdef __linux__
+    alignas(struct inotify_event) char buffer[4096];
+    while (true)
+    {
+        ssize_t length = read(_inotify, buffer, sizeof(buffer));
+        if (length <= 0)
+            break;
+
+        for (char * ptr = buffer; ptr < buffer + length; )
+        {
+            const struct inotify_event * event = reinterpret_cast<const struct inotify_event *>(ptr);
+            ptr += sizeof(struct inotify_event) + event->len;
+
+            auto dir = _watchedDirs.find(event->wd);
+            if (dir == _watchedDirs.end() || event->len == 0)
+                continue;
+
+            auto file = _files.find((*dir).second + "/" + event->name);
+            if (file != _files.end())
+                _changedURLs.insert((*file).second.url);
+        }
+    }
+#endif
+}
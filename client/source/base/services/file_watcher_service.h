@@ -0,0 +1,71 @@
+#pragma once
+
+#ifndef __DFG_FILE_WATCHER_SERVICE_H__
+#define __DFG_FILE_WATCHER_SERVICE_H__
+
+#include "service.h"
+
+
+
+
+/**
+ * FileWatcherService reloads cached assets when their files change on disk.
+ *
+ * Files of all assets in Caches and the files they depend on (see Caches::addDependency)
+ * are watched. On Linux the changes are reported by inotify, on other platforms
+ * files' modification times are polled. All changes detected since the previous
+ * frame are reloaded together, followed by the assets depending on them.
+ *
+ * Files inside packages are not watched. The service is meant for development
+ * builds and is not registered by default.
+ */
+class FileWatcherService : public Service
+{
+    friend class ServiceManager;
+
+public:
+    static const char * getTypeName() { return "FileWatcherService"; };
+
+    /**
+     * Set how often the list of watched files is updated and, when inotify
+     * is not available, how often files are polled for changes.
+     *
+     * @param seconds Interval in seconds. Default is 1 second.
+     */
+    void setPollInterval(float seconds) { _pollInterval = seconds; };
+
+protected:
+    FileWatcherService(const ServiceManager * manager);
+    virtual ~FileWatcherService();
+
+    bool onInit();
+    bool onTick();
+    bool onShutdown();
+
+private:
+    struct WatchedFile
+    {
+        std::string url;
+        time_t modificationTime;
+    };
+
+    void updateWatchedFiles();
+    void pollFiles();
+    void readNotifications();
+
+    std::unordered_map<std::string, WatchedFile> _files;     // by full path
+    std::unordered_set<std::string> _changedURLs;
+    float _pollInterval;
+    double _nextPollTime;
+
+#ifdef __linux__
+    int _inotify;
+    std::unordered_map<int, std::string> _watchedDirs;      // by watch descriptor
+    std::unordered_set<std::string> _watchedDirPaths;
+#endif
+};
+
+
+
+
+#endif // __DFG_FILE_WATCHER_SERVICE_H__
@@ -0,0 +1,465 @@
+#include "pch.h"
+#include "http_response_cache.h"
+
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#ifndef WIN32
+#include <dirent.h>
+#endif
+
+
+
+
+static const uint32_t CACHE_FILE_MAGIC = 0x31434844;   // 'DHC1'
+static const size_t DEFAULT_MEMORY_BUDGET = 4 * 1024 * 1024;
+static const size_t DEFAULT_DISK_BUDGET = 32 * 1024 * 1024;
+
+static bool writeString(FILE * file, const std::string& str)
+{
+    uint32_t length = static_cast<uint32_t>(str.size());
+    return fwrite(&length, sizeof(length), 1, file) == 1 && fwrite(str.data(), 1, length, file) == length;
+}
+
+static bool readString(FILE * file, std::string * out)
+{
+    uint32_t length;
+    if (fread(&length, sizeof(length), 1, file) != 1 || length > 64 * 1024)
+        return false;
+
+    out->resize(length);
+    return fread(&(*out)[0], 1, length, file) == length;
+}
+
+
+
+
+HTTPResponseCache::HTTPResponseCache()
+    : _memorySize(0)
+    , _memoryBudget(DEFAULT_MEMORY_BUDGET)
+    , _diskIndexLoaded(false)
+    , _diskSize(0)
+    , _diskBudget(DEFAULT_DISK_BUDGET)
+    , _diskVersion(0)
+{
+}
+
+HTTPResponseCache::~HTTPResponseCache()
+{
+}
+
+HTTPResponseCache * HTTPResponseCache::create()
+{
+    return new HTTPResponseCache();
+}
+
+void HTTPResponseCache::setDirectory(const char * path)
+{
+    std::string directory = path ? path : "";
+    if (!directory.empty() && directory.back() != '/' && directory.back() != '\\')
+        directory += '/';
+
+    if (!directory.empty())
+    {
+#ifdef WIN32
+        _mkdir(directory.c_str());
+#else
+        mkdir(directory.c_str(), 0777);
+#endif
+    }
+
+    std::unique_lock<std::mutex> lock(_mutex);
+
+    _directory = directory;
+    _diskEntries.clear();
+    _diskSize = 0;
+    _diskIndexLoaded = false;
+}
+
+void HTTPResponseCache::setBudget(size_t memoryBudget, size_t diskBudget)
+{
+    std::vector<std::string> removedFiles;
+    std::string directory;
+    {
+        std::unique_lock<std::mutex> lock(_mutex);
+
+        _memoryBudget = memoryBudget;
+        _diskBudget = diskBudget;
+        trimMemory();
+        if (_diskIndexLoaded)
+            trimDisk(&removedFiles);
+        directory = _directory;
+    }
+
+    removeFiles(directory, removedFiles);
+}
+
+size_t HTTPResponseCache::getMaxEntrySize() const
+{
+    std::unique_lock<std::mutex> lock(_mutex);
+
+    return std::max(_memoryBudget, _directory.empty() ? 0 : _diskBudget) / 4;
+}
+
+size_t HTTPResponseCache::getMemorySize() const
+{
+    std::unique_lock<std::mutex> lock(_mutex);
+
+    return _memorySize;
+}
+
+size_t HTTPResponseCache::getDiskSize() const
+{
+    std::unique_lock<std::mutex> lock(_mutex);
+
+    return _diskSize;
+}
+
+bool HTTPResponseCache::find(const std::string& key, Entry * out)
+{
+    std::string fileName = getFileName(key);
+    std::string directory;
+    size_t maxBodySize;
+    uint64_t version;
+    {
+        std::unique_lock<std::mutex> lock(_mutex);
+
+        auto it = _memoryIndex.find(key);
+        if (it != _memoryIndex.end())
+        {
+            _memoryEntries.splice(_memoryEntries.begin(), _memoryEntries, (*it).second);
+            *out = (*(*it).second).second;
+            return true;
+        }
+
+        if (_directory.empty() || _diskBudget == 0)
+            return false;
+    }
+
+    loadDiskIndex();
+
+    {
+        std::unique_lock<std::mutex> lock(_mutex);
+
+        auto diskEntry = _diskEntries.find(fileName);
+        if (diskEntry == _diskEntries.end())
+            return false;
+
+        directory = _directory;
+        maxBodySize = _diskBudget;
+        version = (*diskEntry).second.version;
+    }
+
+    Entry entry;
+    bool res = readFile(directory + fileName, key, maxBodySize, &entry);
+
+    {
+        std::unique_lock<std::mutex> lock(_mutex);
+
+        // the file may have been replaced or removed while it was read
+        auto diskEntry = _diskEntries.find(fileName);
+        if (directory != _directory || diskEntry == _diskEntries.end() || (*diskEntry).second.version != version)
+            return false;
+
+        if (res)
+        {
+            (*diskEntry).second.lastUse = static_cast<int64_t>(time(NULL));
+            storeInMemory(key, entry);
+            *out = entry;
+            return true;
+        }
+
+        // file is corrupted or belongs to a different key
+        _diskSize -= (*diskEntry).second.size;
+        _diskEntries.erase(diskEntry);
+    }
+
+    remove((directory + fileName).c_str());
+    return false;
+}
+
+void HTTPResponseCache::store(const std::string& key, const Entry& entry)
+{
+    GP_ASSERT(entry.body);
+
+    std::string directory;
+    {
+        std::unique_lock<std::mutex> lock(_mutex);
+
+        storeInMemory(key, entry);
+
+        if (_directory.empty() || _diskBudget == 0 || entry.body->size() > _diskBudget / 4)
+            return;
+    }
+
+    loadDiskIndex();
+
+    std::string fileName = getFileName(key);
+    uint64_t version;
+    {
+        std::unique_lock<std::mutex> lock(_mutex);
+
+        directory = _directory;
+        version = ++_diskVersion;
+    }
+
+    // responses stored simultaneously are written to different temporary files
+    size_t size;
+    if (directory.empty() || !writeFile(directory + fileName, key, entry, version, &size))
+        return;
+
+    std::vector<std::string> removedFiles;
+    {
+        std::unique_lock<std::mutex> lock(_mutex);
+
+        if (directory != _directory)
+            return;
+
+        auto it = _diskEntries.find(fileName);
+        if (it != _diskEntries.end())
+        {
+            // newer response is already stored
+            if ((*it).second.version > version)
+                return;
+            _diskSize -= (*it).second.size;
+        }
+
+        _diskEntries[fileName] = { size, static_cast<int64_t>(time(NULL)), version };
+        _diskSize += size;
+        trimDisk(&removedFiles);
+    }
+
+    removeFiles(directory, removedFiles);
+}
+
+void HTTPResponseCache::clear()
+{
+    loadDiskIndex();
+
+    std::vector<std::string> removedFiles;
+    std::string directory;
+    {
+        std::unique_lock<std::mutex> lock(_mutex);
+
+        _memoryEntries.clear();
+        _memoryIndex.clear();
+        _memorySize = 0;
+
+        for (auto& it : _diskEntries)
+            removedFiles.push_back(it.first);
+        _diskEntries.clear();
+        _diskSize = 0;
+        directory = _directory;
+    }
+
+    removeFiles(directory, removedFiles);
+}
+
+void HTTPResponseCache::storeInMemory(const std::string& key, const Entry& entry)
+{
+    auto it = _memoryIndex.find(key);
+    if (it != _memoryIndex.end())
+    {
+        _memorySize -= (*(*it).second).second.body->size();
+        _memoryEntries.erase((*it).second);
+        _memoryIndex.erase(it);
+    }
+
+    // large responses would push everything else out of memory
+    if (entry.body->size() > _memoryBudget / 4)
+        return;
+
+    _memoryEntries.emplace_front(key, entry);
+    _memoryIndex[key] = _memoryEntries.begin();
+    _memorySize += entry.body->size();
+    trimMemory();
+}
+
+void HTTPResponseCache::trimMemory()
+{
+    while (_memorySize > _memoryBudget && !_memoryEntries.empty())
+    {
+        const std::pair<std::string, Entry>& last = _memoryEntries.back();
+        _memorySize -= last.second.body->size();
+        _memoryIndex.erase(last.first);
+        _memoryEntries.pop_back();
+    }
+}
+
+void HTTPResponseCache::trimDisk(std::vector<std::string> * outRemovedFiles)
+{
+    if (_diskSize <= _diskBudget)
+        return;
+
+    std::vector<std::pair<int64_t, std::string>> entries;
+    entries.reserve(_diskEntries.size());
+    for (auto& it : _diskEntries)
+        entries.emplace_back(it.second.lastUse, it.first);
+    std::sort(entries.begin(), entries.end());
+
+    for (auto& it : entries)
+    {
+        if (_diskSize <= _diskBudget)
+            break;
+
+        auto entry = _diskEntries.find(it.second);
+        _diskSize -= (*entry).second.size;
+        _diskEntries.erase(entry);
+        outRemovedFiles->push_back(it.second);
+    }
+}
+
+void HTTPResponseCache::loadDiskIndex()
+{
+    std::string directory;
+    {
+        std::unique_lock<std::mutex> lock(_mutex);
+
+        if (_diskIndexLoaded || _directory.empty())
+            return;
+
+        directory = _directory;
+    }
+
+    // file modification time is used as the last use time of responses stored in previous sessions
+    std::unordered_map<std::string, DiskEntry> entries;
+
+#ifdef WIN32
+    WIN32_FIND_DATAA data;
+    HANDLE handle = FindFirstFileA((directory + "*.http").c_str(), &data);
+    if (handle != INVALID_HANDLE_VALUE)
+    {
+        do
+        {
+            if (data.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY)
+                continue;
+
+            struct stat st;
+            if (stat((directory + data.cFileName).c_str(), &st) != 0)
+                continue;
+
+            entries[data.cFileName] = { static_cast<size_t>(st.st_size), static_cast<int64_t>(st.st_mtime), 0 };
+        }
+        while (FindNextFileA(handle, &data));
+
+        FindClose(handle);
+    }
+#else
+    DIR * dir = opendir(directory.c_str());
+    if (dir)
+    {
+        while (struct dirent * entry = readdir(dir))
+        {
+            size_t length = strlen(entry->d_name);
+            if (length < 5 || strcmp(entry->d_name + length - 5, ".http") != 0)
+                continue;
+
+            struct stat st;
+            if (stat((directory + entry->d_name).c_str(), &st) != 0 || !S_ISREG(st.st_mode))
+                continue;
+
+            entries[entry->d_name] = { static_cast<size_t>(st.st_size), static_cast<int64_t>(st.st_mtime), 0 };
+        }
+
+        closedir(dir);
+    }
+#endif
+
+    std::vector<std::string> removedFiles;
+    {
+        std::unique_lock<std::mutex> lock(_mutex);
+
+        // index may have been loaded by another thread in the meantime
+        if (_diskIndexLoaded || directory != _directory)
+            return;
+
+        _diskIndexLoaded = true;
+        for (auto& it : entries)
+        {
+            if (_diskEntries.insert(it).second)
+                _diskSize += it.second.size;
+        }
+        trimDisk(&removedFiles);
+    }
+
+    removeFiles(directory, removedFiles);
+}
+
+bool HTTPResponseCache::readFile(const std::string& path, const std::string& key, size_t maxBodySize, Entry * out)
+{
+    FILE * file = fopen(path.c_str(), "rb");
+    if (!file)
+        return false;
+
+    uint32_t magic = 0;
+    uint64_t bodySize = 0;
+    std::string storedKey;
+    Entry entry;
+    bool res = fread(&magic, sizeof(magic), 1, file) == 1 && magic == CACHE_FILE_MAGIC &&
+        readString(file, &storedKey) && storedKey == key &&
+        readString(file, &entry.etag) && readString(file, &entry.lastModified) &&
+        fread(&entry.expires, sizeof(entry.expires), 1, file) == 1 &&
+        fread(&bodySize, sizeof(bodySize), 1, file) == 1 && bodySize <= maxBodySize;
+
+    if (res)
+    {
+        std::shared_ptr<std::vector<uint8_t>> body = std::make_shared<std::vector<uint8_t>>(static_cast<size_t>(bodySize));
+        res = bodySize == 0 || fread(body->data(), 1, body->size(), file) == body->size();
+        entry.body = body;
+    }
+
+    fclose(file);
+
+    if (res)
+        *out = entry;
+    return res;
+}
+
+bool HTTPResponseCache::writeFile(const std::string& path, const std::string& key, const Entry& entry, uint64_t version, size_t * outSize)
+{
+    // write to temporary file first, so readers never see partially written response
+    std::string tmpPath = path + "." + std::to_string(version) + ".tmp";
+    FILE * file = fopen(tmpPath.c_str(), "wb");
+    if (!file)
+        return false;
+
+    uint64_t bodySize = entry.body->size();
+    bool res = fwrite(&CACHE_FILE_MAGIC, sizeof(CACHE_FILE_MAGIC), 1, file) == 1 &&
+        writeString(file, key) && writeString(file, entry.etag) && writeString(file, entry.lastModified) &&
+        fwrite(&entry.expires, sizeof(entry.expires), 1, file) == 1 &&
+        fwrite(&bodySize, sizeof(bodySize), 1, file) == 1 &&
+        (bodySize == 0 || fwrite(entry.body->data(), 1, entry.body->size(), file) == entry.body->size());
+
+    *outSize = static_cast<size_t>(ftell(file));
+    res = fclose(file) == 0 && res;
+
+#ifdef WIN32
+    remove(path.c_str());
+#endif
+    if (!res || rename(tmpPath.c_str(), path.c_str()) != 0)
+    {
+        GP_WARN("Failed to write HTTP cache file %s", path.c_str());
+        remove(tmpPath.c_str());
+        return false;
+    }
+
+    return true;
+}
+
+void HTTPResponseCache::removeFiles(const std::string& directory, const std::vector<std::string>& fileNames)
+{
+    for (const std::string& fileName : fileNames)
+        remove((directory + fileName).c_str());
+}
+
+std::string HTTPResponseCache::getFileName(const std::string& key)
+{
+    // FNV-1a
+    uint64_t hash = 14695981039346656037ULL;
+    for (char ch : key)
+        hash = (hash ^ static_cast<uint8_t>(ch)) * 1099511628211ULL;
+
+    char name[32];
+    snprintf(name, sizeof(name), "%016llx.http", static_cast<unsigned long long>(hash));
+    return name;
+}
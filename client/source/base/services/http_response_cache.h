@@ -0,0 +1,140 @@
+#pragma once
+
+#ifndef __DFG_HTTP_RESPONSE_CACHE_H__
+#define __DFG_HTTP_RESPONSE_CACHE_H__
+
+
+
+
+/**
+ * HTTPResponseCache keeps bodies of HTTP responses in memory and on disk
+ * along with the information needed to revalidate them (ETag, Last-Modified).
+ *
+ * Both memory and disk storage have their own size budgets, least recently
+ * used entries are evicted first. All methods are thread-safe, files are read
+ * and written without holding the lock, so a slow disk doesn't block lookups
+ * of responses kept in memory.
+ */
+class HTTPResponseCache : Noncopyable
+{
+public:
+    /**
+     * Cached response.
+     */
+    struct Entry
+    {
+        std::string etag;
+        std::string lastModified;
+        int64_t expires;                                        // time (seconds since epoch) the response is fresh until
+        std::shared_ptr<const std::vector<uint8_t>> body;
+
+        Entry() : expires(0) {};
+
+        /**
+         * Get whether the response can be used without revalidating it with the server.
+         */
+        bool isFresh() const { return expires > static_cast<int64_t>(time(NULL)); };
+    };
+
+    ~HTTPResponseCache();
+
+    /**
+     * Create an empty cache without disk storage.
+     *
+     * @return Newly created HTTPResponseCache.
+     */
+    static HTTPResponseCache * create();
+
+    /**
+     * Set directory the responses are stored in. Directory is created if it doesn't exist.
+     *
+     * @param path Full path to directory or empty string to disable disk storage.
+     */
+    void setDirectory(const char * path);
+
+    /**
+     * Set maximum memory and disk space taken by cached responses.
+     *
+     * @param memoryBudget Maximum size of responses kept in memory, in bytes.
+     * @param diskBudget Maximum size of responses stored on disk, in bytes.
+     */
+    void setBudget(size_t memoryBudget, size_t diskBudget);
+
+    /**
+     * Find cached response, loading it from disk if necessary.
+     *
+     * @param key Cache key.
+     * @param[out] out Cached response.
+     * @return True if response is found, false otherwise.
+     */
+    bool find(const std::string& key, Entry * out);
+
+    /**
+     * Add or replace cached response.
+     *
+     * @param key Cache key.
+     * @param entry Response to cache.
+     */
+    void store(const std::string& key, const Entry& entry);
+
+    /**
+     * Remove all cached responses from memory and disk.
+     */
+    void clear();
+
+    /**
+     * Get maximum size of a single response that can be cached.
+     */
+    size_t getMaxEntrySize() const;
+
+    /**
+     * Get size of responses kept in memory.
+     */
+    size_t getMemorySize() const;
+
+    /**
+     * Get size of responses stored on disk.
+     */
+    size_t getDiskSize() const;
+
+protected:
+    HTTPResponseCache();
+
+private:
+    typedef std::list<std::pair<std::string, Entry>> MemoryEntriesType;
+
+    struct DiskEntry
+    {
+        size_t size;
+        int64_t lastUse;
+        uint64_t version;       // changes every time the file is written
+    };
+
+    void storeInMemory(const std::string& key, const Entry& entry);
+    void trimMemory();
+    void trimDisk(std::vector<std::string> * outRemovedFiles);
+    void loadDiskIndex();
+    static bool readFile(const std::string& path, const std::string& key, size_t maxBodySize, Entry * out);
+    static bool writeFile(const std::string& path, const std::string& key, const Entry& entry, uint64_t version, size_t * outSize);
+    static void removeFiles(const std::string& directory, const std::vector<std::string>& fileNames);
+    static std::string getFileName(const std::string& key);
+
+    mutable std::mutex _mutex;
+
+    MemoryEntriesType _memoryEntries;                       // most recently used first
+    std::unordered_map<std::string, MemoryEntriesType::iterator> _memoryIndex;
+    size_t _memorySize;
+    size_t _memoryBudget;
+
+    std::string _directory;
+    std::unordered_map<std::string, DiskEntry> _diskEntries;    // by file name
+    bool _diskIndexLoaded;
+    size_t _diskSize;
+    size_t _diskBudget;
+    uint64_t _diskVersion;
+};
+
+
+
+
+#endif // __DFG_HTTP_RESPONSE_CACHE_H__
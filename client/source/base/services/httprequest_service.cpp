@@ -1,9 +1,13 @@
 #include "pch.h"
 #include "httprequest_service.h"
+#include "http_response_cache.h"
 #include "service_manager.h"
 #include "main/memory_stream.h"
-#include "utils/throttle.h"
+#include "main/json.h"
+#include "utils/monotonic_throttle.h"
 #include <curl/curl.h>
+#include <sys/types.h>
+#include <sys/stat.h>
 
 
 
@@ -19,13 +23,238 @@ extern "C"
 }
 #endif
 
-static char errorBuffer[CURL_ERROR_SIZE];
+static const size_t MAX_RESERVED_RESPONSE_SIZE = 256 * 1024 * 1024;
+static const int DEFAULT_MAX_REQUESTS = 16;
+static const int DEFAULT_MAX_REQUESTS_PER_HOST = 6;
+static const long MAX_IDLE_CONNECTIONS = 64;
+static const size_t MAX_IDLE_HANDLES = 8;
+static const size_t MAX_LATENCY_SAMPLES = 1024;
+static const float PROGRESS_INTERVAL = 0.1f;       // in seconds
 const char * HTTP_REQUEST_SERVICE_QUEUE = "HTTPRequestServiceQueue";
+const char * HTTP_RESPONSE_CACHE_QUEUE = "HTTPResponseCacheQueue";
+
+
+
+
+#ifndef __EMSCRIPTEN__
+
+/**
+ * HTTPRequestStatistics accumulates HTTPRequestService::Statistics.
+ * Counters are updated from the engine's loop, latencies from the main thread.
+ */
+class HTTPRequestStatistics : Noncopyable
+{
+public:
+    typedef std::chrono::steady_clock Clock;
+
+    HTTPRequestStatistics() { reset(); };
+
+    void reset();
+    void addTransfer(CURL * curl, CURLcode result);
+    void addCachedResponse();
+    void addCallback(Clock::time_point startTime, Clock::time_point postTime);
+    HTTPRequestService::Statistics get() const;
+
+private:
+    static void addSample(std::vector<float>& samples, size_t& next, float value);
+    static float getPercentile(std::vector<float> samples, float percentile);
+
+    mutable std::mutex _mutex;
+    HTTPRequestService::Statistics _statistics;
+    Clock::time_point _startTime;
+
+    // ring buffers of the most recent samples, in ms
+    std::vector<float> _latencies;
+    std::vector<float> _callbackDelays;
+    size_t _nextLatency;
+    size_t _nextCallbackDelay;
+};
+
+
+
+/**
+ * Latest progress of a transfer, shared with the update waiting in main thread's queue.
+ */
+struct HTTPTransferProgress : Noncopyable
+{
+    std::atomic<uint64_t> dltotal;
+    std::atomic<uint64_t> dlnow;
+    std::atomic<uint64_t> ultotal;
+    std::atomic<uint64_t> ulnow;
+    std::atomic_bool pending;                   // update is waiting in main thread's queue
+    std::atomic_bool aborted;                   // progress callback asked to abort the transfer
+    MonotonicThrottle throttle;
+
+    HTTPTransferProgress() : dltotal(0), dlnow(0), ultotal(0), ulnow(0), pending(false), aborted(false), throttle(PROGRESS_INTERVAL) {};
+};
+
+
+
+/**
+ * A single request processed by HTTPTransferEngine or performed synchronously.
+ */
+struct HTTPTransfer : Noncopyable
+{
+    int id;
+    std::shared_ptr<std::atomic_bool> cancelled;
+    HTTPRequestService::Request request;
+    std::string customRequest;
+    std::string host;
+    std::string range;
+    std::unique_ptr<MemoryStream> response;
+    std::shared_ptr<HTTPTransferProgress> progress;
+    FILE * file;
+    curl_slist * headers;
+    CURL * curl;
+    char errorBuffer[CURL_ERROR_SIZE];
+
+    // identical requests sent while this one is in flight
+    std::string requestKey;
+    std::vector<std::unique_ptr<HTTPTransfer>> followers;
+
+    // set when the response can be cached
+    std::shared_ptr<HTTPResponseCache> cache;
+    std::string cacheKey;
+    HTTPResponseCache::Entry cachedEntry;       // stale response being revalidated
+
+    // caching related response headers
+    std::string etag;
+    std::string lastModified;
+    int64_t maxAge;
+    int64_t expires;
+    bool noStore;
+    bool noCache;
+
+    // set once the cache is looked up for asynchronous request
+    bool cacheChecked;
+
+    // set while the response is a redirect followed by curl, its body is skipped
+    bool redirectStatus;
+    bool redirected;
+
+    // set for asynchronous requests
+    std::shared_ptr<HTTPRequestStatistics> statistics;
+    HTTPRequestStatistics::Clock::time_point startTime;
+
+    HTTPTransfer() : id(-1), cancelled(std::make_shared<std::atomic_bool>(false)), file(NULL), headers(NULL), curl(NULL), cacheChecked(false), redirectStatus(false), redirected(false) { errorBuffer[0] = '\0'; resetCacheHeaders(); };
+    ~HTTPTransfer() { if (file) fclose(file); curl_slist_free_all(headers); };
+
+    void resetCacheHeaders() { etag.clear(); lastModified.clear(); maxAge = expires = -1; noStore = noCache = false; };
+
+    bool isCancelled() const
+    {
+        if (!*cancelled)
+            return false;
+        for (auto& follower : followers)
+            if (!*follower->cancelled)
+                return false;
+        return true;
+    };
+};
+
+
+
+/**
+ * HTTPCacheWorker looks up and stores responses of asynchronous requests in the
+ * response cache, so reading and writing cache files never stalls transfers
+ * on the engine's loop. Its loop runs on a separate queue until the worker is stopped.
+ */
+class HTTPCacheWorker : Noncopyable
+{
+public:
+    HTTPCacheWorker() : _active(true) {};
+
+    void run();
+    void stop();
+    void addJob(const std::function<void()>& job);
+
+private:
+    std::mutex _mutex;
+    std::condition_variable _hasJobs;
+    std::deque<std::function<void()>> _jobs;
+    bool _active;
+};
+
+
+
+/**
+ * HTTPTransferEngine drives all asynchronous requests with a single curl multi handle.
+ *
+ * Connections, DNS lookups and TLS sessions are shared between all requests (including
+ * synchronous ones) and HTTP/2 requests to the same host are multiplexed over one connection.
+ * The engine's loop runs on HTTPRequestService's queue until the engine is stopped.
+ */
+class HTTPTransferEngine : Noncopyable
+{
+public:
+    HTTPTransferEngine(const std::string& userAgent, const std::shared_ptr<HTTPCacheWorker>& cacheWorker);
+    ~HTTPTransferEngine();
+
+    void run();
+    void stop();
+
+    void addTransfer(std::unique_ptr<HTTPTransfer>& transfer);
+    void cancelTransfer(int id);
+    void setMaxRequests(int count);
+    void setMaxRequestsPerHost(int count);
+
+    CURLSH * getShareHandle() const { return _share; };
+
+private:
+    static void lockShare(CURL *, curl_lock_data data, curl_lock_access, void * userp);
+    static void unlockShare(CURL *, curl_lock_data data, void * userp);
+
+    void checkCache(std::unique_ptr<HTTPTransfer>& transfer);
+    void returnTransfer(std::unique_ptr<HTTPTransfer>& transfer);
+    void runOnCacheQueue(std::unique_ptr<HTTPTransfer>& transfer, const std::function<void(std::unique_ptr<HTTPTransfer>&)>& job);
+    void addWaitingTransfer(std::unique_ptr<HTTPTransfer>& transfer);
+    void removeCancelledTransfers();
+    void startTransfers();
+    void finishTransfer(CURL * curl, CURLcode result);
+    std::unique_ptr<HTTPTransfer> removeRunningTransfer(CURL * curl);
+    void releaseHandle(CURL * curl);
+
+    std::string _userAgent;
+    std::shared_ptr<HTTPCacheWorker> _cacheWorker;
+    CURLM * _multi;
+    CURLSH * _share;
+    std::mutex _shareMutexes[CURL_LOCK_DATA_LAST];
+
+    std::mutex _incomingMutex;
+    std::deque<std::unique_ptr<HTTPTransfer>> _incoming;
+    std::unordered_map<int, std::weak_ptr<std::atomic_bool>> _cancelFlags;      // by request id, expire when request's callback is invoked
+    size_t _cancelFlagsPurgeSize;
+    std::atomic_bool _active;
+    std::atomic_bool _hasCancelledTransfers;
+    std::atomic_int _maxRequests;
+    std::atomic_int _maxRequestsPerHost;
+
+    // following members are accessed from the engine's loop only
+    std::deque<std::unique_ptr<HTTPTransfer>> _waiting;                       // sorted by priority
+    std::unordered_map<std::string, HTTPTransfer *> _inFlight;                 // by request key
+    std::unordered_map<CURL *, std::unique_ptr<HTTPTransfer>> _running;
+    std::unordered_map<std::string, int> _runningPerHost;
+    std::vector<CURL *> _idleHandles;
+};
+
+#endif
+
+
+
 
 HTTPRequestService::HTTPRequestService(const ServiceManager * manager)
     : Service(manager)
     , _taskQueueService(NULL)
+    , _maxRequests(DEFAULT_MAX_REQUESTS)
+    , _maxRequestsPerHost(DEFAULT_MAX_REQUESTS_PER_HOST)
 {
+#ifndef __EMSCRIPTEN__
+    // browser caches responses on emscripten
+    _cache.reset(HTTPResponseCache::create());
+    _statistics = std::make_shared<HTTPRequestStatistics>();
+    if (gameplay::Game::getInstance())
+        _cache->setDirectory((std::string(gameplay::Game::getInstance()->getTemporaryFolderPath()) + "http_cache").c_str());
+#endif
 }
 
 HTTPRequestService::~HTTPRequestService()
@@ -36,6 +265,7 @@ bool HTTPRequestService::onPreInit()
 {
     _taskQueueService = _manager->findService<TaskQueueService>();
     _taskQueueService->createQueue(HTTP_REQUEST_SERVICE_QUEUE);
+    _taskQueueService->createQueue(HTTP_RESPONSE_CACHE_QUEUE);
 
     if (gameplay::Game::getInstance())
     {
@@ -60,6 +290,17 @@ bool HTTPRequestService::onPreInit()
 
 bool HTTPRequestService::onInit()
 {
+#ifndef __EMSCRIPTEN__
+    std::shared_ptr<HTTPCacheWorker> cacheWorker = std::make_shared<HTTPCacheWorker>();
+    _engine.reset(new HTTPTransferEngine(_userAgentString, cacheWorker));
+    _engine->setMaxRequests(_maxRequests);
+    _engine->setMaxRequestsPerHost(_maxRequestsPerHost);
+
+    std::shared_ptr<HTTPTransferEngine> engine = _engine;
+    _taskQueueService->addWorkItem(HTTP_REQUEST_SERVICE_QUEUE, [engine]() { engine->run(); });
+    _taskQueueService->addWorkItem(HTTP_RESPONSE_CACHE_QUEUE, [cacheWorker]() { cacheWorker->run(); });
+#endif
+
     return true;
 }
 
@@ -71,35 +312,160 @@ bool HTTPRequestService::onTick()
 
 bool HTTPRequestService::onShutdown()
 {
+#ifndef __EMSCRIPTEN__
+    if (_engine)
+        _engine->stop();
+#endif
+
     if (_taskQueueService)
+    {
         _taskQueueService->removeQueue(HTTP_REQUEST_SERVICE_QUEUE);
+        _taskQueueService->removeQueue(HTTP_RESPONSE_CACHE_QUEUE);
+    }
+
+#ifndef __EMSCRIPTEN__
+    _engine.reset();
+#endif
 
     return true;
 }
 
-int HTTPRequestService::makeRequestAsync(const Request& request, const char * customRequest, bool withCredentials)
+void HTTPRequestService::setCacheSize(size_t memoryBudget, size_t diskBudget)
 {
-#ifdef __EMSCRIPTEN__
-    makeRequestSync(request, customRequest, withCredentials);
-    return -1;
+    if (_cache)
+        _cache->setBudget(memoryBudget, diskBudget);
+}
+
+void HTTPRequestService::setCacheDirectory(const char * path)
+{
+    if (_cache)
+        _cache->setDirectory(path);
+}
+
+void HTTPRequestService::clearCache()
+{
+    if (_cache)
+        _cache->clear();
+}
+
+HTTPRequestService::Statistics HTTPRequestService::getStatistics() const
+{
+#ifndef __EMSCRIPTEN__
+    return _statistics->get();
 #else
-    // note: request is copied by value
-    return _taskQueueService->addWorkItem(HTTP_REQUEST_SERVICE_QUEUE, std::bind(&HTTPRequestService::sendRequest, this, request, false, customRequest ? customRequest : "", withCredentials));
+    return Statistics();
+#endif
+}
+
+void HTTPRequestService::resetStatistics()
+{
+#ifndef __EMSCRIPTEN__
+    _statistics->reset();
+#endif
+}
+
+void HTTPRequestService::setMaxRequests(int count)
+{
+    _maxRequests = count;
+
+#ifndef __EMSCRIPTEN__
+    if (_engine)
+        _engine->setMaxRequests(count);
+#endif
+}
+
+void HTTPRequestService::setMaxRequestsPerHost(int count)
+{
+    _maxRequestsPerHost = count;
+
+#ifndef __EMSCRIPTEN__
+    if (_engine)
+        _engine->setMaxRequestsPerHost(count);
 #endif
 }
 
+int HTTPRequestService::makeRequestAsync(const Request& request, const char * customRequest, bool withCredentials)
+{
+    // requests are always asynchronous on emscripten
+    return sendRequest(request, false, customRequest ? customRequest : "", withCredentials);
+}
+
 void HTTPRequestService::makeRequestSync(const Request& request, const char * customRequest, bool withCredentials)
 {
     sendRequest(request, true, customRequest ? customRequest : "", withCredentials);
 }
 
 static int __requestCount = 0;
+static std::atomic_int __requestId(0);
+#ifdef __EMSCRIPTEN__
+static std::unordered_map<int, HTTPRequestService::Request *> __emscriptenRequests;   // by request handle
+
+static void forgetEmscriptenRequest(HTTPRequestService::Request * request)
+{
+    for (auto it = __emscriptenRequests.begin(); it != __emscriptenRequests.end(); it++)
+        if ((*it).second == request)
+        {
+            __emscriptenRequests.erase(it);
+            break;
+        }
+}
+#endif
+
+void HTTPRequestService::cancelRequest(int handle)
+{
+    if (handle < 0)
+        return;
+
+#ifdef __EMSCRIPTEN__
+    // the browser's request can't be aborted, its callbacks are just not invoked
+    auto it = __emscriptenRequests.find(handle);
+    if (it != __emscriptenRequests.end())
+    {
+        (*it).second->responseCallback = nullptr;
+        (*it).second->progressCallback = nullptr;
+        (*it).second->dataCallback = nullptr;
+        (*it).second->downloadPath.clear();
+        __emscriptenRequests.erase(it);
+    }
+#else
+    if (_engine)
+        _engine->cancelTransfer(handle);
+#endif
+}
+
 void HTTPRequestService::requestLoadCallback(unsigned, void * arg, void *buf, unsigned length, int statusCode, const char * status)
 {
     Request * request = reinterpret_cast<Request *>(arg);
-    MemoryStream * response = MemoryStream::create(buf, length);
-    request->responseCallback(CURLE_OK, response, status, statusCode);
-    delete response;
+#ifdef __EMSCRIPTEN__
+    forgetEmscriptenRequest(request);
+#endif
+
+    // whole response is already in memory, pass it to streaming callbacks at once
+    if (statusCode < 300 && (request->dataCallback || !request->downloadPath.empty()))
+    {
+        if (request->dataCallback)
+        {
+            request->dataCallback(buf, length);
+        }
+        else
+        {
+            FILE * file = fopen(request->downloadPath.c_str(), "wb");
+            if (file)
+            {
+                fwrite(buf, 1, length, file);
+                fclose(file);
+            }
+        }
+
+        length = 0;
+    }
+
+    if (request->responseCallback)
+    {
+        MemoryStream * response = MemoryStream::create(buf, length);
+        request->responseCallback(CURLE_OK, response, status, statusCode);
+        delete response;
+    }
     delete request;
 
     __requestCount--;
@@ -108,8 +474,12 @@ void HTTPRequestService::requestLoadCallback(unsigned, void * arg, void *buf, un
 void HTTPRequestService::requestErrorCallback(unsigned, void *arg, int statusCode, const char * status)
 {
     Request * request = reinterpret_cast<Request *>(arg);
+#ifdef __EMSCRIPTEN__
+    forgetEmscriptenRequest(request);
+#endif
     GP_LOG("Failed to perform HTTP request to %s: error %d %s", request->url.c_str(), statusCode, status);
-    request->responseCallback(-1, NULL, status, statusCode);  // there is no 'curl' error for emscripten callback, errorCode is HTTP status code
+    if (request->responseCallback)
+        request->responseCallback(-1, NULL, status, statusCode);  // there is no 'curl' error for emscripten callback, errorCode is HTTP status code
     delete request;
 
     __requestCount--;
@@ -118,172 +488,1110 @@ void HTTPRequestService::requestErrorCallback(unsigned, void *arg, int statusCod
 void HTTPRequestService::requestProgressCallback(unsigned, void * arg, int dlnow, int dltotal)
 {
     Request * request = reinterpret_cast<Request *>(arg);
-    request->progressCallback(static_cast<uint64_t>(dltotal), static_cast<uint64_t>(dlnow), 0, 0);
+    if (request->progressCallback)
+        request->progressCallback(static_cast<uint64_t>(dltotal), static_cast<uint64_t>(dlnow), 0, 0);
 }
 
-int progressFunction(void * userp, curl_off_t dltotal, curl_off_t dlnow, curl_off_t ultotal, curl_off_t ulnow)
-{
-    HTTPRequestService::Request * request = reinterpret_cast<HTTPRequestService::Request *>(userp);
-    GP_ASSERT(request->progressCallback);
+#ifndef __EMSCRIPTEN__
 
+static void postProgress(HTTPTransfer * transfer)
+{
     static TaskQueueService* taskQueueService = ServiceManager::getInstance()->findService<TaskQueueService>();
 
-    if (taskQueueService)
-    {
-        static Throttle throttle(0.1f);
+    std::shared_ptr<HTTPTransferProgress> progress = transfer->progress;
+    if (!taskQueueService || progress->pending)
+        return;
 
-        // don't flood main queue too much
-        if (throttle.shouldExecute())
-        {
-            // copy callback by value since it is invoked on main thread
-            auto callback = request->progressCallback;
-            taskQueueService->runOnMainThread([=]() {
-                callback(static_cast<uint64_t>(dltotal), static_cast<uint64_t>(dlnow), static_cast<uint64_t>(ultotal), static_cast<uint64_t>(ulnow));
-                });
-        }
-    }
+    progress->pending = true;
 
-    return 0;
+    // copy callback by value since it is invoked on main thread
+    auto callback = transfer->request.progressCallback;
+    std::shared_ptr<std::atomic_bool> cancelled = transfer->cancelled;
+    taskQueueService->runOnMainThread([=]() {
+        progress->pending = false;
+        if (!*cancelled && callback(progress->dltotal, progress->dlnow, progress->ultotal, progress->ulnow))
+            progress->aborted = true;
+        });
 }
 
-bool HTTPRequestService::hasActiveEmscriptenHTTPRequest() const
+static int progressFunction(void * userp, curl_off_t dltotal, curl_off_t dlnow, curl_off_t ultotal, curl_off_t ulnow)
 {
-    return __requestCount > 0;
+    HTTPTransfer * transfer = reinterpret_cast<HTTPTransfer *>(userp);
+    GP_ASSERT(transfer->request.progressCallback);
+
+    if (!transfer->progress)
+        transfer->progress = std::make_shared<HTTPTransferProgress>();
+
+    std::shared_ptr<HTTPTransferProgress> progress = transfer->progress;
+    progress->dltotal = static_cast<uint64_t>(dltotal);
+    progress->dlnow = static_cast<uint64_t>(dlnow);
+    progress->ultotal = static_cast<uint64_t>(ultotal);
+    progress->ulnow = static_cast<uint64_t>(ulnow);
+
+    // each request sends at most one update per interval and the update
+    // waiting in main thread's queue picks up the latest progress
+    if (progress->throttle.shouldExecute())
+        postProgress(transfer);
+
+    return progress->aborted ? 1 : 0;
 }
 
-void HTTPRequestService::sendRequest(const Request& request, bool syncCall, std::string customRequest, bool withCredentials)
+static void postFinalProgress(HTTPTransfer * transfer, CURLcode res)
 {
-    if (request.url.empty()) {
-        // if request url is empty, immediately calll callback with error code
-        if (request.responseCallback)
-        {
-            if (syncCall)
-            {
-                request.responseCallback(-1, nullptr, "", 0);
-            }
-            else
-            {
-                // response is copied by value since callback is invoked on main thread
-                _taskQueueService->runOnMainThread([=]() { request.responseCallback(-1, nullptr, "", 0); });
-            }
-        }
-
+    if (!transfer->request.progressCallback || res != CURLE_OK)
         return;
-    }
 
-#ifdef _DEBUG
-    GP_LOG("Sending HTTP request: %s, %s: %s", request.url.c_str(),
-        customRequest.empty() ? (request.postPayload.empty() ? "GET" : "POST") : customRequest.c_str(), request.postPayload.c_str());
-#endif
+    // the last update may be throttled away, callback always sees the whole response received
+    curl_off_t dlnow = 0, ulnow = 0;
+    curl_easy_getinfo(transfer->curl, CURLINFO_SIZE_DOWNLOAD_T, &dlnow);
+    curl_easy_getinfo(transfer->curl, CURLINFO_SIZE_UPLOAD_T, &ulnow);
+
+    if (!transfer->progress)
+        transfer->progress = std::make_shared<HTTPTransferProgress>();
+
+    HTTPTransferProgress * progress = transfer->progress.get();
+    progress->dltotal = progress->dlnow = static_cast<uint64_t>(dlnow);
+    progress->ultotal = progress->ulnow = static_cast<uint64_t>(ulnow);
+    postProgress(transfer);
+}
+
+static size_t writeFunction(void *contents, size_t size, size_t nmemb, void *userp)
+{
+    size_t realSize = size * nmemb;
+    HTTPTransfer * transfer = reinterpret_cast<HTTPTransfer *>(userp);
+    const HTTPRequestService::Request& request = transfer->request;
+
+    if (transfer->redirected)
+        return realSize;
 
-#ifndef __EMSCRIPTEN__
-    MemoryStream * response = MemoryStream::create();
     long httpResponseCode = 0;
-    CURLcode res;
-
-    {
-        void * curl = NULL;
-
-        curl = curl_easy_init();
-        curl_easy_setopt(curl, CURLOPT_USERAGENT, _userAgentString.c_str());
-        //curl_easy_setopt(curl, CURLOPT_DNS_CACHE_TIMEOUT, -1);
-        curl_easy_setopt(curl, CURLOPT_NOSIGNAL, 1);
-        curl_easy_setopt(curl, CURLOPT_TIMEOUT, 120);
-        curl_easy_setopt(curl, CURLOPT_ERRORBUFFER, errorBuffer);
-        curl_easy_setopt(curl, CURLOPT_TCP_NODELAY, 1);  // make sure packets are sent immediately
-        curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, &writeFunction);
-        curl_easy_setopt(curl, CURLOPT_FOLLOWLOCATION, 1);
-        curl_easy_setopt(curl, CURLOPT_SSL_VERIFYPEER, 0);
-        curl_easy_setopt(curl, CURLOPT_URL, request.url.c_str());
-        curl_easy_setopt(curl, CURLOPT_POSTFIELDS, request.postPayload.c_str());
-        curl_easy_setopt(curl, CURLOPT_POSTFIELDSIZE, request.postPayload.size());
-        curl_easy_setopt(curl, CURLOPT_POST, request.postPayload.empty() ? 0 : 1);
-        curl_easy_setopt(curl, CURLOPT_WRITEDATA, response);
-        curl_easy_setopt(curl, CURLOPT_NOPROGRESS, request.progressCallback ? 0 : 1);
-        curl_easy_setopt(curl, CURLOPT_XFERINFOFUNCTION, &progressFunction);
-        curl_easy_setopt(curl, CURLOPT_XFERINFODATA, &request);
-        //curl_easy_setopt(curl, CURLOPT_IGNORE_CONTENT_LENGTH, 1);
-        if (customRequest == "HEAD")
-        {
-            curl_easy_setopt(curl, CURLOPT_HEADER, 1);
-            curl_easy_setopt(curl, CURLOPT_NOBODY, 1);
-        }
-        else if (!customRequest.empty())
-            curl_easy_setopt(curl, CURLOPT_CUSTOMREQUEST, customRequest.c_str());
+    if (request.dataCallback || !request.downloadPath.empty())
+        curl_easy_getinfo(transfer->curl, CURLINFO_RESPONSE_CODE, &httpResponseCode);
+
+    // error pages are returned to responseCallback as usual
+    if (httpResponseCode == 0 || httpResponseCode >= 300)
+    {
+        transfer->response->write(contents, size, nmemb);
+        return realSize;
+    }
 
-        curl_slist *list = NULL;
-        if (!request.headers.empty())
+    if (request.dataCallback)
+        return request.dataCallback(contents, realSize) ? realSize : 0;
+
+    if (!transfer->file)
+    {
+        // server may ignore Range header and send the whole file
+        transfer->file = fopen(request.downloadPath.c_str(), httpResponseCode == 206 ? "ab" : "wb");
+        if (!transfer->file)
         {
-            for (auto& h : request.headers)
-                list = curl_slist_append(list, (h.first + ": " + h.second).c_str());
+            GP_WARN("Can't open file %s for writing", request.downloadPath.c_str());
+            return 0;
         }
-        curl_easy_setopt(curl, CURLOPT_HTTPHEADER, list);
+    }
 
-        res = curl_easy_perform(curl);
-        curl_slist_free_all(list);
+    return fwrite(contents, 1, realSize, transfer->file) == realSize ? realSize : 0;
+}
 
-        curl_easy_getinfo(curl, CURLINFO_RESPONSE_CODE, &httpResponseCode);
+static bool getHeaderValue(const char * buffer, size_t size, const char * name, std::string * out)
+{
+    size_t nameLength = strlen(name);
+    if (size <= nameLength || !curl_strnequal(buffer, name, nameLength))
+        return false;
 
-        curl_easy_cleanup(curl);
+    const char * begin = buffer + nameLength;
+    const char * end = buffer + size;
+    while (begin < end && isspace(static_cast<unsigned char>(*begin)))
+        begin++;
+    while (end > begin && isspace(static_cast<unsigned char>(*(end - 1))))
+        end--;
 
-        if (res != CURLE_OK)
-            GP_LOG("Failed to perform HTTP request: error %d - %s", res, request.url.c_str());
+    out->assign(begin, end);
+    return true;
+}
+
+static size_t headerFunction(char *buffer, size_t size, size_t nitems, void *userp)
+{
+    size_t realSize = size * nitems;
+    HTTPTransfer * transfer = reinterpret_cast<HTTPTransfer *>(userp);
+    const HTTPRequestService::Request& request = transfer->request;
+
+    // headers of every response are received when redirects are followed
+    if (realSize > 5 && strncmp(buffer, "HTTP/", 5) == 0)
+    {
+        const char * code = static_cast<const char *>(memchr(buffer, ' ', realSize));
+        long httpResponseCode = code ? strtol(code + 1, NULL, 10) : 0;
+        transfer->redirectStatus = httpResponseCode == 301 || httpResponseCode == 302 || httpResponseCode == 303 || httpResponseCode == 307 || httpResponseCode == 308;
+        transfer->redirected = false;
+        transfer->resetCacheHeaders();
+        return realSize;
     }
 
-    if (request.responseCallback)
+    std::string value;
+    if (transfer->redirectStatus && getHeaderValue(buffer, realSize, "location:", &value))
     {
-        if (syncCall)
-        {
-            response->rewind();
-            request.responseCallback(res, response, curl_easy_strerror(res), httpResponseCode);
-            delete response;
-        }
-        else
-        {
-            // response is copied by value since callback is invoked on main thread
-            _taskQueueService->runOnMainThread([=]() { response->rewind(); request.responseCallback(res, response, curl_easy_strerror(res), httpResponseCode); delete response; });
-        }
+        // curl follows the redirect, so the body belongs to neither this nor the final response
+        transfer->redirected = !value.empty();
+    }
+    else if (getHeaderValue(buffer, realSize, "content-length:", &value))
+    {
+        // pre-size response buffer from Content-Length to avoid reallocations while body is received
+        unsigned long long length = strtoull(value.c_str(), NULL, 10);
+        if (!transfer->redirectStatus && !request.dataCallback && request.downloadPath.empty() && length > 0 && length <= MAX_RESERVED_RESPONSE_SIZE)
+            transfer->response->reserve(static_cast<size_t>(length));
+    }
+    else if (!transfer->cache)
+    {
+        return realSize;
     }
+    else if (getHeaderValue(buffer, realSize, "etag:", &value))
+    {
+        transfer->etag = value;
+    }
+    else if (getHeaderValue(buffer, realSize, "last-modified:", &value))
+    {
+        transfer->lastModified = value;
+    }
+    else if (getHeaderValue(buffer, realSize, "expires:", &value))
+    {
+        time_t expires = curl_getdate(value.c_str(), NULL);
+        transfer->expires = expires > 0 ? static_cast<int64_t>(expires) : 0;
+    }
+    else if (getHeaderValue(buffer, realSize, "cache-control:", &value))
+    {
+        std::transform(value.begin(), value.end(), value.begin(), ::tolower);
+        transfer->noStore = transfer->noStore || value.find("no-store") != std::string::npos;
+        transfer->noCache = transfer->noCache || value.find("no-cache") != std::string::npos;
 
-#else
-    
-    std::string additionalHeaders;  // headers in JSON format
-    if (!request.headers.empty())
+        size_t maxAge = value.find("max-age=");
+        if (maxAge != std::string::npos && (maxAge == 0 || value[maxAge - 1] != '-'))
+            transfer->maxAge = strtoll(value.c_str() + maxAge + 8, NULL, 10);
+    }
+    else if (getHeaderValue(buffer, realSize, "vary:", &value))
     {
-        additionalHeaders += "{";
-        for (auto& h : request.headers)
+        transfer->noStore = transfer->noStore || value.find('*') != std::string::npos;
+    }
+
+    return realSize;
+}
+
+static void setupTransfer(HTTPTransfer * transfer, CURL * curl, const std::string& userAgent, CURLSH * share)
+{
+    const HTTPRequestService::Request& request = transfer->request;
+    const std::string& customRequest = transfer->customRequest;
+
+    transfer->curl = curl;
+    curl_easy_setopt(curl, CURLOPT_PRIVATE, transfer);
+    curl_easy_setopt(curl, CURLOPT_SHARE, share);
+    curl_easy_setopt(curl, CURLOPT_USERAGENT, userAgent.c_str());
+    curl_easy_setopt(curl, CURLOPT_DNS_CACHE_TIMEOUT, 300);
+    curl_easy_setopt(curl, CURLOPT_HTTP_VERSION, CURL_HTTP_VERSION_2TLS);
+    // prefer multiplexing over an existing connection to opening a new one, HTTP/2 is only negotiated over TLS
+    curl_easy_setopt(curl, CURLOPT_PIPEWAIT, request.url.compare(0, 8, "https://") == 0 ? 1 : 0);
+    curl_easy_setopt(curl, CURLOPT_TCP_KEEPALIVE, 1);
+    curl_easy_setopt(curl, CURLOPT_NOSIGNAL, 1);
+    curl_easy_setopt(curl, CURLOPT_TIMEOUT, 120);
+    curl_easy_setopt(curl, CURLOPT_ERRORBUFFER, transfer->errorBuffer);
+    curl_easy_setopt(curl, CURLOPT_TCP_NODELAY, 1);  // make sure packets are sent immediately
+    curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, &writeFunction);
+    curl_easy_setopt(curl, CURLOPT_FOLLOWLOCATION, 1);
+    curl_easy_setopt(curl, CURLOPT_SSL_VERIFYPEER, 0);
+    curl_easy_setopt(curl, CURLOPT_URL, request.url.c_str());
+    curl_easy_setopt(curl, CURLOPT_POSTFIELDS, request.postPayload.c_str());
+    curl_easy_setopt(curl, CURLOPT_POSTFIELDSIZE, request.postPayload.size());
+    curl_easy_setopt(curl, CURLOPT_POST, request.postPayload.empty() ? 0 : 1);
+    curl_easy_setopt(curl, CURLOPT_WRITEDATA, transfer);
+    if (!request.dataCallback && !request.downloadPath.empty())
+    {
+        // unlike CURLOPT_RESUME_FROM, a range doesn't fail the request when server sends the whole file
+        struct stat st;
+        if (stat(request.downloadPath.c_str(), &st) == 0 && st.st_size > 0)
         {
-            additionalHeaders += "\"";
-            additionalHeaders += h.first;
-            additionalHeaders += "\":\"";
-            additionalHeaders += h.second;
-            additionalHeaders += "\",";
+            transfer->range = std::to_string(static_cast<uint64_t>(st.st_size)) + "-";
+            curl_easy_setopt(curl, CURLOPT_RANGE, transfer->range.c_str());
         }
-        additionalHeaders.pop_back();
-        additionalHeaders += "}";
     }
 
-    Request * newRequest = new Request(request);
+    if (customRequest != "HEAD")
+    {
+        curl_easy_setopt(curl, CURLOPT_HEADERFUNCTION, &headerFunction);
+        curl_easy_setopt(curl, CURLOPT_HEADERDATA, transfer);
+    }
+    curl_easy_setopt(curl, CURLOPT_NOPROGRESS, request.progressCallback ? 0 : 1);
+    curl_easy_setopt(curl, CURLOPT_XFERINFOFUNCTION, &progressFunction);
+    curl_easy_setopt(curl, CURLOPT_XFERINFODATA, transfer);
+    //curl_easy_setopt(curl, CURLOPT_IGNORE_CONTENT_LENGTH, 1);
+    if (customRequest == "HEAD")
+    {
+        curl_easy_setopt(curl, CURLOPT_HEADER, 1);
+        curl_easy_setopt(curl, CURLOPT_NOBODY, 1);
+    }
+    else if (!customRequest.empty())
+        curl_easy_setopt(curl, CURLOPT_CUSTOMREQUEST, customRequest.c_str());
 
-    __requestCount++;
-    emscripten_async_wget3_data(request.url.c_str(), customRequest.empty() ? (request.postPayload.empty() ? "GET" : "POST") : customRequest.c_str(), request.postPayload.c_str(), request.postPayload.size(),
-        additionalHeaders.c_str(), newRequest, true, &HTTPRequestService::requestLoadCallback, &HTTPRequestService::requestErrorCallback, 
-        request.progressCallback ? &HTTPRequestService::requestProgressCallback : NULL, withCredentials);
+    for (auto& h : request.headers)
+        transfer->headers = curl_slist_append(transfer->headers, (h.first + ": " + h.second).c_str());
 
-#endif
+    if (transfer->cachedEntry.body)
+    {
+        if (!transfer->cachedEntry.etag.empty())
+            transfer->headers = curl_slist_append(transfer->headers, ("If-None-Match: " + transfer->cachedEntry.etag).c_str());
+        if (!transfer->cachedEntry.lastModified.empty())
+            transfer->headers = curl_slist_append(transfer->headers, ("If-Modified-Since: " + transfer->cachedEntry.lastModified).c_str());
+    }
+    curl_easy_setopt(curl, CURLOPT_HTTPHEADER, transfer->headers);
 }
 
-size_t HTTPRequestService::writeFunction(void *contents, size_t size, size_t nmemb, void *userp)
+static bool copyFile(const std::string& from, const std::string& to)
 {
-    size_t realSize = size * nmemb;
-    gameplay::Stream * response = reinterpret_cast<gameplay::Stream *>(userp);
+    if (from == to)
+        return true;
 
-    response->write(contents, size, nmemb);
+    FILE * src = fopen(from.c_str(), "rb");
+    if (!src)
+        return false;
 
-    return realSize;
+    FILE * dst = fopen(to.c_str(), "wb");
+    if (!dst)
+    {
+        fclose(src);
+        return false;
+    }
+
+    bool res = true;
+    uint8_t buffer[16384];
+    size_t read;
+    while (res && (read = fread(buffer, 1, sizeof(buffer), src)) > 0)
+        res = fwrite(buffer, 1, read, dst) == read;
+
+    fclose(src);
+    return fclose(dst) == 0 && res;
 }
 
-const char * HTTPRequestService::getTaskQueueName()
+static std::string getCancelledDownloadPath(const HTTPRequestService::Request& request)
 {
-    return HTTP_REQUEST_SERVICE_QUEUE;
-}
\ No newline at end of file
+    return request.removeDownloadOnCancel && !request.dataCallback ? request.downloadPath : std::string();
+}
+
+static void removeCancelledDownload(const std::string& path)
+{
+    if (!path.empty())
+        remove(path.c_str());
+}
+
+static void deliverResponse(std::unique_ptr<HTTPTransfer>& transfer, CURLcode res, long httpResponseCode, bool syncCall)
+{
+    if (!transfer->followers.empty())
+    {
+        // all followers share a single copy of the response body
+        std::shared_ptr<std::vector<uint8_t>> body = std::make_shared<std::vector<uint8_t>>();
+        if (transfer->response->length() > 0)
+            body->assign(transfer->response->getBuffer(), transfer->response->getBuffer() + transfer->response->length());
+
+        // resumed download (206) or already complete file (416) leaves the whole file at the leader's path as well
+        bool downloaded = res == CURLE_OK && (httpResponseCode == 200 || httpResponseCode == 206 || httpResponseCode == 416)
+            && !transfer->request.downloadPath.empty();
+        for (std::unique_ptr<HTTPTransfer>& follower : transfer->followers)
+        {
+            if (*follower->cancelled)
+                continue;
+
+            follower->response.reset(body->empty() ? MemoryStream::create() : MemoryStream::create(body->data(), body->size(), body));
+
+            CURLcode followerRes = res;
+            if (downloaded && !copyFile(transfer->request.downloadPath, follower->request.downloadPath))
+            {
+                GP_WARN("Can't copy downloaded file to %s", follower->request.downloadPath.c_str());
+                followerRes = CURLE_WRITE_ERROR;
+            }
+
+            deliverResponse(follower, followerRes, httpResponseCode, syncCall);
+        }
+        transfer->followers.clear();
+    }
+
+    // downloaded file of cancelled leader is no longer needed once it's copied to followers
+    if (*transfer->cancelled)
+    {
+        removeCancelledDownload(getCancelledDownloadPath(transfer->request));
+        return;
+    }
+
+    auto callback = transfer->request.responseCallback;
+    if (!callback)
+        return;
+
+    MemoryStream * response = transfer->response.release();
+    if (syncCall)
+    {
+        response->rewind();
+        callback(res, response, curl_easy_strerror(res), httpResponseCode);
+        delete response;
+    }
+    else
+    {
+        // callback is copied by value since it is invoked on main thread,
+        // request may be cancelled while callback is waiting in main thread's queue
+        std::shared_ptr<std::atomic_bool> cancelled = transfer->cancelled;
+        std::string cancelledDownloadPath = getCancelledDownloadPath(transfer->request);
+        std::shared_ptr<HTTPRequestStatistics> statistics = transfer->statistics;
+        HTTPRequestStatistics::Clock::time_point startTime = transfer->startTime;
+        HTTPRequestStatistics::Clock::time_point postTime = HTTPRequestStatistics::Clock::now();
+        ServiceManager::getInstance()->findService<TaskQueueService>()->runOnMainThread([=]() {
+            if (!*cancelled)
+            {
+                if (statistics)
+                    statistics->addCallback(startTime, postTime);
+
+                response->rewind();
+                callback(res, response, curl_easy_strerror(res), httpResponseCode);
+            }
+            else
+            {
+                removeCancelledDownload(cancelledDownloadPath);
+            }
+            delete response;
+        });
+    }
+}
+
+static void setResponseFromCache(HTTPTransfer * transfer)
+{
+    const std::shared_ptr<const std::vector<uint8_t>>& body = transfer->cachedEntry.body;
+    if (!transfer->request.downloadPath.empty())
+    {
+        FILE * file = fopen(transfer->request.downloadPath.c_str(), "wb");
+        if (file)
+        {
+            fwrite(body->data(), 1, body->size(), file);
+            fclose(file);
+        }
+
+        transfer->response.reset(MemoryStream::create());
+    }
+    else
+    {
+        // response shares memory with the cache
+        transfer->response.reset(body->empty() ? MemoryStream::create() : MemoryStream::create(body->data(), body->size(), body));
+    }
+}
+
+static bool useCachedResponse(HTTPTransfer * transfer)
+{
+    if (!transfer->cache || !transfer->cache->find(transfer->cacheKey, &transfer->cachedEntry))
+        return false;
+
+    // stale response is revalidated with conditional request
+    if (!transfer->cachedEntry.isFresh())
+        return false;
+
+    setResponseFromCache(transfer);
+    return true;
+}
+
+static void cacheResponse(HTTPTransfer * transfer, long * httpResponseCode)
+{
+    int64_t now = static_cast<int64_t>(time(NULL));
+    int64_t expires = transfer->noCache ? 0 : (transfer->maxAge >= 0 ? now + transfer->maxAge : std::max<int64_t>(transfer->expires, 0));
+
+    if (*httpResponseCode == 304 && transfer->cachedEntry.body)
+    {
+        HTTPResponseCache::Entry& entry = transfer->cachedEntry;
+        if (!transfer->etag.empty())
+            entry.etag = transfer->etag;
+        if (!transfer->lastModified.empty())
+            entry.lastModified = transfer->lastModified;
+        entry.expires = expires;
+        transfer->cache->store(transfer->cacheKey, entry);
+
+        // caller gets the cached response as if it was sent by server
+        setResponseFromCache(transfer);
+        *httpResponseCode = 200;
+        return;
+    }
+
+    if (*httpResponseCode != 200 || !transfer->range.empty() || transfer->noStore || (transfer->etag.empty() && transfer->lastModified.empty() && expires <= now))
+        return;
+
+    HTTPResponseCache::Entry entry;
+    entry.etag = transfer->etag;
+    entry.lastModified = transfer->lastModified;
+    entry.expires = expires;
+
+    if (transfer->request.downloadPath.empty())
+    {
+        if (transfer->response->length() > transfer->cache->getMaxEntrySize())
+            return;
+
+        // take the body from response without copying it
+        std::shared_ptr<std::vector<uint8_t>> body = std::make_shared<std::vector<uint8_t>>(transfer->response->releaseBuffer());
+        transfer->response.reset(body->empty() ? MemoryStream::create() : MemoryStream::create(body->data(), body->size(), body));
+        entry.body = body;
+    }
+    else
+    {
+        struct stat st;
+        if (stat(transfer->request.downloadPath.c_str(), &st) != 0 || static_cast<size_t>(st.st_size) > transfer->cache->getMaxEntrySize())
+            return;
+
+        FILE * file = fopen(transfer->request.downloadPath.c_str(), "rb");
+        if (!file)
+            return;
+
+        std::shared_ptr<std::vector<uint8_t>> body = std::make_shared<std::vector<uint8_t>>();
+        uint8_t buffer[16384];
+        size_t read;
+        while ((read = fread(buffer, 1, sizeof(buffer), file)) > 0)
+            body->insert(body->end(), buffer, buffer + read);
+        fclose(file);
+        entry.body = body;
+    }
+
+    transfer->cache->store(transfer->cacheKey, entry);
+}
+
+static long detachTransfer(HTTPTransfer * transfer, CURLcode res)
+{
+    long httpResponseCode = 0;
+    curl_easy_getinfo(transfer->curl, CURLINFO_RESPONSE_CODE, &httpResponseCode);
+    if (transfer->statistics)
+        transfer->statistics->addTransfer(transfer->curl, res);
+    postFinalProgress(transfer, res);
+    transfer->curl = NULL;
+
+    return httpResponseCode;
+}
+
+static void completeTransfer(std::unique_ptr<HTTPTransfer>& transfer, CURLcode res, long httpResponseCode, bool syncCall)
+{
+    if (transfer->file)
+    {
+        fclose(transfer->file);
+        transfer->file = NULL;
+    }
+    else if (!transfer->request.dataCallback && !transfer->request.downloadPath.empty() && res == CURLE_OK && httpResponseCode == 200)
+    {
+        // empty body, make sure the file is truncated as well
+        FILE * file = fopen(transfer->request.downloadPath.c_str(), "wb");
+        if (file)
+            fclose(file);
+    }
+
+    if (res != CURLE_OK)
+        GP_LOG("Failed to perform HTTP request: error %d - %s", res, transfer->request.url.c_str());
+    else if (transfer->cache)
+        cacheResponse(transfer.get(), &httpResponseCode);
+
+    deliverResponse(transfer, res, httpResponseCode, syncCall);
+}
+
+#endif
+
+bool HTTPRequestService::hasActiveEmscriptenHTTPRequest() const
+{
+    return __requestCount > 0;
+}
+
+int HTTPRequestService::sendRequest(const Request& request, bool syncCall, std::string customRequest, bool withCredentials)
+{
+    if (request.url.empty()) {
+        // if request url is empty, immediately calll callback with error code
+        if (request.responseCallback)
+        {
+            if (syncCall)
+            {
+                request.responseCallback(-1, nullptr, "", 0);
+            }
+            else
+            {
+                // response is copied by value since callback is invoked on main thread
+                _taskQueueService->runOnMainThread([=]() { request.responseCallback(-1, nullptr, "", 0); });
+            }
+        }
+
+        return -1;
+    }
+
+#ifdef _DEBUG
+    GP_LOG("Sending HTTP request: %s, %s: %s", request.url.c_str(),
+        customRequest.empty() ? (request.postPayload.empty() ? "GET" : "POST") : customRequest.c_str(), request.postPayload.c_str());
+#endif
+
+#ifndef __EMSCRIPTEN__
+    std::unique_ptr<HTTPTransfer> transfer(new HTTPTransfer());
+    transfer->request = request;
+    transfer->customRequest = customRequest;
+    transfer->response.reset(MemoryStream::create());
+
+    std::string key;
+    if (request.postPayload.empty() && customRequest.empty() && !request.dataCallback)
+    {
+        key = request.url;
+        for (auto& h : request.headers)
+            key += "\n" + h.first + ": " + h.second;
+    }
+
+    if (_cache && !key.empty())
+    {
+        transfer->cache = _cache;
+        transfer->cacheKey = key;
+    }
+
+    if (!syncCall && _engine)
+    {
+        // downloads to file are only coalesced with other downloads to file
+        if (!key.empty())
+            transfer->requestKey = request.downloadPath.empty() ? key : key + "\n>file";
+
+        int id = ++__requestId;
+        transfer->id = id;
+        transfer->statistics = _statistics;
+        transfer->startTime = HTTPRequestStatistics::Clock::now();
+        _engine->addTransfer(transfer);
+        return id;
+    }
+
+    if (useCachedResponse(transfer.get()))
+    {
+        deliverResponse(transfer, CURLE_OK, 200, syncCall);
+        return -1;
+    }
+
+    CURL * curl = curl_easy_init();
+    setupTransfer(transfer.get(), curl, _userAgentString, _engine ? _engine->getShareHandle() : NULL);
+    CURLcode res = curl_easy_perform(curl);
+    completeTransfer(transfer, res, detachTransfer(transfer.get(), res), syncCall);
+    curl_easy_cleanup(curl);
+    return -1;
+
+#else
+    
+    std::string additionalHeaders;  // headers in JSON format
+    if (!request.headers.empty())
+    {
+        JSONWriter writer(&additionalHeaders);
+        writer.beginObject();
+        for (auto& h : request.headers)
+        {
+            writer.key(h.first.c_str(), h.first.size());
+            writer.writeString(h.second);
+        }
+        writer.endObject();
+    }
+
+    Request * newRequest = new Request(request);
+    int id = ++__requestId;
+    __emscriptenRequests[id] = newRequest;
+
+    __requestCount++;
+    emscripten_async_wget3_data(request.url.c_str(), customRequest.empty() ? (request.postPayload.empty() ? "GET" : "POST") : customRequest.c_str(), request.postPayload.c_str(), request.postPayload.size(),
+        additionalHeaders.c_str(), newRequest, true, &HTTPRequestService::requestLoadCallback, &HTTPRequestService::requestErrorCallback, 
+        request.progressCallback ? &HTTPRequestService::requestProgressCallback : NULL, withCredentials);
+
+    return id;
+#endif
+}
+
+const char * HTTPRequestService::getTaskQueueName()
+{
+    return HTTP_REQUEST_SERVICE_QUEUE;
+}
+
+
+
+
+
+
+#ifndef __EMSCRIPTEN__
+
+//
+// HTTPRequestStatistics
+//
+
+void HTTPRequestStatistics::reset()
+{
+    std::unique_lock<std::mutex> lock(_mutex);
+
+    _statistics = HTTPRequestService::Statistics();
+    _startTime = Clock::now();
+    _latencies.clear();
+    _callbackDelays.clear();
+    _nextLatency = _nextCallbackDelay = 0;
+}
+
+void HTTPRequestStatistics::addTransfer(CURL * curl, CURLcode result)
+{
+    curl_off_t bytes = 0;
+    long connections = 0;
+    curl_easy_getinfo(curl, CURLINFO_SIZE_DOWNLOAD_T, &bytes);
+    curl_easy_getinfo(curl, CURLINFO_NUM_CONNECTS, &connections);
+
+    std::unique_lock<std::mutex> lock(_mutex);
+
+    _statistics.requests++;
+    _statistics.failedRequests += result != CURLE_OK ? 1 : 0;
+    _statistics.connections += static_cast<uint64_t>(connections);
+    _statistics.bytesReceived += static_cast<uint64_t>(bytes);
+}
+
+void HTTPRequestStatistics::addCachedResponse()
+{
+    std::unique_lock<std::mutex> lock(_mutex);
+
+    _statistics.requests++;
+    _statistics.cachedResponses++;
+}
+
+void HTTPRequestStatistics::addCallback(Clock::time_point startTime, Clock::time_point postTime)
+{
+    Clock::time_point now = Clock::now();
+
+    std::unique_lock<std::mutex> lock(_mutex);
+
+    addSample(_latencies, _nextLatency, std::chrono::duration<float, std::milli>(now - startTime).count());
+    addSample(_callbackDelays, _nextCallbackDelay, std::chrono::duration<float, std::milli>(now - postTime).count());
+}
+
+HTTPRequestService::Statistics HTTPRequestStatistics::get() const
+{
+    std::unique_lock<std::mutex> lock(_mutex);
+
+    HTTPRequestService::Statistics res = _statistics;
+    res.duration = std::chrono::duration<float>(Clock::now() - _startTime).count();
+    res.latencyP50 = getPercentile(_latencies, 0.5f);
+    res.latencyP99 = getPercentile(_latencies, 0.99f);
+    res.callbackDelayP50 = getPercentile(_callbackDelays, 0.5f);
+    res.callbackDelayP99 = getPercentile(_callbackDelays, 0.99f);
+    return res;
+}
+
+void HTTPRequestStatistics::addSample(std::vector<float>& samples, size_t& next, float value)
+{
+    if (samples.size() < MAX_LATENCY_SAMPLES)
+        samples.push_back(value);
+    else
+        samples[next] = value;
+    next = (next + 1) % MAX_LATENCY_SAMPLES;
+}
+
+float HTTPRequestStatistics::getPercentile(std::vector<float> samples, float percentile)
+{
+    if (samples.empty())
+        return 0.0f;
+
+    auto it = samples.begin() + static_cast<size_t>(percentile * (samples.size() - 1) + 0.5f);
+    std::nth_element(samples.begin(), it, samples.end());
+    return *it;
+}
+
+
+
+//
+// HTTPCacheWorker
+//
+
+void HTTPCacheWorker::run()
+{
+    for (;;)
+    {
+        std::function<void()> job;
+        {
+            std::unique_lock<std::mutex> lock(_mutex);
+            while (_active && _jobs.empty())
+                _hasJobs.wait(lock);
+            if (!_active)
+                return;
+
+            job = std::move(_jobs.front());
+            _jobs.pop_front();
+        }
+
+        job();
+    }
+}
+
+void HTTPCacheWorker::stop()
+{
+    std::unique_lock<std::mutex> lock(_mutex);
+    _active = false;
+    _hasJobs.notify_one();
+}
+
+void HTTPCacheWorker::addJob(const std::function<void()>& job)
+{
+    std::unique_lock<std::mutex> lock(_mutex);
+    _jobs.push_back(job);
+    _hasJobs.notify_one();
+}
+
+
+
+//
+// HTTPTransferEngine
+//
+
+static std::string getHostKey(const std::string& url)
+{
+    size_t start = url.find("://");
+    start = start == std::string::npos ? 0 : start + 3;
+
+    std::string host = url.substr(start, url.find_first_of("/?#", start) - start);
+    size_t userInfo = host.rfind('@');
+    if (userInfo != std::string::npos)
+        host.erase(0, userInfo + 1);
+
+    std::transform(host.begin(), host.end(), host.begin(), ::tolower);
+    return host;
+}
+
+HTTPTransferEngine::HTTPTransferEngine(const std::string& userAgent, const std::shared_ptr<HTTPCacheWorker>& cacheWorker)
+    : _userAgent(userAgent)
+    , _cacheWorker(cacheWorker)
+    , _cancelFlagsPurgeSize(64)
+    , _active(true)
+    , _hasCancelledTransfers(false)
+    , _maxRequests(DEFAULT_MAX_REQUESTS)
+    , _maxRequestsPerHost(DEFAULT_MAX_REQUESTS_PER_HOST)
+{
+    _share = curl_share_init();
+    curl_share_setopt(_share, CURLSHOPT_LOCKFUNC, &HTTPTransferEngine::lockShare);
+    curl_share_setopt(_share, CURLSHOPT_UNLOCKFUNC, &HTTPTransferEngine::unlockShare);
+    curl_share_setopt(_share, CURLSHOPT_USERDATA, this);
+    curl_share_setopt(_share, CURLSHOPT_SHARE, CURL_LOCK_DATA_DNS);
+    curl_share_setopt(_share, CURLSHOPT_SHARE, CURL_LOCK_DATA_SSL_SESSION);
+    curl_share_setopt(_share, CURLSHOPT_SHARE, CURL_LOCK_DATA_CONNECT);
+
+    _multi = curl_multi_init();
+    curl_multi_setopt(_multi, CURLMOPT_PIPELINING, CURLPIPE_MULTIPLEX);
+
+    // curl's default limit is 4 idle connections per running transfer, so connections were
+    // closed whenever only a few transfers were running between responses
+    curl_multi_setopt(_multi, CURLMOPT_MAXCONNECTS, MAX_IDLE_CONNECTIONS);
+}
+
+HTTPTransferEngine::~HTTPTransferEngine()
+{
+    for (auto& it : _running)
+    {
+        curl_multi_remove_handle(_multi, it.first);
+        curl_easy_cleanup(it.first);
+    }
+    _running.clear();
+
+    for (CURL * curl : _idleHandles)
+        curl_easy_cleanup(curl);
+    _idleHandles.clear();
+
+    curl_multi_cleanup(_multi);
+    curl_share_cleanup(_share);
+}
+
+void HTTPTransferEngine::lockShare(CURL *, curl_lock_data data, curl_lock_access, void * userp)
+{
+    reinterpret_cast<HTTPTransferEngine *>(userp)->_shareMutexes[data].lock();
+}
+
+void HTTPTransferEngine::unlockShare(CURL *, curl_lock_data data, void * userp)
+{
+    reinterpret_cast<HTTPTransferEngine *>(userp)->_shareMutexes[data].unlock();
+}
+
+void HTTPTransferEngine::addTransfer(std::unique_ptr<HTTPTransfer>& transfer)
+{
+    transfer->host = getHostKey(transfer->request.url);
+
+    {
+        std::unique_lock<std::mutex> lock(_incomingMutex);
+
+        // flags of finished requests expire once their callbacks are invoked
+        if (_cancelFlags.size() >= _cancelFlagsPurgeSize)
+        {
+            for (auto it = _cancelFlags.begin(); it != _cancelFlags.end(); )
+                it = (*it).second.expired() ? _cancelFlags.erase(it) : std::next(it);
+            _cancelFlagsPurgeSize = std::max<size_t>(64, _cancelFlags.size() * 2);
+        }
+
+        _cancelFlags[transfer->id] = transfer->cancelled;
+        _incoming.push_back(std::move(transfer));
+    }
+
+    curl_multi_wakeup(_multi);
+}
+
+void HTTPTransferEngine::cancelTransfer(int id)
+{
+    {
+        std::unique_lock<std::mutex> lock(_incomingMutex);
+
+        auto it = _cancelFlags.find(id);
+        if (it == _cancelFlags.end())
+            return;
+
+        std::shared_ptr<std::atomic_bool> cancelled = (*it).second.lock();
+        _cancelFlags.erase(it);
+        if (!cancelled)
+            return;
+
+        *cancelled = true;
+    }
+
+    _hasCancelledTransfers = true;
+    curl_multi_wakeup(_multi);
+}
+
+void HTTPTransferEngine::setMaxRequests(int count)
+{
+    _maxRequests = count;
+    curl_multi_wakeup(_multi);
+}
+
+void HTTPTransferEngine::setMaxRequestsPerHost(int count)
+{
+    _maxRequestsPerHost = count;
+    curl_multi_wakeup(_multi);
+}
+
+void HTTPTransferEngine::stop()
+{
+    _active = false;
+    _cacheWorker->stop();
+    curl_multi_wakeup(_multi);
+}
+
+void HTTPTransferEngine::run()
+{
+    std::deque<std::unique_ptr<HTTPTransfer>> incoming;
+    while (_active)
+    {
+        {
+            std::unique_lock<std::mutex> lock(_incomingMutex);
+            incoming.swap(_incoming);
+        }
+
+        // fresh cached responses don't need to wait for their turn
+        for (std::unique_ptr<HTTPTransfer>& transfer : incoming)
+        {
+            if (*transfer->cancelled)
+                continue;
+
+            if (transfer->cache && !transfer->cacheChecked)
+                checkCache(transfer);
+            else
+                addWaitingTransfer(transfer);
+        }
+        incoming.clear();
+
+        if (_hasCancelledTransfers.exchange(false))
+            removeCancelledTransfers();
+
+        startTransfers();
+
+        int runningHandles = 0;
+        curl_multi_perform(_multi, &runningHandles);
+
+        bool finished = false;
+        int messagesLeft = 0;
+        while (CURLMsg * message = curl_multi_info_read(_multi, &messagesLeft))
+        {
+            if (message->msg != CURLMSG_DONE)
+                continue;
+
+            CURL * curl = message->easy_handle;
+            CURLcode result = message->data.result;
+            finishTransfer(curl, result);
+            finished = true;
+        }
+
+        // finished requests may have freed slots for waiting ones
+        if (!finished)
+            curl_multi_poll(_multi, NULL, 0, 1000, NULL);
+    }
+}
+
+void HTTPTransferEngine::checkCache(std::unique_ptr<HTTPTransfer>& transfer)
+{
+    runOnCacheQueue(transfer, [this](std::unique_ptr<HTTPTransfer>& transfer)
+    {
+        transfer->cacheChecked = true;
+        if (*transfer->cancelled)
+            return;
+
+        if (useCachedResponse(transfer.get()))
+        {
+            if (transfer->statistics)
+                transfer->statistics->addCachedResponse();
+            deliverResponse(transfer, CURLE_OK, 200, false);
+        }
+        else
+        {
+            returnTransfer(transfer);
+        }
+    });
+}
+
+void HTTPTransferEngine::returnTransfer(std::unique_ptr<HTTPTransfer>& transfer)
+{
+    {
+        std::unique_lock<std::mutex> lock(_incomingMutex);
+        _incoming.push_back(std::move(transfer));
+    }
+
+    curl_multi_wakeup(_multi);
+}
+
+void HTTPTransferEngine::runOnCacheQueue(std::unique_ptr<HTTPTransfer>& transfer, const std::function<void(std::unique_ptr<HTTPTransfer>&)>& job)
+{
+    // worker's jobs must be copyable, engine outlives them since both queues are removed before the engine is destroyed
+    std::shared_ptr<std::unique_ptr<HTTPTransfer>> holder = std::make_shared<std::unique_ptr<HTTPTransfer>>(std::move(transfer));
+    _cacheWorker->addJob([holder, job]() { job(*holder); });
+}
+
+static bool compareTransferPriority(const std::unique_ptr<HTTPTransfer>& a, const std::unique_ptr<HTTPTransfer>& b)
+{
+    return a->request.priority > b->request.priority;
+}
+
+void HTTPTransferEngine::addWaitingTransfer(std::unique_ptr<HTTPTransfer>& transfer)
+{
+    if (!transfer->requestKey.empty())
+    {
+        auto it = _inFlight.find(transfer->requestKey);
+        if (it != _inFlight.end())
+        {
+            // identical request is already in flight, wait for its response
+            HTTPTransfer * leader = (*it).second;
+            if (leader->request.priority < transfer->request.priority)
+            {
+                leader->request.priority = transfer->request.priority;
+                if (!leader->curl)
+                    std::stable_sort(_waiting.begin(), _waiting.end(), &compareTransferPriority);
+            }
+
+            leader->followers.push_back(std::move(transfer));
+            return;
+        }
+
+        _inFlight[transfer->requestKey] = transfer.get();
+    }
+
+    // requests of the same priority are started in order they were sent
+    _waiting.insert(std::upper_bound(_waiting.begin(), _waiting.end(), transfer, &compareTransferPriority), std::move(transfer));
+}
+
+void HTTPTransferEngine::removeCancelledTransfers()
+{
+    for (auto it = _waiting.begin(); it != _waiting.end(); )
+    {
+        if ((*it)->isCancelled())
+        {
+            if (!(*it)->requestKey.empty())
+                _inFlight.erase((*it)->requestKey);
+            removeCancelledDownload(getCancelledDownloadPath((*it)->request));
+            it = _waiting.erase(it);
+        }
+        else
+        {
+            it++;
+        }
+    }
+
+    std::vector<CURL *> cancelled;
+    for (auto& it : _running)
+        if (it.second->isCancelled())
+            cancelled.push_back(it.first);
+
+    // transfer is destroyed along with its partially received response,
+    // downloaded file is removed after the transfer closes it
+    for (CURL * curl : cancelled)
+    {
+        std::unique_ptr<HTTPTransfer> transfer = removeRunningTransfer(curl);
+        releaseHandle(curl);
+
+        std::string cancelledDownloadPath = getCancelledDownloadPath(transfer->request);
+        transfer.reset();
+        removeCancelledDownload(cancelledDownloadPath);
+    }
+}
+
+void HTTPTransferEngine::startTransfers()
+{
+    int maxRequests = _maxRequests;
+    int maxRequestsPerHost = _maxRequestsPerHost;
+    for (auto it = _waiting.begin(); it != _waiting.end(); )
+    {
+        if (maxRequests > 0 && _running.size() >= static_cast<size_t>(maxRequests))
+            break;
+
+        int& running = _runningPerHost[(*it)->host];
+        if (maxRequestsPerHost > 0 && running >= maxRequestsPerHost)
+        {
+            it++;
+            continue;
+        }
+
+        CURL * curl;
+        if (_idleHandles.empty())
+        {
+            curl = curl_easy_init();
+        }
+        else
+        {
+            curl = _idleHandles.back();
+            _idleHandles.pop_back();
+        }
+
+        running++;
+        setupTransfer((*it).get(), curl, _userAgent, _share);
+        curl_multi_add_handle(_multi, curl);
+        _running[curl] = std::move(*it);
+        it = _waiting.erase(it);
+    }
+}
+
+void HTTPTransferEngine::finishTransfer(CURL * curl, CURLcode result)
+{
+    std::unique_ptr<HTTPTransfer> transfer = removeRunningTransfer(curl);
+    long httpResponseCode = detachTransfer(transfer.get(), result);
+    releaseHandle(curl);
+
+    // cached responses and downloaded files of coalesced requests are written on the cache queue
+    if (transfer->cache)
+        runOnCacheQueue(transfer, [result, httpResponseCode](std::unique_ptr<HTTPTransfer>& transfer) { completeTransfer(transfer, result, httpResponseCode, false); });
+    else
+        completeTransfer(transfer, result, httpResponseCode, false);
+}
+
+std::unique_ptr<HTTPTransfer> HTTPTransferEngine::removeRunningTransfer(CURL * curl)
+{
+    curl_multi_remove_handle(_multi, curl);
+
+    auto it = _running.find(curl);
+    GP_ASSERT(it != _running.end());
+    std::unique_ptr<HTTPTransfer> transfer = std::move((*it).second);
+    _running.erase(it);
+
+    auto host = _runningPerHost.find(transfer->host);
+    if (host != _runningPerHost.end() && --(*host).second <= 0)
+        _runningPerHost.erase(host);
+
+    // identical requests sent from now on are performed again
+    if (!transfer->requestKey.empty())
+        _inFlight.erase(transfer->requestKey);
+
+    return transfer;
+}
+
+void HTTPTransferEngine::releaseHandle(CURL * curl)
+{
+    // easy handles keep their internal buffers between requests
+    if (_idleHandles.size() < MAX_IDLE_HANDLES)
+    {
+        curl_easy_reset(curl);
+        _idleHandles.push_back(curl);
+    }
+    else
+    {
+        curl_easy_cleanup(curl);
+    }
+}
+
+#endif
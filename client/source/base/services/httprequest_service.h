@@ -12,6 +12,10 @@
  * response as well as CURL error code in case of any error.
  * This service works on top of TaskQueueService, it creates
  * a new dedicated queue and send request asynchorniously.
+ *
+ * Asynchronous requests are processed concurrently by a single curl multi
+ * handle running on the service's queue. All requests share connections,
+ * DNS cache and TLS sessions, HTTP/2 requests to the same host are multiplexed.
  */
 class HTTPRequestService : public Service
 {
@@ -21,27 +25,77 @@ public:
     /**
      * Request structure used to send HTTP requests.
      * Response is returned via responseCallback which accepts error code, a Stream with response data and a error string.
+     * Bodies of error responses (HTTP code 300 and above) are always returned in the Stream,
+     * bodies of redirects are skipped since redirects are followed.
      */
     struct Request
     {
         typedef std::vector<std::pair<std::string, std::string> > HeadersList;
 
+        enum Priority
+        {
+            PRIORITY_LOW = -1,
+            PRIORITY_NORMAL = 0,
+            PRIORITY_HIGH = 1,
+        };
+
         std::string url;
         std::string postPayload;
         HeadersList headers;
         std::function<void(int, class MemoryStream *, const char *, long)> responseCallback;    // error code, response, error, http response
 
-        // progress callback, can be invoked from separate thread
+        // progress callback, invoked on main thread at most 10 times a second with the latest progress of the request
         // agruments and return value match the ones of CURLOPT_XFERINFOFUNCTION (dltotal, dlnow, ultotal, ulnow)
         // return True from callback to abort the downloading or uploading
         std::function<bool(uint64_t, uint64_t, uint64_t, uint64_t)> progressCallback;
+
+        // optional callback invoked from separate thread for each chunk of response body as it arrives,
+        // the body is then not accumulated in memory and responseCallback receives an empty stream
+        // return False from callback to abort the downloading
+        std::function<bool(const void *, size_t)> dataCallback;
+
+        // optional path to the file response body is written to instead of memory,
+        // if the file already exists the download is resumed from its end using Range header
+        // (HTTP response code is 206 then, 416 means the file is already complete)
+        std::string downloadPath;
+
+        // remove the file at downloadPath once the request is cancelled instead of keeping it for resuming,
+        // the file is removed by the service after the transfer is stopped
+        bool removeDownloadOnCancel = false;
+
+        // requests with higher priority are sent first when the number of simultaneous requests is limited
+        int priority = PRIORITY_NORMAL;
+    };
+
+    /**
+     * Statistics of asynchronous requests completed since the service is started
+     * or statistics are reset. Latencies are computed over the most recent requests.
+     * Statistics are not collected on emscripten.
+     */
+    struct Statistics
+    {
+        uint64_t requests = 0;                  // performed requests, including failed and cached ones, identical requests sent at the same time count once
+        uint64_t failedRequests = 0;            // requests failed with curl error
+        uint64_t cachedResponses = 0;           // responses served from cache without contacting server
+        uint64_t connections = 0;               // new connections opened, other requests reused existing ones
+        uint64_t bytesReceived = 0;             // size of response bodies received from network
+        float duration = 0.0f;                  // time statistics are collected for, in seconds
+        float latencyP50 = 0.0f;                // time from makeRequestAsync to response callback, in ms
+        float latencyP99 = 0.0f;
+        float callbackDelayP50 = 0.0f;          // time response callback waits in main thread's queue, in ms
+        float callbackDelayP99 = 0.0f;
     };
 
     static const char * getTypeName() { return "HTTPRequestService"; };
 
     /** 
      * Get queue name for HTTPRequestService.
+     *
+     * @deprecated The queue is occupied by the transfer loop for the service's lifetime,
+     * work items added to it are not run until the service is shut down. Requests are
+     * no longer work items of this queue, their handles can't be used with TaskQueueService.
      */
+    [[deprecated("requests are not work items of the queue, use cancelRequest with request handles")]]
     static const char * getTaskQueueName();
 
     /**
@@ -50,10 +104,13 @@ public:
      * Note: Response callback is called from the main thread, so
      * there is no need to use synchonization primitives.
      *
+     * Identical GET requests sent at the same time are performed once and
+     * all their callbacks receive the same response.
+     *
      * @param[in] request Request data.
      * @param[in] customRequest Custom request type (HEAD, PATCH, DELETE)
      * @param[in] withCredentials Send credentials (cookies) on emscripten.
-     * @return Work item handle.
+     * @return Request handle, valid only as an argument of cancelRequest.
      */
     int makeRequestAsync(const Request& request, const char * customRequest = NULL, bool withCredentials = false);
 
@@ -66,6 +123,64 @@ public:
      */
     void makeRequestSync(const Request& request, const char * customRequest = NULL, bool withCredentials = false);
 
+    /**
+     * Cancel asynchronous request. The transfer is aborted unless there are identical
+     * requests waiting for it. When called from the main thread, no callbacks of the
+     * request are invoked after this call.
+     *
+     * @param[in] handle Request handle returned from makeRequestAsync.
+     */
+    void cancelRequest(int handle);
+
+    /**
+     * Set maximum number of asynchronous requests processed simultaneously.
+     * Waiting requests are started in order of their priority.
+     *
+     * @param[in] count Maximum number of requests, 0 means no limit. Default is 16.
+     */
+    void setMaxRequests(int count);
+
+    /**
+     * Set maximum number of asynchronous requests processed simultaneously for one host.
+     * Other requests to this host wait until running ones are finished.
+     *
+     * @param[in] count Maximum number of requests per host, 0 means no limit. Default is 6.
+     */
+    void setMaxRequestsPerHost(int count);
+
+    /**
+     * Set maximum size of cached responses kept in memory and on disk.
+     * Only GET requests without streaming callback are cached, according to
+     * response's Cache-Control header. Stale responses are revalidated using
+     * ETag and Last-Modified headers.
+     *
+     * @param[in] memoryBudget Maximum size of responses kept in memory. Default is 4MB.
+     * @param[in] diskBudget Maximum size of responses stored on disk. Default is 32MB.
+     */
+    void setCacheSize(size_t memoryBudget, size_t diskBudget);
+
+    /**
+     * Set directory cached responses are stored in.
+     *
+     * @param[in] path Full path to directory or empty string to disable disk cache. Default is http_cache in temporary folder.
+     */
+    void setCacheDirectory(const char * path);
+
+    /**
+     * Remove all cached responses.
+     */
+    void clearCache();
+
+    /**
+     * Get statistics of asynchronous requests.
+     */
+    Statistics getStatistics() const;
+
+    /**
+     * Reset statistics of asynchronous requests.
+     */
+    void resetStatistics();
+
     /**
      * Get whether or not any of HTTP requests is currently in process.
      */
@@ -81,12 +196,16 @@ protected:
     virtual bool onShutdown() override;
 
 private:
-    void sendRequest(const Request& request, bool syncCall = false, std::string customRequest = "", bool withCredentials = false);
-    static size_t writeFunction(void *contents, size_t size, size_t nmemb, void *userp);
+    int sendRequest(const Request& request, bool syncCall = false, std::string customRequest = "", bool withCredentials = false);
     static void requestLoadCallback(unsigned, void * arg, void *buf, unsigned length, int statusCode, const char * status);
     static void requestErrorCallback(unsigned, void * arg, int statusCode, const char * status);
     static void requestProgressCallback(unsigned, void * arg, int dlnow, int dltotal);
 
     TaskQueueService * _taskQueueService;
     std::string _userAgentString;
+    int _maxRequests;
+    int _maxRequestsPerHost;
+    std::shared_ptr<class HTTPTransferEngine> _engine;
+    std::shared_ptr<class HTTPResponseCache> _cache;
+    std::shared_ptr<class HTTPRequestStatistics> _statistics;
 };
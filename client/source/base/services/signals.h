@@ -20,6 +20,7 @@ struct Signals : Noncopyable
     sigc::signal<void, unsigned, unsigned> resizeEvent;
     sigc::signal<void, float, float> virtualKeyboardSizeChanged;    // passing (0,0) when keyboard is hidden
     sigc::signal<void, float, float, float, float> safeAreaChangedEvent;
+    sigc::signal<void> lowMemoryEvent;                              // fired after unused assets have been evicted
 
     //
     // ServiceManager
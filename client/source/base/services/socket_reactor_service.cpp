@@ -0,0 +1,635 @@
+#include "pch.h"
+#include "socket_reactor_service.h"
+#include "service_manager.h"
+#include "taskqueue_service.h"
+
+#ifdef WIN32
+#define poll WSAPoll
+#else
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <poll.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+#ifdef __linux__
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#define USE_EPOLL
+#endif
+
+#ifndef MSG_NOSIGNAL
+#define MSG_NOSIGNAL 0      // SO_NOSIGPIPE is set on the socket instead
+#endif
+
+
+
+
+static const char * SOCKET_REACTOR_SERVICE_QUEUE = "SocketReactorServiceQueue";
+static const size_t READ_CHUNK_SIZE = 64 * 1024;
+static const size_t MAX_INPUT_SIZE = 4 * 1024 * 1024;      // reading is paused until the stream consumes the data
+static const int MAX_IOV_COUNT = 64;
+
+static const uint32_t EVENT_READ = 1;
+static const uint32_t EVENT_WRITE = 2;
+
+typedef SocketReactorService::Channel Channel;
+
+static bool wouldBlock()
+{
+#ifdef WIN32
+    return WSAGetLastError() == WSAEWOULDBLOCK;
+#else
+    return errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR;
+#endif
+}
+
+
+
+
+/**
+ * SocketReactor runs the I/O loop of all registered channels.
+ *
+ * The loop runs on SocketReactorService's queue until the reactor is stopped and
+ * blocks until a socket is ready or the reactor is woken up with an eventfd on Linux,
+ * a pipe on other POSIX platforms or a loopback UDP socket on Windows.
+ * Channels are processed with _channelsMutex locked, so a channel's socket
+ * is never used by the reactor after the channel is removed.
+ */
+class SocketReactor : Noncopyable
+{
+public:
+    SocketReactor(TaskQueueService * taskQueueService);
+    ~SocketReactor();
+
+    void run();
+    void stop();
+
+    bool addChannel(const std::shared_ptr<Channel>& channel);
+    void removeChannel(const std::shared_ptr<Channel>& channel);
+    void updateChannel(const std::shared_ptr<Channel>& channel);
+
+private:
+    void wakeup();
+    void readChannel(const std::shared_ptr<Channel>& channel);
+    void writeChannel(const std::shared_ptr<Channel>& channel);
+    void updateEvents(const std::shared_ptr<Channel>& channel);
+    void notify(const std::shared_ptr<Channel>& channel, bool Channel::* pending, std::function<void()> Channel::* callback);
+
+    TaskQueueService * _taskQueueService;
+    std::atomic_bool _active;
+
+    std::mutex _channelsMutex;
+    std::unordered_map<Channel *, std::shared_ptr<Channel>> _channels;
+
+    std::mutex _updatesMutex;
+    std::vector<std::shared_ptr<Channel>> _updates;
+
+    std::vector<uint8_t> _readBuffer;
+
+#ifdef USE_EPOLL
+    int _epoll;
+    int _wakeup;
+#elif defined(WIN32)
+    SOCKET _wakeup;                                 // loopback UDP socket connected to itself
+#else
+    int _wakeupPipe[2];
+#endif
+};
+
+SocketReactor::SocketReactor(TaskQueueService * taskQueueService)
+    : _taskQueueService(taskQueueService)
+    , _active(true)
+    , _readBuffer(READ_CHUNK_SIZE)
+{
+#ifdef USE_EPOLL
+    _epoll = epoll_create1(EPOLL_CLOEXEC);
+    _wakeup = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+
+    // wakeup descriptor is the only one registered without a channel
+    struct epoll_event event;
+    memset(&event, 0, sizeof(event));
+    event.events = EPOLLIN;
+    event.data.ptr = nullptr;
+    epoll_ctl(_epoll, EPOLL_CTL_ADD, _wakeup, &event);
+#elif defined(WIN32)
+    // WSAPoll doesn't accept pipes, a datagram sent to itself wakes the loop up instead
+    WSADATA wsaData;
+    WSAStartup(MAKEWORD(2, 2), &wsaData);
+
+    sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    addr.sin_port = 0;
+
+    int addrLength = sizeof(addr);
+    _wakeup = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
+    if (_wakeup == INVALID_SOCKET ||
+        bind(_wakeup, reinterpret_cast<sockaddr *>(&addr), sizeof(addr)) != 0 ||
+        getsockname(_wakeup, reinterpret_cast<sockaddr *>(&addr), &addrLength) != 0 ||
+        connect(_wakeup, reinterpret_cast<sockaddr *>(&addr), sizeof(addr)) != 0)
+    {
+        GP_WARN("Can't create wakeup socket: %d", WSAGetLastError());
+    }
+
+    u_long mode = 1;
+    ioctlsocket(_wakeup, FIONBIO, &mode);
+#else
+    if (pipe(_wakeupPipe) != 0)
+    {
+        GP_WARN("Can't create wakeup pipe: %d", errno);
+        _wakeupPipe[0] = _wakeupPipe[1] = -1;
+    }
+
+    for (int fd : _wakeupPipe)
+    {
+        fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+        fcntl(fd, F_SETFD, FD_CLOEXEC);
+    }
+#endif
+}
+
+SocketReactor::~SocketReactor()
+{
+#ifdef USE_EPOLL
+    close(_wakeup);
+    close(_epoll);
+#elif defined(WIN32)
+    closesocket(_wakeup);
+    WSACleanup();
+#else
+    close(_wakeupPipe[0]);
+    close(_wakeupPipe[1]);
+#endif
+}
+
+void SocketReactor::stop()
+{
+    _active = false;
+    wakeup();
+}
+
+void SocketReactor::wakeup()
+{
+#ifdef USE_EPOLL
+    uint64_t value = 1;
+    if (write(_wakeup, &value, sizeof(value)) < 0)
+    {
+        // counter is already signaled
+    }
+#elif defined(WIN32)
+    char value = 1;
+    send(_wakeup, &value, 1, 0);
+#else
+    char value = 1;
+    if (write(_wakeupPipe[1], &value, 1) < 0)
+    {
+        // pipe is full, the loop is going to wake up anyway
+    }
+#endif
+}
+
+bool SocketReactor::addChannel(const std::shared_ptr<Channel>& channel)
+{
+    std::unique_lock<std::mutex> lock(_channelsMutex);
+
+#ifdef USE_EPOLL
+    struct epoll_event event;
+    memset(&event, 0, sizeof(event));
+    event.events = EPOLLIN;
+    event.data.ptr = channel.get();
+    if (epoll_ctl(_epoll, EPOLL_CTL_ADD, channel->socket, &event) != 0)
+    {
+        GP_WARN("Can't add socket to epoll: %d", errno);
+        return false;
+    }
+#endif
+
+    channel->events = EVENT_READ;
+    _channels[channel.get()] = channel;
+
+#ifndef USE_EPOLL
+    // poll set is rebuilt with the new socket
+    wakeup();
+#endif
+
+    return true;
+}
+
+void SocketReactor::removeChannel(const std::shared_ptr<Channel>& channel)
+{
+    std::unique_lock<std::mutex> lock(_channelsMutex);
+
+    if (_channels.erase(channel.get()) == 0)
+        return;
+
+#ifdef USE_EPOLL
+    if (channel->events != 0)
+        epoll_ctl(_epoll, EPOLL_CTL_DEL, channel->socket, NULL);
+#else
+    // socket is about to be closed, it shouldn't stay in the poll set
+    wakeup();
+#endif
+    channel->events = 0;
+}
+
+void SocketReactor::updateChannel(const std::shared_ptr<Channel>& channel)
+{
+    {
+        std::unique_lock<std::mutex> lock(_updatesMutex);
+        _updates.push_back(channel);
+    }
+
+    wakeup();
+}
+
+void SocketReactor::run()
+{
+    std::vector<std::shared_ptr<Channel>> updates;
+#ifdef USE_EPOLL
+    struct epoll_event events[64];
+#else
+    std::vector<struct pollfd> fds;
+    std::vector<std::shared_ptr<Channel>> polled;
+#endif
+
+    while (_active)
+    {
+        {
+            std::unique_lock<std::mutex> lock(_updatesMutex);
+            updates.swap(_updates);
+        }
+
+        // writes queued since the last iteration are sent at once
+        if (!updates.empty())
+        {
+            std::unique_lock<std::mutex> lock(_channelsMutex);
+            for (const std::shared_ptr<Channel>& channel : updates)
+            {
+                if (_channels.find(channel.get()) == _channels.end())
+                    continue;
+
+                writeChannel(channel);
+                updateEvents(channel);
+            }
+            updates.clear();
+        }
+
+#ifdef USE_EPOLL
+        int count = epoll_wait(_epoll, events, sizeof(events) / sizeof(events[0]), 1000);
+
+        std::unique_lock<std::mutex> lock(_channelsMutex);
+        for (int i = 0; i < count; i++)
+        {
+            if (!events[i].data.ptr)
+            {
+                uint64_t value;
+                while (read(_wakeup, &value, sizeof(value)) > 0);
+                continue;
+            }
+
+            auto it = _channels.find(reinterpret_cast<Channel *>(events[i].data.ptr));
+            if (it == _channels.end())
+                continue;
+
+            std::shared_ptr<Channel> channel = (*it).second;
+            if (events[i].events & (EPOLLIN | EPOLLHUP | EPOLLERR))
+                readChannel(channel);
+            if (events[i].events & EPOLLOUT)
+                writeChannel(channel);
+            updateEvents(channel);
+        }
+#else
+        // wakeup descriptor is the first one and is the only one polled without a channel
+        struct pollfd wakeupFd;
+#ifdef WIN32
+        wakeupFd.fd = _wakeup;
+#else
+        wakeupFd.fd = _wakeupPipe[0];
+#endif
+        wakeupFd.events = POLLIN;
+        wakeupFd.revents = 0;
+        fds.push_back(wakeupFd);
+        polled.push_back(nullptr);
+
+        {
+            std::unique_lock<std::mutex> lock(_channelsMutex);
+            for (auto& it : _channels)
+            {
+                if (it.second->events == 0)
+                    continue;
+
+                struct pollfd fd;
+                fd.fd = it.second->socket;
+                fd.events = ((it.second->events & EVENT_READ) ? POLLIN : 0) | ((it.second->events & EVENT_WRITE) ? POLLOUT : 0);
+                fd.revents = 0;
+                fds.push_back(fd);
+                polled.push_back(it.second);
+            }
+        }
+
+        if (poll(fds.data(), static_cast<unsigned>(fds.size()), -1) > 0)
+        {
+            if (fds[0].revents != 0)
+            {
+                char value[64];
+#ifdef WIN32
+                while (recv(_wakeup, value, sizeof(value), 0) > 0);
+#else
+                while (read(_wakeupPipe[0], value, sizeof(value)) > 0);
+#endif
+            }
+
+            std::unique_lock<std::mutex> lock(_channelsMutex);
+            for (size_t i = 1; i < fds.size(); i++)
+            {
+                const std::shared_ptr<Channel>& channel = polled[i];
+                if (fds[i].revents == 0 || _channels.find(channel.get()) == _channels.end())
+                    continue;
+
+                if (fds[i].revents & (POLLIN | POLLHUP | POLLERR))
+                    readChannel(channel);
+                if (fds[i].revents & POLLOUT)
+                    writeChannel(channel);
+                updateEvents(channel);
+            }
+        }
+
+        fds.clear();
+        polled.clear();
+#endif
+    }
+}
+
+void SocketReactor::readChannel(const std::shared_ptr<Channel>& channel)
+{
+    bool received = false;
+    while (true)
+    {
+        {
+            std::unique_lock<std::mutex> lock(channel->mutex);
+            if (channel->closed || channel->getInputSize() >= MAX_INPUT_SIZE)
+                break;
+        }
+
+#ifdef WIN32
+        int res = recv(channel->socket, reinterpret_cast<char *>(_readBuffer.data()), static_cast<int>(_readBuffer.size()), 0);
+#else
+        ssize_t res = recv(channel->socket, _readBuffer.data(), _readBuffer.size(), 0);
+#endif
+        if (res < 0 && wouldBlock())
+            break;
+
+        std::unique_lock<std::mutex> lock(channel->mutex);
+        received = true;
+        if (res <= 0)
+        {
+            channel->closed = true;
+            break;
+        }
+
+        // drop the data that was already read before appending new one
+        if (channel->inputOffset > 0 && channel->inputOffset >= channel->input.size() / 2)
+        {
+            channel->input.erase(channel->input.begin(), channel->input.begin() + channel->inputOffset);
+            channel->inputOffset = 0;
+        }
+
+        channel->input.insert(channel->input.end(), _readBuffer.data(), _readBuffer.data() + res);
+        if (static_cast<size_t>(res) < _readBuffer.size())
+            break;
+    }
+
+    if (received)
+        notify(channel, &Channel::notifyPending, &Channel::readCallback);
+}
+
+void SocketReactor::writeChannel(const std::shared_ptr<Channel>& channel)
+{
+    bool failed = false;
+    bool writable = false;
+
+    {
+        std::unique_lock<std::mutex> lock(channel->mutex);
+        while (channel->outputSize > 0 && !channel->closed)
+        {
+            // all queued chunks are sent with a single call
+#ifdef WIN32
+            WSABUF buffers[MAX_IOV_COUNT];
+            DWORD count = 0;
+            for (auto it = channel->output.begin(); it != channel->output.end() && count < MAX_IOV_COUNT; it++, count++)
+            {
+                size_t offset = count == 0 ? channel->outputOffset : 0;
+                buffers[count].buf = reinterpret_cast<char *>((*it).data() + offset);
+                buffers[count].len = static_cast<ULONG>((*it).size() - offset);
+            }
+
+            DWORD sent = 0;
+            long res = WSASend(channel->socket, buffers, count, &sent, 0, NULL, NULL) == 0 ? static_cast<long>(sent) : -1;
+#else
+            struct iovec buffers[MAX_IOV_COUNT];
+            int count = 0;
+            for (auto it = channel->output.begin(); it != channel->output.end() && count < MAX_IOV_COUNT; it++, count++)
+            {
+                size_t offset = count == 0 ? channel->outputOffset : 0;
+                buffers[count].iov_base = (*it).data() + offset;
+                buffers[count].iov_len = (*it).size() - offset;
+            }
+
+            // unlike writev, sendmsg doesn't raise SIGPIPE when peer has closed the connection
+            struct msghdr message;
+            memset(&message, 0, sizeof(message));
+            message.msg_iov = buffers;
+            message.msg_iovlen = count;
+            ssize_t res = sendmsg(channel->socket, &message, MSG_NOSIGNAL);
+#endif
+            if (res < 0)
+            {
+                if (wouldBlock())
+                    break;
+
+                channel->closed = true;
+                channel->output.clear();
+                channel->outputOffset = channel->outputSize = 0;
+                failed = true;
+                break;
+            }
+
+            size_t sent = static_cast<size_t>(res);
+            channel->outputSize -= sent;
+            while (sent > 0)
+            {
+                size_t chunkSize = channel->output.front().size() - channel->outputOffset;
+                if (sent < chunkSize)
+                {
+                    channel->outputOffset += sent;
+                    break;
+                }
+
+                sent -= chunkSize;
+                channel->output.pop_front();
+                channel->outputOffset = 0;
+            }
+        }
+
+        // stream is notified once half of the limit is sent, so the socket doesn't run dry before more data is queued
+        if (channel->writeBlocked && !channel->closed && channel->outputSize <= Channel::MAX_OUTPUT_SIZE / 2)
+        {
+            channel->writeBlocked = false;
+            writable = true;
+        }
+    }
+
+    if (failed)
+        notify(channel, &Channel::notifyPending, &Channel::readCallback);
+    else if (writable)
+        notify(channel, &Channel::writeNotifyPending, &Channel::writeCallback);
+}
+
+void SocketReactor::updateEvents(const std::shared_ptr<Channel>& channel)
+{
+    uint32_t events = 0;
+    {
+        std::unique_lock<std::mutex> lock(channel->mutex);
+        if (!channel->closed)
+        {
+            channel->inputPaused = channel->getInputSize() >= MAX_INPUT_SIZE;
+            events = (channel->inputPaused ? 0 : EVENT_READ) | (channel->outputSize > 0 ? EVENT_WRITE : 0);
+        }
+    }
+
+    if (events == channel->events)
+        return;
+
+#ifdef USE_EPOLL
+    // sockets without any events of interest are removed from epoll, hang up would be reported over and over otherwise
+    struct epoll_event event;
+    memset(&event, 0, sizeof(event));
+    event.events = ((events & EVENT_READ) ? EPOLLIN : 0) | ((events & EVENT_WRITE) ? EPOLLOUT : 0);
+    event.data.ptr = channel.get();
+    if (channel->events == 0)
+        epoll_ctl(_epoll, EPOLL_CTL_ADD, channel->socket, &event);
+    else if (events == 0)
+        epoll_ctl(_epoll, EPOLL_CTL_DEL, channel->socket, NULL);
+    else
+        epoll_ctl(_epoll, EPOLL_CTL_MOD, channel->socket, &event);
+#endif
+
+    channel->events = events;
+}
+
+void SocketReactor::notify(const std::shared_ptr<Channel>& channel, bool Channel::* pending, std::function<void()> Channel::* callback)
+{
+    {
+        std::unique_lock<std::mutex> lock(channel->mutex);
+        if (!((*channel).*callback) || (*channel).*pending)
+            return;
+        (*channel).*pending = true;
+    }
+
+    // stream may be destroyed before the callback is invoked
+    std::weak_ptr<Channel> weakChannel = channel;
+    _taskQueueService->runOnMainThread([weakChannel, pending, callback]() {
+        std::shared_ptr<Channel> channel = weakChannel.lock();
+        if (!channel)
+            return;
+
+        std::function<void()> func;
+        {
+            std::unique_lock<std::mutex> lock(channel->mutex);
+            (*channel).*pending = false;
+            func = (*channel).*callback;
+        }
+
+        if (func)
+            func();
+    });
+}
+
+
+
+
+SocketReactorService::Channel::Channel()
+#ifdef WIN32
+    : socket((SOCKET)-1)
+#else
+    : socket(-1)
+#endif
+    , inputOffset(0)
+    , outputOffset(0)
+    , outputSize(0)
+    , closed(false)
+    , inputPaused(false)
+    , notifyPending(false)
+    , writeBlocked(false)
+    , writeNotifyPending(false)
+    , events(0)
+{
+}
+
+SocketReactorService::SocketReactorService(const ServiceManager * manager)
+    : Service(manager)
+    , _taskQueueService(NULL)
+{
+}
+
+SocketReactorService::~SocketReactorService()
+{
+}
+
+const char * SocketReactorService::getTaskQueueName()
+{
+    return SOCKET_REACTOR_SERVICE_QUEUE;
+}
+
+bool SocketReactorService::onPreInit()
+{
+    _taskQueueService = _manager->findService<TaskQueueService>();
+    _taskQueueService->createQueue(SOCKET_REACTOR_SERVICE_QUEUE);
+
+    return true;
+}
+
+bool SocketReactorService::onInit()
+{
+    _reactor.reset(new SocketReactor(_taskQueueService));
+
+    std::shared_ptr<SocketReactor> reactor = _reactor;
+    _taskQueueService->addWorkItem(SOCKET_REACTOR_SERVICE_QUEUE, [reactor]() { reactor->run(); });
+
+    return true;
+}
+
+bool SocketReactorService::onShutdown()
+{
+    if (_reactor)
+        _reactor->stop();
+
+    if (_taskQueueService)
+        _taskQueueService->removeQueue(SOCKET_REACTOR_SERVICE_QUEUE);
+
+    _reactor.reset();
+
+    return true;
+}
+
+bool SocketReactorService::addChannel(const std::shared_ptr<Channel>& channel)
+{
+    return _reactor && _reactor->addChannel(channel);
+}
+
+void SocketReactorService::removeChannel(const std::shared_ptr<Channel>& channel)
+{
+    if (_reactor)
+        _reactor->removeChannel(channel);
+}
+
+void SocketReactorService::updateChannel(const std::shared_ptr<Channel>& channel)
+{
+    if (_reactor)
+        _reactor->updateChannel(channel);
+}
@@ -0,0 +1,98 @@
+#pragma once
+
+#ifndef __DFG_SOCKET_REACTOR_SERVICE_H__
+#define __DFG_SOCKET_REACTOR_SERVICE_H__
+
+#include "service.h"
+
+#ifdef WIN32
+#include <winsock2.h>
+#endif
+
+
+
+
+/**
+ * SocketReactorService performs I/O of all non-blocking SocketStreams on a
+ * single thread.
+ *
+ * Received data is buffered until the stream is read on any thread, writes are
+ * queued and sent together with a single vectored write once the socket is
+ * writable. On Linux sockets are multiplexed with epoll, other platforms poll them.
+ *
+ * This service works on top of TaskQueueService and has to be registered
+ * before any non-blocking SocketStream is created.
+ */
+class SocketReactorService : public Service
+{
+    friend class ServiceManager;
+    friend class SocketStream;
+
+public:
+    /**
+     * Buffered state of a socket shared by SocketStream and the reactor.
+     */
+    struct Channel : ::Noncopyable
+    {
+        static const size_t MAX_OUTPUT_SIZE = 4 * 1024 * 1024;     // stream refuses to queue more data until it's sent
+
+#ifdef WIN32
+        SOCKET socket;
+#else
+        int socket;
+#endif
+
+        std::mutex mutex;
+        std::vector<uint8_t> input;                     // received data, starting at inputOffset
+        size_t inputOffset;
+        std::deque<std::vector<uint8_t>> output;        // data waiting to be sent, starting at outputOffset of the first chunk
+        size_t outputOffset;
+        size_t outputSize;
+        bool closed;                                    // connection is closed by peer or failed
+        bool inputPaused;                               // reactor stopped reading until buffered input is consumed
+        bool notifyPending;                             // readCallback is scheduled on the main thread
+        bool writeBlocked;                              // stream refused to queue data, writeCallback is invoked once there's room
+        bool writeNotifyPending;                        // writeCallback is scheduled on the main thread
+        std::function<void()> readCallback;
+        std::function<void()> writeCallback;
+
+        // following members are accessed from the reactor's thread only
+        uint32_t events;
+
+        Channel();
+
+        size_t getInputSize() const { return input.size() - inputOffset; };
+    };
+
+    static const char * getTypeName() { return "SocketReactorService"; };
+
+    /**
+     * Get queue name the reactor runs on.
+     */
+    static const char * getTaskQueueName();
+
+protected:
+    SocketReactorService(const ServiceManager * manager);
+    virtual ~SocketReactorService();
+
+    bool onPreInit();
+    bool onInit();
+    bool onShutdown();
+
+private:
+    bool addChannel(const std::shared_ptr<Channel>& channel);
+    void removeChannel(const std::shared_ptr<Channel>& channel);
+
+    /**
+     * Ask the reactor to send queued output and resume reading drained input.
+     */
+    void updateChannel(const std::shared_ptr<Channel>& channel);
+
+    class TaskQueueService * _taskQueueService;
+    std::shared_ptr<class SocketReactor> _reactor;
+};
+
+
+
+
+#endif // __DFG_SOCKET_REACTOR_SERVICE_H__
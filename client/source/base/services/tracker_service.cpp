@@ -2,8 +2,9 @@
 #include "tracker_service.h"
 #include "service_manager.h"
 #include "httprequest_service.h"
+#include "taskqueue_service.h"
 #include "main.h"
-#include <iomanip>
+#include "main/json.h"
 
 #if defined(__ANDROID__) || defined(__APPLE__) && TARGET_OS_IPHONE
 #define FIREBASE_AVAILABLE
@@ -29,12 +30,178 @@ extern struct android_app* __state;
 
 
 
+#define TRACKER_SERVICE_QUEUE "TrackerServiceQueue"
+
+static const size_t MAX_EVENTS_PER_BATCH = 25;          // Measurement Protocol limit
+static const size_t MAX_STORED_BATCHES = 100;
+static const double MIN_RETRY_DELAY = 5.0;
+static const double MAX_RETRY_DELAY = 600.0;
+static const int64_t MAX_EVENT_AGE = 72ll * 3600 * 1000000;       // Measurement Protocol doesn't accept older events
+static const uint32_t BATCHES_FILE_MAGIC = 0x33425444;  // 'DTB3'
+
+
+
+static int64_t getTimestampMicros()
+{
+    return std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::system_clock::now().time_since_epoch()).count();
+}
+
+// batches file is a log of records with the length, value and data. Record of a batch
+// holds its time as the value, record without data removes the batch with the index given by the value
+static bool writeRecord(FILE * file, const std::string& data, int64_t value)
+{
+    uint32_t length = static_cast<uint32_t>(data.size());
+    return fwrite(&length, sizeof(length), 1, file) == 1 && fwrite(&value, sizeof(value), 1, file) == 1 &&
+        fwrite(data.data(), 1, data.size(), file) == data.size();
+}
+
+static bool readRecord(FILE * file, std::string * data, int64_t * value)
+{
+    uint32_t length;
+    if (fread(&length, sizeof(length), 1, file) != 1 || length > 1024 * 1024 || fread(value, sizeof(*value), 1, file) != 1)
+        return false;
+
+    data->resize(length);
+    return length == 0 || fread(&(*data)[0], 1, length, file) == length;
+}
+
+
+
+
+/**
+ * Writes batch records to the file. Shared with the work items
+ * so that it outlives TrackerService while they are queued.
+ */
+class TrackerBatchWriter
+{
+public:
+    struct Record
+    {
+        std::string data;
+        int64_t value;
+    };
+
+    TrackerBatchWriter(const std::string& path)
+        : _path(path)
+        , _rewrite(false)
+        , _needsRewrite(false)
+    {
+    }
+
+    void append(Record&& record);
+    void rewrite(std::vector<Record>&& records);
+    void processJobs();
+
+    bool needsRewrite() const { return _needsRewrite; };
+
+private:
+    static bool writeRecords(const std::string& path, const char * mode, const std::vector<Record>& records);
+
+    std::string _path;
+
+    // guards the records not yet written
+    std::mutex _jobsMutex;
+    std::vector<Record> _records;
+    bool _rewrite;
+
+    // held while writing, the file is only touched under this mutex
+    std::mutex _writeMutex;
+    std::atomic<bool> _needsRewrite;    // append has failed, so the log may be torn
+};
+
+void TrackerBatchWriter::append(Record&& record)
+{
+    std::unique_lock<std::mutex> lock(_jobsMutex);
+    _records.push_back(std::move(record));
+}
+
+void TrackerBatchWriter::rewrite(std::vector<Record>&& records)
+{
+    // the new file contains all the records that have not been written yet
+    std::unique_lock<std::mutex> lock(_jobsMutex);
+    _records = std::move(records);
+    _rewrite = true;
+    _needsRewrite = false;
+}
+
+void TrackerBatchWriter::processJobs()
+{
+    std::unique_lock<std::mutex> lock(_writeMutex);
+
+    std::vector<Record> records;
+    bool rewrite;
+    {
+        std::unique_lock<std::mutex> jobsLock(_jobsMutex);
+        records.swap(_records);
+        rewrite = _rewrite;
+        _rewrite = false;
+    }
+
+    if (rewrite)
+    {
+        if (records.empty())
+        {
+            remove(_path.c_str());
+            return;
+        }
+
+        // write to temporary file first, so the batches survive the app being killed while saving
+        std::string tmpPath = _path + ".tmp";
+        bool res = writeRecords(tmpPath, "wb", records);
+#ifdef WIN32
+        remove(_path.c_str());
+#endif
+        if (!res || rename(tmpPath.c_str(), _path.c_str()) != 0)
+        {
+            GP_WARN("Failed to save analytics events to %s", _path.c_str());
+            remove(tmpPath.c_str());
+            _needsRewrite = true;
+        }
+        return;
+    }
+
+    // nothing is appended after a torn record, the whole file is rewritten instead
+    if (records.empty() || _needsRewrite)
+        return;
+
+    if (!writeRecords(_path, "ab", records))
+    {
+        GP_WARN("Failed to save analytics events to %s", _path.c_str());
+        _needsRewrite = true;
+    }
+}
+
+bool TrackerBatchWriter::writeRecords(const std::string& path, const char * mode, const std::vector<Record>& records)
+{
+    FILE * file = fopen(path.c_str(), mode);
+    if (!file)
+        return false;
+
+    bool res = true;
+    fseek(file, 0, SEEK_END);
+    if (ftell(file) == 0)
+        res = fwrite(&BATCHES_FILE_MAGIC, sizeof(BATCHES_FILE_MAGIC), 1, file) == 1;
+
+    for (const Record& record : records)
+        res = res && writeRecord(file, record.data, record.value);
+
+    return fclose(file) == 0 && res;
+}
+
+
 
 
 TrackerService::TrackerService(const ServiceManager * manager)
     : Service(manager)
     , _firebaseApp(NULL)
     , _httpRequestService(NULL)
+    , _firstPendingEventTime(0.0)
+    , _nextSendTime(0.0)
+    , _flushInterval(30.0f)
+    , _failedAttempts(0)
+    , _requestId(-1)
+    , _nextBatchId(0)
+    , _removedBatchCount(0)
 {
 #ifdef FIREBASE_AVAILABLE
 #ifdef __ANDROID__
@@ -75,6 +242,8 @@ void TrackerService::setupTracking(const char * appId, const char * appInstanceI
     // GA require app instance id to be 32 digits hex number
     _appInstanceId.erase(std::remove(_appInstanceId.begin(), _appInstanceId.end(), '-'), _appInstanceId.end());
 
+    _endpoint = fmt::format("https://www.google-analytics.com/mp/collect?api_secret={}&firebase_app_id={}", _apiSecret, _appId);
+
 #ifdef FIREBASE_AVAILABLE
     firebase::analytics::GetAnalyticsInstanceId().OnCompletion([this](const firebase::Future<std::string>& future) {
         if (future.error() == 0)
@@ -82,6 +251,17 @@ void TrackerService::setupTracking(const char * appId, const char * appInstanceI
     });
 
     _appId = _firebaseApp->options().app_id();
+    _endpoint = fmt::format("https://www.google-analytics.com/mp/collect?api_secret={}&firebase_app_id={}", _apiSecret, _appId);
+#endif
+
+#ifndef __EMSCRIPTEN__
+    // send events left from previous sessions
+    if (_batchesPath.empty() && gameplay::Game::getInstance())
+    {
+        _batchesPath = std::string(DfgGame::getInstance()->getUserDataFolder()) + "/analytics_batches.dat";
+        _writer.reset(new TrackerBatchWriter(_batchesPath));
+        loadBatches();
+    }
 #endif
 
 #ifdef __EMSCRIPTEN__
@@ -117,142 +297,196 @@ bool TrackerService::onPreInit()
 {
     _httpRequestService = _manager->findService<HTTPRequestService>();
 
+    // the app may be killed while paused
+    _pauseConnection = _manager->signals.pauseEvent.connect(sigc::mem_fun(this, &TrackerService::flush));
+
     return true;
 }
 
 bool TrackerService::onShutdown()
 {
+    _pauseConnection.disconnect();
+
+#ifndef __EMSCRIPTEN__
+    // buffered events are sent in the next session
+    if (!_endpoint.empty())
+        while (createBatch())
+            ;
+
+    if (_requestId >= 0 && _httpRequestService)
+        _httpRequestService->cancelRequest(_requestId);
+    _requestId = -1;
+
+    // queued records are written before the app exits
+    if (_writer)
+    {
+        if (_writer->needsRewrite())
+            saveBatches(true);
+        _writer->processJobs();
+    }
+#endif
+
     return true;
 }
 
 bool TrackerService::onTick()
 {
+#ifdef __EMSCRIPTEN__
+    // Firebase JS SDK batches events itself
     return true;
+#else
+    double time = gameplay::Game::getAbsoluteTime() * 0.001;
+
+    bool batchReady;
+    {
+        std::unique_lock<std::mutex> lock(_pendingEventsMutex);
+        batchReady = !_pendingEventEnds.empty() && (_pendingEventEnds.size() >= MAX_EVENTS_PER_BATCH || time >= _firstPendingEventTime + _flushInterval);
+    }
+
+    if (!_endpoint.empty() && batchReady)
+        createBatch();
+
+    if (_requestId < 0 && !_batches.empty() && time >= _nextSendTime)
+        sendBatch();
+
+    return false;
+#endif
 }
 
-void TrackerService::sendView(const char * screenName, const char * screenClass, const Parameter * parameters, unsigned parameterCount)
+void TrackerService::flush()
 {
-    std::unique_ptr<Parameter[]> params(new Parameter[parameterCount + 2]);
-    params[0].name = "screen_name";
-    params[0].value.set(std::string(screenName));
-    params[1].name = "screen_class";
-    params[1].value.set(std::string(screenClass));
-    memcpy(params.get() + 2, parameters, sizeof(Parameter) * parameterCount);
+#ifndef __EMSCRIPTEN__
+    if (_endpoint.empty())
+        return;
 
-    sendEvent("screen_view", params.get(), parameterCount + 2);
+    while (createBatch())
+        ;
+
+    _nextSendTime = 0.0;
+    if (_requestId < 0 && !_batches.empty())
+        sendBatch();
+#endif
 }
 
-// Function to escape JSON string
-std::string escapeJsonString(const std::string& input)
+/**
+ * Collects parameters of a single event, either as Firebase parameters or as
+ * JSON object. Both are stored in per-thread buffers that are reused by all
+ * events, so no memory is allocated once the buffers have grown.
+ */
+class TrackerEventBuilder : Noncopyable
 {
-    std::ostringstream ss;
-    for (char c : input)
-    {
-        switch (c)
-        {
-        case '"':  ss << "\\\""; break;
-        case '\\': ss << "\\\\"; break;
-        case '\b': ss << "\\b";  break;
-        case '\f': ss << "\\f";  break;
-        case '\n': ss << "\\n";  break;
-        case '\r': ss << "\\r";  break;
-        case '\t': ss << "\\t";  break;
-        default:
-            if (static_cast<unsigned char>(c) < 0x20 || c == 0x7F)
-            {
-                // Escape control characters
-                ss << "\\u" << std::hex << std::setw(4) << std::setfill('0')
-                    << static_cast<int>(static_cast<unsigned char>(c));
-            }
-            else
-            {
-                ss << c;
-            }
-        break;
-        }
-    }
-    return ss.str();
+public:
+    explicit TrackerEventBuilder(bool firebase);
+
+    void addString(const char * name, const char * value);
+    void addInt(const char * name, int64_t value);
+    void addBool(const char * name, bool value);
+    void addParameters(const TrackerService::Parameter * parameters, unsigned parameterCount);
+
+    /**
+     * Add 'items' array of ecommerce event. Only supported for JSON.
+     */
+    void addItems(const TrackerService::EcommerceItem * items, unsigned itemCount);
+
+    /**
+     * Finish JSON object and get it.
+     */
+    const std::string& getJSON();
+
+#ifdef FIREBASE_AVAILABLE
+    const std::vector<firebase::analytics::Parameter>& getFirebaseParameters() const { return *_firebaseParameters; };
+#endif
+
+private:
+    bool _firebase;
+    std::string * _json;
+    JSONWriter _writer;
+
+#ifdef FIREBASE_AVAILABLE
+    std::vector<firebase::analytics::Parameter> * _firebaseParameters;
+#endif
+};
+
+static std::string * getEventBuffer()
+{
+    static thread_local std::string buffer;
+    buffer.clear();
+    return &buffer;
 }
 
-std::string formatVariantType(const VariantType& value)
+TrackerEventBuilder::TrackerEventBuilder(bool firebase)
+    : _firebase(firebase)
+    , _json(getEventBuffer())
+    , _writer(_json)
 {
-    switch (value.getType())
-    {
-    case VariantType::TYPE_INT8:
-    case VariantType::TYPE_INT16:
-    case VariantType::TYPE_INT32:
-    case VariantType::TYPE_INT64:
-    case VariantType::TYPE_UINT8:
-    case VariantType::TYPE_UINT16:
-    case VariantType::TYPE_UINT32:
-    case VariantType::TYPE_UINT64:
-        return fmt::format("{}", value.get<int64_t>());
-
-    case VariantType::TYPE_BOOLEAN:
-        return value.get<bool>() ? "true" : "false";
-
-    case VariantType::TYPE_FLOAT:
-        return fmt::format("{}", value.get<float>());
-
-    case VariantType::TYPE_FLOAT64:
-        return fmt::format("{}", value.get<double>());
-
-    case VariantType::TYPE_STRING:
-        return std::string("\"") + escapeJsonString(value.get<std::string>()) + "\"";
-        
-    default:
-        GP_ASSERT(!"Unsupported variant type");
-    }
+#ifdef FIREBASE_AVAILABLE
+    static thread_local std::vector<firebase::analytics::Parameter> firebaseParameters;
+    firebaseParameters.clear();
+    _firebaseParameters = &firebaseParameters;
+#endif
 
-    return "";
+    if (!_firebase)
+        _writer.beginObject();
 }
 
-std::string TrackerService::getJsonParamsPayload(const Parameter * parameters, unsigned parameterCount) const
+void TrackerEventBuilder::addString(const char * name, const char * value)
 {
-    std::string paramsPayload = "{";
-    for (unsigned i = 0; i < parameterCount; i++)
+#ifdef FIREBASE_AVAILABLE
+    if (_firebase)
     {
-        paramsPayload += fmt::format("\"{}\":", escapeJsonString(parameters[i].name));
-        paramsPayload += formatVariantType(parameters[i].value);
-        paramsPayload += ",";
+        _firebaseParameters->emplace_back();
+        _firebaseParameters->back().name = name;
+        _firebaseParameters->back().value.set_string_value(value);     // not copied, used before value goes out of scope
+        return;
     }
+#endif
 
-    if (parameterCount > 0)
-        paramsPayload.pop_back();
-    paramsPayload += "}";
-
-    return std::move(paramsPayload);
+    _writer.key(name);
+    _writer.writeString(value);
 }
 
-void TrackerService::sendEcommerceEvent(const char * eventName, const EcommerceItem * items, unsigned itemCount, const Parameter * parameters, unsigned parameterCount)
+void TrackerEventBuilder::addInt(const char * name, int64_t value)
 {
-    std::string paramsPayload = getJsonParamsPayload(parameters, parameterCount);
-    paramsPayload.pop_back();
-    paramsPayload += ", \"items\":[";
-
-    for (unsigned j = 0; j < itemCount; j++)
+#ifdef FIREBASE_AVAILABLE
+    if (_firebase)
     {
-        paramsPayload += getJsonParamsPayload(items[j].parameters, items[j].parameterCount);
-        paramsPayload += ",";
+        _firebaseParameters->emplace_back();
+        _firebaseParameters->back().name = name;
+        _firebaseParameters->back().value.set_int64_value(value);
+        return;
     }
+#endif
 
-    GP_ASSERT(itemCount > 0);
-    paramsPayload.pop_back();
-    paramsPayload += "]}";
-
-    sendGAEvent(eventName, paramsPayload);
+    _writer.key(name);
+    _writer.writeInt(value);
 }
 
-void TrackerService::sendEvent(const char * eventName, const Parameter * parameters, unsigned parameterCount)
+void TrackerEventBuilder::addBool(const char * name, bool value)
 {
 #ifdef FIREBASE_AVAILABLE
-    if (_firebaseApp)
+    if (_firebase)
     {
-        std::unique_ptr<firebase::analytics::Parameter[]> params(new firebase::analytics::Parameter[parameterCount]);
+        _firebaseParameters->emplace_back();
+        _firebaseParameters->back().name = name;
+        _firebaseParameters->back().value.set_bool_value(value);
+        return;
+    }
+#endif
 
-        for (unsigned i = 0; i < parameterCount; i++)
+    _writer.key(name);
+    _writer.writeBool(value);
+}
+
+void TrackerEventBuilder::addParameters(const TrackerService::Parameter * parameters, unsigned parameterCount)
+{
+    for (unsigned i = 0; i < parameterCount; i++)
+    {
+#ifdef FIREBASE_AVAILABLE
+        if (_firebase)
         {
-            params[i].name = parameters[i].name;
+            _firebaseParameters->emplace_back();
+            firebase::analytics::Parameter& param = _firebaseParameters->back();
+            param.name = parameters[i].name;
 
             switch (parameters[i].value.getType())
             {
@@ -264,31 +498,101 @@ void TrackerService::sendEvent(const char * eventName, const Parameter * paramet
             case VariantType::TYPE_UINT16:
             case VariantType::TYPE_UINT32:
             case VariantType::TYPE_UINT64:
-                params[i].value.set_int64_value(parameters[i].value.get<int64_t>());
+                param.value.set_int64_value(parameters[i].value.get<int64_t>());
                 break;
 
             case VariantType::TYPE_BOOLEAN:
-                params[i].value.set_bool_value(parameters[i].value.get<bool>());
+                param.value.set_bool_value(parameters[i].value.get<bool>());
                 break;
 
             case VariantType::TYPE_FLOAT:
-                params[i].value.set_double_value(parameters[i].value.get<float>());
+                param.value.set_double_value(parameters[i].value.get<float>());
                 break;
 
             case VariantType::TYPE_FLOAT64:
-                params[i].value.set_double_value(parameters[i].value.get<double>());
+                param.value.set_double_value(parameters[i].value.get<double>());
                 break;
 
             case VariantType::TYPE_STRING:
-                params[i].value.set_string_value(parameters[i].value.get<std::string>());
+                param.value.set_string_value(parameters[i].value.get<std::string>());
                 break;
 
             default:
                 GP_ASSERT(!"Unsupported variant type");
             }
+
+            continue;
         }
+#endif
+
+        _writer.key(parameters[i].name);
+        _writer.writeVariant(parameters[i].value);
+    }
+}
+
+void TrackerEventBuilder::addItems(const TrackerService::EcommerceItem * items, unsigned itemCount)
+{
+    GP_ASSERT(!_firebase);
+
+    _writer.key("items");
+    _writer.beginArray();
+    for (unsigned j = 0; j < itemCount; j++)
+    {
+        _writer.beginObject();
+        addParameters(items[j].parameters, items[j].parameterCount);
+        _writer.endObject();
+    }
+    _writer.endArray();
+}
+
+const std::string& TrackerEventBuilder::getJSON()
+{
+    GP_ASSERT(!_firebase);
+    _writer.endObject();
+    return *_json;
+}
+
+
+
+
+void TrackerService::sendView(const char * screenName, const char * screenClass, const Parameter * parameters, unsigned parameterCount)
+{
+    TrackerEventBuilder builder(_firebaseApp != NULL);
+    builder.addString("screen_name", screenName);
+    builder.addString("screen_class", screenClass);
+    builder.addParameters(parameters, parameterCount);
+
+    logEvent("screen_view", &builder);
+}
+
+void TrackerService::sendEcommerceEvent(const char * eventName, const EcommerceItem * items, unsigned itemCount, const Parameter * parameters, unsigned parameterCount)
+{
+    GP_ASSERT(itemCount > 0);
 
-        firebase::analytics::LogEvent(eventName, params.get(), parameterCount);
+    // Firebase C++ SDK can't send array parameters
+    TrackerEventBuilder builder(false);
+    builder.addParameters(parameters, parameterCount);
+    builder.addItems(items, itemCount);
+
+    const std::string& paramsPayload = builder.getJSON();
+    sendGAEvent(eventName, paramsPayload.c_str(), paramsPayload.size());
+}
+
+void TrackerService::sendEvent(const char * eventName, const Parameter * parameters, unsigned parameterCount)
+{
+    TrackerEventBuilder builder(_firebaseApp != NULL);
+    builder.addParameters(parameters, parameterCount);
+
+    logEvent(eventName, &builder);
+}
+
+void TrackerService::logEvent(const char * eventName, TrackerEventBuilder * builder)
+{
+#ifdef FIREBASE_AVAILABLE
+    if (_firebaseApp)
+    {
+        const std::vector<firebase::analytics::Parameter>& params = builder->getFirebaseParameters();
+        firebase::analytics::LogEvent(eventName, params.data(), params.size());
         return;
     }
 
@@ -296,10 +600,11 @@ void TrackerService::sendEvent(const char * eventName, const Parameter * paramet
 
 #endif
 
-    sendGAEvent(eventName, getJsonParamsPayload(parameters, parameterCount));
+    const std::string& paramsPayload = builder->getJSON();
+    sendGAEvent(eventName, paramsPayload.c_str(), paramsPayload.size());
 }
 
-void TrackerService::sendGAEvent(const char * eventName, const std::string& paramsPayload) const
+void TrackerService::sendGAEvent(const char * eventName, const char * paramsPayload, size_t paramsPayloadLength)
 {
 #ifdef __EMSCRIPTEN__
 
@@ -308,68 +613,289 @@ void TrackerService::sendGAEvent(const char * eventName, const std::string& para
             Module.firebaseAnalytics.logEvent(Module.fa, Module.UTF8ToString($0), JSON.parse(Module.UTF8ToString($1)));
         else if (Module.faQueue)
             Module.faQueue.push([Module.UTF8ToString($0), JSON.parse(Module.UTF8ToString($1))]);
-    }, eventName, paramsPayload.c_str());
+    }, eventName, paramsPayload);
 
 #else
 
-    //GP_ASSERT(_httpRequestService);
-    if (!_httpRequestService)
-        return;
+    // events may be sent long after they are logged
+    int64_t timestamp = getTimestampMicros();
+
+    // event is written right after other buffered events and sent later along with them
+    std::unique_lock<std::mutex> lock(_pendingEventsMutex);
+    if (_pendingEventEnds.empty())
+        _firstPendingEventTime = gameplay::Game::getAbsoluteTime() * 0.001;
+    else
+        _pendingEvents.push_back(',');
+
+    JSONWriter writer(&_pendingEvents, paramsPayloadLength + 96);
+    writer.beginObject();
+    writer.key("name");
+    writer.writeString(eventName);
+    writer.key("timestamp_micros");
+    writer.writeInt(timestamp);
+    writer.key("params");
+    writer.writeRaw(paramsPayload, paramsPayloadLength);
+    writer.endObject();
+    _pendingEventEnds.push_back(_pendingEvents.size());
+    _pendingEventTimes.push_back(timestamp);
+
+#endif
+}
+
+bool TrackerService::createBatch()
+{
+    // events are taken from the buffer, so the lock isn't held while the batch is compressed
+    std::string events;
+    int64_t timestamp;
+    {
+        std::unique_lock<std::mutex> lock(_pendingEventsMutex);
+        if (_pendingEventEnds.empty())
+            return false;
+
+        size_t count = std::min(_pendingEventEnds.size(), MAX_EVENTS_PER_BATCH);
+        timestamp = *std::min_element(_pendingEventTimes.begin(), _pendingEventTimes.begin() + count);
+
+        // remaining events are moved to the beginning of the buffer
+        size_t length = _pendingEventEnds[count - 1];
+        events.assign(_pendingEvents, 0, length);
+        _pendingEvents.erase(0, length);
+        _pendingEventEnds.erase(_pendingEventEnds.begin(), _pendingEventEnds.begin() + count);
+        _pendingEventTimes.erase(_pendingEventTimes.begin(), _pendingEventTimes.begin() + count);
+        if (!_pendingEvents.empty())
+        {
+            _pendingEvents.erase(0, 1);     // separating comma
+            for (size_t& end : _pendingEventEnds)
+                end -= length + 1;
+        }
+    }
 
-    static std::string endpoint = fmt::format("https://www.google-analytics.com/mp/collect?api_secret={}&firebase_app_id={}", _apiSecret, _appId);
+    std::string payload;
+    JSONWriter writer(&payload, 1024);
+    writer.beginObject();
+    writer.key("app_instance_id");
+    writer.writeString(_appInstanceId);
+    writer.key("timestamp_micros");
+    writer.writeInt(timestamp);
 
-    std::string userIdPayload;
     if (!_userId.empty())
-        userIdPayload = fmt::format(",\"user_id\": \"{}\"", _userId);
+    {
+        writer.key("user_id");
+        writer.writeString(_userId);
+    }
 
-    std::string userPropertiesPayload;
     if (!_userProperties.empty())
     {
-        userPropertiesPayload = ",\"user_properties\":{";
+        writer.key("user_properties");
+        writer.beginObject();
         for (const auto& prop : _userProperties)
-            userPropertiesPayload += fmt::format(R"("{}":{{"value":"{}"}},)", prop.first, prop.second);
-        userPropertiesPayload.pop_back();
-        userPropertiesPayload += "}";
+        {
+            writer.key(prop.first.c_str(), prop.first.size());
+            writer.beginObject();
+            writer.key("value");
+            writer.writeString(prop.second);
+            writer.endObject();
+        }
+        writer.endObject();
+    }
+
+    writer.key("events");
+    writer.beginArray();
+    writer.writeRaw(events.c_str(), events.size());
+    writer.endArray();
+    writer.endObject();
+
+    std::string body;
+    if (!Utils::gzipCompress(payload.c_str(), payload.size(), &body))
+    {
+        GP_WARN("Failed to compress analytics events");
+        return true;
     }
 
-    const char * clientKey = "app_instance_id";
+    addBatch(std::move(body), timestamp);
 
-    std::string payload = fmt::format(R"({{"{}":"{}"{}{},"events":[{{"name":"{}", "params":{}}}]}})", clientKey,
-        _appInstanceId, userIdPayload, userPropertiesPayload, eventName, paramsPayload);
+    // the oldest batches are dropped if events can't be delivered for a long time,
+    // the batch being sent is kept until its response arrives
+    while (_batches.size() > MAX_STORED_BATCHES)
+        removeBatch(_batches.begin() + (_requestId >= 0 ? 1 : 0));
 
-    //GP_LOG("making GA request %s %s", endpoint.c_str(), payload.c_str());
-    _httpRequestService->makeRequestAsync({ endpoint.c_str(), payload.c_str(),
+    saveBatches(false);
+    return true;
+}
+
+void TrackerService::sendBatch()
+{
+    if (!_httpRequestService || _endpoint.empty())
+        return;
+
+    dropExpiredBatches();
+    if (_batches.empty())
+        return;
+
+    HTTPRequestService::Request request = { _endpoint, _batches.front().body,
         { { "Content-Type", "application/json" },
+          { "Content-Encoding", "gzip" },
+        },
+        std::bind(&TrackerService::batchSentCallback, this, std::placeholders::_1, std::placeholders::_4)
+    };
+
+    // analytics shouldn't delay requests the user is waiting for
+    request.priority = HTTPRequestService::Request::PRIORITY_LOW;
+    _requestId = _httpRequestService->makeRequestAsync(request);
+}
+
+void TrackerService::batchSentCallback(int curlCode, long httpResponseCode)
+{
+    _requestId = -1;
+
+    // client errors mean the batch will never be accepted
+    bool rejected = curlCode == 0 && httpResponseCode >= 400 && httpResponseCode < 500 && httpResponseCode != 408 && httpResponseCode != 429;
+    if (rejected)
+        GP_WARN("Analytics events are rejected with HTTP code %d", static_cast<int>(httpResponseCode));
+
+    if (rejected || (curlCode == 0 && httpResponseCode >= 200 && httpResponseCode < 300))
+    {
+        removeBatch(_batches.begin());
+        _failedAttempts = 0;
+        _nextSendTime = 0.0;
+        saveBatches(false);
+        return;
+    }
+
+    _failedAttempts++;
+    double delay = std::min(MIN_RETRY_DELAY * static_cast<double>(1u << std::min(_failedAttempts - 1, 16u)), MAX_RETRY_DELAY);
+    _nextSendTime = gameplay::Game::getAbsoluteTime() * 0.001 + delay;
+}
+
+void TrackerService::addBatch(std::string&& body, int64_t timestamp)
+{
+    _batches.push_back({ std::move(body), timestamp, _nextBatchId++ });
+    if (_writer)
+        _writer->append({ _batches.back().body, _batches.back().timestamp });
+}
+
+std::deque<TrackerService::Batch>::iterator TrackerService::removeBatch(std::deque<Batch>::iterator it)
+{
+    if (_writer)
+    {
+        _writer->append({ std::string(), (*it).id });
+        _removedBatchCount++;
+    }
+
+    return _batches.erase(it);
+}
+
+void TrackerService::dropExpiredBatches()
+{
+    // the batch being sent is kept until its response arrives
+    int64_t minTimestamp = getTimestampMicros() - MAX_EVENT_AGE;
+    auto it = _batches.begin() + (_requestId >= 0 ? 1 : 0);
+    if (it == _batches.end() || (*it).timestamp >= minTimestamp)
+        return;
+
+    while (it != _batches.end() && (*it).timestamp < minTimestamp)
+        it = removeBatch(it);
+    saveBatches(false);
+}
+
+void TrackerService::loadBatches()
+{
+    FILE * file = fopen(_batchesPath.c_str(), "rb");
+    if (!file)
+        return;
+
+    // batch records are replayed in order, the log stops at a torn record
+    uint32_t magic = 0;
+    std::deque<Batch> batches;
+    if (fread(&magic, sizeof(magic), 1, file) == 1 && magic == BATCHES_FILE_MAGIC)
+    {
+        uint32_t id = 0;
+        Batch batch;
+        int64_t value;
+        while (readRecord(file, &batch.body, &value))
+        {
+            if (!batch.body.empty())
+            {
+                batch.timestamp = value;
+                batch.id = id++;
+                batches.push_back(std::move(batch));
+                continue;
+            }
+
+            auto it = std::find_if(batches.begin(), batches.end(), [value](const Batch& b) { return b.id == value; });
+            if (it != batches.end())
+                batches.erase(it);
         }
-    });
+    }
 
-#endif
+    fclose(file);
+
+    // batches created in this session before tracking was set up are newer
+    _batches.insert(_batches.begin(), batches.begin(), batches.end());
+    while (_batches.size() > MAX_STORED_BATCHES)
+        _batches.pop_front();
+
+    // expired batches are dropped by the rewrite below
+    int64_t minTimestamp = getTimestampMicros() - MAX_EVENT_AGE;
+    _batches.erase(std::remove_if(_batches.begin() + (_requestId >= 0 ? 1 : 0), _batches.end(),
+        [minTimestamp](const Batch& b) { return b.timestamp < minTimestamp; }), _batches.end());
+
+    saveBatches(true);
+}
+
+void TrackerService::saveBatches(bool rewrite)
+{
+    if (!_writer)
+        return;
+
+    // the file is compacted once it has as many removals as there can be batches
+    if (rewrite || _removedBatchCount > MAX_STORED_BATCHES || _writer->needsRewrite())
+    {
+        std::vector<TrackerBatchWriter::Record> records;
+        records.reserve(_batches.size());
+        _nextBatchId = 0;
+        for (Batch& batch : _batches)
+        {
+            batch.id = _nextBatchId++;
+            records.push_back({ batch.body, batch.timestamp });
+        }
+
+        _removedBatchCount = 0;
+        _writer->rewrite(std::move(records));
+    }
+
+    TaskQueueService * taskQueueService = _manager->findService<TaskQueueService>();
+    if (taskQueueService && taskQueueService->getState() == Service::RUNNING)
+    {
+        taskQueueService->createQueue(TRACKER_SERVICE_QUEUE);
+
+        std::shared_ptr<TrackerBatchWriter> writer = _writer;
+        taskQueueService->addWorkItem(TRACKER_SERVICE_QUEUE, [writer]() { writer->processJobs(); });
+    }
+    else
+    {
+        _writer->processJobs();
+    }
 }
 
 void TrackerService::sendTiming(const char * category, const char * variable, const int& timeMs, const Parameter * parameters, unsigned parameterCount)
 {
-    std::unique_ptr<Parameter[]> params(new Parameter[parameterCount + 3]);
-    params[0].name = "event_category";
-    params[0].value.set(std::string(category));
-    params[1].name = "name";
-    params[1].value.set(std::string(variable));
-    params[2].name = "value";
-    params[2].value.set(timeMs);
-    memcpy(params.get() + 3, parameters, sizeof(Parameter) * parameterCount);
+    TrackerEventBuilder builder(_firebaseApp != NULL);
+    builder.addString("event_category", category);
+    builder.addString("name", variable);
+    builder.addInt("value", timeMs);
+    builder.addParameters(parameters, parameterCount);
 
-    sendEvent("timing_complete", params.get(), parameterCount + 3);
+    logEvent("timing_complete", &builder);
 }
 
 void TrackerService::sendException(const char * type, bool isFatal, const Parameter * parameters, unsigned parameterCount)
 {
-    std::unique_ptr<Parameter[]> params(new Parameter[parameterCount + 2]);
-    params[0].name = "description";
-    params[0].value.set(std::string(type));
-    params[1].name = "fatal";
-    params[1].value.set(isFatal);
-    memcpy(params.get() + 2, parameters, sizeof(Parameter) * parameterCount);
+    TrackerEventBuilder builder(_firebaseApp != NULL);
+    builder.addString("description", type);
+    builder.addBool("fatal", isFatal);
+    builder.addParameters(parameters, parameterCount);
 
-    sendEvent("exception", params.get(), parameterCount + 2);
+    logEvent("exception", &builder);
 }
 
 void TrackerService::setUserId(const char * userId)
@@ -9,6 +9,16 @@ namespace firebase { class App; };
  * Tracks user interactions, game events and sends data to Google Analytics.
  * A wrapper around Firebase Analytics. This fallbacks to Measurement Protocol
  * on platforms where Firebase Analytics is not supported.
+ *
+ * Measurement Protocol events are buffered and sent in gzipped batches of up to
+ * 25 events. Batches that couldn't be sent are retried with exponential backoff
+ * and are kept in the user data folder until they are delivered. Created and delivered
+ * batches are appended to the file off the main thread, pending events are put into
+ * a batch when the app is paused. Each event carries the time it was logged at, events
+ * older than 72 hours are dropped since Measurement Protocol doesn't accept them.
+ *
+ * Events can be sent from any thread. Setup, user properties and flush() are
+ * only called from the main thread.
  */
 
 class TrackerService : public Service
@@ -42,6 +52,18 @@ public:
 
     void setTrackerEnabled(bool enabled);
 
+    /**
+     * Set how long Measurement Protocol events are buffered before they are sent.
+     *
+     * @param[in] seconds Interval in seconds. Default is 30 seconds.
+     */
+    void setFlushInterval(float seconds) { _flushInterval = seconds; };
+
+    /**
+     * Send all buffered Measurement Protocol events now, e.g. when the app goes to background.
+     */
+    void flush();
+
     static const char * getTypeName() { return "TrackerService"; }
     
     /**
@@ -107,8 +129,23 @@ protected:
     virtual bool onTick();
 
 private:
-    std::string getJsonParamsPayload(const Parameter * parameters, unsigned parameterCount) const;
-    void sendGAEvent(const char * eventName, const std::string& paramsPayload) const;
+    struct Batch
+    {
+        std::string body;                           // gzipped request body
+        int64_t timestamp;                          // time of the oldest event in the batch, in microseconds since epoch
+        uint32_t id;                                // index of the batch record in the batches file
+    };
+
+    void logEvent(const char * eventName, class TrackerEventBuilder * builder);
+    void sendGAEvent(const char * eventName, const char * paramsPayload, size_t paramsPayloadLength);
+    bool createBatch();
+    void sendBatch();
+    void batchSentCallback(int curlCode, long httpResponseCode);
+    void addBatch(std::string&& body, int64_t timestamp);
+    std::deque<Batch>::iterator removeBatch(std::deque<Batch>::iterator it);
+    void dropExpiredBatches();
+    void loadBatches();
+    void saveBatches(bool rewrite);
 
     firebase::App * _firebaseApp;
 
@@ -121,4 +158,22 @@ private:
     std::string _apiSecret;
     std::string _userId;
     std::map<std::string, std::string> _userProperties;
+
+    // Measurement Protocol event buffering
+    std::string _endpoint;
+    std::string _batchesPath;
+    std::mutex _pendingEventsMutex;                 // guards pending events, they are logged from any thread
+    std::string _pendingEvents;                     // comma separated JSON objects of events not yet put into a batch
+    std::vector<size_t> _pendingEventEnds;          // end offset of each event in _pendingEvents
+    std::vector<int64_t> _pendingEventTimes;        // time each event in _pendingEvents was logged at
+    double _firstPendingEventTime;
+    std::deque<Batch> _batches;                     // oldest first
+    double _nextSendTime;
+    float _flushInterval;
+    unsigned _failedAttempts;
+    int _requestId;                                 // request sending the oldest batch, or -1
+    std::shared_ptr<class TrackerBatchWriter> _writer;
+    uint32_t _nextBatchId;
+    uint32_t _removedBatchCount;                    // removal records in the batches file
+    sigc::connection _pauseConnection;
 };
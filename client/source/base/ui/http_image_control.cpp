@@ -9,12 +9,14 @@
 
 HTTPImageControl::HTTPImageControl()
     : _httpRequestService(NULL)
+    , _requestId(-1)
     , _preserveAspect(true)
 {
 }
 
 HTTPImageControl::~HTTPImageControl()
 {
+    cancelDownload();
 }
 
 const char * HTTPImageControl::getTypeName() const
@@ -60,49 +62,58 @@ unsigned int HTTPImageControl::drawImages(gameplay::Form * form) const
 void HTTPImageControl::setImage(const char * path)
 {
     SAFE_DELETE(_batch);
+    cancelDownload();
+
     if (!path || !*path)
         return;
 
     if (gameplay::FileSystem::fileExists(path))
         return gameplay::ImageControl::setImage(path);
 
-    // make sure instance is present while callback is scheduled
-    this->addRef();
-    _httpRequestService->makeRequestAsync({ path, "", HTTPRequestService::Request::HeadersList(),
-        std::bind(&HTTPImageControl::imageDownloadedCallback, this, std::placeholders::_1, std::placeholders::_2, std::string(path), std::placeholders::_3, std::placeholders::_4) });
-}
-
-void HTTPImageControl::imageDownloadedCallback(int curlCode, MemoryStream * response, const std::string& path, const char * error, int httpResponseCode)
-{
-    if (curlCode != 0 || response == nullptr || httpResponseCode != 200)
-    {
-        this->release();
-        return;
-    }
-
-    // create temporary file with an extension from original request
+    // download image directly to temporary file with an extension from original request
 #ifdef WIN32
     const char * tmpFilename = tmpnam(NULL);
-    std::string filename = std::string(tmpFilename) + gameplay::FileSystem::getExtension(path.c_str());
+    std::string filename = std::string(tmpFilename) + gameplay::FileSystem::getExtension(path);
 #else
     char tmpFilename[] = "tmp.XXXXXX";
     mktemp(tmpFilename);
-    std::string filename = std::string(gameplay::Game::getInstance()->getTemporaryFolderPath()) + tmpFilename + gameplay::FileSystem::getExtension(path.c_str());
+    std::string filename = std::string(gameplay::Game::getInstance()->getTemporaryFolderPath()) + tmpFilename + gameplay::FileSystem::getExtension(path);
 #endif
-    std::unique_ptr<gameplay::Stream> stream(gameplay::FileSystem::open(filename.c_str(), gameplay::FileSystem::WRITE));
-    if (stream && stream->write(response->getBuffer(), response->length(), 1) == 1)
-    {
-        stream.reset();
 
+    HTTPRequestService::Request request = { path, "", HTTPRequestService::Request::HeadersList(),
+        std::bind(&HTTPImageControl::imageDownloadedCallback, this, std::placeholders::_1, std::placeholders::_2, filename, std::placeholders::_3, std::placeholders::_4) };
+    request.downloadPath = filename;
+    request.removeDownloadOnCancel = true;
+
+    // images are visible to user, fetch them ahead of background requests
+    request.priority = HTTPRequestService::Request::PRIORITY_HIGH;
+
+    // request is cancelled when the control is destroyed, so callback never outlives it
+    _requestId = _httpRequestService->makeRequestAsync(request);
+}
+
+void HTTPImageControl::cancelDownload()
+{
+    if (_requestId < 0)
+        return;
+
+    if (_httpRequestService)
+        _httpRequestService->cancelRequest(_requestId);
+    _requestId = -1;
+}
+
+void HTTPImageControl::imageDownloadedCallback(int curlCode, MemoryStream * response, const std::string& filename, const char * error, int httpResponseCode)
+{
+    if (curlCode == 0 && response != nullptr && httpResponseCode == 200)
+    {
         gameplay::ImageControl::setImage(filename.c_str());
         if (_preserveAspect)
             setDirty(DIRTY_BOUNDS);
     }
 
-    stream.reset();
     remove(filename.c_str());
 
-    this->release();
+    _requestId = -1;
 }
 
 void HTTPImageControl::setPreserveAspect(bool set)
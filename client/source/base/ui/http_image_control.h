@@ -40,7 +40,7 @@ public:
      * Set the path of the image for this ImageControl to display.
      * File can't be opened using path argument, it is then interpreted
      * as URL and is tried to be downloaded using HTTP request.
-     * The file is downloaded and stored in the temporary folder and 
+     * The file is downloaded directly to the temporary folder and 
      * then opened as usual file.
      *
      * @param path The path to the image or URL.
@@ -96,9 +96,11 @@ protected:
 
 private:
 
-    void imageDownloadedCallback(int curlCode, class MemoryStream * stream, const std::string& path, const char * error, int httpResponseCode);
+    void imageDownloadedCallback(int curlCode, class MemoryStream * stream, const std::string& filename, const char * error, int httpResponseCode);
+    void cancelDownload();
 
     class HTTPRequestService * _httpRequestService;
+    int _requestId;
     bool _preserveAspect;
 };
 
@@ -0,0 +1,49 @@
+#pragma once
+
+#ifndef __DFG_MONOTONIC_THROTTLE_H__
+#define __DFG_MONOTONIC_THROTTLE_H__
+
+#include <atomic>
+#include <chrono>
+
+
+
+
+/**
+ * MonotonicThrottle limits how often some action is executed, the same way
+ * Throttle does, but measures time with a monotonic clock instead of game time.
+ *
+ * Unlike Throttle it doesn't pause with the game and can be used from any thread.
+ * shouldExecute() is thread-safe, only one of the threads calling it simultaneously
+ * is allowed to execute.
+ */
+class MonotonicThrottle
+{
+public:
+    float interval;     // in seconds
+
+    MonotonicThrottle(float _interval) : interval(_interval), _lastTime(0) {}
+
+    bool shouldExecute()
+    {
+        int64_t currentTime = std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+        int64_t lastTime = _lastTime.load(std::memory_order_relaxed);
+        if (lastTime != 0 && currentTime - lastTime < static_cast<int64_t>(interval * 1e9f))
+            return false;
+
+        return _lastTime.compare_exchange_strong(lastTime, currentTime, std::memory_order_relaxed);
+    }
+
+    /**
+     * Allow the next call to shouldExecute() to execute regardless of the interval.
+     */
+    void reset() { _lastTime = 0; }
+
+private:
+    std::atomic<int64_t> _lastTime;     // in ns, 0 if never executed
+};
+
+
+
+
+#endif // __DFG_MONOTONIC_THROTTLE_H__
@@ -8,13 +8,13 @@
 
 
 RunOnChange::RunOnChange(const std::function<void()>& fn, const std::vector<const VariantType *>& dependencies)
-    : _function(fn), _dependencies(dependencies)
+    : _function(fn), _dependencies(dependencies), _lastNotificationBatchId(0)
 {
     connectDependencies();
 }
 
 RunOnChange::RunOnChange(const std::function<void()>& fn, const std::vector<const char *>& dependencies)
-    : _function(fn)
+    : _function(fn), _lastNotificationBatchId(0)
 {
     for (const auto& dep : dependencies)
     {
@@ -45,5 +45,14 @@ void RunOnChange::connectDependencies()
 
 void RunOnChange::onDependencyChanged(const VariantType&)
 {
+    // values of all dependencies are already updated when batched notifications are sent
+    unsigned batchId = VariantType::getNotificationBatchId();
+    if (batchId != 0)
+    {
+        if (batchId == _lastNotificationBatchId)
+            return;
+        _lastNotificationBatchId = batchId;
+    }
+
     _function();
 }
\ No newline at end of file
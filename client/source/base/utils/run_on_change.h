@@ -7,6 +7,9 @@
 /**
  * A wrapper around some function which is executed when any of the dependencies change.
  * Similar to how React.useEffect works.
+ *
+ * When several dependencies are changed within one batch (see Settings::beginChanges)
+ * the function is executed only once.
  */
 class RunOnChange
 {
@@ -34,6 +37,7 @@ private:
     std::function<void()> _function;
     std::vector<const VariantType *> _dependencies;
     std::vector<sigc::connection> _connections;
+    unsigned _lastNotificationBatchId;
 
     void connectDependencies();
     void onDependencyChanged(const VariantType& value);
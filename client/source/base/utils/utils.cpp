@@ -81,6 +81,32 @@ unsigned long compressToStream(const void * data, size_t dataLength, gameplay::S
     return defstream.total_out;
 }
 
+bool gzipCompress(const void * data, size_t dataLength, std::string * out)
+{
+    z_stream defstream;
+
+    defstream.zalloc = Z_NULL;
+    defstream.zfree = Z_NULL;
+    defstream.opaque = Z_NULL;
+
+    // 16 added to window bits makes zlib write gzip header and trailer
+    if (deflateInit2(&defstream, Z_DEFAULT_COMPRESSION, Z_DEFLATED, 15 + 16, 8, Z_DEFAULT_STRATEGY) != Z_OK)
+        return false;
+
+    out->resize(deflateBound(&defstream, static_cast<uLong>(dataLength)));
+
+    defstream.avail_in = static_cast<uInt>(dataLength);
+    defstream.next_in = (Bytef *)data;
+    defstream.avail_out = static_cast<uInt>(out->size());
+    defstream.next_out = (Bytef *)&(*out)[0];
+
+    int res = deflate(&defstream, Z_FINISH);
+    out->resize(defstream.total_out);
+    deflateEnd(&defstream);
+
+    return res == Z_STREAM_END;
+}
+
 
 // Function to calculate HMAC-SHA256
 std::string calculateHMAC_SHA256(const std::string& key, const std::string& data) {
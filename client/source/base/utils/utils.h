@@ -195,6 +195,17 @@ std::string calculateHMAC_SHA256(const std::string& key, const std::string& data
  */
 unsigned long compressToStream(const void * data, size_t dataLength, gameplay::Stream * stream, void * tmpBuf, size_t tmpBufSize);
 
+/**
+ * Compress data to gzip format, suitable for 'Content-Encoding: gzip' HTTP bodies.
+ *
+ * @param data Input buffer.
+ * @param dataLength Length of input buffer.
+ * @param out String to store result.
+ *
+ * @return True if data is compressed successfully.
+ */
+bool gzipCompress(const void * data, size_t dataLength, std::string * out);
+
 
 };
 
@@ -14,20 +14,26 @@
 #include "main/dictionary.h"
 #include "main/gameplay_assets.h"
 #include "main/idb_stream.h"
+#include "main/json.h"
 #include "main/memory_stream.h"
+#include "main/message_channel.h"
 #include "main/settings.h"
+#include "main/settings_storage.h"
 #include "main/socket_stream.h"
 #include "main/variant.h"
 #include "main/zip_packages.h"
 #include "main/zip_stream.h"
 #include "render/particle_system.h"
 #include "services/debug_service.h"
+#include "services/file_watcher_service.h"
+#include "services/http_response_cache.h"
 #include "services/httprequest_service.h"
 #include "services/input_service.h"
 #include "services/render_service.h"
 #include "services/service.h"
 #include "services/service_manager.h"
 #include "services/signals.h"
+#include "services/socket_reactor_service.h"
 #include "services/social_service.h"
 #include "services/storefront_service.h"
 #include "services/taskqueue_service.h"
@@ -42,6 +48,7 @@
 #include "ui/slide_menu.h"
 #include "utils/curve.h"
 #include "utils/intrusive_list.h"
+#include "utils/monotonic_throttle.h"
 #include "utils/noncopyable.h"
 #include "utils/priority_signal.h"
 #include "utils/profiler.h"
@@ -16,6 +16,7 @@
 #include <memory.h>
 #include <math.h>
 #include <unordered_set>
+#include <atomic>
 
 
 
@@ -0,0 +1,183 @@
+#include "pch.h"
+#include "loopback_http_server.h"
+#include "services/service_manager.h"
+#include "services/taskqueue_service.h"
+#include "services/httprequest_service.h"
+#include "main/memory_stream.h"
+
+#include <curl/curl.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#include <new>
+
+
+
+
+/**
+ * Measures throughput of asynchronous HTTPRequestService requests against
+ * LoopbackHTTPServer running in a child process, so only the client's
+ * allocations are counted.
+ *
+ * Usage: http_request_benchmark [requests] [concurrency] [payload size in bytes]
+ */
+
+static std::atomic<uint64_t> allocatedBytes(0);
+static std::atomic<uint64_t> allocationCount(0);
+
+void * operator new(size_t size)
+{
+    allocatedBytes += size;
+    allocationCount++;
+
+    void * res = malloc(size ? size : 1);
+    if (!res)
+        throw std::bad_alloc();
+    return res;
+}
+
+void operator delete(void * ptr) noexcept
+{
+    free(ptr);
+}
+
+void operator delete(void * ptr, size_t) noexcept
+{
+    free(ptr);
+}
+
+static float getPercentile(std::vector<float>& samples, float percentile)
+{
+    if (samples.empty())
+        return 0.0f;
+
+    auto it = samples.begin() + static_cast<size_t>(percentile * (samples.size() - 1) + 0.5f);
+    std::nth_element(samples.begin(), it, samples.end());
+    return *it;
+}
+
+// server runs until the pipe is closed by the parent process
+static pid_t startServer(std::string * baseURL, int * controlPipe)
+{
+    int urlPipe[2];
+    if (pipe(urlPipe) != 0 || pipe(controlPipe) != 0)
+        return -1;
+
+    pid_t pid = fork();
+    if (pid == 0)
+    {
+        close(urlPipe[0]);
+        close(controlPipe[1]);
+
+        LoopbackHTTPServer server;
+        std::string url = server.start() ? server.getURL("") : std::string();
+        if (write(urlPipe[1], url.c_str(), url.size() + 1) < 0)
+            _exit(1);
+        close(urlPipe[1]);
+
+        char value;
+        while (read(controlPipe[0], &value, 1) > 0);
+
+        server.stop();
+        _exit(0);
+    }
+
+    close(urlPipe[1]);
+    close(controlPipe[0]);
+
+    char buffer[256];
+    ssize_t size = pid > 0 ? read(urlPipe[0], buffer, sizeof(buffer) - 1) : -1;
+    close(urlPipe[0]);
+    if (size <= 1)
+        return -1;
+
+    buffer[size] = '\0';
+    *baseURL = buffer;
+    return pid;
+}
+
+int main(int argc, char ** argv)
+{
+    int requests = argc > 1 ? atoi(argv[1]) : 10000;
+    int concurrency = argc > 2 ? atoi(argv[2]) : 16;
+    int payloadSize = argc > 3 ? atoi(argv[3]) : 16 * 1024;
+    if (requests <= 0 || concurrency <= 0 || payloadSize < 0)
+    {
+        printf("Usage: %s [requests] [concurrency] [payload size in bytes]\n", argv[0]);
+        return 1;
+    }
+
+    std::string baseURL;
+    int controlPipe[2];
+    pid_t serverPid = startServer(&baseURL, controlPipe);
+    if (serverPid < 0)
+    {
+        printf("Can't start HTTP server\n");
+        return 1;
+    }
+
+    curl_global_init(CURL_GLOBAL_ALL);
+
+    ServiceManager * manager = ServiceManager::getInstance();
+    Service * dependencies[] = { manager->registerService<TaskQueueService>(NULL), NULL };
+    HTTPRequestService * service = manager->registerService<HTTPRequestService>(dependencies);
+    while (service->getState() != Service::RUNNING)
+        manager->update(0.0f);
+
+    service->setCacheDirectory("");
+    service->setMaxRequests(concurrency);
+    service->setMaxRequestsPerHost(concurrency);
+
+    // each request has its own URL, so identical requests are not coalesced
+    int sent = 0, completed = 0, failed = 0;
+    std::vector<float> latencies;
+    latencies.reserve(requests);
+    std::function<void()> sendNext = [&]()
+    {
+        HTTPRequestService::Request request;
+        request.url = fmt::format("{}/bytes/{}?{}", baseURL, payloadSize, sent++);
+        auto startTime = std::chrono::steady_clock::now();
+        request.responseCallback = [&, startTime](int error, MemoryStream * stream, const char *, long httpCode)
+        {
+            completed++;
+            if (error != 0 || httpCode != 200 || !stream || stream->length() != static_cast<size_t>(payloadSize))
+                failed++;
+            latencies.push_back(std::chrono::duration<float, std::milli>(std::chrono::steady_clock::now() - startTime).count());
+
+            if (sent < requests)
+                sendNext();
+        };
+        service->makeRequestAsync(request);
+    };
+
+    service->resetStatistics();
+    uint64_t startBytes = allocatedBytes;
+    uint64_t startCount = allocationCount;
+    auto start = std::chrono::steady_clock::now();
+
+    for (int i = 0; i < concurrency && sent < requests; i++)
+        sendNext();
+
+    // main thread runs one callback per update, like the game does once a frame
+    while (completed < requests)
+        manager->update(0.0f);
+
+    double elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    uint64_t bytes = allocatedBytes - startBytes;
+    uint64_t count = allocationCount - startCount;
+    HTTPRequestService::Statistics statistics = service->getStatistics();
+
+    printf("requests: %d, concurrency %d, payload %d bytes, failed %d\n", requests, concurrency, payloadSize, failed);
+    printf("throughput: %.0f req/s, %.1f Mb/s\n", requests / elapsed, requests * static_cast<double>(payloadSize) / elapsed / (1024.0 * 1024.0));
+    printf("latency: p50 %.2f ms, p99 %.2f ms\n", getPercentile(latencies, 0.5f), getPercentile(latencies, 0.99f));
+    printf("callback delay: p50 %.2f ms, p99 %.2f ms\n", statistics.callbackDelayP50, statistics.callbackDelayP99);
+    printf("allocations: %.1f per request, %.0f bytes per request\n", static_cast<double>(count) / requests, static_cast<double>(bytes) / requests);
+    printf("connections: %d\n", static_cast<int>(statistics.connections));
+
+    manager->shutdown();
+    curl_global_cleanup();
+
+    close(controlPipe[1]);
+    waitpid(serverPid, NULL, 0);
+
+    return failed == 0 ? 0 : 1;
+}
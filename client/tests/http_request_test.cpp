@@ -0,0 +1,569 @@
+#include "pch.h"
+#include "loopback_http_server.h"
+#include "services/service_manager.h"
+#include "services/taskqueue_service.h"
+#include "services/httprequest_service.h"
+#include "main/memory_stream.h"
+
+#include <curl/curl.h>
+#include <unistd.h>
+
+
+
+
+/**
+ * Tests asynchronous requests of HTTPRequestService against LoopbackHTTPServer.
+ */
+
+static int failures = 0;
+
+#define CHECK(condition) \
+    do { if (!(condition)) { printf("%s:%d: check failed: %s\n", __FILE__, __LINE__, #condition); failures++; } } while (0)
+
+struct Response
+{
+    bool completed = false;
+    int error = -1;
+    long httpCode = 0;
+    std::string body;
+    std::chrono::steady_clock::time_point time;
+};
+
+static int sendRequest(HTTPRequestService * service, const std::string& url, Response * response, const std::string& postPayload = "")
+{
+    HTTPRequestService::Request request;
+    request.url = url;
+    request.postPayload = postPayload;
+    request.responseCallback = [response](int error, MemoryStream * stream, const char *, long httpCode)
+    {
+        response->completed = true;
+        response->error = error;
+        response->httpCode = httpCode;
+        if (stream)
+            response->body.assign(reinterpret_cast<const char *>(stream->getBuffer()), stream->length());
+        response->time = std::chrono::steady_clock::now();
+    };
+
+    return service->makeRequestAsync(request);
+}
+
+// update services until all responses are completed or timeout expires
+static bool waitFor(const std::vector<Response>& responses, int timeoutMs = 10000)
+{
+    auto end = std::chrono::steady_clock::now() + std::chrono::milliseconds(timeoutMs);
+    while (std::chrono::steady_clock::now() < end)
+    {
+        ServiceManager::getInstance()->update(0.0f);
+        if (std::all_of(responses.begin(), responses.end(), [](const Response& r) { return r.completed; }))
+            return true;
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+
+    return false;
+}
+
+static void testRequests(HTTPRequestService * service, LoopbackHTTPServer * server)
+{
+    std::vector<Response> responses(20);
+    for (size_t i = 0; i < responses.size(); i++)
+        sendRequest(service, server->getURL(fmt::format("/bytes/{}", 1000 + i).c_str()), &responses[i]);
+
+    CHECK(waitFor(responses));
+    for (size_t i = 0; i < responses.size(); i++)
+    {
+        CHECK(responses[i].error == 0 && responses[i].httpCode == 200);
+        CHECK(responses[i].body == LoopbackHTTPServer::makeBody(1000 + i));
+    }
+
+    // connections are reused
+    CHECK(server->getConnectionCount() <= 6);
+}
+
+static void testPost(HTTPRequestService * service, LoopbackHTTPServer * server)
+{
+    std::string payload = LoopbackHTTPServer::makeBody(100000);
+    std::vector<Response> responses(1);
+    sendRequest(service, server->getURL("/echo"), &responses[0], payload);
+
+    CHECK(waitFor(responses));
+    CHECK(responses[0].error == 0 && responses[0].body == payload);
+}
+
+static void testErrorResponse(HTTPRequestService * service, LoopbackHTTPServer * server)
+{
+    std::vector<Response> responses(1);
+    sendRequest(service, server->getURL("/status/404"), &responses[0]);
+
+    CHECK(waitFor(responses));
+    CHECK(responses[0].httpCode == 404 && responses[0].body == "status 404");
+}
+
+static std::string readFile(const std::string& path)
+{
+    std::string res;
+    FILE * file = fopen(path.c_str(), "rb");
+    if (file)
+    {
+        char buffer[1024];
+        size_t size;
+        while ((size = fread(buffer, 1, sizeof(buffer), file)) > 0)
+            res.append(buffer, size);
+        fclose(file);
+    }
+    return res;
+}
+
+static void writeFile(const std::string& path, const std::string& data)
+{
+    FILE * file = fopen(path.c_str(), "wb");
+    if (file)
+    {
+        fwrite(data.data(), 1, data.size(), file);
+        fclose(file);
+    }
+}
+
+static void testRedirect(HTTPRequestService * service, LoopbackHTTPServer * server)
+{
+    // redirect page is not a part of the response
+    std::vector<Response> responses(3);
+    sendRequest(service, server->getURL("/redirect/100"), &responses[0]);
+
+    std::string streamed;
+    HTTPRequestService::Request request;
+    request.url = server->getURL("/redirect/200");
+    request.dataCallback = [&streamed](const void * data, size_t size) { streamed.append(reinterpret_cast<const char *>(data), size); return true; };
+    request.responseCallback = [&responses](int error, MemoryStream * stream, const char *, long httpCode)
+    {
+        responses[1].completed = true;
+        responses[1].error = error;
+        responses[1].httpCode = httpCode;
+        responses[1].body.assign(reinterpret_cast<const char *>(stream->getBuffer()), stream->length());
+    };
+    service->makeRequestAsync(request);
+
+    std::string downloadPath = fmt::format("/tmp/dfg_http_request_test_{}.bin", getpid());
+    remove(downloadPath.c_str());
+    request.url = server->getURL("/redirect/300");
+    request.dataCallback = nullptr;
+    request.downloadPath = downloadPath;
+    request.responseCallback = [&responses](int error, MemoryStream * stream, const char *, long httpCode)
+    {
+        responses[2].completed = true;
+        responses[2].error = error;
+        responses[2].httpCode = httpCode;
+        responses[2].body.assign(reinterpret_cast<const char *>(stream->getBuffer()), stream->length());
+    };
+    service->makeRequestAsync(request);
+
+    CHECK(waitFor(responses));
+    CHECK(responses[0].httpCode == 200 && responses[0].body == LoopbackHTTPServer::makeBody(100));
+    CHECK(responses[1].httpCode == 200 && responses[1].body.empty() && streamed == LoopbackHTTPServer::makeBody(200));
+    CHECK(responses[2].httpCode == 200 && responses[2].body.empty());
+
+    CHECK(readFile(downloadPath) == LoopbackHTTPServer::makeBody(300));
+    remove(downloadPath.c_str());
+}
+
+static void testResume(HTTPRequestService * service, LoopbackHTTPServer * server)
+{
+    std::string downloadPath = fmt::format("/tmp/dfg_http_request_test_{}.bin", getpid());
+    std::string body = LoopbackHTTPServer::makeBody(5000);
+
+    // partial file is completed with 206, complete file gets 416 and is kept as is,
+    // the whole body replaces partial file when server doesn't support ranges
+    struct
+    {
+        const char * path;
+        std::string partial;
+        long httpCode;
+        int rangeRequests;
+    } cases[] = {
+        { "/range/0/5000", body.substr(0, 1000), 206, 1 },
+        { "/range/0/5000", body, 416, 1 },
+        { "/bytes/5000", std::string(1000, 'x'), 200, 0 },
+    };
+
+    for (const auto& c : cases)
+    {
+        writeFile(downloadPath, c.partial);
+        server->resetCounters();
+
+        std::vector<Response> responses(1);
+        HTTPRequestService::Request request;
+        request.url = server->getURL(c.path);
+        request.downloadPath = downloadPath;
+        request.responseCallback = [&responses](int error, MemoryStream *, const char *, long httpCode)
+        {
+            responses[0].completed = true;
+            responses[0].error = error;
+            responses[0].httpCode = httpCode;
+        };
+        service->makeRequestAsync(request);
+
+        CHECK(waitFor(responses));
+        CHECK(responses[0].error == 0 && responses[0].httpCode == c.httpCode);
+        CHECK(server->getRangeRequestCount() == c.rangeRequests);
+        CHECK(readFile(downloadPath) == body);
+    }
+
+    remove(downloadPath.c_str());
+}
+
+static void testProgress(HTTPRequestService * service, LoopbackHTTPServer * server)
+{
+    // the last update is never throttled away and arrives before the response
+    uint64_t dltotal = 0, dlnow = 0;
+    bool progressBeforeResponse = false;
+    std::vector<Response> responses(1);
+    HTTPRequestService::Request request;
+    request.url = server->getURL("/bytes/300000");
+    request.progressCallback = [&dltotal, &dlnow](uint64_t total, uint64_t now, uint64_t, uint64_t)
+    {
+        dltotal = total;
+        dlnow = now;
+        return false;
+    };
+    request.responseCallback = [&](int error, MemoryStream *, const char *, long)
+    {
+        responses[0].completed = true;
+        responses[0].error = error;
+        progressBeforeResponse = dlnow == 300000 && dltotal == 300000;
+    };
+    service->makeRequestAsync(request);
+
+    CHECK(waitFor(responses));
+    CHECK(responses[0].error == 0 && progressBeforeResponse);
+}
+
+static void testSlowRequest(HTTPRequestService * service, LoopbackHTTPServer * server)
+{
+    // slow request doesn't block the others
+    std::vector<Response> responses(6);
+    sendRequest(service, server->getURL("/delay/1000/10"), &responses[0]);
+    for (size_t i = 1; i < responses.size(); i++)
+        sendRequest(service, server->getURL(fmt::format("/bytes/{}", i).c_str()), &responses[i]);
+
+    CHECK(waitFor(responses));
+    for (size_t i = 1; i < responses.size(); i++)
+        CHECK(responses[i].error == 0 && responses[i].time < responses[0].time);
+}
+
+static void testHostLimit(HTTPRequestService * service, LoopbackHTTPServer * server)
+{
+    service->setMaxRequestsPerHost(2);
+    server->resetCounters();
+
+    std::vector<Response> responses(8);
+    for (size_t i = 0; i < responses.size(); i++)
+        sendRequest(service, server->getURL(fmt::format("/delay/50/{}", i).c_str()), &responses[i]);
+
+    CHECK(waitFor(responses));
+    CHECK(server->getMaxActiveRequests() == 2);
+
+    service->setMaxRequestsPerHost(6);
+}
+
+static void testPriority(HTTPRequestService * service, LoopbackHTTPServer * server)
+{
+    service->setMaxRequestsPerHost(1);
+    server->resetCounters();
+
+    // higher priority is sent first, the same priority in order of sending,
+    // identical request of higher priority raises the priority of the waiting one
+    struct
+    {
+        const char * path;
+        int priority;
+    } requests[] = {
+        { "/bytes/11", HTTPRequestService::Request::PRIORITY_LOW },
+        { "/bytes/12", HTTPRequestService::Request::PRIORITY_NORMAL },
+        { "/bytes/13", HTTPRequestService::Request::PRIORITY_LOW },
+        { "/bytes/14", HTTPRequestService::Request::PRIORITY_HIGH },
+        { "/bytes/15", HTTPRequestService::Request::PRIORITY_LOW },
+        { "/bytes/15", HTTPRequestService::Request::PRIORITY_HIGH },
+    };
+
+    // the others wait until the first request is completed
+    std::vector<Response> responses(1 + sizeof(requests) / sizeof(requests[0]));
+    sendRequest(service, server->getURL("/delay/200/1"), &responses[0]);
+    while (server->getRequestCount() == 0)
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+
+    std::vector<int> order;
+    for (size_t i = 0; i < sizeof(requests) / sizeof(requests[0]); i++)
+    {
+        HTTPRequestService::Request request;
+        request.url = server->getURL(requests[i].path);
+        request.priority = requests[i].priority;
+        request.responseCallback = [&responses, &order, i](int error, MemoryStream *, const char *, long httpCode)
+        {
+            responses[i + 1].completed = true;
+            responses[i + 1].error = error;
+            responses[i + 1].httpCode = httpCode;
+            order.push_back(static_cast<int>(i));
+        };
+        service->makeRequestAsync(request);
+    }
+
+    CHECK(waitFor(responses));
+
+    // callbacks of identical requests are invoked together
+    if (order.size() == 6 && order[1] == 5)
+        std::swap(order[1], order[2]);
+    CHECK(order == std::vector<int>({ 3, 4, 5, 1, 0, 2 }));
+    CHECK(server->getRequestCount() == 6);
+
+    service->setMaxRequestsPerHost(6);
+}
+
+static void testCancel(HTTPRequestService * service, LoopbackHTTPServer * server)
+{
+    // the other request completes later than the cancelled one would
+    Response cancelled;
+    std::vector<Response> responses(1);
+    int handle = sendRequest(service, server->getURL("/delay/100/10"), &cancelled);
+    sendRequest(service, server->getURL("/delay/300/10"), &responses[0]);
+    service->cancelRequest(handle);
+
+    CHECK(waitFor(responses));
+    CHECK(!cancelled.completed);
+}
+
+static bool fileExists(const std::string& path)
+{
+    FILE * file = fopen(path.c_str(), "rb");
+    if (file)
+        fclose(file);
+    return file != NULL;
+}
+
+static void testCancelDownload(HTTPRequestService * service, LoopbackHTTPServer * server)
+{
+    // identical requests are coalesced, cancelled leader keeps downloading for the other one
+    std::string leaderPath = fmt::format("/tmp/dfg_http_request_test_leader_{}.bin", getpid());
+    std::string followerPath = fmt::format("/tmp/dfg_http_request_test_follower_{}.bin", getpid());
+    std::string cancelledPath = fmt::format("/tmp/dfg_http_request_test_cancelled_{}.bin", getpid());
+
+    std::vector<Response> responses(1);
+    HTTPRequestService::Request request;
+    request.url = server->getURL("/delay/200/5000");
+    request.removeDownloadOnCancel = true;
+    request.downloadPath = leaderPath;
+    request.responseCallback = [](int, MemoryStream *, const char *, long) {};
+    int leader = service->makeRequestAsync(request);
+
+    request.downloadPath = followerPath;
+    request.responseCallback = [&responses](int error, MemoryStream *, const char *, long httpCode)
+    {
+        responses[0].completed = true;
+        responses[0].error = error;
+        responses[0].httpCode = httpCode;
+    };
+    service->makeRequestAsync(request);
+
+    // the other request is cancelled while it's being received
+    request.url = server->getURL("/delay/100/5000");
+    request.downloadPath = cancelledPath;
+    request.responseCallback = [](int, MemoryStream *, const char *, long) {};
+    int cancelled = service->makeRequestAsync(request);
+
+    std::this_thread::sleep_for(std::chrono::milliseconds(50));
+    service->cancelRequest(leader);
+    service->cancelRequest(cancelled);
+
+    CHECK(waitFor(responses));
+    CHECK(responses[0].error == 0 && responses[0].httpCode == 200);
+    CHECK(fileExists(followerPath));
+    CHECK(!fileExists(leaderPath));
+
+    // wait for the cancelled request to be dropped
+    std::vector<Response> delay(1);
+    sendRequest(service, server->getURL("/delay/300/10"), &delay[0]);
+    CHECK(waitFor(delay));
+    CHECK(!fileExists(cancelledPath));
+
+    remove(followerPath.c_str());
+    remove(leaderPath.c_str());
+    remove(cancelledPath.c_str());
+}
+
+static void testCoalescedResume(HTTPRequestService * service, LoopbackHTTPServer * server)
+{
+    // the other request gets the whole file when the leader resumes its partial download
+    std::string leaderPath = fmt::format("/tmp/dfg_http_request_test_leader_{}.bin", getpid());
+    std::string followerPath = fmt::format("/tmp/dfg_http_request_test_follower_{}.bin", getpid());
+    std::string body = LoopbackHTTPServer::makeBody(5000);
+
+    for (size_t resumeFrom : { static_cast<size_t>(1000), body.size() })
+    {
+        writeFile(leaderPath, body.substr(0, resumeFrom));
+        remove(followerPath.c_str());
+        server->resetCounters();
+
+        std::vector<Response> responses(2);
+        for (size_t i = 0; i < responses.size(); i++)
+        {
+            HTTPRequestService::Request request;
+            request.url = server->getURL("/range/100/5000");
+            request.downloadPath = i == 0 ? leaderPath : followerPath;
+            request.responseCallback = [&responses, i](int error, MemoryStream *, const char *, long httpCode)
+            {
+                responses[i].completed = true;
+                responses[i].error = error;
+                responses[i].httpCode = httpCode;
+            };
+            service->makeRequestAsync(request);
+        }
+
+        long expectedCode = resumeFrom < body.size() ? 206 : 416;
+        CHECK(waitFor(responses));
+        CHECK(server->getRequestCount() == 1 && server->getRangeRequestCount() == 1);
+        CHECK(responses[0].error == 0 && responses[0].httpCode == expectedCode);
+        CHECK(responses[1].error == 0 && responses[1].httpCode == expectedCode);
+        CHECK(readFile(leaderPath) == body);
+        CHECK(readFile(followerPath) == body);
+    }
+
+    remove(leaderPath.c_str());
+    remove(followerPath.c_str());
+}
+
+static void testCache(HTTPRequestService * service, LoopbackHTTPServer * server)
+{
+    std::string directory = fmt::format("/tmp/dfg_http_request_test_cache_{}", getpid());
+    service->setCacheDirectory(directory.c_str());
+    service->clearCache();
+
+    // second request is served from memory, the third one from disk
+    std::vector<Response> responses(3);
+    for (size_t i = 0; i < responses.size(); i++)
+    {
+        if (i == 2)
+            service->setCacheSize(0, 1024 * 1024);
+
+        std::vector<Response> response(1);
+        sendRequest(service, server->getURL("/cache/5000"), &response[0]);
+        CHECK(waitFor(response));
+        responses[i] = response[0];
+        if (i == 0)
+            server->resetCounters();
+    }
+
+    for (const Response& response : responses)
+        CHECK(response.error == 0 && response.httpCode == 200 && response.body == LoopbackHTTPServer::makeBody(5000));
+    CHECK(server->getRequestCount() == 0);
+    CHECK(service->getStatistics().cachedResponses >= 2);
+
+    service->clearCache();
+    service->setCacheDirectory("");
+    rmdir(directory.c_str());
+}
+
+static void testRevalidation(HTTPRequestService * service, LoopbackHTTPServer * server)
+{
+    std::string directory = fmt::format("/tmp/dfg_http_request_test_cache_{}", getpid());
+    service->setCacheDirectory(directory.c_str());
+    service->clearCache();
+
+    // stale responses are revalidated with ETag and Last-Modified, 304 is returned to the caller as cached 200
+    for (const char * path : { "/etag/3000", "/modified/3000" })
+    {
+        server->resetCounters();
+        for (int i = 0; i < 2; i++)
+        {
+            std::vector<Response> responses(1);
+            sendRequest(service, server->getURL(path), &responses[0]);
+            CHECK(waitFor(responses));
+            CHECK(responses[0].error == 0 && responses[0].httpCode == 200 && responses[0].body == LoopbackHTTPServer::makeBody(3000));
+        }
+
+        CHECK(server->getRequestCount() == 2 && server->getNotModifiedCount() == 1);
+    }
+
+    service->clearCache();
+    service->setCacheDirectory("");
+    rmdir(directory.c_str());
+}
+
+static void testCacheControl(HTTPRequestService * service, LoopbackHTTPServer * server)
+{
+    std::string directory = fmt::format("/tmp/dfg_http_request_test_cache_{}", getpid());
+    service->setCacheDirectory(directory.c_str());
+    service->clearCache();
+
+    // no-store responses are never cached, max-age ones are served from cache until they expire
+    struct
+    {
+        const char * path;
+        int delayMs;
+        int serverRequests;
+    } cases[] = {
+        { "/nostore/2000", 0, 2 },
+        { "/maxage/60/2000", 0, 1 },
+        { "/maxage/1/2000", 2100, 2 },
+    };
+
+    for (const auto& c : cases)
+    {
+        server->resetCounters();
+        for (int i = 0; i < 2; i++)
+        {
+            if (i > 0)
+                std::this_thread::sleep_for(std::chrono::milliseconds(c.delayMs));
+
+            std::vector<Response> responses(1);
+            sendRequest(service, server->getURL(c.path), &responses[0]);
+            CHECK(waitFor(responses));
+            CHECK(responses[0].error == 0 && responses[0].httpCode == 200 && responses[0].body == LoopbackHTTPServer::makeBody(2000));
+        }
+
+        CHECK(server->getRequestCount() == c.serverRequests && server->getNotModifiedCount() == 0);
+    }
+
+    service->clearCache();
+    service->setCacheDirectory("");
+    rmdir(directory.c_str());
+}
+
+int main(int argc, char ** argv)
+{
+    curl_global_init(CURL_GLOBAL_ALL);
+
+    LoopbackHTTPServer server;
+    if (!server.start())
+    {
+        printf("Can't start HTTP server\n");
+        return 1;
+    }
+
+    ServiceManager * manager = ServiceManager::getInstance();
+    Service * dependencies[] = { manager->registerService<TaskQueueService>(NULL), NULL };
+    HTTPRequestService * service = manager->registerService<HTTPRequestService>(dependencies);
+    while (service->getState() != Service::RUNNING)
+        manager->update(0.0f);
+    service->setCacheDirectory("");
+
+    testRequests(service, &server);
+    testPost(service, &server);
+    testErrorResponse(service, &server);
+    testRedirect(service, &server);
+    testResume(service, &server);
+    testProgress(service, &server);
+    testSlowRequest(service, &server);
+    testHostLimit(service, &server);
+    testPriority(service, &server);
+    testCancel(service, &server);
+    testCancelDownload(service, &server);
+    testCoalescedResume(service, &server);
+    testCache(service, &server);
+    testRevalidation(service, &server);
+    testCacheControl(service, &server);
+
+    manager->shutdown();
+    server.stop();
+    curl_global_cleanup();
+
+    printf("%s\n", failures == 0 ? "All tests passed" : "Some tests failed");
+    return failures == 0 ? 0 : 1;
+}
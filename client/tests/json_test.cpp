@@ -0,0 +1,234 @@
+#include "pch.h"
+#include "main/json.h"
+#include "main/archive.h"
+
+
+
+
+/**
+ * Tests JSONWriter and JSONReader: round trips, escapes, numbers and malformed input.
+ */
+
+static int failures = 0;
+
+#define CHECK(condition) \
+    do { if (!(condition)) { printf("%s:%d: check failed: %s\n", __FILE__, __LINE__, #condition); failures++; } } while (0)
+
+static bool parseJSON(const std::string& json, VariantType * out)
+{
+    return JSONReader::parse(json.data(), json.size(), out);
+}
+
+static std::string writeJSON(const VariantType& value)
+{
+    std::string res;
+    JSONWriter writer(&res);
+    writer.writeVariant(value);
+    return res;
+}
+
+static void testRoundTrip()
+{
+    // every character that has to be escaped, including control characters and DEL
+    std::string special = "quote \" backslash \\ slash / \b\f\n\r\t \x01\x1f\x7f";
+    std::string unicode = "\xd0\xbf\xd1\x80\xd0\xb8\xd0\xb2\xd0\xb5\xd1\x82 \xf0\x9f\x98\x80";
+
+    std::unique_ptr<Archive> archive(Archive::create());
+    archive->set("special", special);
+    archive->set("unicode", unicode);
+    archive->set("empty", std::string());
+    archive->set("int", -12345);
+    archive->set("int64", static_cast<int64_t>(INT64_MIN));
+    archive->set("uint64", static_cast<uint64_t>(UINT64_MAX));
+    archive->set("double", 0.1);
+    archive->set("true", true);
+    archive->set("false", false);
+    archive->set("null", VariantType());
+    archive->set("list", VariantType({ 1, 2, 3 }));
+    std::vector<VariantType> emptyList;
+    archive->set("emptyList", VariantType(emptyList.begin(), emptyList.end()));
+
+    std::unique_ptr<Archive> nested(Archive::create());
+    nested->set("key with \"quotes\"", 1);
+    archive->set("nested", VariantType()).setArchive(nested.get());
+
+    std::string json;
+    CHECK(archive->serializeToJSON(&json));
+
+    std::unique_ptr<Archive> parsed(Archive::create());
+    CHECK(parsed->deserializeFromJSON(json.data(), json.size()));
+    CHECK(parsed->get<std::string>("special") == special);
+    CHECK(parsed->get<std::string>("unicode") == unicode);
+    CHECK(parsed->get<std::string>("empty").empty());
+    CHECK(parsed->get<int32_t>("int") == -12345);
+    CHECK(parsed->get("int64")->getType() == VariantType::TYPE_INT64 && parsed->get<int64_t>("int64") == INT64_MIN);
+    CHECK(parsed->get("uint64")->getType() == VariantType::TYPE_UINT64 && parsed->get<uint64_t>("uint64") == UINT64_MAX);
+    CHECK(parsed->get<double>("double") == 0.1);
+    CHECK(parsed->get<bool>("true") && !parsed->get<bool>("false"));
+    CHECK(parsed->hasKey("null") && parsed->get("null")->isEmpty());
+    CHECK(parsed->get("list")->getList()->size() == 3 && (*parsed->get("list"))[2].get<int32_t>() == 3);
+    CHECK(parsed->get("emptyList")->getType() == VariantType::TYPE_LIST && parsed->get("emptyList")->getList()->empty());
+    CHECK(parsed->get("nested")->getArchive()->get<int32_t>("key with \"quotes\"") == 1);
+
+    // every value is read back with its original type, archives have no ordering
+    std::vector<std::string> keys, parsedKeys;
+    archive->getKeyList(&keys);
+    parsed->getKeyList(&parsedKeys);
+    CHECK(keys.size() == parsedKeys.size());
+    for (const std::string& key : keys)
+    {
+        const VariantType * value = archive->get(key.c_str());
+        const VariantType * parsedValue = parsed->get(key.c_str());
+        CHECK(parsedValue && parsedValue->getType() == value->getType());
+        if (parsedValue && value->getType() != VariantType::TYPE_NONE && value->getType() != VariantType::TYPE_LIST && value->getType() != VariantType::TYPE_KEYED_ARCHIVE)
+            CHECK(*parsedValue == *value);
+    }
+}
+
+static void testEscapes()
+{
+    VariantType v;
+    CHECK(parseJSON("\"a\\\"\\\\\\/\\b\\f\\n\\r\\t\\u0041\\u00e9\\u20ac\"", &v));
+    CHECK(v.get<std::string>() == "a\"\\/\b\f\n\r\t" "A" "\xc3\xa9" "\xe2\x82\xac");
+
+    // escaped control characters are written with \u
+    CHECK(writeJSON(VariantType(std::string("\x01\x1f"))) == "\"\\u0001\\u001f\"");
+
+    CHECK(!parseJSON("\"\\x\"", &v));
+    CHECK(!parseJSON("\"\\u00g0\"", &v));
+    CHECK(!parseJSON("\"\\u00\"", &v));
+    CHECK(!parseJSON(std::string("\"a\nb\""), &v));
+    CHECK(!parseJSON(std::string("\"a\0b\"", 5), &v));
+}
+
+static void testSurrogatePairs()
+{
+    VariantType v;
+    CHECK(parseJSON("\"\\ud83d\\ude00\"", &v));
+    CHECK(v.get<std::string>() == "\xf0\x9f\x98\x80");
+    CHECK(parseJSON("\"\\uD834\\uDD1E!\"", &v));
+    CHECK(v.get<std::string>() == "\xf0\x9d\x84\x9e!");
+
+    // lone or reversed surrogates
+    CHECK(!parseJSON("\"\\ud83d\"", &v));
+    CHECK(!parseJSON("\"\\ud83dx\"", &v));
+    CHECK(!parseJSON("\"\\ud83d\\u0041\"", &v));
+    CHECK(!parseJSON("\"\\ude00\"", &v));
+    CHECK(!parseJSON("\"\\ude00\\ud83d\"", &v));
+    CHECK(!parseJSON("\"\\ud83d\\ud83d\"", &v));
+}
+
+static void testNumbers()
+{
+    VariantType v;
+    CHECK(parseJSON("0", &v) && v.getType() == VariantType::TYPE_INT32 && v.get<int32_t>() == 0);
+    CHECK(parseJSON("-0", &v) && v.getType() == VariantType::TYPE_INT32 && v.get<int32_t>() == 0);
+    CHECK(parseJSON("2147483647", &v) && v.getType() == VariantType::TYPE_INT32 && v.get<int32_t>() == INT32_MAX);
+    CHECK(parseJSON("-2147483648", &v) && v.getType() == VariantType::TYPE_INT32 && v.get<int32_t>() == INT32_MIN);
+    CHECK(parseJSON("2147483648", &v) && v.getType() == VariantType::TYPE_INT64 && v.get<int64_t>() == 2147483648LL);
+    CHECK(parseJSON("-9223372036854775808", &v) && v.getType() == VariantType::TYPE_INT64 && v.get<int64_t>() == INT64_MIN);
+    CHECK(parseJSON("9223372036854775808", &v) && v.getType() == VariantType::TYPE_UINT64 && v.get<uint64_t>() == 9223372036854775808ULL);
+    CHECK(parseJSON("18446744073709551615", &v) && v.getType() == VariantType::TYPE_UINT64 && v.get<uint64_t>() == UINT64_MAX);
+
+    // integers that don't fit into 64 bits and fractional numbers are doubles
+    CHECK(parseJSON("18446744073709551616", &v) && v.getType() == VariantType::TYPE_FLOAT64 && v.get<double>() == 18446744073709551616.0);
+    CHECK(parseJSON("-9223372036854775809", &v) && v.getType() == VariantType::TYPE_FLOAT64);
+    CHECK(parseJSON("1.5", &v) && v.getType() == VariantType::TYPE_FLOAT64 && v.get<double>() == 1.5);
+    CHECK(parseJSON("-2.5e-3", &v) && v.get<double>() == -2.5e-3);
+    CHECK(parseJSON("1E+2", &v) && v.getType() == VariantType::TYPE_FLOAT64 && v.get<double>() == 100.0);
+    CHECK(parseJSON(" 1e308 ", &v) && v.get<double>() == 1e308);
+
+    // doubles are written with enough digits to be read back exactly
+    const double values[] = { 0.1, 1.0 / 3.0, -1e-300, 123456789.125, 5e-324 };
+    for (double value : values)
+        CHECK(parseJSON(writeJSON(VariantType(value)), &v) && v.get<double>() == value);
+
+    const char * malformed[] = { "-", "+1", "01", "-01", ".5", "1.", "1.e5", "1e", "1e+", "0x10", "1 2", "--1", "Infinity", "NaN" };
+    for (const char * json : malformed)
+    {
+        bool parsed = parseJSON(json, &v);
+        CHECK(!parsed);
+        if (parsed)
+            printf("  accepted \"%s\"\n", json);
+    }
+}
+
+static void testNesting()
+{
+    VariantType v;
+
+    // nesting up to the limit is accepted
+    std::string json = std::string(512, '[') + std::string(512, ']');
+    CHECK(parseJSON(json, &v));
+    const VariantType * inner = &v;
+    int depth = 1;
+    while (inner->getType() == VariantType::TYPE_LIST && !inner->getList()->empty())
+    {
+        inner = &(*inner)[0];
+        depth++;
+    }
+    CHECK(depth == 512);
+
+    json.clear();
+    for (int i = 0; i < 255; i++)
+        json += "{\"a\":";
+    json += "{}";
+    json += std::string(255, '}');
+    CHECK(parseJSON(json, &v));
+
+    // deeper data is rejected without exhausting the stack
+    CHECK(!parseJSON(std::string(513, '[') + std::string(513, ']'), &v));
+    CHECK(!parseJSON(std::string(100000, '['), &v));
+
+    std::string deepObject;
+    for (int i = 0; i < 100000; i++)
+        deepObject += "{\"a\":";
+    CHECK(!parseJSON(deepObject, &v));
+}
+
+static void testMalformed()
+{
+    // every proper prefix of a valid document is rejected
+    std::string json = "{\"a\":[1,-2.5e3,true,false,null,\"s\\u0041\\n\",{\"b\":{}},[]],\"c\":\"\\ud83d\\ude00\"}";
+    VariantType v;
+    CHECK(parseJSON(json, &v));
+    for (size_t i = 0; i < json.size(); i++)
+    {
+        bool parsed = parseJSON(json.substr(0, i), &v);
+        CHECK(!parsed);
+        if (parsed)
+            printf("  accepted prefix of %u bytes\n", static_cast<unsigned>(i));
+    }
+
+    const char * malformed[] = {
+        "", " ", "{", "}", "[", "]", "{\"a\"}", "{\"a\":}", "{\"a\" 1}", "{a:1}", "{'a':1}",
+        "{\"a\":1,}", "[1,]", "[,1]", "[1 2]", "{\"a\":1 \"b\":2}", "[1]]", "{} {}", "tru", "truex",
+        "nul", "[True]", "\"abc", "\"abc\\", "[\"a\",", "/* */ 1",
+    };
+    for (const char * text : malformed)
+    {
+        bool parsed = parseJSON(text, &v);
+        CHECK(!parsed);
+        if (parsed)
+            printf("  accepted \"%s\"\n", text);
+    }
+
+    // archive root must be an object
+    std::unique_ptr<Archive> archive(Archive::create());
+    CHECK(!archive->deserializeFromJSON("[1]", 3));
+    CHECK(!archive->deserializeFromJSON("1", 1));
+    CHECK(archive->deserializeFromJSON(" {} ", 4));
+}
+
+int main(int argc, char ** argv)
+{
+    testRoundTrip();
+    testEscapes();
+    testSurrogatePairs();
+    testNumbers();
+    testNesting();
+    testMalformed();
+
+    printf("%s\n", failures == 0 ? "All tests passed" : "Some tests failed");
+    return failures == 0 ? 0 : 1;
+}
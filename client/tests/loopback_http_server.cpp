@@ -0,0 +1,314 @@
+#include "pch.h"
+#include "loopback_http_server.h"
+
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <unistd.h>
+#include <curl/curl.h>
+
+
+
+
+static bool sendAll(int socket, const char * data, size_t size)
+{
+    while (size > 0)
+    {
+        ssize_t sent = ::send(socket, data, size, MSG_NOSIGNAL);
+        if (sent <= 0)
+            return false;
+
+        data += sent;
+        size -= sent;
+    }
+
+    return true;
+}
+
+static bool sendResponse(int socket, int code, const char * reason, const std::string& headers, const std::string& body)
+{
+    std::string response = fmt::format("HTTP/1.1 {} {}\r\nContent-Length: {}\r\nContent-Type: application/octet-stream\r\n{}\r\n",
+        code, reason, body.size(), headers);
+    response += body;
+
+    return sendAll(socket, response.data(), response.size());
+}
+
+
+
+
+LoopbackHTTPServer::LoopbackHTTPServer()
+    : _listenSocket(-1)
+    , _port(0)
+    , _stopped(false)
+    , _connectionCount(0)
+    , _requestCount(0)
+    , _activeRequests(0)
+    , _maxActiveRequests(0)
+    , _rangeRequestCount(0)
+    , _notModifiedCount(0)
+{
+}
+
+LoopbackHTTPServer::~LoopbackHTTPServer()
+{
+    stop();
+}
+
+bool LoopbackHTTPServer::start()
+{
+    GP_ASSERT(_listenSocket < 0);
+
+    _listenSocket = ::socket(AF_INET, SOCK_STREAM, 0);
+    if (_listenSocket < 0)
+        return false;
+
+    sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    addr.sin_port = 0;
+
+    socklen_t addrLength = sizeof(addr);
+    if (::bind(_listenSocket, reinterpret_cast<sockaddr *>(&addr), sizeof(addr)) != 0 ||
+        ::listen(_listenSocket, 128) != 0 ||
+        ::getsockname(_listenSocket, reinterpret_cast<sockaddr *>(&addr), &addrLength) != 0)
+    {
+        ::close(_listenSocket);
+        _listenSocket = -1;
+        return false;
+    }
+
+    _port = ntohs(addr.sin_port);
+    _stopped = false;
+    _acceptThread = std::thread(&LoopbackHTTPServer::acceptConnections, this);
+    return true;
+}
+
+void LoopbackHTTPServer::stop()
+{
+    if (_listenSocket < 0)
+        return;
+
+    _stopped = true;
+
+    // wake up threads blocked in accept and recv
+    ::shutdown(_listenSocket, SHUT_RDWR);
+    _acceptThread.join();
+    ::close(_listenSocket);
+    _listenSocket = -1;
+
+    std::vector<std::thread> threads;
+    {
+        std::unique_lock<std::mutex> lock(_connectionsMutex);
+        for (int socket : _connections)
+            ::shutdown(socket, SHUT_RDWR);
+        threads.swap(_connectionThreads);
+    }
+
+    for (std::thread& thread : threads)
+        thread.join();
+}
+
+std::string LoopbackHTTPServer::getURL(const char * path) const
+{
+    return fmt::format("http://127.0.0.1:{}{}", _port, path);
+}
+
+void LoopbackHTTPServer::resetCounters()
+{
+    _connectionCount = 0;
+    _requestCount = 0;
+    _maxActiveRequests = 0;
+    _rangeRequestCount = 0;
+    _notModifiedCount = 0;
+}
+
+std::string LoopbackHTTPServer::makeBody(size_t size)
+{
+    std::string res(size, '\0');
+    for (size_t i = 0; i < size; i++)
+        res[i] = static_cast<char>('a' + i % 26);
+    return res;
+}
+
+void LoopbackHTTPServer::acceptConnections()
+{
+    while (!_stopped)
+    {
+        int socket = ::accept(_listenSocket, NULL, NULL);
+        if (socket < 0)
+            break;
+
+        int noDelay = 1;
+        ::setsockopt(socket, IPPROTO_TCP, TCP_NODELAY, &noDelay, sizeof(noDelay));
+
+        _connectionCount++;
+
+        std::unique_lock<std::mutex> lock(_connectionsMutex);
+        if (_stopped)
+        {
+            ::close(socket);
+            break;
+        }
+        _connections.push_back(socket);
+        _connectionThreads.emplace_back(&LoopbackHTTPServer::serveConnection, this, socket);
+    }
+}
+
+void LoopbackHTTPServer::serveConnection(int socket)
+{
+    std::string input;
+    char buffer[16 * 1024];
+
+    for (;;)
+    {
+        size_t headerEnd = input.find("\r\n\r\n");
+        if (headerEnd == std::string::npos)
+        {
+            ssize_t received = ::recv(socket, buffer, sizeof(buffer), 0);
+            if (received <= 0)
+                break;
+            input.append(buffer, received);
+            continue;
+        }
+
+        std::string header = input.substr(0, headerEnd);
+        size_t methodEnd = header.find(' ');
+        size_t pathEnd = header.find(' ', methodEnd + 1);
+        if (methodEnd == std::string::npos || pathEnd == std::string::npos)
+            break;
+
+        std::string method = header.substr(0, methodEnd);
+        std::string path = header.substr(methodEnd + 1, pathEnd - methodEnd - 1);
+
+        size_t contentLength = 0;
+        std::string lowerHeader(header);
+        std::for_each(lowerHeader.begin(), lowerHeader.end(), [](char& c) { c = static_cast<char>(tolower(c)); });
+        size_t contentLengthPos = lowerHeader.find("\r\ncontent-length:");
+        if (contentLengthPos != std::string::npos)
+            contentLength = static_cast<size_t>(atoll(header.c_str() + contentLengthPos + 17));
+        bool closeConnection = lowerHeader.find("\r\nconnection: close") != std::string::npos;
+
+        size_t requestSize = headerEnd + 4 + contentLength;
+        while (input.size() < requestSize)
+        {
+            ssize_t received = ::recv(socket, buffer, sizeof(buffer), 0);
+            if (received <= 0)
+                break;
+            input.append(buffer, received);
+        }
+        if (input.size() < requestSize)
+            break;
+
+        std::string body = input.substr(headerEnd + 4, contentLength);
+        input.erase(0, requestSize);
+
+        int active = ++_activeRequests;
+        int maxActive = _maxActiveRequests;
+        while (active > maxActive && !_maxActiveRequests.compare_exchange_weak(maxActive, active))
+            ;
+
+        _requestCount++;
+        bool res = handleRequest(socket, method, path, lowerHeader, body);
+        _activeRequests--;
+
+        if (!res || closeConnection)
+            break;
+    }
+
+    std::unique_lock<std::mutex> lock(_connectionsMutex);
+    _connections.erase(std::find(_connections.begin(), _connections.end(), socket));
+    ::close(socket);
+}
+
+// get value of the header, names in lowerHeader are lowercase
+static bool getHeader(const std::string& lowerHeader, const char * name, std::string * out)
+{
+    size_t pos = lowerHeader.find(fmt::format("\r\n{}:", name));
+    if (pos == std::string::npos)
+        return false;
+
+    size_t start = lowerHeader.find_first_not_of(' ', pos + strlen(name) + 3);
+    size_t end = lowerHeader.find("\r\n", pos + 2);
+    *out = start < end ? lowerHeader.substr(start, end - start) : std::string();
+    return true;
+}
+
+bool LoopbackHTTPServer::handleRequest(int socket, const std::string& method, const std::string& path, const std::string& lowerHeader, const std::string& body)
+{
+    int size = 0, delay = 0, code = 0;
+    std::string value;
+
+    if (method == "POST" && path == "/echo")
+        return sendResponse(socket, 200, "OK", "", body);
+
+    if (sscanf(path.c_str(), "/bytes/%d", &size) == 1 && size >= 0)
+        return sendResponse(socket, 200, "OK", "", makeBody(size));
+
+    if (sscanf(path.c_str(), "/delay/%d/%d", &delay, &size) == 2 && size >= 0)
+    {
+        auto end = std::chrono::steady_clock::now() + std::chrono::milliseconds(delay);
+        while (!_stopped && std::chrono::steady_clock::now() < end)
+            std::this_thread::sleep_for(std::chrono::milliseconds(5));
+        return sendResponse(socket, 200, "OK", "", makeBody(size));
+    }
+
+    if (sscanf(path.c_str(), "/cache/%d", &size) == 1 && size >= 0)
+        return sendResponse(socket, 200, "OK", fmt::format("Cache-Control: max-age=60\r\nETag: \"{}\"\r\n", size), makeBody(size));
+
+    if (sscanf(path.c_str(), "/range/%d/%d", &delay, &size) == 2 && size >= 0)
+    {
+        auto end = std::chrono::steady_clock::now() + std::chrono::milliseconds(delay);
+        while (!_stopped && std::chrono::steady_clock::now() < end)
+            std::this_thread::sleep_for(std::chrono::milliseconds(5));
+
+        long long from = 0;
+        if (!getHeader(lowerHeader, "range", &value) || sscanf(value.c_str(), "bytes=%lld-", &from) != 1)
+            return sendResponse(socket, 200, "OK", "", makeBody(size));
+
+        _rangeRequestCount++;
+        if (from >= size)
+            return sendResponse(socket, 416, "Range Not Satisfiable", fmt::format("Content-Range: bytes */{}\r\n", size), "");
+
+        return sendResponse(socket, 206, "Partial Content", fmt::format("Content-Range: bytes {}-{}/{}\r\n", from, size - 1, size),
+            makeBody(size).substr(static_cast<size_t>(from)));
+    }
+
+    if (sscanf(path.c_str(), "/etag/%d", &size) == 1 && size >= 0)
+    {
+        std::string etag = fmt::format("\"e{}\"", size);
+        if (getHeader(lowerHeader, "if-none-match", &value) && value == etag)
+        {
+            _notModifiedCount++;
+            return sendResponse(socket, 304, "Not Modified", fmt::format("ETag: {}\r\n", etag), "");
+        }
+        return sendResponse(socket, 200, "OK", fmt::format("Cache-Control: no-cache\r\nETag: {}\r\n", etag), makeBody(size));
+    }
+
+    if (sscanf(path.c_str(), "/modified/%d", &size) == 1 && size >= 0)
+    {
+        const char * lastModified = "Wed, 21 Oct 2015 07:28:00 GMT";
+        if (getHeader(lowerHeader, "if-modified-since", &value) && curl_strequal(value.c_str(), lastModified))
+        {
+            _notModifiedCount++;
+            return sendResponse(socket, 304, "Not Modified", "", "");
+        }
+        return sendResponse(socket, 200, "OK", fmt::format("Cache-Control: max-age=0\r\nLast-Modified: {}\r\n", lastModified), makeBody(size));
+    }
+
+    if (sscanf(path.c_str(), "/nostore/%d", &size) == 1 && size >= 0)
+        return sendResponse(socket, 200, "OK", "Cache-Control: no-store, max-age=60\r\nETag: \"n\"\r\n", makeBody(size));
+
+    if (sscanf(path.c_str(), "/maxage/%d/%d", &delay, &size) == 2 && size >= 0)
+        return sendResponse(socket, 200, "OK", fmt::format("Cache-Control: max-age={}\r\n", delay), makeBody(size));
+
+    if (sscanf(path.c_str(), "/redirect/%d", &size) == 1 && size >= 0)
+        return sendResponse(socket, 302, "Found", fmt::format("Location: /bytes/{}\r\n", size), "<html>Moved</html>");
+
+    if (sscanf(path.c_str(), "/status/%d", &code) == 1 && code >= 200)
+        return sendResponse(socket, code, "Status", "", fmt::format("status {}", code));
+
+    return sendResponse(socket, 404, "Not Found", "", "not found");
+}
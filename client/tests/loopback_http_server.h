@@ -0,0 +1,118 @@
+#pragma once
+
+#ifndef __DFG_LOOPBACK_HTTP_SERVER_H__
+#define __DFG_LOOPBACK_HTTP_SERVER_H__
+
+#include <thread>
+#include <atomic>
+
+
+
+
+/**
+ * Minimal HTTP/1.1 server listening on 127.0.0.1, used by tests and benchmarks
+ * to exercise HTTPRequestService without network access.
+ *
+ * Each connection is served by its own thread and kept alive until the client
+ * closes it. Supported requests:
+ *
+ *  GET /bytes/<size>               - responds with <size> bytes of data
+ *  GET /delay/<ms>/<size>          - same, but waits <ms> milliseconds before responding
+ *  GET /cache/<size>               - same as /bytes/<size>, cacheable for 60 seconds
+ *  GET /range/<ms>/<size>          - same as /delay/<ms>/<size>, Range header "bytes=<from>-" is served
+ *                                    with 206 and the rest of the body or 416 if <from> is past the end
+ *  GET /etag/<size>                - same as /bytes/<size> with ETag and "Cache-Control: no-cache",
+ *                                    304 if If-None-Match matches the ETag
+ *  GET /modified/<size>            - same as /bytes/<size> with Last-Modified and "Cache-Control: max-age=0",
+ *                                    304 if If-Modified-Since matches Last-Modified
+ *  GET /nostore/<size>             - same as /bytes/<size> with ETag and "Cache-Control: no-store, max-age=60"
+ *  GET /maxage/<seconds>/<size>    - same as /bytes/<size>, cacheable for <seconds> without validators
+ *  GET /redirect/<size>            - 302 with a body, redirecting to /bytes/<size>
+ *  GET /status/<code>              - responds with given status code and a short body
+ *  POST /echo                      - responds with the request body
+ *
+ * Body of 200 responses to requests with <size> is makeBody(size).
+ */
+class LoopbackHTTPServer : Noncopyable
+{
+public:
+    LoopbackHTTPServer();
+    ~LoopbackHTTPServer();
+
+    /**
+     * Start listening on a free port.
+     *
+     * @return False if the server can't be started.
+     */
+    bool start();
+
+    /**
+     * Stop the server and close all connections.
+     */
+    void stop();
+
+    /**
+     * Get URL of the given path on this server.
+     */
+    std::string getURL(const char * path) const;
+
+    /**
+     * Get number of accepted connections.
+     */
+    int getConnectionCount() const { return _connectionCount; };
+
+    /**
+     * Get number of handled requests.
+     */
+    int getRequestCount() const { return _requestCount; };
+
+    /**
+     * Get maximum number of requests handled simultaneously.
+     */
+    int getMaxActiveRequests() const { return _maxActiveRequests; };
+
+    /**
+     * Get number of requests to /range/ with Range header.
+     */
+    int getRangeRequestCount() const { return _rangeRequestCount; };
+
+    /**
+     * Get number of 304 responses.
+     */
+    int getNotModifiedCount() const { return _notModifiedCount; };
+
+    /**
+     * Reset counters.
+     */
+    void resetCounters();
+
+    /**
+     * Make response body of the given size.
+     */
+    static std::string makeBody(size_t size);
+
+private:
+    void acceptConnections();
+    void serveConnection(int socket);
+    bool handleRequest(int socket, const std::string& method, const std::string& path, const std::string& lowerHeader, const std::string& body);
+
+    int _listenSocket;
+    int _port;
+    std::thread _acceptThread;
+    std::mutex _connectionsMutex;
+    std::vector<int> _connections;
+    std::vector<std::thread> _connectionThreads;
+
+    std::atomic<bool> _stopped;
+    std::atomic<int> _connectionCount;
+    std::atomic<int> _requestCount;
+    std::atomic<int> _activeRequests;
+    std::atomic<int> _maxActiveRequests;
+    std::atomic<int> _rangeRequestCount;
+    std::atomic<int> _notModifiedCount;
+};
+
+
+
+
+#endif // __DFG_LOOPBACK_HTTP_SERVER_H__
@@ -0,0 +1,271 @@
+#include "pch.h"
+#include "services/service_manager.h"
+#include "services/taskqueue_service.h"
+#include "services/socket_reactor_service.h"
+#include "main/message_channel.h"
+
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <unistd.h>
+
+
+
+
+/**
+ * Tests MessageChannel over non-blocking SocketStream against a server on 127.0.0.1.
+ */
+
+static int failures = 0;
+
+#define CHECK(condition) \
+    do { if (!(condition)) { printf("%s:%d: check failed: %s\n", __FILE__, __LINE__, #condition); failures++; } } while (0)
+
+/**
+ * Server sends each frame back only after the whole frame is received, so the
+ * client's output is never flushed by incoming data.
+ */
+class FrameEchoServer : Noncopyable
+{
+public:
+    FrameEchoServer() : _listenSocket(-1), _port(0) {};
+    ~FrameEchoServer() { stop(); };
+
+    bool start()
+    {
+        _listenSocket = ::socket(AF_INET, SOCK_STREAM, 0);
+        if (_listenSocket < 0)
+            return false;
+
+        sockaddr_in addr;
+        memset(&addr, 0, sizeof(addr));
+        addr.sin_family = AF_INET;
+        addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+        socklen_t addrLength = sizeof(addr);
+        if (::bind(_listenSocket, reinterpret_cast<sockaddr *>(&addr), sizeof(addr)) != 0 ||
+            ::listen(_listenSocket, 4) != 0 ||
+            ::getsockname(_listenSocket, reinterpret_cast<sockaddr *>(&addr), &addrLength) != 0)
+            return false;
+
+        _port = ntohs(addr.sin_port);
+        _thread = std::thread(&FrameEchoServer::serve, this);
+        return true;
+    }
+
+    void stop()
+    {
+        if (_listenSocket < 0)
+            return;
+
+        ::shutdown(_listenSocket, SHUT_RDWR);
+        _thread.join();
+        ::close(_listenSocket);
+        _listenSocket = -1;
+    }
+
+    uint16_t getPort() const { return _port; };
+
+private:
+    static bool receive(int socket, void * data, size_t size)
+    {
+        uint8_t * ptr = reinterpret_cast<uint8_t *>(data);
+        while (size > 0)
+        {
+            ssize_t received = ::recv(socket, ptr, size, 0);
+            if (received <= 0)
+                return false;
+            ptr += received;
+            size -= received;
+        }
+        return true;
+    }
+
+    void serve()
+    {
+        int socket = ::accept(_listenSocket, NULL, NULL);
+        if (socket < 0)
+            return;
+
+        // frame header: payload size (uint32), request id (uint32), flags (uint8)
+        std::vector<uint8_t> frame;
+        for (;;)
+        {
+            frame.resize(9);
+            if (!receive(socket, frame.data(), frame.size()))
+                break;
+
+            uint32_t size;
+            memcpy(&size, frame.data(), sizeof(size));
+            frame.resize(9 + size);
+            if (!receive(socket, frame.data() + 9, size))
+                break;
+
+            const uint8_t * data = frame.data();
+            size_t remaining = frame.size();
+            while (remaining > 0)
+            {
+                ssize_t sent = ::send(socket, data, remaining, MSG_NOSIGNAL);
+                if (sent <= 0)
+                    break;
+                data += sent;
+                remaining -= sent;
+            }
+        }
+
+        ::close(socket);
+    }
+
+    int _listenSocket;
+    uint16_t _port;
+    std::thread _thread;
+};
+
+static std::vector<uint8_t> makeMessage(size_t size)
+{
+    std::vector<uint8_t> res(size);
+    for (size_t i = 0; i < size; i++)
+        res[i] = static_cast<uint8_t>(i % 251);
+    return res;
+}
+
+// update services until condition is met or timeout expires
+static bool waitFor(const std::function<bool()>& condition, int timeoutMs = 10000)
+{
+    auto end = std::chrono::steady_clock::now() + std::chrono::milliseconds(timeoutMs);
+    while (std::chrono::steady_clock::now() < end)
+    {
+        ServiceManager::getInstance()->update(0.0f);
+        if (condition())
+            return true;
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+
+    return false;
+}
+
+static void testMessages(MessageChannel * channel)
+{
+    // the large message doesn't fit into the stream's output and is sent once there's room for it,
+    // nothing is received until the whole message is sent
+    std::vector<std::vector<uint8_t>> sent = { makeMessage(10 * 1024 * 1024), makeMessage(100), makeMessage(1000) };
+    std::vector<std::vector<uint8_t>> received;
+    channel->setMessageCallback([&received](MemoryStream * message)
+    {
+        received.emplace_back(message->getBuffer(), message->getBuffer() + message->length());
+    });
+
+    CHECK(channel->send(sent[0].data(), sent[0].size()));
+    CHECK(channel->send(sent[1].data(), sent[1].size()));
+    CHECK(channel->send(sent[2].data(), sent[2].size(), true));
+
+    CHECK(waitFor([&]() { return received.size() == sent.size(); }));
+    CHECK(received == sent);
+
+    channel->setMessageCallback(nullptr);
+}
+
+static void testRequests(MessageChannel * channel)
+{
+    // server echoes the requests back, so the channel answers its own requests
+    channel->setRequestHandler([](const Archive& request, Archive * response)
+    {
+        response->set("answer", request.get<int>("question") * 2);
+    });
+
+    int responses = 0;
+    for (int i = 0; i < 20; i++)
+    {
+        std::unique_ptr<Archive> request(Archive::create());
+        request->set("question", i);
+        request->set("payload", std::string(i * 1000, 'x'));
+        channel->request(*request, [&responses, i](const Archive * response)
+        {
+            if (response && response->get<int>("answer") == i * 2)
+                responses++;
+        }, i % 2 == 0);
+    }
+
+    CHECK(waitFor([&]() { return responses == 20; }));
+}
+
+static void testClose(MessageChannel * channel)
+{
+    // pending requests receive empty response
+    bool failed = false;
+    std::unique_ptr<Archive> request(Archive::create());
+    request->set("question", 1);
+    channel->request(*request, [&failed](const Archive * response) { failed = response == NULL; });
+    channel->close();
+
+    CHECK(failed);
+    CHECK(channel->isClosed());
+    CHECK(!channel->send("x", 1));
+}
+
+static void testLostConnection()
+{
+    // peer drops the connection of the blocking stream right after accepting it
+    int listenSocket = ::socket(AF_INET, SOCK_STREAM, 0);
+    sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+    socklen_t addrLength = sizeof(addr);
+    CHECK(::bind(listenSocket, reinterpret_cast<sockaddr *>(&addr), sizeof(addr)) == 0 && ::listen(listenSocket, 1) == 0 &&
+        ::getsockname(listenSocket, reinterpret_cast<sockaddr *>(&addr), &addrLength) == 0);
+
+    SocketStream * stream = SocketStream::create("127.0.0.1", ntohs(addr.sin_port), true);
+    CHECK(stream != NULL);
+    ::close(::accept(listenSocket, NULL, NULL));
+    ::close(listenSocket);
+    if (!stream)
+        return;
+
+    // writes succeed until the connection is reset, the following frames are never queued
+    std::unique_ptr<MessageChannel> channel(MessageChannel::create(stream));
+    bool sent = true;
+    for (int i = 0; i < 100 && sent; i++)
+    {
+        sent = channel->send("x", 1);
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+
+    CHECK(!sent);
+    CHECK(channel->isClosed());
+}
+
+int main(int argc, char ** argv)
+{
+    FrameEchoServer server;
+    if (!server.start())
+    {
+        printf("Can't start server\n");
+        return 1;
+    }
+
+    ServiceManager * manager = ServiceManager::getInstance();
+    Service * dependencies[] = { manager->registerService<TaskQueueService>(NULL), NULL };
+    SocketReactorService * reactor = manager->registerService<SocketReactorService>(dependencies);
+    while (reactor->getState() != Service::RUNNING)
+        manager->update(0.0f);
+
+    SocketStream * stream = SocketStream::create("127.0.0.1", server.getPort(), false);
+    CHECK(stream != NULL);
+    if (stream)
+    {
+        std::unique_ptr<MessageChannel> channel(MessageChannel::create(stream));
+        testMessages(channel.get());
+        testRequests(channel.get());
+        testClose(channel.get());
+    }
+
+    testLostConnection();
+
+    manager->shutdown();
+    server.stop();
+
+    printf("%s\n", failures == 0 ? "All tests passed" : "Some tests failed");
+    return failures == 0 ? 0 : 1;
+}
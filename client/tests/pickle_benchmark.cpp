@@ -0,0 +1,185 @@
+#include "pch.h"
+
+#include <chrono>
+
+
+
+
+/**
+ * Measures throughput of VariantType::unpickle on a multi-megabyte table of dictionaries,
+ * similar to the data tables produced by the Python pipeline with protocol 4.
+ *
+ * Usage: pickle_benchmark [size in Mb] [iterations]
+ */
+
+class PickleWriter
+{
+public:
+    void op(char opcode) { _data.push_back(opcode); };
+
+    template<typename _Type> void raw(const _Type& value)
+    {
+        const char * bytes = reinterpret_cast<const char *>(&value);
+        _data.insert(_data.end(), bytes, bytes + sizeof(value));
+    }
+
+    void unicode(const std::string& str)
+    {
+        op('\x8c');     // SHORT_BINUNICODE
+        raw(static_cast<uint8_t>(str.size()));
+        _data.insert(_data.end(), str.begin(), str.end());
+    }
+
+    void bytes(const void * data, uint8_t size)
+    {
+        op('C');        // SHORT_BINBYTES
+        raw(size);
+        _data.insert(_data.end(), reinterpret_cast<const char *>(data), reinterpret_cast<const char *>(data) + size);
+    }
+
+    void float64(double value)
+    {
+        // BINFLOAT is big-endian
+        op('G');
+        uint64_t bits;
+        memcpy(&bits, &value, sizeof(bits));
+        for (int i = 7; i >= 0; i--)
+            raw(static_cast<uint8_t>(bits >> (i * 8)));
+    }
+
+    size_t size() const { return _data.size(); };
+    std::vector<char>& data() { return _data; };
+
+private:
+    std::vector<char> _data;
+};
+
+static void writeTable(size_t targetSize, PickleWriter * writer)
+{
+    static const char * keys[] = { "id", "name", "score", "tags", "payload", "enabled" };
+    static const int keysCount = sizeof(keys) / sizeof(keys[0]);
+    static const int batchSize = 1000;
+
+    writer->op('\x80');     // PROTO
+    writer->raw(static_cast<uint8_t>(4));
+
+    // single frame covering the rest of the data, its size is patched at the end
+    writer->op('\x95');     // FRAME
+    size_t frameOffset = writer->size();
+    writer->raw(static_cast<uint64_t>(0));
+
+    writer->op(']');        // EMPTY_LIST
+    writer->op('\x94');     // MEMOIZE
+
+    uint8_t payload[32];
+    for (size_t i = 0; i < sizeof(payload); i++)
+        payload[i] = static_cast<uint8_t>(i * 7);
+
+    // keys are memoized in the first row, the same way pickle does it for repeated strings
+    int row = 0;
+    uint8_t keyMemo[keysCount] = { 0 };
+    while (writer->size() < targetSize)
+    {
+        writer->op('(');    // MARK
+        for (int batch = 0; batch < batchSize; batch++, row++)
+        {
+            writer->op('}');        // EMPTY_DICT
+            writer->op('(');        // MARK
+            for (int k = 0; k < keysCount; k++)
+            {
+                if (row == 0)
+                {
+                    writer->unicode(keys[k]);
+                    writer->op('q');        // BINPUT
+                    keyMemo[k] = static_cast<uint8_t>(1 + k);
+                    writer->raw(keyMemo[k]);
+                }
+                else
+                {
+                    writer->op('h');        // BINGET
+                    writer->raw(keyMemo[k]);
+                }
+
+                switch (k)
+                {
+                case 0:
+                    writer->op('J');        // BININT
+                    writer->raw(static_cast<int32_t>(row));
+                    break;
+                case 1:
+                    writer->unicode(fmt::format("item_{}", row));
+                    break;
+                case 2:
+                    writer->float64(row * 0.25);
+                    break;
+                case 3:
+                    writer->op(']');        // EMPTY_LIST
+                    writer->op('(');        // MARK
+                    for (int t = 0; t < 4; t++)
+                    {
+                        writer->op('K');    // BININT1
+                        writer->raw(static_cast<uint8_t>(row + t));
+                    }
+                    writer->op('e');        // APPENDS
+                    break;
+                case 4:
+                    writer->bytes(payload, sizeof(payload));
+                    break;
+                default:
+                    writer->op(row % 2 ? '\x88' : '\x89');      // NEWTRUE, NEWFALSE
+                    break;
+                }
+            }
+            writer->op('u');        // SETITEMS
+        }
+        writer->op('e');    // APPENDS
+    }
+
+    writer->op('.');        // STOP
+
+    uint64_t frameSize = writer->size() - frameOffset - sizeof(uint64_t);
+    memcpy(writer->data().data() + frameOffset, &frameSize, sizeof(frameSize));
+}
+
+int main(int argc, char ** argv)
+{
+    size_t sizeMb = argc > 1 ? static_cast<size_t>(atoi(argv[1])) : 16;
+    int iterations = argc > 2 ? atoi(argv[2]) : 5;
+    if (sizeMb == 0 || iterations <= 0)
+    {
+        printf("Usage: %s [size in Mb] [iterations]\n", argv[0]);
+        return 1;
+    }
+
+    PickleWriter writer;
+    writeTable(sizeMb * 1024 * 1024, &writer);
+
+    double best = std::numeric_limits<double>::max();
+    double total = 0.0;
+    size_t rows = 0;
+    for (int i = 0; i < iterations; i++)
+    {
+        VariantType value;
+        size_t consumed = 0;
+
+        auto start = std::chrono::steady_clock::now();
+        bool res = value.unpickle(writer.data().data(), writer.size(), &consumed);
+        double elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+        if (!res || consumed != writer.size() || value.getType() != VariantType::TYPE_LIST)
+        {
+            printf("Failed to unpickle the data\n");
+            return 1;
+        }
+
+        rows = value.getList()->size();
+        best = std::min(best, elapsed);
+        total += elapsed;
+    }
+
+    double mb = writer.size() / (1024.0 * 1024.0);
+    printf("unpickle: %.2f Mb, %d rows, best %.2f ms (%.1f Mb/s), average %.2f ms (%.1f Mb/s)\n",
+        mb, static_cast<int>(rows), best * 1000.0, mb / best, total * 1000.0 / iterations, mb * iterations / total);
+
+    return 0;
+}
@@ -0,0 +1,132 @@
+#include "pch.h"
+#include "main/settings.h"
+#include "main/settings_storage.h"
+
+#include <unistd.h>
+
+
+
+
+/**
+ * Tests batched change notifications of Settings and saving them with SettingsStorage.
+ */
+
+static int failures = 0;
+
+#define CHECK(condition) \
+    do { if (!(condition)) { printf("%s:%d: check failed: %s\n", __FILE__, __LINE__, #condition); failures++; } } while (0)
+
+static void testCommittedKeys()
+{
+    Settings * settings = Settings::getInstance();
+    settings->set("withSlot", 0);
+    settings->set("withoutSlot", 0);
+    settings->set("unchanged", 0);
+
+    int notifications = 0;
+    int lastValue = 0;
+    sigc::connection connection = settings->connect<int>("withSlot", [&notifications, &lastValue](int value)
+    {
+        notifications++;
+        lastValue = value;
+    });
+
+    std::vector<std::string> committedKeys;
+    sigc::connection committedConnection = settings->changesCommittedSignal.connect([&committedKeys](const std::vector<std::string>& keys)
+    {
+        committedKeys = keys;
+    });
+
+    // keys are reported whether or not they have slots connected, slots run once with the final value
+    settings->beginChanges();
+    settings->set("withSlot", 1);
+    settings->set("withSlot", 2);
+    settings->set("withoutSlot", 3);
+    CHECK(settings->get("withoutSlot")->isChangePending());
+    CHECK(!settings->get("unchanged")->isChangePending());
+    CHECK(notifications == 0);
+    settings->commitChanges();
+
+    std::sort(committedKeys.begin(), committedKeys.end());
+    CHECK(committedKeys == std::vector<std::string>({ "withSlot", "withoutSlot" }));
+    CHECK(notifications == 1 && lastValue == 2);
+    CHECK(!settings->get("withSlot")->isChangePending());
+    CHECK(!settings->get("withoutSlot")->isChangePending());
+
+    // nested batches are committed by the outermost call
+    committedKeys.clear();
+    settings->beginChanges();
+    settings->beginChanges();
+    settings->set("withoutSlot", 4);
+    settings->commitChanges();
+    CHECK(committedKeys.empty());
+    settings->commitChanges();
+    CHECK(committedKeys == std::vector<std::string>({ "withoutSlot" }));
+
+    // setting the same value is not a change
+    committedKeys.clear();
+    settings->beginChanges();
+    settings->set("withoutSlot", 4);
+    settings->commitChanges();
+    CHECK(committedKeys.empty());
+
+    connection.disconnect();
+    committedConnection.disconnect();
+}
+
+static void testStorage()
+{
+    Settings * settings = Settings::getInstance();
+    settings->clear();
+
+    char path[] = "/tmp/settings_test_XXXXXX";
+    int fd = mkstemp(path);
+    CHECK(fd >= 0);
+    close(fd);
+    std::string journalPath = std::string(path) + ".journal";
+
+    {
+        // without TaskQueueService files are written on the calling thread
+        SettingsStorage storage(path);
+        settings->set("kept", 1);
+        settings->set("removed", 1);
+        settings->set("recreated", 1);
+        CHECK(storage.save());
+
+        // the value is likely to be recreated at the same address
+        settings->removeKey("recreated");
+        settings->set("recreated", 2);
+        settings->removeKey("removed");
+        CHECK(storage.save());
+
+        // changes of the recreated value are still tracked
+        settings->set("recreated", 3);
+        settings->set("kept", 2);
+        CHECK(storage.save());
+
+        // value removed and added back between saves
+        settings->removeKey("kept");
+        settings->set("kept", 4);
+        CHECK(storage.save());
+    }
+
+    std::unique_ptr<Archive> loaded(Archive::create());
+    SettingsStorage storage(path);
+    CHECK(storage.load(loaded.get()));
+    CHECK(loaded->get<int32_t>("kept") == 4);
+    CHECK(loaded->get<int32_t>("recreated") == 3);
+    CHECK(!loaded->hasKey("removed"));
+
+    settings->clear();
+    remove(path);
+    remove(journalPath.c_str());
+}
+
+int main(int argc, char ** argv)
+{
+    testCommittedKeys();
+    testStorage();
+
+    printf("%s\n", failures == 0 ? "All tests passed" : "Some tests failed");
+    return failures == 0 ? 0 : 1;
+}
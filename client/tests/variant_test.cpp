@@ -0,0 +1,202 @@
+#include "pch.h"
+#include "main/archive.h"
+#include "main/memory_stream.h"
+
+
+
+
+/**
+ * Tests sharing of archives and lists between VariantType copies and the values read from
+ * archives, JSON and pickle data.
+ */
+
+static int failures = 0;
+
+#define CHECK(condition) \
+    do { if (!(condition)) { printf("%s:%d: check failed: %s\n", __FILE__, __LINE__, #condition); failures++; } } while (0)
+
+// copies share the data until one of them is modified
+static bool isShared(const VariantType& a, const VariantType& b)
+{
+    if (a.getType() != b.getType())
+        return false;
+    if (a.getType() == VariantType::TYPE_KEYED_ARCHIVE)
+        return a.getArchive() == b.getArchive();
+    if (a.getType() == VariantType::TYPE_LIST)
+        return a.getList() == b.getList();
+    return false;
+}
+
+static Archive * createArchive()
+{
+    Archive * res = Archive::create();
+    res->set("int", 1);
+    res->set("list", VariantType({ 1, 2, 3 }));
+
+    std::unique_ptr<Archive> nested(Archive::create());
+    nested->set("string", std::string("value"));
+    res->set("nested", VariantType()).setArchive(nested.get());
+    return res;
+}
+
+static void testDeserializedArchive()
+{
+    std::unique_ptr<Archive> source(createArchive());
+    std::unique_ptr<MemoryStream> stream(MemoryStream::create());
+    CHECK(source->serialize(stream.get()));
+    stream->rewind();
+
+    VariantType value;
+    value.setArchive(NULL);
+    CHECK(value.getArchive()->deserialize(stream.get()));
+
+    // nested values filled by the reader are shared by copies
+    const Archive * archive = static_cast<const VariantType&>(value).getArchive();
+    VariantType copy(*archive->get("nested"));
+    CHECK(isShared(copy, *archive->get("nested")));
+    VariantType listCopy(*archive->get("list"));
+    CHECK(isShared(listCopy, *archive->get("list")));
+
+    std::unique_ptr<Archive> archiveCopy(Archive::create(*archive));
+    CHECK(isShared(*archiveCopy->get("nested"), *archive->get("nested")));
+
+    // modifying the copy doesn't affect the original
+    archiveCopy->get("nested")->getArchive()->set("string", std::string("changed"));
+    CHECK(!isShared(*archiveCopy->get("nested"), *archive->get("nested")));
+    CHECK(archive->get("nested")->getArchive()->get<std::string>("string") == "value");
+}
+
+static void testJSONArchive()
+{
+    std::unique_ptr<Archive> source(createArchive());
+    std::string json;
+    CHECK(source->serializeToJSON(&json));
+
+    std::unique_ptr<Archive> archive(Archive::create());
+    CHECK(archive->deserializeFromJSON(json.data(), json.size()));
+
+    const Archive * constArchive = archive.get();
+    VariantType copy(*constArchive->get("nested"));
+    CHECK(isShared(copy, *constArchive->get("nested")));
+    VariantType listCopy(*constArchive->get("list"));
+    CHECK(isShared(listCopy, *constArchive->get("list")));
+}
+
+static void testNestedArchives()
+{
+    // archives nested into archives and lists are preceded by their sizes
+    std::unique_ptr<Archive> source;
+    for (int i = 4; i >= 0; i--)
+    {
+        std::unique_ptr<Archive> level(createArchive());
+        std::unique_ptr<Archive> item(createArchive());
+        VariantType list({ VariantType(i), VariantType() });
+        list.getList()->back().setArchive(item.get());
+        level->set("depth", i);
+        level->set("list", list);
+        if (source)
+            level->set("deeper", VariantType()).setArchive(source.get());
+        source = std::move(level);
+    }
+
+    std::unique_ptr<MemoryStream> stream(MemoryStream::create());
+    CHECK(source->serialize(stream.get()));
+    stream->rewind();
+
+    std::unique_ptr<Archive> result(Archive::create());
+    CHECK(result->deserialize(stream.get()));
+    CHECK(stream->eof());
+
+    const Archive * level = result.get();
+    for (int i = 0; i < 5 && level; i++)
+    {
+        const VariantType * list = level->get("list");
+        CHECK(level->get<int>("depth") == i);
+        CHECK(level->get("nested")->getArchive()->get<std::string>("string") == "value");
+        CHECK(list && list->getType() == VariantType::TYPE_LIST && (*list)[0].get<int>() == i);
+        CHECK(list && (*list)[1].getType() == VariantType::TYPE_KEYED_ARCHIVE && (*list)[1].getArchive()->get<int>("int") == 1);
+
+        const VariantType * deeper = level->get("deeper");
+        CHECK((deeper != NULL) == (i < 4));
+        level = deeper ? deeper->getArchive() : NULL;
+    }
+}
+
+static bool unpickle(const char * data, size_t size, VariantType * out)
+{
+    size_t consumed = 0;
+    return out->unpickle(data, size, &consumed) && consumed == size;
+}
+
+static void testPickleMemo()
+{
+    // pickle.dumps([a, a]) where a = [1, 2], protocols 0, 2 and 4
+    static const char sharedList0[] = "(lp0\n(lp1\nI1\naI2\naag1\na.";
+    static const char sharedList2[] = "\x80\x02]q\x00(]q\x01(K\x01K\x02" "eh\x01" "e.";
+    static const char sharedList4[] = "\x80\x04\x95\x0f\x00\x00\x00\x00\x00\x00\x00]\x94(]\x94(K\x01K\x02" "eh\x01" "e.";
+    const std::pair<const char *, size_t> lists[] = {
+        { sharedList0, sizeof(sharedList0) - 1 }, { sharedList2, sizeof(sharedList2) - 1 }, { sharedList4, sizeof(sharedList4) - 1 } };
+
+    for (const auto& data : lists)
+    {
+        VariantType value;
+        CHECK(unpickle(data.first, data.second, &value));
+        CHECK(value.getType() == VariantType::TYPE_LIST && value.getList()->size() == 2);
+        if (value.getType() != VariantType::TYPE_LIST || value.getList()->size() != 2)
+            continue;
+
+        // both items reference the same list
+        const VariantType& first = static_cast<const VariantType&>(value)[0];
+        const VariantType& second = static_cast<const VariantType&>(value)[1];
+        CHECK(second.getType() == VariantType::TYPE_LIST && second.getList()->size() == 2);
+        CHECK(isShared(first, second));
+    }
+
+    // pickle.dumps({'x': d, 'y': d, 'z': [d]}) where d = {'k': 'v'}, protocol 2
+    static const char sharedDict[] = "\x80\x02}q\x00(X\x01\x00\x00\x00xq\x01}q\x02X\x01\x00\x00\x00kq\x03"
+        "X\x01\x00\x00\x00vq\x04sX\x01\x00\x00\x00yq\x05h\x02X\x01\x00\x00\x00zq\x06]q\x07h\x02" "au.";
+    VariantType dict;
+    CHECK(unpickle(sharedDict, sizeof(sharedDict) - 1, &dict));
+    CHECK(dict.getType() == VariantType::TYPE_KEYED_ARCHIVE);
+    if (dict.getType() == VariantType::TYPE_KEYED_ARCHIVE)
+    {
+        const Archive * archive = static_cast<const VariantType&>(dict).getArchive();
+        const VariantType * x = archive->get("x");
+        const VariantType * y = archive->get("y");
+        const VariantType * z = archive->get("z");
+        CHECK(x && y && z && isShared(*x, *y));
+        CHECK(y && y->getType() == VariantType::TYPE_KEYED_ARCHIVE && y->getArchive()->get<std::wstring>("k") == L"v");
+        CHECK(z && z->getType() == VariantType::TYPE_LIST && z->getList()->size() == 1 && isShared((*z)[0], *x));
+    }
+
+    // recursive structures can't be represented: r = [1, r] and a = [b] where b = [a]
+    static const char recursiveList[] = "\x80\x02]q\x00(K\x01h\x00" "e.";
+    static const char indirectList[] = "\x80\x02]q\x00]q\x01h\x00" "aa.";
+    VariantType recursive;
+    CHECK(!recursive.unpickle(recursiveList, sizeof(recursiveList) - 1));
+    CHECK(!recursive.unpickle(indirectList, sizeof(indirectList) - 1));
+}
+
+static void testLeakedPointer()
+{
+    // the pointer returned by non-const accessor may be kept, so the copies don't share the data
+    VariantType value({ 1, 2, 3 });
+    std::vector<VariantType> * list = value.getList();
+    VariantType copy(value);
+    CHECK(!isShared(copy, value));
+
+    list->push_back(VariantType(4));
+    CHECK(copy.getList()->size() == 3);
+}
+
+int main(int argc, char ** argv)
+{
+    testDeserializedArchive();
+    testJSONArchive();
+    testNestedArchives();
+    testPickleMemo();
+    testLeakedPointer();
+
+    printf("%s\n", failures == 0 ? "All tests passed" : "Some tests failed");
+    return failures == 0 ? 0 : 1;
+}